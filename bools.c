@@ -12,6 +12,7 @@
 #include "install_log.h"
 #include "detect.h"
 #include "arch.h"
+#include "plan.h"
 
 #include <sys/types.h>
 #include <ctype.h>
@@ -23,6 +24,10 @@
 /* The maximum length of a boolean variable name */
 #define MAX_VARNAME 30
 
+/* Sizes of the hash tables of booleans and compiled expressions */
+#define BOOL_BUCKETS	64
+#define EXPR_BUCKETS	256
+
 /* Use a N-tree to represent the expressions */
 struct _setup_expression
 {
@@ -32,11 +37,56 @@ struct _setup_expression
 	struct _setup_expression *list, *next;
 };
 
+/* The compiled form of an expression: the nodes of the tree in prefix order,
+   each of them followed by its operands */
+typedef struct {
+	int type;
+	int negate;
+	int len;			/* Number of nodes in the subtree */
+	setup_bool *var;
+} setup_op;
+
+typedef struct _setup_compiled {
+	char *expr;
+	setup_op *code;		/* NULL if the expression did not parse */
+	struct _setup_compiled *next;
+} setup_compiled;
+
 setup_bool *setup_booleans = NULL;
 
 static install_info *cur_info = NULL;
 static setup_bool *setup_false = NULL, *setup_true = NULL;
 
+static setup_bool *bool_hash[BOOL_BUCKETS];
+static setup_compiled *expr_hash[EXPR_BUCKETS];
+
+static unsigned hash_string(const char *str)
+{
+	unsigned hash = 5381;
+
+	while ( *str ) {
+		hash = hash * 33 + (unsigned char)*str++;
+	}
+	return hash;
+}
+
+/* Forget the compiled expressions, which point to the bools they use */
+static void flush_expressions(void)
+{
+	setup_compiled *comp;
+	int i;
+
+	for ( i = 0; i < EXPR_BUCKETS; ++i ) {
+		while ( expr_hash[i] ) {
+			comp = expr_hash[i];
+			expr_hash[i] = comp->next;
+			free(comp->expr);
+			free(comp->code);
+			free(comp);
+		}
+	}
+}
+
 /* Fill up with standard booleans */
 void setup_init_bools(install_info *info)
 {
@@ -44,6 +94,7 @@ void setup_init_bools(install_info *info)
 
 	cur_info = info;
 	setup_booleans = NULL;
+	memset(bool_hash, 0, sizeof(bool_hash));
 
 	/* Basic bools */
 	setup_true = setup_add_bool("true", 1);
@@ -57,6 +108,15 @@ void setup_init_bools(install_info *info)
 #ifdef HAVE_BZIP2_SUPPORT
 	setup_add_bool("bzip2", 1);
 #endif
+#ifdef HAVE_XZ_SUPPORT
+	setup_add_bool("xz", 1);
+#endif
+#ifdef HAVE_ZSTD_SUPPORT
+	setup_add_bool("zstd", 1);
+#endif
+#ifdef HAVE_LZ4_SUPPORT
+	setup_add_bool("lz4", 1);
+#endif
 #ifdef RPM_SUPPORT
 	setup_add_bool("rpm-support", 1);
 # if RPM_SUPPORT == 3
@@ -90,10 +150,17 @@ setup_bool *setup_new_bool(const char *name)
 {
 	setup_bool *ret = malloc(sizeof(setup_bool));
 	if ( ret ) {
+		unsigned bucket = hash_string(name) % BOOL_BUCKETS;
+
 		memset(ret, 0, sizeof(*ret));
 		ret->name = strdup(name);
 		ret->next = setup_booleans;
 		setup_booleans = ret;
+		/* The newest bool of a name is found first, as in the list */
+		ret->hash_next = bool_hash[bucket];
+		bool_hash[bucket] = ret;
+		/* Expressions may refer to it, instead of the false bool they were given */
+		flush_expressions();
 	}
 	return ret;
 }
@@ -122,7 +189,7 @@ setup_bool *setup_find_bool(const char *name)
 {
 	setup_bool *ret;
 
-	for ( ret = setup_booleans; ret; ret = ret->next ) {
+	for ( ret = bool_hash[hash_string(name) % BOOL_BUCKETS]; ret; ret = ret->hash_next ) {
 		if ( !strcmp(ret->name, name) ) {
 			return ret;
 		}
@@ -136,8 +203,10 @@ int setup_get_bool(setup_bool *b)
 		if ( b->once ) {
 			return b->inited ? b->value : 0;
 		} else if (b->script) { /* Run the script to determine the value */
-			b->value = (run_script(cur_info, b->script, 0, 0) == 0);
-			b->inited = 1; /* Keep track of the last value */
+			if ( ! b->current ) {
+				setup_set_bool(b, run_script(cur_info, b->script, 0, 0) == 0); /* Keep track of the last value */
+				b->current = 1;
+			}
 			return b->value;
 		}
 	}
@@ -147,11 +216,24 @@ int setup_get_bool(setup_bool *b)
 void setup_set_bool(setup_bool *b, unsigned value)
 {
 	if (b) {
+		/* The conditions of the XML file may give another result now */
+		if ( !b->inited || (b->value != value) ) {
+			plan_invalidate();
+		}
 		b->value = value;
 		b->inited = 1;
 	}
 }
 
+void setup_invalidate_bools(void)
+{
+	setup_bool *b;
+
+	for ( b = setup_booleans; b; b = b->next ) {
+		b->current = 0;
+	}
+}
+
 /* Return the number of characters parsed */
 static setup_expression *parse_token(const char *str, int *len)
 {
@@ -341,15 +423,106 @@ int setup_evaluate(setup_expression *expr)
 	return ret;
 }
 
+static int count_ops(setup_expression *expr)
+{
+	setup_expression *sub;
+	int count = 1;
+
+	for ( sub = expr->list; sub; sub = sub->next ) {
+		count += count_ops(sub);
+	}
+	return count;
+}
+
+static int compile_ops(setup_expression *expr, setup_op *op)
+{
+	setup_expression *sub;
+
+	op->type = expr->type;
+	op->negate = expr->negate;
+	op->var = expr->var;
+	op->len = 1;
+	/* In the order of evaluation of setup_evaluate() */
+	for ( sub = expr->list; sub; sub = sub->next ) {
+		op->len += compile_ops(sub, op + op->len);
+	}
+	return op->len;
+}
+
+/* Same as setup_evaluate(), on a compiled expression */
+static int evaluate_ops(const setup_op *op)
+{
+	const setup_op *sub = op + 1, *end = op + op->len;
+	int ret = 0;
+
+	switch (op->type) {
+	case OP_VARIABLE:
+		ret = setup_get_bool(op->var);
+		break;
+	case OP_AND:
+		ret = 1;
+		for ( ; ret && (sub < end); sub += sub->len ) {
+			ret = evaluate_ops(sub);
+		}
+		break;
+	case OP_OR:
+		for ( ; !ret && (sub < end); sub += sub->len ) {
+			ret = evaluate_ops(sub);
+		}
+		break;
+	case OP_XOR: /* Only one of the operands must be true */
+		for ( ; sub < end; sub += sub->len ) {
+			ret += evaluate_ops(sub);
+		}
+		if ( ret > 1 )
+			ret = 0;
+		break;
+	}
+	return op->negate ? !ret : ret;
+}
+
+/* The compiled form of an expression string, parsed the first time it is seen */
+static setup_compiled *compile_expression(const char *expr)
+{
+	unsigned bucket = hash_string(expr) % EXPR_BUCKETS;
+	setup_compiled *comp;
+	setup_expression *xp;
+
+	for ( comp = expr_hash[bucket]; comp; comp = comp->next ) {
+		if ( !strcmp(comp->expr, expr) ) {
+			return comp;
+		}
+	}
+	comp = malloc(sizeof(setup_compiled));
+	if ( ! comp ) {
+		log_fatal("Failed to allocate expression token");
+		return NULL;
+	}
+	comp->expr = strdup(expr);
+	comp->code = NULL;
+	xp = setup_parse_expression(expr);
+	if ( xp ) {
+		comp->code = malloc(count_ops(xp) * sizeof(setup_op));
+		if ( comp->code ) {
+			compile_ops(xp, comp->code);
+		} else {
+			log_fatal("Failed to allocate expression token");
+		}
+		setup_free_expression(xp);
+	}
+	comp->next = expr_hash[bucket];
+	expr_hash[bucket] = comp;
+	return comp;
+}
+
 /* Easy shortcut to evaluate an expression string */
 int match_condition(const char *expr)
 {
 	int ret = 1; /* Default to TRUE so that empty strings still match */
 	if ( expr ) {
-		setup_expression *xp = setup_parse_expression(expr);
-		if ( xp ) {
-			ret = setup_evaluate(xp);
-			setup_free_expression(xp);
+		setup_compiled *comp = compile_expression(expr);
+		if ( comp && comp->code ) {
+			ret = evaluate_ops(comp->code);
 		} else {
 			ret = 0;
 		}
@@ -367,6 +540,8 @@ void setup_exit_bools(void)
 		setup_free_bool(setup_booleans);
 		setup_booleans = b;
 	}
+	flush_expressions();
+	memset(bool_hash, 0, sizeof(bool_hash));
 	cur_info = NULL;
 	setup_booleans = NULL;
 }
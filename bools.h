@@ -17,7 +17,9 @@ typedef struct _setup_bool {
 	unsigned value : 1; /* Boolean value */
 	unsigned once : 1; /* Whether the script has to be run every time the bool is evaluated, or just upon init */
 	unsigned inited : 1; /* Value was filled in */
+	unsigned current : 1; /* The last value of a script run every time still holds */
 	struct _setup_bool *next;
+	struct _setup_bool *hash_next; /* Next bool with the same hash value */
 } setup_bool;
 
 
@@ -46,6 +48,10 @@ setup_bool *setup_find_bool(const char *name);
 int         setup_get_bool(setup_bool *b);
 void        setup_set_bool(setup_bool *b, unsigned value);
 
+/* Have the scripts of the bools that are run every time run again the next
+   time they are evaluated, once the system was changed by the install */
+void        setup_invalidate_bools(void);
+
 
 /* Handle expressions */
 setup_expression *setup_parse_expression(const char *expr);
@@ -53,7 +59,7 @@ void              setup_free_expression(setup_expression *);
 /* Evaluate the expression - returns TRUE or FALSE */
 int               setup_evaluate(setup_expression *);
 
-/* Easy shortcut to evaluate an expression string */
+/* Easy shortcut to evaluate an expression string, which is only parsed once */
 int   match_condition(const char *expr);
 
 /* Free up all memory */
@@ -0,0 +1,355 @@
+/* Parallel decoder for bzip2 compressed data
+
+   The blocks of a bzip2 stream are independent, but they are not byte aligned
+   and there is no index: each of them starts with a 48 bit magic number. The
+   scanner looks for those and copies every block into a standalone single
+   block stream, for the threads of the parallel reader to decode.
+
+   The magic number may also show up by chance inside the compressed data. The
+   block is then cut in two pieces which both fail to decode, or to pass their
+   CRC check, and the reader starts over at the beginning of the stream with
+   the sequential decoder.
+*/
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bzip2.h"
+
+#ifdef BZIP2_PARALLEL
+
+#include <bzlib.h>
+
+#define BLOCK_MAGIC	0x314159265359ULL
+#define EOS_MAGIC	0x177245385090ULL
+#define MAGIC_MASK	0xFFFFFFFFFFFFULL
+
+/* Size of the reads of the sequential decoder */
+#define BZ_INPUT	(1024*1024)
+
+typedef unsigned long long bits_t;
+
+/* State of the sequential decoder */
+enum {
+	SEQ_ERROR = -1,
+	SEQ_DATA,
+	SEQ_START,	/* At the beginning of a stream */
+	SEQ_END,	/* At the end of a stream, another one may follow */
+	SEQ_DONE
+};
+
+typedef struct {
+	int fd;
+	bz_stream strm;
+	unsigned char *in;
+	off_t offset;
+	int eof, state, streams;
+} bz_seq;
+
+static bits_t get_bits(const unsigned char *buf, bits_t pos, int n)
+{
+	bits_t value = 0;
+
+	while ( n-- > 0 ) {
+		value = (value << 1) | ((buf[pos >> 3] >> (7 - (pos & 7))) & 1);
+		++pos;
+	}
+	return value;
+}
+
+/* Write bits in a zero filled buffer */
+static void put_bits(unsigned char *buf, bits_t pos, bits_t value, int n)
+{
+	while ( n-- > 0 ) {
+		if ( (value >> n) & 1 ) {
+			buf[pos >> 3] |= 0x80 >> (pos & 7);
+		}
+		++pos;
+	}
+}
+
+/* Copy 'n' bits at bit 'pos' of 'src' to the start of 'dst'. There must be
+   a byte of data after them in 'src' */
+static void copy_bits(unsigned char *dst, const unsigned char *src, bits_t pos, bits_t n)
+{
+	size_t i, bytes = (n + 7) / 8;
+	int shift = pos & 7;
+
+	src += pos / 8;
+	if ( shift == 0 ) {
+		memcpy(dst, src, bytes);
+	} else {
+		for ( i = 0; i < bytes; ++i ) {
+			dst[i] = (src[i] << shift) | (src[i + 1] >> (8 - shift));
+		}
+	}
+	if ( n & 7 ) {
+		dst[bytes - 1] &= 0xFF << (8 - (n & 7));
+	}
+}
+
+/* Bit position of the next block or end of stream magic at or after bit 'from',
+   -1 if there is none before the end of the file, -2 on a read error */
+static long long find_magic(preader_input *in, bits_t from)
+{
+	bits_t window, magic;
+	size_t i;
+	long long pos;
+	int k, ret;
+
+	for ( ;; ) {
+		window = 0;
+		for ( i = from / 8; i < in->len; ++i ) {
+			window = (window << 8) | in->buf[i];
+			for ( k = 7; k >= 0; --k ) {
+				pos = (long long)(i + 1) * 8 - k - 48;
+				if ( pos < (long long)from ) {
+					continue;
+				}
+				magic = (window >> k) & MAGIC_MASK;
+				if ( (magic == BLOCK_MAGIC) || (magic == EOS_MAGIC) ) {
+					return pos;
+				}
+			}
+		}
+		/* Only look at the places where a magic may end in the new data */
+		if ( in->len * 8 > from + 47 ) {
+			from = in->len * 8 - 47;
+		}
+		ret = preader_fill(in);
+		if ( ret <= 0 ) {
+			return (ret < 0) ? -2 : -1;
+		}
+	}
+}
+
+/* Turn the block between bits 'start' and 'end' into a stream and queue it.
+   Returns 0 if the reader is going away, -1 if out of memory */
+static int submit_block(preader *reader, preader_input *in, int level, bits_t start, bits_t end, off_t restart)
+{
+	preader_job *job;
+	bits_t len = end - start;
+
+	/* Header, block, end of stream magic and the stream CRC, which is the one of the block */
+	job = preader_job_new((32 + len + 80 + 7) / 8, restart);
+	if ( job == NULL ) {
+		return -1;
+	}
+	job->param = level;
+	memcpy(job->in, "BZh", 3);
+	job->in[3] = '0' + level;
+	copy_bits(job->in + 4, in->buf, start, len);
+	put_bits(job->in, 32 + len, EOS_MAGIC, 48);
+	put_bits(job->in, 32 + len + 48, get_bits(in->buf, start + 48, 32), 32);
+	return preader_submit(reader, job);
+}
+
+static int bz_scan(preader *reader, int fd, off_t start, off_t *resume)
+{
+	preader_input in;
+	bits_t pos = 0, magic;
+	long long end;
+	off_t stream = start;
+	int level, ret, streams = 0, done = 0;
+
+	memset(&in, 0, sizeof(in));
+	in.fd = fd;
+	in.offset = in.next = start;
+	for ( ;; ) {
+		/* Stream header */
+		if ( preader_need(&in, pos / 8 + 4) < 0 ) {
+			break;
+		}
+		if ( (in.len < pos / 8 + 4) || memcmp(in.buf + pos / 8, "BZh", 3) ||
+			 (in.buf[pos / 8 + 3] < '1') || (in.buf[pos / 8 + 3] > '9') ) {
+			/* Anything after the last stream is ignored, like bzip2 does */
+			done = (streams > 0);
+			break;
+		}
+		stream = in.offset + pos / 8;
+		level = in.buf[pos / 8 + 3] - '0';
+		pos += 32;
+		++streams;
+
+		/* Blocks, up to the end of stream magic */
+		for ( ;; ) {
+			preader_drop(&in, pos / 8);
+			pos &= 7;
+			if ( preader_need(&in, (pos + 80 + 7) / 8) <= 0 ) {
+				goto out;
+			}
+			magic = get_bits(in.buf, pos, 48);
+			if ( magic == EOS_MAGIC ) {
+				pos = (pos + 80 + 7) & ~7;
+				break;
+			}
+			if ( magic != BLOCK_MAGIC ) {
+				goto out;
+			}
+			end = find_magic(&in, pos + 48);
+			if ( end < 0 ) {
+				goto out;
+			}
+			ret = submit_block(reader, &in, level, pos, end, stream);
+			if ( ret <= 0 ) {
+				done = (ret == 0);
+				goto out;
+			}
+			pos = end;
+		}
+	}
+out:
+	free(in.buf);
+	/* Let the sequential decoder deal with the stream that could not be split */
+	*resume = stream;
+	return done;
+}
+
+static int bz_decode(preader_job *job)
+{
+	bz_stream strm;
+	size_t size = job->param * 100000 + 4096;
+	unsigned char *out;
+	int ret;
+
+	memset(&strm, 0, sizeof(strm));
+	if ( BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK ) {
+		return 0;
+	}
+	job->out = (unsigned char *)malloc(size);
+	strm.next_in = (char *)job->in;
+	strm.avail_in = job->in_len;
+	for ( ret = BZ_OK; job->out; ) {
+		strm.next_out = (char *)job->out + job->out_len;
+		strm.avail_out = size - job->out_len;
+		ret = BZ2_bzDecompress(&strm);
+		job->out_len = size - strm.avail_out;
+		if ( ret != BZ_OK ) {
+			break;
+		}
+		if ( strm.avail_out > 0 ) {
+			/* Ran out of input before the end of the stream */
+			ret = BZ_UNEXPECTED_EOF;
+			break;
+		}
+		/* Runs of bytes can expand a block well beyond its size */
+		size *= 2;
+		out = (unsigned char *)realloc(job->out, size);
+		if ( out == NULL ) {
+			break;
+		}
+		job->out = out;
+	}
+	BZ2_bzDecompressEnd(&strm);
+	return (ret == BZ_STREAM_END) && job->out;
+}
+
+static void *bz_seq_open(int fd, off_t offset)
+{
+	bz_seq *seq;
+
+	seq = (bz_seq *)calloc(1, sizeof *seq);
+	if ( seq == NULL ) {
+		return NULL;
+	}
+	seq->fd = fd;
+	seq->offset = offset;
+	seq->in = (unsigned char *)malloc(BZ_INPUT);
+	if ( !seq->in || (BZ2_bzDecompressInit(&seq->strm, 0, 0) != BZ_OK) ) {
+		free(seq->in);
+		free(seq);
+		return NULL;
+	}
+	seq->state = SEQ_START;
+	return seq;
+}
+
+static int bz_seq_read(void *data, void *buf, int len)
+{
+	bz_seq *seq = (bz_seq *)data;
+	bz_stream *strm = &seq->strm;
+	unsigned int avail_in, avail_out;
+	char *next_in;
+	ssize_t n;
+	int ret;
+
+	strm->next_out = (char *)buf;
+	strm->avail_out = len;
+	while ( (strm->avail_out > 0) && (seq->state != SEQ_DONE) && (seq->state != SEQ_ERROR) ) {
+		if ( (strm->avail_in == 0) && !seq->eof ) {
+			n = pread(seq->fd, seq->in, BZ_INPUT, seq->offset);
+			if ( n < 0 ) {
+				if ( seq->state != SEQ_END ) {
+					BZ2_bzDecompressEnd(strm);
+				}
+				seq->state = SEQ_ERROR;
+				break;
+			}
+			seq->eof = (n == 0);
+			seq->offset += n;
+			strm->next_in = (char *)seq->in;
+			strm->avail_in = n;
+		}
+		if ( seq->state == SEQ_END ) {
+			if ( strm->avail_in == 0 ) {
+				seq->state = SEQ_DONE;
+				break;
+			}
+			/* Streams may be concatenated */
+			next_in = strm->next_in;
+			avail_in = strm->avail_in;
+			if ( BZ2_bzDecompressInit(strm, 0, 0) != BZ_OK ) {
+				seq->state = SEQ_ERROR;
+				break;
+			}
+			strm->next_in = next_in;
+			strm->avail_in = avail_in;
+			seq->state = SEQ_START;
+		}
+		avail_in = strm->avail_in;
+		avail_out = strm->avail_out;
+		ret = BZ2_bzDecompress(strm);
+		if ( ret == BZ_STREAM_END ) {
+			BZ2_bzDecompressEnd(strm);
+			seq->state = SEQ_END;
+			++seq->streams;
+		} else if ( (ret == BZ_DATA_ERROR_MAGIC) && (seq->state == SEQ_START) && seq->streams ) {
+			/* Not another stream, ignore the rest of the file */
+			BZ2_bzDecompressEnd(strm);
+			seq->state = SEQ_DONE;
+		} else if ( (ret != BZ_OK) || (seq->eof && (strm->avail_in == avail_in) && (strm->avail_out == avail_out)) ) {
+			BZ2_bzDecompressEnd(strm);
+			seq->state = SEQ_ERROR;
+		} else {
+			seq->state = SEQ_DATA;
+		}
+	}
+	if ( (seq->state == SEQ_ERROR) && (strm->avail_out == (unsigned int)len) ) {
+		return -1;
+	}
+	return len - strm->avail_out;
+}
+
+static void bz_seq_close(void *data)
+{
+	bz_seq *seq = (bz_seq *)data;
+
+	/* The decoder is only left open in the middle of a stream */
+	if ( (seq->state == SEQ_DATA) || (seq->state == SEQ_START) ) {
+		BZ2_bzDecompressEnd(&seq->strm);
+	}
+	free(seq->in);
+	free(seq);
+}
+
+const preader_ops bzip2_preader = {
+	bz_scan,
+	bz_decode,
+	bz_seq_open,
+	bz_seq_read,
+	bz_seq_close
+};
+
+#endif /* BZIP2_PARALLEL */
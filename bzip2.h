@@ -0,0 +1,16 @@
+/* Parallel decoder for bzip2 compressed data */
+
+#ifndef __BZIP2_H__
+#define __BZIP2_H__
+
+#include "config.h"
+#include "preader.h"
+
+/* It needs the low-level interface of libbz2, which is not loaded by dlopen() */
+#if defined(HAVE_BZIP2_SUPPORT) && defined(LIBBZ2_PREFIX) && !defined(BZIP2_DLOPEN) && defined(HAVE_PTHREAD_H)
+#define BZIP2_PARALLEL
+
+extern const preader_ops bzip2_preader;
+#endif
+
+#endif
@@ -10,6 +10,7 @@
 #include "detect.h"
 #include "file.h"
 #include "copy.h"
+#include "progress.h"
 #include "bools.h"
 #include "loki_launchurl.h"
 
@@ -656,7 +657,7 @@ int OnOptionClickEvent(OptionsButton *ButtonWithEventClick)
 		}
 
 		/* Mark this option for installation */
-		mark_option(cur_info, data_node, "true", 0);
+		mark_option_size(cur_info, data_node, "true", 0);
 		
 		/* Recurse down any other options to re-enable grayed out options */
 		node = XML_CHILDREN(data_node);
@@ -670,7 +671,7 @@ int OnOptionClickEvent(OptionsButton *ButtonWithEventClick)
     {
         carbon_debug("OnOptionClickEvent() - Button toggle to false\n");
 		/* Unmark this option for installation */
-		mark_option(cur_info, data_node, "false", 1);
+		mark_option_size(cur_info, data_node, "false", 1);
 		
 		/* Recurse down any other options */
 		node = XML_CHILDREN(data_node);
@@ -708,7 +709,6 @@ int OnOptionClickEvent(OptionsButton *ButtonWithEventClick)
 			node = node->next;
 		}
 	}
-    cur_info->install_size = size_tree(cur_info, XML_CHILDREN(XML_ROOT(cur_info->config)));
 	update_size();
 
     return true;
@@ -1277,6 +1277,8 @@ static int carbonui_update(install_info *info, const char *path, size_t progress
 /*     char text[1024]; */
 /*     char *install_path; */
     double new_update;
+    const char *rate;
+    char title[1024];
 
     static char LastCurrent[1024] = "";
 
@@ -1301,11 +1303,16 @@ static int carbonui_update(install_info *info, const char *path, size_t progress
         else
             last_update = new_update;
 
-        // Set "current_option" label to the current option (only if it's changed)
-        if(strcmp(current, LastCurrent) != 0)
+        // Set "current_option" label to the current option and throughput (only if it's changed)
+        rate = progress_rate(info);
+        if(*rate)
+            snprintf(title, sizeof(title), "%s (%s)", current, rate);
+        else
+            snprintf(title, sizeof(title), "%s", current);
+        if(strcmp(title, LastCurrent) != 0)
         {
-            carbon_SetLabelText(MyRes, COPY_TITLE_LABEL_ID, current);
-            strcpy(LastCurrent, current);
+            carbon_SetLabelText(MyRes, COPY_TITLE_LABEL_ID, title);
+            strcpy(LastCurrent, title);
         }
 
         // Set the "current_file" label to the current file being processed
@@ -1562,6 +1569,7 @@ int carbonui_okay(Install_UI *UI, int *argc, char ***argv)
         UI->complete = carbonui_complete;
         UI->pick_class = carbonui_pick_class;
 	    UI->idle = carbonui_idle;
+	    UI->event_fd = NULL;
 	    UI->exit = NULL;
 	    UI->shutdown = carbonui_shutdown;
 	    UI->is_gui = 1;
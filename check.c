@@ -15,14 +15,21 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <time.h>
 #include <locale.h>
 
 #include <gtk/gtk.h>
 #include <glade/glade.h>
 
 #include "config.h"
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 #include "arch.h"
 #include "setupdb.h"
+#include "md5.h"
 #include "install.h"
 #include "copy.h"
 
@@ -184,24 +191,369 @@ static void message_dialog(const char *txt, const char *title)
     gtk_widget_destroy(dialog);	
 }
 
+/* Where the results go: the list of the dialog, or stdout when run unattended */
+typedef enum {
+	OUTPUT_GTK,
+	OUTPUT_CONSOLE,
+	OUTPUT_JSON
+} output_mode;
+
+static output_mode output = OUTPUT_GTK;
+
+/* Find out whether -c or -j was given, before getopt() runs: the user
+   interface has to be initialized first, so that it takes its own options
+   (--display, --sync...) out of the command line */
+static output_mode scan_output(int argc, char *argv[])
+{
+	output_mode mode = OUTPUT_GTK;
+	const char *opt;
+	int i;
+
+	for ( i = 1; i < argc; ++i ) {
+		if ( !strcmp(argv[i], "--") ) {
+			break;
+		}
+		if ( (argv[i][0] != '-') || (argv[i][1] == '-') ) {
+			continue;
+		}
+		for ( opt = argv[i] + 1; *opt; ++opt ) {
+			if ( *opt == 'c' ) {
+				mode = OUTPUT_CONSOLE;
+			} else if ( *opt == 'j' ) {
+				mode = OUTPUT_JSON;
+			}
+		}
+	}
+	return mode;
+}
+
+/* Lines are added to the list in batches, at most every MESSAGE_INTERVAL ms */
+#define MESSAGE_BATCH		256
+#define MESSAGE_INTERVAL	100
+
+static GList *pending_items = NULL;
+static int pending_count = 0;
+static struct timeval last_flush;
+
+static void flush_messages(GtkWidget *list)
+{
+	if ( pending_items ) {
+		gtk_list_append_items(GTK_LIST(list), pending_items);
+		gtk_list_scroll_vertical(GTK_LIST(list), GTK_SCROLL_JUMP, 1.0);
+		pending_items = NULL;
+		pending_count = 0;
+	}
+	while ( gtk_events_pending() ) {
+		gtk_main_iteration();
+	}
+	gettimeofday(&last_flush, NULL);
+}
+
+/* Flush the messages if it is time to */
+static void poll_messages(GtkWidget *list)
+{
+	struct timeval now;
+
+	if ( output != OUTPUT_GTK ) {
+		return;
+	}
+	gettimeofday(&now, NULL);
+	if ( (pending_count >= MESSAGE_BATCH) ||
+		 ((now.tv_sec - last_flush.tv_sec) * 1000 + (now.tv_usec - last_flush.tv_usec) / 1000 >= MESSAGE_INTERVAL) ) {
+		flush_messages(list);
+	}
+}
+
 static void add_message(GtkWidget *list, const char *str, ...)
 {
-	static int line = 0;
     va_list ap;
     char buf[BUFSIZ];
-	GList *items = NULL;
 	GtkWidget *item;
 
     va_start(ap, str);
     vsnprintf(buf, sizeof(buf), str, ap);
     va_end(ap);
 
-	item = gtk_list_item_new_with_label(buf);
-	gtk_widget_show(item);
-	items = g_list_append(items, item);
-	gtk_list_append_items(GTK_LIST(list), items);
-	line++;
-	gtk_list_scroll_vertical(GTK_LIST(list), GTK_SCROLL_JUMP, 1.0);
+	switch ( output ) {
+	case OUTPUT_GTK:
+		item = gtk_list_item_new_with_label(buf);
+		gtk_widget_show(item);
+		pending_items = g_list_append(pending_items, item);
+		++pending_count;
+		poll_messages(list);
+		break;
+	case OUTPUT_CONSOLE:
+		puts(buf);
+		break;
+	case OUTPUT_JSON:
+		/* Only the files are listed */
+		break;
+	}
+}
+
+static void json_string(const char *str)
+{
+	putchar('"');
+	for ( ; *str; ++str ) {
+		if ( (*str == '"') || (*str == '\\') ) {
+			printf("\\%c", *str);
+		} else if ( (unsigned char)*str < 0x20 ) {
+			printf("\\u%04x", *str);
+		} else {
+			putchar(*str);
+		}
+	}
+	putchar('"');
+}
+
+static void report_file(GtkWidget *list, const char *path, file_check_t result)
+{
+	static int first = 1;
+
+	if ( output == OUTPUT_JSON ) {
+		printf("%s\n    { \"path\": ", first ? "" : ",");
+		json_string(path);
+		printf(", \"status\": \"%s\" }",
+			   (result == LOKI_REMOVED) ? "removed" : (result == LOKI_CHANGED) ? "modified" : "ok");
+		first = 0;
+		return;
+	}
+	switch ( result ) {
+	case LOKI_REMOVED:
+		add_message(list, _("%s was REMOVED"), path);
+		break;
+	case LOKI_CHANGED:
+		add_message(list, _("%s was MODIFIED"), path);
+		break;
+	case LOKI_OK:
+		add_message(list, _("%s is OK"), path);
+		break;
+	}
+}
+
+/* Size and modification time of the files found intact by the last check, in
+   a file next to the product database. With the quick option, a file that
+   still matches is not read again */
+#define FINGERPRINT_BUCKETS	4096
+
+typedef struct fingerprint {
+	char *path;
+	off_t size;
+	time_t mtime;
+	struct fingerprint *next;
+} fingerprint;
+
+static fingerprint *fingerprints[FINGERPRINT_BUCKETS];
+static int quick_check = 0;
+
+static unsigned int hash_path(const char *path)
+{
+	unsigned int hash = 5381;
+
+	while ( *path ) {
+		hash = hash * 33 + (unsigned char)*path++;
+	}
+	return hash % FINGERPRINT_BUCKETS;
+}
+
+static void load_fingerprints(const char *file)
+{
+	FILE *fp = fopen(file, "r");
+	char line[PATH_MAX + 64], *path;
+	long long size;
+	long mtime;
+	fingerprint *fpr;
+
+	if ( ! fp ) {
+		return;
+	}
+	while ( fgets(line, sizeof(line), fp) ) {
+		line[strcspn(line, "\n")] = '\0';
+		if ( (sscanf(line, "%lld %ld", &size, &mtime) != 2) ||
+			 !(path = strchr(line, ' ')) || !(path = strchr(path + 1, ' ')) ) {
+			continue;
+		}
+		fpr = (fingerprint *)malloc(sizeof(*fpr));
+		if ( ! fpr ) {
+			break;
+		}
+		fpr->path = strdup(path + 1);
+		fpr->size = (off_t)size;
+		fpr->mtime = (time_t)mtime;
+		fpr->next = fingerprints[hash_path(fpr->path)];
+		fingerprints[hash_path(fpr->path)] = fpr;
+	}
+	fclose(fp);
+}
+
+static int match_fingerprint(const char *path, const struct stat *st)
+{
+	fingerprint *fpr;
+
+	for ( fpr = fingerprints[hash_path(path)]; fpr; fpr = fpr->next ) {
+		if ( !strcmp(fpr->path, path) ) {
+			return (fpr->size == st->st_size) && (fpr->mtime == st->st_mtime);
+		}
+	}
+	return 0;
+}
+
+/* The MD5 sums of the files are checked by a few threads, which hash each
+   file as they read it. setupdb is not thread safe: the threads only use
+   copies of the paths and of the sums it recorded, and the main thread gets
+   their verdicts in order. It asks setupdb for the other kinds of files */
+#define CHECK_THREADS	4
+#define CHECK_READ		(256*1024)
+
+enum {
+	ENTRY_WAITING,
+	ENTRY_CHECKING,
+	ENTRY_CHECKED,
+	ENTRY_REPORTED
+};
+
+typedef struct {
+	product_file_t *file;
+	product_option_t *option;
+	char *path;
+	file_type_t type;
+	unsigned char md5[16];
+	int has_md5;
+	int state;
+	int stat_ok;
+	int verdict;			/* Whether the result was found without setupdb */
+	file_check_t result;
+	struct stat st;
+} check_entry;
+
+static struct {
+	check_entry *entries;
+	int count, next;
+	int quit;
+	unsigned char *buf;		/* For the files the threads did not get to */
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+} check;
+
+static void check_file_sum(check_entry *entry, unsigned char *buf)
+{
+	MD5_CONTEXT md5;
+	ssize_t n;
+	int fd;
+
+	if ( lstat(entry->path, &entry->st) < 0 ) {
+		return;
+	}
+	entry->stat_ok = 1;
+	if ( !S_ISREG(entry->st.st_mode) || (entry->type != LOKI_FILE_REGULAR) || !entry->has_md5 ) {
+		return;
+	}
+	if ( quick_check && match_fingerprint(entry->path, &entry->st) ) {
+		entry->result = LOKI_OK;
+		entry->verdict = 1;
+		return;
+	}
+	if ( buf ) {
+		fd = open(entry->path, O_RDONLY);
+		if ( fd >= 0 ) {
+#ifdef HAVE_POSIX_FADVISE
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+			md5_init(&md5);
+			while ( (n = read(fd, buf, CHECK_READ)) > 0 ) {
+				md5_write(&md5, buf, n);
+			}
+			close(fd);
+			if ( n == 0 ) {
+				md5_final(&md5);
+				entry->result = memcmp(md5.buf, entry->md5, 16) ? LOKI_CHANGED : LOKI_OK;
+				entry->verdict = 1;
+			}
+		}
+	}
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *check_worker(void *unused)
+{
+	unsigned char *buf = (unsigned char *)malloc(CHECK_READ);
+	check_entry *entry;
+
+	pthread_mutex_lock(&check.lock);
+	while ( !check.quit && (check.next < check.count) ) {
+		entry = &check.entries[check.next++];
+		if ( entry->state != ENTRY_WAITING ) {
+			continue;
+		}
+		entry->state = ENTRY_CHECKING;
+		pthread_mutex_unlock(&check.lock);
+
+		check_file_sum(entry, buf);
+
+		pthread_mutex_lock(&check.lock);
+		entry->state = ENTRY_CHECKED;
+		pthread_cond_broadcast(&check.cond);
+	}
+	pthread_mutex_unlock(&check.lock);
+	free(buf);
+	return NULL;
+}
+#endif
+
+static file_check_t check_entry_file(check_entry *entry)
+{
+	int state;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&check.lock);
+	while ( entry->state == ENTRY_CHECKING ) {
+		pthread_cond_wait(&check.cond, &check.lock);
+	}
+	state = entry->state;
+	entry->state = ENTRY_REPORTED;
+	pthread_mutex_unlock(&check.lock);
+#else
+	state = entry->state;
+	entry->state = ENTRY_REPORTED;
+#endif
+	if ( state == ENTRY_WAITING ) {
+		/* The threads did not get to it */
+		if ( ! check.buf ) {
+			check.buf = (unsigned char *)malloc(CHECK_READ);
+		}
+		check_file_sum(entry, check.buf);
+	}
+	if ( entry->verdict ) {
+		return entry->result;
+	}
+	return loki_check_file(entry->file);
+}
+
+static void save_fingerprints(const char *file, file_check_t *results)
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
+	int i;
+
+	snprintf(tmp, sizeof(tmp), "%s.new", file);
+	fp = fopen(tmp, "w");
+	if ( ! fp ) {
+		return;
+	}
+	for ( i = 0; i < check.count; ++i ) {
+		check_entry *entry = &check.entries[i];
+
+		if ( (results[i] == LOKI_OK) && entry->stat_ok && S_ISREG(entry->st.st_mode) ) {
+			fprintf(fp, "%lld %ld %s\n", (long long)entry->st.st_size, (long)entry->st.st_mtime, entry->path);
+		}
+	}
+	if ( fclose(fp) == 0 ) {
+		rename(tmp, file);
+	} else {
+		unlink(tmp);
+	}
 }
 
 void on_cdrom_radio_toggled(GtkWidget *widget, gpointer user_data)
@@ -306,6 +658,7 @@ on_media_ok_clicked (GtkButton       *button,
 		/* Enable the relevant options */
 		select_corrupt_options(install);
 		copy_tree(install, XML_CHILDREN(XML_ROOT(install->config)), install->install_path, NULL);
+		copy_flush(install, NULL);
 
 		/* Menu items are currently not being restored - maybe they should be tagged in setupdb ? */
 
@@ -402,12 +755,20 @@ on_dismiss_button_clicked            (GtkButton       *button,
 
 int main(int argc, char *argv[])
 {
-	GtkWidget *window, *ok_but, *fix_but, *diag, *list, *scroll;
+	GtkWidget *window = NULL, *ok_but, *fix_but = NULL, *diag = NULL, *list = NULL, *scroll;
 	GtkAdjustment *adj;
     product_component_t *component;
 	product_option_t *option;
 	product_file_t *file;
-	int removed = 0, modified = 0;
+	file_check_t *results;
+	const unsigned char *md5;
+	char fingerprint_file[PATH_MAX];
+	int removed = 0, modified = 0, c, i;
+#ifdef HAVE_PTHREAD_H
+	pthread_t threads[CHECK_THREADS];
+	int nthreads = 0;
+	long cpus;
+#endif
 	
     goto_installpath(argv[0]);
 
@@ -425,50 +786,134 @@ int main(int argc, char *argv[])
 # endif
 #endif
 
-	if ( argc < 2 ) {
-		fprintf(stderr, _("Usage: %s product\n"), argv[0]);
-		return 1;
+	if ( scan_output(argc, argv) == OUTPUT_GTK ) {
+		gtk_init(&argc,&argv);
 	}
 
-    gtk_init(&argc,&argv);
+	while ( (c = getopt(argc, argv, "cjq")) != EOF ) {
+		switch ( c ) {
+		case 'c':
+			output = OUTPUT_CONSOLE;
+			break;
+		case 'j':
+			output = OUTPUT_JSON;
+			break;
+		case 'q':
+			quick_check = 1;
+			break;
+		default:
+			argc = 0;
+			break;
+		}
+	}
+	if ( optind >= argc ) {
+		fprintf(stderr, _("Usage: %s [-c | -j] [-q] product\n"
+						  "  -c : Check without the user interface, and print the results.\n"
+						  "  -j : The same, in the JSON format.\n"
+						  "  -q : Only check the sums of the files whose size or time changed.\n"), argv[0]);
+		return 1;
+	}
 
 	argv0 = argv[0];
 
-    /* Initialize Glade */
-    glade_init();
-    check_glade = GLADE_XML_NEW(CHECK_GLADE, "check_dialog"); 
+	if ( output == OUTPUT_GTK ) {
+		/* Initialize Glade */
+		glade_init();
+		check_glade = GLADE_XML_NEW(CHECK_GLADE, "check_dialog"); 
 
-    /* Add all signal handlers defined in glade file */
-    glade_xml_signal_autoconnect(check_glade);
+		/* Add all signal handlers defined in glade file */
+		glade_xml_signal_autoconnect(check_glade);
 
-    window = glade_xml_get_widget(check_glade, "check_dialog");
-    gtk_widget_realize(window);
-    while( gtk_events_pending() ) {
-        gtk_main_iteration();
-    }
+		window = glade_xml_get_widget(check_glade, "check_dialog");
+		gtk_widget_realize(window);
+		while( gtk_events_pending() ) {
+			gtk_main_iteration();
+		}
 
-	diag = glade_xml_get_widget(check_glade, "diagnostic_label");
-	ok_but = glade_xml_get_widget(check_glade, "dismiss_button");
-	fix_but = glade_xml_get_widget(check_glade, "rescue_button");
-	list = glade_xml_get_widget(check_glade, "main_list");
-	scroll = glade_xml_get_widget(check_glade, "scrolledwindow");
+		diag = glade_xml_get_widget(check_glade, "diagnostic_label");
+		ok_but = glade_xml_get_widget(check_glade, "dismiss_button");
+		fix_but = glade_xml_get_widget(check_glade, "rescue_button");
+		list = glade_xml_get_widget(check_glade, "main_list");
+		scroll = glade_xml_get_widget(check_glade, "scrolledwindow");
+	}
 
-	product = loki_openproduct(argv[1]);
+	product = loki_openproduct(argv[optind]);
 	if ( ! product ) {
-	  message_dialog(_("Impossible to locate the product information.\nMaybe another user installed it?"),
-					 _("Error"));
+		if ( output == OUTPUT_GTK ) {
+			message_dialog(_("Impossible to locate the product information.\nMaybe another user installed it?"),
+						   _("Error"));
+		} else {
+			fprintf(stderr, _("Impossible to locate the product information.\nMaybe another user installed it?\n"));
+		}
 		return 1;
 	}
 
 	info = loki_getinfo_product(product);
 
-	gtk_label_set_text(GTK_LABEL(diag), "");
-	gtk_widget_set_sensitive(fix_but, FALSE);
+	snprintf(fingerprint_file, sizeof(fingerprint_file), "%s.check", info->registry_path);
+	if ( quick_check ) {
+		load_fingerprints(fingerprint_file);
+	}
 
-	adj = GTK_ADJUSTMENT(gtk_adjustment_new(100.0, 1.0, 100.0, 1.0, 10.0, 10.0));
-	gtk_scrolled_window_set_vadjustment(GTK_SCROLLED_WINDOW(scroll), adj);
+	if ( output == OUTPUT_GTK ) {
+		gtk_label_set_text(GTK_LABEL(diag), "");
+		gtk_widget_set_sensitive(fix_but, FALSE);
+
+		adj = GTK_ADJUSTMENT(gtk_adjustment_new(100.0, 1.0, 100.0, 1.0, 10.0, 10.0));
+		gtk_scrolled_window_set_vadjustment(GTK_SCROLLED_WINDOW(scroll), adj);
+		gettimeofday(&last_flush, NULL);
+	} else if ( output == OUTPUT_JSON ) {
+		printf("{\n  \"product\": ");
+		json_string(info->name);
+		printf(",\n  \"files\": [");
+	}
+
+	/* List all the files first, for the threads to check them */
+	for ( component = loki_getfirst_component(product); component; component = loki_getnext_component(component) ) {
+		for ( option = loki_getfirst_option(component); option; option = loki_getnext_option(option) ) {
+			for ( file = loki_getfirst_file(option); file; file = loki_getnext_file(file) ) {
+				++check.count;
+			}
+		}
+	}
+	check.entries = (check_entry *)calloc(check.count + 1, sizeof(check_entry));
+	results = (file_check_t *)calloc(check.count + 1, sizeof(file_check_t));
+	if ( !check.entries || !results ) {
+		fprintf(stderr, _("Out of memory\n"));
+		return 1;
+	}
+	i = 0;
+	for ( component = loki_getfirst_component(product); component; component = loki_getnext_component(component) ) {
+		for ( option = loki_getfirst_option(component); option; option = loki_getnext_option(option) ) {
+			for ( file = loki_getfirst_file(option); file; file = loki_getnext_file(file) ) {
+				check.entries[i].file = file;
+				check.entries[i].option = option;
+				check.entries[i].path = strdup(loki_getpath_file(file));
+				check.entries[i].type = loki_gettype_file(file);
+				md5 = loki_getmd5_file(file);
+				if ( md5 && (check.entries[i].type == LOKI_FILE_REGULAR) ) {
+					memcpy(check.entries[i].md5, md5, 16);
+					check.entries[i].has_md5 = 1;
+				}
+				++i;
+			}
+		}
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&check.lock, NULL);
+	pthread_cond_init(&check.cond, NULL);
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	while ( (nthreads < CHECK_THREADS) && (nthreads < cpus) ) {
+		if ( pthread_create(&threads[nthreads], NULL, check_worker, NULL) != 0 ) {
+			break;
+		}
+		++nthreads;
+	}
+#endif
 
 	/* Iterate through the components */
+	i = 0;
 	for ( component = loki_getfirst_component(product);
 		  component;
 		  component = loki_getnext_component(component) ) {
@@ -483,28 +928,53 @@ int main(int argc, char *argv[])
 
 			for ( file = loki_getfirst_file(option);
 				  file;
-				  file = loki_getnext_file(file) ) {
+				  file = loki_getnext_file(file), ++i ) {
+				const char *path = check.entries[i].path;
 
-				gtk_main_iteration();
-				switch ( loki_check_file(file) ) {
+				poll_messages(list);
+				results[i] = check_entry_file(&check.entries[i]);
+				switch ( results[i] ) {
 				case LOKI_REMOVED:
-					add_message(list, _("%s was REMOVED"), loki_getpath_file(file));
 					removed ++;
-					add_corrupt_file(product, loki_getpath_file(file), loki_getname_option(option));
+					add_corrupt_file(product, path, loki_getname_option(option));
 					break;
 				case LOKI_CHANGED:
-					add_message(list, _("%s was MODIFIED"), loki_getpath_file(file));
 					modified ++;
-					add_corrupt_file(product, loki_getpath_file(file), loki_getname_option(option));
+					add_corrupt_file(product, path, loki_getname_option(option));
 					break;
 				case LOKI_OK:
-					add_message(list, _("%s is OK"), loki_getpath_file(file));
 					break;
 				}
+				report_file(list, path, results[i]);
 			}
 		}
 	}
 
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&check.lock);
+	check.quit = 1;
+	pthread_cond_broadcast(&check.cond);
+	pthread_mutex_unlock(&check.lock);
+	for ( c = 0; c < nthreads; ++c ) {
+		pthread_join(threads[c], NULL);
+	}
+#endif
+	save_fingerprints(fingerprint_file, results);
+
+	if ( output == OUTPUT_JSON ) {
+		printf("\n  ],\n  \"removed\": %d,\n  \"modified\": %d\n}\n", removed, modified);
+	} else if ( output == OUTPUT_CONSOLE ) {
+		if ( removed || modified ) {
+			printf(_("Changes detected: %d files removed, %d files modified.\n"), removed, modified);
+		} else {
+			printf(_("No problems were found.\n"));
+		}
+	}
+	if ( output != OUTPUT_GTK ) {
+		return (removed || modified) ? 2 : 0;
+	}
+	flush_messages(list);
+
 	if ( removed || modified ) {
 		char status[200];
 
@@ -521,6 +991,3 @@ int main(int argc, char *argv[])
 
 	return 0;
 }
-
-
-
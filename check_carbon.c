@@ -238,6 +238,7 @@ void DoMediaCheck(const char *Dir)
 		/* Enable the relevant options */
 		select_corrupt_options(install);
 		copy_tree(install, XML_CHILDREN(XML_ROOT(install->config)), install->install_path, NULL);
+		copy_flush(install, NULL);
 
 		/* Menu items are currently not being restored - maybe they should be tagged in setupdb ? */
 
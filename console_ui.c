@@ -28,6 +28,7 @@
 #include "detect.h"
 #include "file.h"
 #include "copy.h"
+#include "progress.h"
 #include "bools.h"
 #include "loki_launchurl.h"
 
@@ -256,11 +257,8 @@ static int parse_option(install_info *info, const char *component, xmlNodePtr no
 				}
 			}
 
-            /* Mark this option for installation */
-            mark_option(info, node, "true", 0);
-
-            /* Add this option size to the total */
-            info->install_size += size_node(info, node);
+            /* Mark this option for installation, with its size */
+            mark_option_size(info, node, "true", 0);
 
             /* Recurse down any other options */
             kid = XML_CHILDREN(node);
@@ -294,7 +292,7 @@ static int parse_option(install_info *info, const char *component, xmlNodePtr no
 
         default:
             /* Unmark this option for installation */
-            mark_option(info, node, "false", 1);
+            mark_option_size(info, node, "false", 1);
             break;
     }
 	return retval;
@@ -526,8 +524,8 @@ static install_state console_setup(install_info *info)
 				}
 			}
 			
-			/* Go through the install options */
-			info->install_size = 0;
+			/* Go through the install options, the size follows the changes */
+			info->install_size = size_tree(info, XML_CHILDREN(XML_ROOT(info->config)));
 			node = XML_CHILDREN(XML_ROOT(info->config));
 			while ( node ) {
 				if ( ! strcmp((char *)node->name, "option") ) {
@@ -627,7 +625,9 @@ static install_state console_setup(install_info *info)
 static int console_update(install_info *info, const char *path, size_t progress, size_t size, const char *current)
 {
     static char previous[200] = "";
+    static char lastrate[128] = "";
     static int lastpercentage = -1;
+    const char *rate = progress_rate(info);
 
     if(strcmp(previous, current)){
         strncpy(previous,current, sizeof(previous));
@@ -635,11 +635,16 @@ static int console_update(install_info *info, const char *path, size_t progress,
     }
     if ( progress && size ) {
         int percentage = (int) (((float)progress/(float)size)*100.0);
-        if (percentage == lastpercentage)
+        if (percentage == lastpercentage && !strcmp(rate, lastrate))
             return 1;  /* don't output the same thing again. */
 
         lastpercentage = percentage;
-        printf(" %3d%% - %s\r", percentage, path);
+        strncpy(lastrate, rate, sizeof(lastrate));
+        if ( *rate ) {
+            printf(" %3d%% - %s (%s)\r", percentage, path, rate);
+        } else {
+            printf(" %3d%% - %s\r", percentage, path);
+        }
     } else { /* "Running script" */
         printf(" %s\r", path);
     }
@@ -745,6 +750,7 @@ int console_okay(Install_UI *UI, int *argc, char ***argv)
     UI->complete = console_complete;
     UI->pick_class = console_pick_class;
     UI->idle = NULL;
+    UI->event_fd = NULL;
     UI->exit = NULL;
     UI->shutdown = NULL;
     UI->is_gui = 0;
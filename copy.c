@@ -78,6 +78,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <ctype.h>
@@ -93,6 +94,9 @@
 #  include <selinux/selinux.h>
 #  include <selinux/context.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
 
 
 #include "file.h"
@@ -102,82 +106,120 @@
 #include "install_log.h"
 #include "install_ui.h"
 #include "bools.h"
+#include "plan.h"
+#include "progress.h"
+#include "preader.h"
+
+/* Amount of data handed to the kernel at once when copying uncompressed files */
+#define COPY_CHUNK	(8*1024*1024)
+/* Size of the buffer used when the data has to go through user space */
+#define COPY_BUFFER	(64*1024)
 
 char current_option_txt[200];
 struct option_elem *current_option = NULL;
 struct component_elem *current_component = NULL;
 
-/* We maintain a list of files to be fixed */
+/* Number of files copied concurrently from a <files> element */
+int copy_workers = COPY_WORKERS_DEFAULT;
+
+/* We maintain a set of files to be fixed, hashed by their path relative to the install */
+#define CORRUPT_BUCKETS	4096
+
 typedef struct _corrupt_list {
 	char *path, *option;
 	struct _corrupt_list *next;
 } corrupt_list;
 
-static corrupt_list *corrupts = NULL;
+static corrupt_list *corrupts[CORRUPT_BUCKETS];
+static int corrupts_left = 0;
+/* Stays set once the files are all restored, the rest must still be left alone */
+static int restoring = 0;
 
 static void copy_binary_finish(install_info* info, xmlNodePtr node, const char* fn, struct file_elem *file);
 
+static unsigned int corrupt_hash(const char *path)
+{
+	unsigned int hash = 5381;
+
+	while ( *path ) {
+		hash = hash * 33 + (unsigned char)*path++;
+	}
+	return hash % CORRUPT_BUCKETS;
+}
+
 void add_corrupt_file(const product_t *prod, const char *path, const char *option)
 {
 	corrupt_list *item;
-	/* TODO: Should we look at sorting this list to optimize ? */
+	unsigned int hash;
+
 	item = (corrupt_list *) malloc(sizeof(corrupt_list));
 	item->path = strdup(loki_remove_root(prod, path));
 	item->option = strdup(option);
-	item->next = corrupts;
-	corrupts = item;
+	hash = corrupt_hash(item->path);
+	item->next = corrupts[hash];
+	corrupts[hash] = item;
+	++ corrupts_left;
+	restoring = 1;
 }
 
 void free_corrupt_files(void)
 {
 	corrupt_list *next;
-	while ( corrupts ) {
-		next = corrupts->next;
-		free(corrupts->path);
-		free(corrupts->option);
-		free(corrupts);
-		corrupts = next;
+	int i;
+
+	for ( i = 0; i < CORRUPT_BUCKETS; ++i ) {
+		while ( corrupts[i] ) {
+			next = corrupts[i]->next;
+			free(corrupts[i]->path);
+			free(corrupts[i]->option);
+			free(corrupts[i]);
+			corrupts[i] = next;
+		}
 	}
+	corrupts_left = 0;
+	restoring = 0;
 }
 
 int file_is_corrupt(const product_t *prod, const char *path)
 {
-	/* If found, return TRUE and remove it from the list */
-	corrupt_list *i = corrupts, *prev = NULL;
+	/* If found, return TRUE and remove it from the set */
+	corrupt_list *i, **prev;
 
 	path = loki_remove_root(prod, path);
-	while ( i ) {
+	for ( prev = &corrupts[corrupt_hash(path)]; (i = *prev) != NULL; prev = &i->next ) {
 		if ( !strcmp(path, i->path) ) {
-			/* Remove */
-			if ( prev ) {
-				prev->next = i->next;
-			} else {
-				corrupts = i->next;
-			}
+			*prev = i->next;
 			free(i->path);
 			free(i->option);
 			free(i);
+			-- corrupts_left;
 			return 1;
 		}
-		prev = i;
-		i = i->next;
 	}
 	return 0;
 }
 
 void select_corrupt_options(install_info *info)
 {
-	corrupt_list *i = corrupts;
-	while ( i ) {
-		/* Locate and enable the option */
-		enable_option(info, i->option); /* This could be optimized */
-		i = i->next;
+	corrupt_list *i;
+	int bucket;
+
+	for ( bucket = 0; bucket < CORRUPT_BUCKETS; ++bucket ) {
+		for ( i = corrupts[bucket]; i; i = i->next ) {
+			/* Locate and enable the option */
+			enable_option(info, i->option); /* This could be optimized */
+		}
 	}
 }
 
 int restoring_corrupt(void)
 {
-	return corrupts != NULL;
+	return restoring;
+}
+
+int corrupt_files_left(void)
+{
+	return corrupts_left;
 }
 
 void getToken(const char *src, const char **end) {
@@ -252,6 +294,379 @@ int parse_line(const char **srcpp, char *buf, int maxlen)
     return strlen(buf);
 }
 
+/* Copy the data of an input stream to an output stream, reporting each chunk
+   written to 'progress'. The copy stops early if 'progress' returns 0.
+   It may run in a worker thread, so a failure is left in 'error' (-2 for a
+   write, -3 for a read, as with file_copy_range()) for copy_stream_error() */
+static ssize_t copy_stream(install_info *info, stream *input, stream *output,
+						   int (*progress)(void *data, size_t len), void *data, int *error)
+{
+	char buf[COPY_BUFFER];
+	ssize_t size = 0, copied;
+
+	/* Uncompressed files are copied by the kernel when possible */
+	while ( (copied=file_copy_range(info, input, output, COPY_CHUNK)) > 0 ) {
+		size += copied;
+		if ( ! progress(data, copied) ) {
+			return size; /* Abort */
+		}
+	}
+	if ( copied < -1 ) {
+		*error = copied;
+	} else if ( copied < 0 ) {
+		while ( (copied=file_try_read(info, buf, sizeof(buf), input)) > 0 ) {
+			if ( file_try_write(info, buf, copied, output) != copied ) {
+				*error = -2;
+				break;
+			}
+			size += copied;
+			if ( ! progress(data, copied) ) {
+				break; /* Abort */
+			}
+		}
+		if ( copied < 0 ) {
+			*error = -3;
+		}
+	}
+	return size;
+}
+
+/* Report the failure of copy_stream(), in the installer thread */
+static void copy_stream_error(int error, stream *input, stream *output)
+{
+	if ( error == -2 ) {
+		log_fatal(_("Write failure on %s"), output->path);
+	} else if ( error == -3 ) {
+		log_fatal(_("Read failure on %s"), input->path);
+	}
+}
+
+/* The size of a compressed file is only an estimate until it is decoded,
+   the total of the install is corrected once the copy reached its end */
+static void copy_correct_total(install_info *info, stream *input)
+{
+	if ( input->codec && input->eof && (input->offset != input->size) ) {
+		info->install_size += input->offset - input->size;
+	}
+}
+
+/* Progress of a file copied by the installer thread itself */
+typedef struct {
+	install_info *info;
+	const char *final;
+	size_t size, total;
+	UIUpdateFunc update;
+} copy_progress;
+
+static int copy_file_progress(void *data, size_t len)
+{
+	copy_progress *prog = (copy_progress *)data;
+
+	prog->info->installed_bytes += len;
+	prog->size += len;
+	if ( prog->update ) {
+		return prog->update(prog->info, prog->final, prog->size, prog->total, current_option_txt);
+	}
+	return 1;
+}
+
+/* Set the SELinux context of a copied file and check its optional MD5 sum */
+static void copy_file_verify(install_info *info, xmlNodePtr node, const char *final,
+							 const char *base, struct file_elem *output_elem)
+{
+	char *md5 = (char *)xmlGetProp(node, BAD_CAST "md5sum");
+#ifdef __linux
+	char *se_context = (char *)xmlGetProp(node, BAD_CAST "secontext");
+
+	if ( se_context && have_selinux ) {
+//# ifdef HAVE_SELINUX_SELINUX_H
+#if 0 // Using chcon directly seems more reliable
+		/* Use the selinux library */
+		context_t cont = context_new(se_context);
+		if ( cont ) {
+			security_context_t sec = context_str(cont);
+			if ( setfilecon(final, sec) < 0 ) {
+				if ( errno == ENOTSUP ) {
+					log_debug(_("Failed to change SELinux context for file '%s' - not supported"), base);
+				} else {
+					log_warning(_("Failed to change SELinux context for file '%s'"), base);
+				}
+			}
+			context_free(cont);
+		} else {
+			log_warning(_("Invalid SELinux context '%s' for file '%s'"), se_context, base);
+		}
+# else
+		run_command3(info, "chcon", "-ht", se_context, final, 0);
+# endif
+	}
+	xmlFree(se_context);
+#endif
+	if ( md5 ) { /* Verify the output file */
+		char sum[CHECKSUM_SIZE+1];
+
+		strcpy(sum, get_md5(output_elem->md5sum));
+		if ( strcasecmp(md5, sum) ) {
+			log_fatal(_("File '%s' has an invalid checksum! Aborting."), base);
+		}
+	}
+	xmlFree(md5);
+}
+
+#ifdef HAVE_PTHREAD_H
+/* A plain file handed over to the copy workers */
+typedef struct _copy_job {
+	install_info *info;
+	xmlNodePtr node;
+	stream *input, *output;
+	struct file_elem *elem;
+	char *final, *base;
+	int mode;
+	int done;
+	int error;			/* Left by copy_stream() */
+	size_t size;
+	struct _copy_job *next, *next_queued;
+} copy_job;
+
+/* The worker pool is active while the files of a <files> element are copied.
+   Streams are opened and closed by the installer thread, so that file entries
+   are recorded in a deterministic order and user prompts stay in the UI thread,
+   while the workers only move the data. Finished jobs are completed in the
+   order they were submitted. */
+static struct {
+	int active, quit, abort;
+	pthread_mutex_t lock;
+	pthread_cond_t work, progress;
+	pthread_t threads[COPY_WORKERS_MAX];
+	int nthreads;
+	copy_job *jobs, *jobs_tail;		/* All unfinished jobs, in submission order */
+	copy_job *queue, *queue_tail;	/* Jobs waiting for a worker */
+	int pending;
+	copy_job *last;					/* Job that a worker started last */
+	ssize_t total;
+} pool;
+
+static int copy_job_progress(void *data, size_t len)
+{
+	copy_job *job = (copy_job *)data;
+
+	/* The installer thread picks it up when it is time to update the UI */
+	progress_count(&job->size, len);
+	progress_add(len);
+	return ! progress_aborted();
+}
+
+static void *copy_worker(void *unused)
+{
+	copy_job *job;
+
+	pthread_mutex_lock(&pool.lock);
+	for ( ;; ) {
+		while ( !pool.queue && !pool.quit ) {
+			pthread_cond_wait(&pool.work, &pool.lock);
+		}
+		job = pool.queue;
+		if ( ! job ) {
+			break;
+		}
+		pool.queue = job->next_queued;
+		if ( ! pool.queue ) {
+			pool.queue_tail = NULL;
+		}
+		pool.last = job;
+		if ( ! pool.abort ) {
+			pthread_mutex_unlock(&pool.lock);
+			copy_stream(job->info, job->input, job->output, copy_job_progress, job, &job->error);
+			pthread_mutex_lock(&pool.lock);
+		}
+		job->done = 1;
+		pthread_cond_signal(&pool.progress);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+static void copy_job_finish(copy_job *job)
+{
+	copy_stream_error(job->error, job->input, job->output);
+	copy_correct_total(job->info, job->input);
+	file_close(job->info, job->output);
+	file_close(job->info, job->input);
+	file_chmod(job->info, job->final, job->mode);
+	copy_file_verify(job->info, job->node, job->final, job->base, job->elem);
+	pool.total += job->size;
+	free(job->final);
+	free(job->base);
+	free(job);
+}
+
+/* Report the progress of the workers to the UI and complete the finished jobs,
+   until no more than 'limit' jobs are left pending */
+static void copy_pool_poll(install_info *info, UIUpdateFunc update, int limit)
+{
+	copy_job *job, *last;
+	size_t size = 0, total = 0;
+	const char *final = NULL;
+	struct timeval now;
+	struct timespec until;
+	int abort;
+
+	for ( ;; ) {
+		pthread_mutex_lock(&pool.lock);
+		if ( (pool.pending > limit) && !(pool.jobs && pool.jobs->done) ) {
+			if ( update ) {
+				/* Wake up in time for the next update of the UI */
+				gettimeofday(&now, NULL);
+				until.tv_sec = now.tv_sec;
+				until.tv_nsec = (now.tv_usec + PROGRESS_INTERVAL * 1000) * 1000;
+				if ( until.tv_nsec >= 1000000000 ) {
+					until.tv_sec += until.tv_nsec / 1000000000;
+					until.tv_nsec %= 1000000000;
+				}
+				pthread_cond_timedwait(&pool.progress, &pool.lock, &until);
+			} else {
+				pthread_cond_wait(&pool.progress, &pool.lock);
+			}
+		}
+		last = pool.last;
+		if ( last ) {
+			final = last->final;
+			size = progress_count(&last->size, 0);
+			total = last->input->size;
+		}
+		job = NULL;
+		if ( pool.jobs && pool.jobs->done ) {
+			job = pool.jobs;
+			pool.jobs = job->next;
+			if ( ! pool.jobs ) {
+				pool.jobs_tail = NULL;
+			}
+			if ( pool.last == job ) {
+				pool.last = NULL;
+			}
+		}
+		abort = pool.abort;
+		pthread_mutex_unlock(&pool.lock);
+
+		progress_collect(info);
+		if ( last && update && !abort ) {
+			if ( ! update(info, final, size, total, current_option_txt) ) {
+				pthread_mutex_lock(&pool.lock);
+				pool.abort = 1;
+				pthread_mutex_unlock(&pool.lock);
+			}
+		}
+		if ( job ) {
+			copy_job_finish(job);
+			-- pool.pending;
+		} else if ( pool.pending <= limit ) {
+			break;
+		}
+	}
+}
+
+/* Start the worker pool, unless it is disabled or already running.
+   Returns 1 if the caller has to stop it with copy_pool_stop() */
+static int copy_pool_start(void)
+{
+	int i;
+
+	if ( pool.active || copy_workers <= 1 ) {
+		return 0;
+	}
+	memset(&pool, 0, sizeof(pool));
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.work, NULL);
+	pthread_cond_init(&pool.progress, NULL);
+	for ( i = 0; i < copy_workers && i < COPY_WORKERS_MAX; ++i ) {
+		if ( pthread_create(&pool.threads[i], NULL, copy_worker, NULL) != 0 ) {
+			break;
+		}
+	}
+	pool.nthreads = i;
+	if ( pool.nthreads == 0 ) {
+		log_debug(_("Unable to start the copy threads, copying files one at a time\n"));
+		pthread_cond_destroy(&pool.progress);
+		pthread_cond_destroy(&pool.work);
+		pthread_mutex_destroy(&pool.lock);
+		return 0;
+	}
+	/* The decoders of the streams share the processors with the workers */
+	preader_set_streams(pool.nthreads);
+	pool.active = 1;
+	return 1;
+}
+
+/* Wait for all the queued files and stop the workers.
+   Returns the number of bytes they copied */
+static ssize_t copy_pool_stop(install_info *info, UIUpdateFunc update)
+{
+	int i;
+
+	copy_pool_poll(info, update, 0);
+	pthread_mutex_lock(&pool.lock);
+	pool.quit = 1;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+	for ( i = 0; i < pool.nthreads; ++i ) {
+		pthread_join(pool.threads[i], NULL);
+	}
+	pthread_cond_destroy(&pool.progress);
+	pthread_cond_destroy(&pool.work);
+	pthread_mutex_destroy(&pool.lock);
+	preader_set_streams(1);
+	pool.active = 0;
+	return pool.total;
+}
+
+/* Queue the copy of an open file. At most two files per worker are kept open */
+static void copy_pool_submit(install_info *info, stream *input, stream *output,
+							 const char *final, const char *base, int mode,
+							 xmlNodePtr node, UIUpdateFunc update)
+{
+	copy_job *job = (copy_job *)malloc(sizeof *job);
+
+	memset(job, 0, sizeof(*job));
+	job->info = info;
+	job->node = node;
+	job->input = input;
+	job->output = output;
+	job->elem = output->elem;
+	job->final = strdup(final);
+	job->base = strdup(base);
+	job->mode = mode;
+
+	pthread_mutex_lock(&pool.lock);
+	if ( pool.jobs_tail ) {
+		pool.jobs_tail->next = job;
+	} else {
+		pool.jobs = job;
+	}
+	pool.jobs_tail = job;
+	if ( pool.queue_tail ) {
+		pool.queue_tail->next_queued = job;
+	} else {
+		pool.queue = job;
+	}
+	pool.queue_tail = job;
+	pthread_cond_signal(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+	++ pool.pending;
+
+	copy_pool_poll(info, update, 2*pool.nthreads);
+}
+#else
+static int copy_pool_start(void)
+{
+	return 0;
+}
+
+static ssize_t copy_pool_stop(install_info *info, UIUpdateFunc update)
+{
+	return 0;
+}
+#endif
+
 ssize_t copy_file(install_info *info, const char *cdrom, const char *path, const char *dest, char *final, 
 				  int binary, int strip_dirs, xmlNodePtr node,
 				  UIUpdateFunc update,
@@ -262,6 +677,7 @@ ssize_t copy_file(install_info *info, const char *cdrom, const char *path, const
     char buf[BUFSIZ], fullpath[PATH_MAX];
     stream *input, *output;
 	struct file_elem *output_elem;
+	int error = 0;
 
     if ( strip_dirs ) {
         /* Get the final pathname (useful for binaries only!) */
@@ -276,7 +692,7 @@ ssize_t copy_file(install_info *info, const char *cdrom, const char *path, const
     }
     sprintf(final, "%s/%s", dest, base);
 
-	if ( corrupts && !file_is_corrupt(info->product, final) ) { /* We are actually restoring corrupted files */
+	if ( restoring && !file_is_corrupt(info->product, final) ) { /* We are actually restoring corrupted files */
 		return 0;
 	}
 
@@ -301,16 +717,11 @@ ssize_t copy_file(install_info *info, const char *cdrom, const char *path, const
 			log_warning(_("Unable to create %s symlink pointing to %s"), final, buf);
 		}
 	} else {
-		ssize_t copied = -1;
 		char sum[CHECKSUM_SIZE+1];
-		/* Optional MD5 sum can be specified in the XML file */
-		char *md5 = (char *)xmlGetProp(node, BAD_CAST "md5sum");
+		copy_progress prog;
 		char *mut = (char *)xmlGetProp(node, BAD_CAST "mutable");
 		char *uncompress = (char *)xmlGetProp(node, BAD_CAST "process");
 		char *mode_str = (char *)xmlGetProp(node, BAD_CAST "mode");
-#ifdef __linux
-		char *se_context = (char *)xmlGetProp(node, BAD_CAST "secontext");
-#endif
 		int mode = binary ? 0755 : 0644;
 
 		input = file_open(info, fullpath, "r");
@@ -328,18 +739,22 @@ ssize_t copy_file(install_info *info, const char *cdrom, const char *path, const
 			mode = (int) strtol(mode_str, NULL, 8);
 		} 
 
-		while ( (copied=file_read(info, buf, sizeof(buf), input)) > 0 ) {
-			if ( file_write(info, buf, copied, output) != copied ) {
-				break;
-			}
-			info->installed_bytes += copied;
-			size += copied;
-			if ( update ) {
-				if ( ! update(info, final, size, input->size, current_option_txt) ) {
-					break; /* Abort */
-				}
-			}
+#ifdef HAVE_PTHREAD_H
+		/* Let the workers copy the data if the file needs no further processing */
+		if ( pool.active && !uncompress && !elem ) {
+			copy_pool_submit(info, input, output, final, base, mode, node, update);
+			goto copy_file_exit;
 		}
+#endif
+		prog.info = info;
+		prog.final = final;
+		prog.size = 0;
+		prog.total = input->size;
+		prog.update = update;
+		size = copy_stream(info, input, output, copy_file_progress, &prog, &error);
+		copy_stream_error(error, input, output);
+		copy_correct_total(info, input);
+
         if ( elem ) { /* Give the pointer to the element, for what it's worth (binaries mostly) */
             *elem = output->elem;
         }
@@ -390,41 +805,9 @@ ssize_t copy_file(install_info *info, const char *cdrom, const char *path, const
 		} else {
 			file_chmod(info, final, mode);
 		}
-#ifdef __linux
-		if ( se_context && have_selinux ) {
-//# ifdef HAVE_SELINUX_SELINUX_H
-#if 0 // Using chcon directly seems more reliable
-			/* Use the selinux library */
-			context_t cont = context_new(se_context);
-			if ( cont ) {
-				security_context_t sec = context_str(cont);
-				if ( setfilecon(final, sec) < 0 ) {
-					if ( errno == ENOTSUP ) {
-						log_debug(_("Failed to change SELinux context for file '%s' - not supported"), base);
-					} else {
-						log_warning(_("Failed to change SELinux context for file '%s'"), base);
-					}
-				}
-				context_free(cont);
-			} else {
-				log_warning(_("Invalid SELinux context '%s' for file '%s'"), se_context, base);
-			}
-# else
-			run_command3(info, "chcon", "-ht", se_context, final, 0);
-# endif
-		}
-#endif
-		if ( md5 ) { /* Verify the output file */
-			strcpy(sum, get_md5(output->md5.buf));
-			if ( strcasecmp(md5, sum) ) {
-				log_fatal(_("File '%s' has an invalid checksum! Aborting."), base);
-			}
-		}
+		copy_file_verify(info, node, final, base, output_elem);
 	copy_file_exit:
-		xmlFree(md5); xmlFree(mut); xmlFree(uncompress); xmlFree(mode_str);
-#ifdef __linux
-		xmlFree(se_context);
-#endif
+		xmlFree(mut); xmlFree(uncompress); xmlFree(mode_str);
 	}
     return size;
 }
@@ -477,6 +860,10 @@ ssize_t copy_path(install_info *info, const char *path, const char *dest,
     
 	//fprintf(stderr, "copy_path %s\n", path);
 
+	if ( restoring && !corrupts_left ) { /* Everything was restored, don't even open the archives */
+		return 0;
+	}
+
     if ( ! stat(path, &sb) ) {
         if ( S_ISDIR(sb.st_mode) ) {
             copied = copy_directory(info, path, dest, cdrom, suffix, node, update);
@@ -508,9 +895,10 @@ static ssize_t copy_list(install_info *info, const char *filedesc, const char *d
 		  xmlNodePtr node,
 		  UIUpdateFunc update)
 {
-    char fpat[PATH_MAX];
-    int i;
-    glob_t globbed;
+    char full_cdpath[PATH_MAX];
+    int i, j, workers;
+    plan_node *plan;
+    plan_pattern *pat;
     ssize_t size, copied;
     const char *cdpath = NULL;
 
@@ -523,48 +911,42 @@ static ssize_t copy_list(install_info *info, const char *filedesc, const char *d
         if ( ! cdpath ) {
             return 0;
         }
+        snprintf(full_cdpath, sizeof(full_cdpath), "%s/%s", cdpath, srcpath);
+        srcpath = full_cdpath;
     }
 
-    while ( filedesc && parse_line(&filedesc, fpat, (sizeof fpat)) ) {
-        if ( from_cdrom ) {
-            char full_cdpath[PATH_MAX];
-            snprintf(full_cdpath, sizeof(full_cdpath), "%s/%s", cdpath, srcpath);
-            push_curdir(full_cdpath);
-            if ( glob(fpat, GLOB_ERR, NULL, &globbed) == 0 ) {
-                for ( i=0; i<globbed.gl_pathc; ++i ) {
-                    copied = copy_path(info, globbed.gl_pathv[i], dest, 
-                                       full_cdpath, strip_dirs, suffix, node, update);
-                    if ( copied > 0 ) {
-                        size += copied;
-                    }
+	/* The files were usually found already when sizing the install */
+	plan = plan_files(info, node, srcpath, filedesc, suffix);
+
+	/* Plain files are copied concurrently until the end of the list */
+	workers = copy_pool_start();
+
+    push_curdir(srcpath);
+    for ( i=0; i<plan->num_patterns; ++i ) {
+        pat = &plan->patterns[i];
+        if ( pat->found ) {
+            for ( j=0; j<pat->count; ++j ) {
+                copied = copy_path(info, pat->files[j].path, dest, cdpath ? full_cdpath : NULL,
+                                   strip_dirs, suffix, node, update);
+                if ( copied > 0 ) {
+                    size += copied;
                 }
-                globfree(&globbed);
-            } else {
-                log_warning(_("Unable to find file '%s' on any of the CDROM drives"), fpat);
             }
-            pop_curdir();
+        } else if ( from_cdrom ) {
+            log_warning(_("Unable to find file '%s' on any of the CDROM drives"), pat->pattern);
         } else {
-            push_curdir(srcpath);
-            if ( glob(fpat, GLOB_ERR, NULL, &globbed) == 0 ) {
-                for ( i=0; i<globbed.gl_pathc; ++i ) {
-                    copied = copy_path(info, globbed.gl_pathv[i], dest, NULL,
-                                       strip_dirs, suffix, node, update);
-                    if ( copied > 0 ) {
-                        size += copied;
-                    }
-                }
-                globfree(&globbed);
-            } else {
-                //!!!TODO - TEMP
-                char _temp[1024];
-                getcwd(_temp, sizeof(_temp));
-                log_warning(_("2 Unable to find file '%s' in '%s'"), fpat, _temp);
-                //!!!TODO - END TEMP
-                //log_warning(_("Unable to find file '%s'"), fpat);
-            }
-            pop_curdir();
+            //!!!TODO - TEMP
+            char _temp[1024];
+            getcwd(_temp, sizeof(_temp));
+            log_warning(_("2 Unable to find file '%s' in '%s'"), pat->pattern, _temp);
+            //!!!TODO - END TEMP
+            //log_warning(_("Unable to find file '%s'"), pat->pattern);
         }
     }
+    pop_curdir();
+	if ( workers ) {
+		size += copy_pool_stop(info, update);
+	}
     return size;
 }
 
@@ -702,6 +1084,9 @@ ssize_t copy_binary(install_info *info, xmlNodePtr node, const char *filedesc, c
     os = detect_os();
     copied = 0;
     size = 0;
+	if ( in_rpm ) { /* The package may not be installed yet */
+		size = copy_flush(info, update);
+	}
 
 	if(xmlNodePropIsTrue(node, "inline"))
 	{
@@ -878,7 +1263,7 @@ static int copy_script(install_info *info, xmlNodePtr node, const char *script,
     struct cdrom_elem *cdrom_start;
     int rc;
 
-	if ( corrupts ) { /* Don't run any scripts while restoring files */
+	if ( restoring ) { /* Don't run any scripts while restoring files */
 		return 0;
 	}
 	if ( update ) {
@@ -888,8 +1273,9 @@ static int copy_script(install_info *info, xmlNodePtr node, const char *script,
 			rc = update(info, _("Running script. Please wait..."), size/2, size, current_option_txt);
 		if ( !rc ) 
 			return 0;
+		/* The script may run for a while */
+		progress_flush(info);
 	}
-
     cdrom_start = info->cdroms_list;
     while ( from_cdrom != NULL && info->cdroms_list ) {
         cdrom = info->cdroms_list;
@@ -901,6 +1287,10 @@ static int copy_script(install_info *info, xmlNodePtr node, const char *script,
 
     rc = run_script(info, script, -1, 1);
     info->cdroms_list = cdrom_start;
+	/* The script may have changed what the scripted bools check,
+	   and the files that the next elements install */
+	setup_invalidate_bools();
+	plan_invalidate_files();
     return rc;
 }
 
@@ -1000,6 +1390,10 @@ ssize_t copy_node(install_info *info, xmlNodePtr node, const char *dest,
 				char *msg= (char *)xmlGetProp(node, BAD_CAST "message");
 				int rc;
 
+				/* The script may need the files of packages still waiting to be installed */
+				if ( ! restoring ) {
+					size += copy_flush(info, update);
+				}
 				rc = copy_script(info, node,
 								 (char *)xmlNodeListGetString(info->config, XML_CHILDREN(node), 1),
 					    path, sz, update, from_cdrom, msg);
@@ -1071,6 +1465,8 @@ ssize_t copy_tree(install_info *info, xmlNodePtr node, const char *dest,
 					if ( copied > 0 ) {
 						size += copied;
 					}
+					/* Scripted bools may look for the files of the option */
+					setup_invalidate_bools();
 					copied = copy_tree(info, XML_CHILDREN(node), dest, update);
 					if ( copied > 0 ) {
 						size += copied;
@@ -1143,6 +1539,17 @@ ssize_t copy_tree(install_info *info, xmlNodePtr node, const char *dest,
 	return size;
 }
 
+size_t copy_flush(install_info *info, UIUpdateFunc update)
+{
+	ssize_t size = FlushPlugins(info, update);
+
+	if ( size < 0 ) {
+		log_fatal(_("Unable to install the packages. Aborting."));
+		return 0;
+	}
+	return size;
+}
+
 /* Returns the install size of a man page, in bytes */
 ssize_t size_manpage(install_info *info, xmlNodePtr node, const char *from_cdrom)
 {
@@ -1215,14 +1622,14 @@ ssize_t size_binary(install_info *info, const char *from_cdrom, const char *file
 }
 
 /* Returns the install size of a list of files, in bytes */
-static ssize_t size_list(install_info *info, const char *from_cdrom, const char *srcpath,
-		const char *filedesc, const char* suffix)
+static unsigned long long size_list(install_info *info, const char *from_cdrom, const char *srcpath,
+		const char *filedesc, const char* suffix, xmlNodePtr node)
 {
-    char fpat[PATH_MAX];
     char fullpath[PATH_MAX];
-    int i;
-    glob_t globbed;
-    ssize_t size, count;
+    int i, j;
+    plan_node *plan;
+    plan_pattern *pat;
+    unsigned long long size;
 
     size = 0;
     if( from_cdrom ) {
@@ -1231,42 +1638,20 @@ static ssize_t size_list(install_info *info, const char *from_cdrom, const char
         if ( ! cdpath ) {
             return 0;
         }
-        while ( filedesc && parse_line(&filedesc, fpat, (sizeof fpat)) ) {
-            snprintf(fullpath, sizeof(fullpath), "%s/%s/%s", cdpath, srcpath, fpat);
-            if ( glob(fullpath, GLOB_ERR, NULL, &globbed) == 0 ) {
-                for ( i=0; i<globbed.gl_pathc; ++i ) {
-                    const SetupPlugin *plug = FindPluginForFile(globbed.gl_pathv[i], suffix);
-                    if (plug) {
-                        count = plug->Size(info, globbed.gl_pathv[i]);
-                    } else {
-                        count = file_size(info, globbed.gl_pathv[i]);
-                    }
-                    if ( count > 0 ) {
-                        size += count;
-                    }
-                }
-                globfree(&globbed);
-            } else { /* Error in glob, try next CDROM drive */
-                size = 0;
-            }
-        }
-    } else {
-        while ( filedesc && parse_line(&filedesc, fpat, (sizeof fpat)) ) {
-            snprintf(fullpath, sizeof(fullpath), "%s/%s", srcpath, fpat);
-            if ( glob(fullpath, GLOB_ERR, NULL, &globbed) == 0 ) {
-                for ( i=0; i<globbed.gl_pathc; ++i ) {
-					const SetupPlugin *plug = FindPluginForFile(globbed.gl_pathv[i], suffix);
-					if (plug) {
-						count = plug->Size(info, globbed.gl_pathv[i]);
-					} else {
-						count = file_size(info, globbed.gl_pathv[i]);
-					}
-                    if ( count > 0 ) {
-                        size += count;
-                    }
+        snprintf(fullpath, sizeof(fullpath), "%s/%s", cdpath, srcpath);
+        srcpath = fullpath;
+    }
+    plan = plan_files(info, node, srcpath, filedesc, suffix);
+    for ( i=0; i<plan->num_patterns; ++i ) {
+        pat = &plan->patterns[i];
+        if ( pat->found ) {
+            for ( j=0; j<pat->count; ++j ) {
+                if ( pat->files[j].size > 0 ) {
+                    size += pat->files[j].size;
                 }
-				globfree(&globbed);
             }
+        } else if ( from_cdrom ) { /* Error in glob, try next CDROM drive */
+            size = 0;
         }
     }
     return size;
@@ -1277,12 +1662,17 @@ ssize_t size_readme(install_info *info, xmlNodePtr node)
 {
 	char *lang_prop;
 	int ret = 0;
+	plan_node *plan = plan_get(node);
 
+	if ( plan_sized(plan) ) {
+		return plan->size;
+	}
 	lang_prop = (char *)xmlGetProp(node, BAD_CAST "lang");
 	if (lang_prop && match_locale(lang_prop) ) {
-		ret = size_list(info, 0, ".", (char *)xmlNodeListGetString(info->config, XML_CHILDREN(node), 1), NULL);
+		ret = size_list(info, 0, ".", (char *)xmlNodeListGetString(info->config, XML_CHILDREN(node), 1), NULL, node);
 	}
 	xmlFree(lang_prop);
+	plan_set_size(plan, ret);
 	return ret;
 }
 
@@ -1292,6 +1682,12 @@ unsigned long long size_node(install_info *info, xmlNodePtr node)
     char *size_prop, *lang_prop;
     unsigned long long size = 0;
 	int lang_matched = 1;
+	plan_node *plan = plan_get(node);
+
+	/* Toggling options in the UI doesn't change their size */
+	if ( plan_sized(plan) ) {
+		return plan->size;
+	}
 
     /* First do it the easy way, look for a size attribute */
     size_prop = (char *)xmlGetProp(node, BAD_CAST "size");
@@ -1344,7 +1740,7 @@ unsigned long long size_node(install_info *info, xmlNodePtr node)
 				if ( strcmp((char *)node->name, "files") == 0 ) {
 					char* suffix = (char *)xmlGetProp(node, BAD_CAST "suffix");
 					size += size_list(info, from_cdrom, srcpath,
-									  (char *)xmlNodeListGetString(info->config, XML_CHILDREN(node), 1), suffix);
+									  (char *)xmlNodeListGetString(info->config, XML_CHILDREN(node), 1), suffix, node);
 					xmlFree(suffix);
 				} else if ( strcmp((char *)node->name, "binary") == 0 ) {
 					if(!xmlNodePropIsTrue(node, "inline"))
@@ -1357,9 +1753,38 @@ unsigned long long size_node(install_info *info, xmlNodePtr node)
             node = node->next;
         }
     }
+	plan_set_size(plan, size);
     return size;
 }
 
+/* Get what an option and the options below it add to the install size, in bytes */
+unsigned long long size_option(install_info *info, xmlNodePtr node)
+{
+    xmlNodePtr parent;
+    char *wanted;
+    int selected;
+
+    /* Nothing unless it is selected, and everything above it is too */
+    for ( parent = node; parent && (parent->type == XML_ELEMENT_NODE); parent = parent->parent ) {
+        if ( ! strcmp((char *)parent->name, "option") ) {
+            wanted = (char *)xmlGetProp(parent, BAD_CAST "install");
+            selected = wanted && (strcmp(wanted, "true") == 0);
+            xmlFree(wanted);
+            if ( ! selected ) {
+                return 0;
+            }
+        } else if ( !strcmp((char *)parent->name, "component") ) {
+            if ( !(match_arch(info, (char *)xmlGetProp(parent, BAD_CAST "arch")) &&
+                   match_libc(info, (char *)xmlGetProp(parent, BAD_CAST "libc")) &&
+                   match_distro(info, (char *)xmlGetProp(parent, BAD_CAST "distro")) &&
+                   match_condition((char *)xmlGetProp(parent, BAD_CAST "if"))) ) {
+                return 0;
+            }
+        }
+    }
+    return size_node(info, node) + size_tree(info, XML_CHILDREN(node));
+}
+
 /* Get the install size of an option tree, in bytes */
 unsigned long long size_tree(install_info *info, xmlNodePtr node)
 {
@@ -8,6 +8,11 @@
 
 #include "install.h"
 
+/* Number of files copied concurrently, set with the -j command line option */
+#define COPY_WORKERS_DEFAULT	4
+#define COPY_WORKERS_MAX		32
+extern int copy_workers;
+
 /* Copy a path to the destination directory */
 extern ssize_t copy_path(install_info *info, const char *path, 
 						 const char *dest, const char *cdrom, int strip_dirs,
@@ -19,12 +24,19 @@ extern ssize_t copy_path(install_info *info, const char *path,
 extern ssize_t copy_tree(install_info *info, xmlNodePtr node, const char *dest,
 						UIUpdateFunc update);
 
+/* Install what the plugins left for later, the install is aborted if that fails.
+   Returns the number of bytes installed */
+extern size_t copy_flush(install_info *info, UIUpdateFunc update);
+
 /* Get the install size of an option node, in bytes */
 extern unsigned long long size_node(install_info *info, xmlNodePtr node);
 
 /* Get the install size of an option tree, in bytes */
 extern unsigned long long size_tree(install_info *info, xmlNodePtr node);
 
+/* Get what a selected option and the ones below it add to the install size */
+extern unsigned long long size_option(install_info *info, xmlNodePtr node);
+
 /* See whether or not an XML file contains binary entries */
 extern int has_binaries(install_info *info, xmlNodePtr node);
 
@@ -7,6 +7,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <sys/param.h>
+#include <sys/stat.h>
 #ifdef HAVE_SYS_MOUNT_H
 # include <sys/mount.h>
 #endif
@@ -804,6 +805,20 @@ int detect_cdrom(install_info *info)
     return(num_mounted);
 }
 
+/* Whether a CDROM found earlier is still there: the same device is mounted
+   and the file that identifies the disc can be found */
+static int cdrom_still_mounted(struct cdrom_elem *cd)
+{
+    char file[PATH_MAX];
+    struct stat st;
+
+    if ( !cd->mounted || (stat(cd->mounted, &st) < 0) || (st.st_dev != cd->dev) ) {
+        return 0;
+    }
+    snprintf(file, sizeof(file), "%s/%s", cd->mounted, cd->file);
+    return access(file, F_OK) == 0;
+}
+
 /* Get a mount point for the specified CDROM, and return its path.
    If the CDROM is not mounted, prompt the user to mount it */
 const char *get_cdrom(install_info *info, const char *id)
@@ -811,6 +826,12 @@ const char *get_cdrom(install_info *info, const char *id)
     const char *mounted = NULL, *desc = info->desc;
     struct cdrom_elem *cd;
 
+    /* The drives are only looked for again when the disc went away */
+    for ( cd = info->cdroms_list; cd; cd = cd->next ) {
+        if ( !strcmp(id, cd->id) && cdrom_still_mounted(cd) ) {
+            return cd->mounted;
+        }
+    }
     while ( ! mounted ) {
 		detect_cdrom(info);
         for ( cd = info->cdroms_list; cd; cd = cd->next ) {
@@ -18,6 +18,7 @@
 #include "detect.h"
 #include "file.h"
 #include "copy.h"
+#include "progress.h"
 #include "bools.h"
 #include "loki_launchurl.h"
 #include "dialog/dialog.h"
@@ -191,9 +192,9 @@ static int parse_option(install_info *info, const char *component, xmlNodePtr pa
 				}
 				if ( exclusive && ! excl_reinst ) {
 					if ( comp && loki_find_option(comp, get_option_name(info, node, NULL, 0)) ) {
-						mark_option(info, node, "true", 0);
+						mark_option_size(info, node, "true", 0);
 					} else {
-						mark_option(info, node, "false", 0);
+						mark_option_size(info, node, "false", 0);
 					}
 					continue;
 				} else if ( !GetProductReinstall(info) || !GetReinstallNode(info, node) ) {
@@ -290,11 +291,8 @@ options_loop:
 					snprintf(buf, sizeof(buf), "%s:\n%s", get_option_name(info, nodes[i], NULL, 0), warn);
 					dialog_prompt(buf, RESPONSE_OK);
 				}
-				/* Mark this option for installation */
-				mark_option(info, nodes[i], "true", 0);
-				
-				/* Add this option size to the total */
-				info->install_size += size_node(info, nodes[i]);
+				/* Mark this option for installation, with its size */
+				mark_option_size(info, nodes[i], "true", 0);
                 /* Parse any child options */
 		        ret = parse_option(info, NULL, nodes[i], 0, 0, _("Choose the options"));
 		    } else if ( xmlGetProp(nodes[i], BAD_CAST "required") ) {
@@ -302,18 +300,15 @@ options_loop:
 						 get_option_name(info, nodes[i], NULL, 0));
 				dialog_prompt(buf, RESPONSE_OK);
 			    
-				/* Mark this option for installation */
-				mark_option(info, nodes[i], "true", 0);
-				
-				/* Add this option size to the total */
-				info->install_size += size_node(info, nodes[i]);
+				/* Mark this option for installation, with its size */
+				mark_option_size(info, nodes[i], "true", 0);
                 /* Parse any child options */
 		        ret = parse_option(info, NULL, nodes[i], 0, 0, _("Choose the options"));
                 
 		    } else { /* Unmark */
 				xmlNodePtr sub_option = XML_CHILDREN(nodes[i]);
 				/* Unmark the childs */
-				mark_option(info, nodes[i], "false", 0);
+				mark_option_size(info, nodes[i], "false", 0);
 				while(sub_option) {
 					mark_option(info, sub_option, "false", 1); /* Recursively unmark the child options */
 					sub_option = sub_option->next;
@@ -330,7 +325,7 @@ options_loop:
                 /* If an exclusive option is deselected, unmark all the child options */
 			   xmlNodePtr exc_childs = XML_CHILDREN(nodes[i]);
 			   while(exc_childs) {
-				   mark_option(info, exc_childs, "false", 1); /* Recursively unmark the child options */
+				   mark_option_size(info, exc_childs, "false", 1); /* Recursively unmark the child options */
 				   exc_childs = exc_childs->next;
 			   }
 		   }
@@ -520,9 +515,8 @@ install_state dialog_setup(install_info *info)
 					}
 				}
 
-				/* Go through the install options */
-
-				info->install_size = 0;
+				/* Go through the install options, the size follows the changes */
+				info->install_size = size_tree(info, XML_CHILDREN(XML_ROOT(info->config)));
 				if ( GetProductNumComponents(info) > 1 ) {
 					label = _("Please choose the components to install");
 				} else {
@@ -609,6 +603,9 @@ int dialog_update(install_info *info, const char *path, size_t progress,
 {
 	char buf[PATH_MAX];
     static char previous[200] = "";
+	static char shown[PATH_MAX] = "";
+	static int shown_percent = -1;
+	const char *rate = progress_rate(info);
 	int percent;
 
     if (strcmp(previous, current)) {
@@ -628,9 +625,17 @@ int dialog_update(install_info *info, const char *path, size_t progress,
 
 	if ( progress && !path ) {
 		snprintf(buf, sizeof(buf), _("Installing %s ..."), current);
-		dialog_gauge_update(_("Installing..."), buf, percent);
     } else { /* Script */
-		dialog_gauge_update(_("Installing..."), path, percent);
+		snprintf(buf, sizeof(buf), "%s", path);
+	}
+	if ( *rate ) {
+		snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "\n%s", rate);
+	}
+	/* Only redraw the gauge when it changed */
+	if ( (percent != shown_percent) || strcmp(buf, shown) ) {
+		shown_percent = percent;
+		strcpy(shown, buf);
+		dialog_gauge_update(_("Installing..."), buf, percent);
 	}
 	return 1;
 }
@@ -746,6 +751,7 @@ int dialog_okay(Install_UI *UI, int *argc, char ***argv)
     UI->exit = dialog_exit;
     UI->pick_class = dialog_pick_class;
     UI->idle = NULL;
+    UI->event_fd = NULL;
     UI->shutdown = dialog_shutdown;
     UI->is_gui = 0;
 
@@ -1,6 +1,7 @@
 
 /* Functions to handle logging and uninstalling */
 
+#define _GNU_SOURCE /* copy_file_range() under Linux */
 #include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -10,6 +11,8 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <time.h>
 
@@ -17,63 +20,1444 @@
 
 #include "config.h"
 
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+#ifdef HAVE_XZ_SUPPORT
+#  include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD_SUPPORT
+#  include <zstd.h>
+#endif
+#ifdef HAVE_LZ4_SUPPORT
+#  include <lz4frame.h>
+#endif
+#ifdef __linux
+#  include <sys/ioctl.h>
+#  ifdef HAVE_LINUX_FS_H
+#    include <linux/fs.h>
+#  endif
+#  ifdef HAVE_SYS_SENDFILE_H
+#    include <sys/sendfile.h>
+#  endif
+#endif
+
 #include "file.h"
+#include "bzip2.h"
+#include "gzip.h"
 #include "install_log.h"
 #include "install_ui.h"
 
 #ifdef HAVE_BZIP2_SUPPORT
 
-#ifndef BZIP2_DLOPEN
-#ifdef LIBBZ2_PREFIX
-#define BZOPEN BZ2_bzopen
-#define BZDOPEN BZ2_bzdopen
-#define BZREAD BZ2_bzread
-#define BZWRITE BZ2_bzwrite
-#define BZERROR BZ2_bzerror
-#define BZCLOSE BZ2_bzclose
-#else
-#define BZOPEN bzopen
-#define BZDOPEN bzdopen
-#define BZREAD bzread
-#define BZWRITE bzwrite
-#define BZERROR bzerror
-#define BZCLOSE bzclose
-#endif
-#else
+#ifndef BZIP2_DLOPEN
+#ifdef LIBBZ2_PREFIX
+#define BZOPEN BZ2_bzopen
+#define BZDOPEN BZ2_bzdopen
+#define BZREAD BZ2_bzread
+#define BZWRITE BZ2_bzwrite
+#define BZERROR BZ2_bzerror
+#define BZCLOSE BZ2_bzclose
+#define BZDECOMPRESSINIT BZ2_bzDecompressInit
+#define BZDECOMPRESS BZ2_bzDecompress
+#define BZDECOMPRESSEND BZ2_bzDecompressEnd
+#else
+#define BZOPEN bzopen
+#define BZDOPEN bzdopen
+#define BZREAD bzread
+#define BZWRITE bzwrite
+#define BZERROR bzerror
+#define BZCLOSE bzclose
+#define BZDECOMPRESSINIT bzDecompressInit
+#define BZDECOMPRESS bzDecompress
+#define BZDECOMPRESSEND bzDecompressEnd
+#endif
+#else
+
+#include <dlfcn.h>
+
+static BZFILE* dummy_bzopen(const char* path, const char* mode);
+static BZFILE* dummy_bzdopen(int fd, const char* mode);
+static int dummy_bzread(BZFILE* b, void* buf, int len);
+static int dummy_bzwrite(BZFILE* b, void* buf, int len);
+static const char* dummy_bzerror(BZFILE *b, int *errnum);
+static void dummy_bzclose(BZFILE* b);
+static int dummy_bzDecompressInit(bz_stream *strm, int verbosity, int small);
+static int dummy_bzDecompress(bz_stream *strm);
+static int dummy_bzDecompressEnd(bz_stream *strm);
+
+static BZFILE* (*BZOPEN)(const char* path, const char* mode) = dummy_bzopen;
+static BZFILE* (*BZDOPEN)(int fd, const char* mode)          = dummy_bzdopen;
+static int (*BZREAD)(BZFILE* b, void* buf, int len)          = dummy_bzread;
+static int (*BZWRITE)(BZFILE* b, void* buf, int len)         = dummy_bzwrite;
+static const char* (*BZERROR)(BZFILE *b, int *errnum)        = dummy_bzerror;
+static void (*BZCLOSE)(BZFILE* b)                            = dummy_bzclose;
+static int (*BZDECOMPRESSINIT)(bz_stream *strm, int verbosity, int small) = dummy_bzDecompressInit;
+static int (*BZDECOMPRESS)(bz_stream *strm)                  = dummy_bzDecompress;
+static int (*BZDECOMPRESSEND)(bz_stream *strm)               = dummy_bzDecompressEnd;
+
+static void dobz2init(void); // dlopen libbz2
+
+#endif
+
+#endif
+
+extern struct option_elem *current_option;
+
+/* Size of the block buffers used for plain files */
+static size_t block_size = FILE_BLOCK_DEFAULT;
+
+typedef struct stream_codec stream_codec;
+typedef struct stream_pipe stream_pipe;
+
+void file_init(void)
+{
+#ifdef BZIP2_DLOPEN
+	dobz2init();
+#endif
+}
+
+int file_set_blocksize(const char *size)
+{
+	char *end;
+	unsigned long long bytes;
+	long pagesize = sysconf(_SC_PAGESIZE);
+
+	if ( !size || !isdigit((int)*size) ) {
+		return 0;
+	}
+	bytes = strtoull(size, &end, 10);
+	switch ( *end ) {
+		case 'k': case 'K':
+			bytes *= 1024;
+			break;
+		case 'm': case 'M':
+			bytes *= 1024*1024;
+			break;
+		case '\0':
+		case 'b': case 'B':
+			break;
+		default:
+			return 0;
+	}
+	if ( bytes < FILE_BLOCK_MIN ) {
+		bytes = FILE_BLOCK_MIN;
+	} else if ( bytes > FILE_BLOCK_MAX ) {
+		bytes = FILE_BLOCK_MAX;
+	}
+	block_size = (bytes + pagesize - 1) & ~((unsigned long long)pagesize - 1);
+	log_debug("Using %lu bytes I/O buffers", (unsigned long)block_size);
+	return 1;
+}
+
+/* The descriptor behind a plain file stream, or -1 */
+static int stream_fd(stream *streamp)
+{
+	if ( streamp->fp ) {
+		return fileno(streamp->fp);
+	}
+	return streamp->fd;
+}
+
+/* Tell the kernel we won't need the input data before 'offset' again,
+   so that a large install does not evict everything else from the cache */
+static void block_release(stream *streamp, off_t offset)
+{
+#ifdef HAVE_POSIX_FADVISE
+	if ( offset > streamp->dropped ) {
+		posix_fadvise(stream_fd(streamp), streamp->dropped, offset - streamp->dropped, POSIX_FADV_DONTNEED);
+		streamp->dropped = offset;
+	}
+#endif
+}
+
+/* Allocate a page-aligned I/O buffer */
+static void *block_malloc(size_t size)
+{
+#ifdef HAVE_POSIX_MEMALIGN
+	void *ptr;
+	if ( posix_memalign(&ptr, sysconf(_SC_PAGESIZE), size) != 0 ) {
+		ptr = NULL;
+	}
+	return ptr;
+#else
+	return malloc(size);
+#endif
+}
+
+static int block_alloc(stream *streamp)
+{
+	streamp->buf = block_malloc(streamp->buf_size);
+	if ( streamp->buf == NULL ) {
+		log_warning(_("Out of memory"));
+		return 0;
+	}
+	return 1;
+}
+
+/* Read directly from the descriptor of a block stream */
+static ssize_t block_rawread(stream *streamp, void *buf, size_t len)
+{
+	ssize_t nread;
+
+	do {
+		nread = read(streamp->fd, buf, len);
+	} while ( (nread < 0) && (errno == EINTR) );
+	if ( nread == 0 ) {
+		streamp->eof = 1;
+	} else if ( nread > 0 ) {
+		streamp->offset += nread;
+	}
+	return nread;
+}
+
+static int block_read(stream *streamp, void *buf, int len)
+{
+	unsigned char *ptr = (unsigned char *) buf;
+	ssize_t nread;
+	size_t count;
+	int total = 0;
+
+	while ( len > 0 ) {
+		if ( streamp->buf_pos == streamp->buf_len ) {
+			if ( streamp->eof ) {
+				break;
+			}
+			/* Everything before the current position has been consumed */
+			block_release(streamp, streamp->offset);
+			streamp->buf_pos = streamp->buf_len = 0;
+			if ( (size_t)len >= streamp->buf_size ) {
+				/* Large reads go straight to the caller's buffer */
+				nread = block_rawread(streamp, ptr, len);
+			} else {
+				if ( !streamp->buf && !block_alloc(streamp) ) {
+					return -1;
+				}
+				nread = block_rawread(streamp, streamp->buf, streamp->buf_size);
+				if ( nread > 0 ) {
+					streamp->buf_len = nread;
+					continue;
+				}
+			}
+			if ( nread < 0 ) {
+				return total ? total : -1;
+			} else if ( nread == 0 ) {
+				break;
+			}
+			count = nread;
+		} else {
+			count = streamp->buf_len - streamp->buf_pos;
+			if ( count > (size_t)len ) {
+				count = len;
+			}
+			memcpy(ptr, streamp->buf + streamp->buf_pos, count);
+			streamp->buf_pos += count;
+		}
+		ptr += count;
+		total += count;
+		len -= count;
+	}
+	return total;
+}
+
+/* Write out a buffer completely, returns -1 on error */
+static int block_rawwrite(stream *streamp, const unsigned char *buf, size_t len)
+{
+	ssize_t nwrote;
+
+	while ( len > 0 ) {
+		nwrote = write(streamp->fd, buf, len);
+		if ( nwrote < 0 ) {
+			if ( errno == EINTR ) {
+				continue;
+			}
+			return -1;
+		}
+		buf += nwrote;
+		len -= nwrote;
+		streamp->offset += nwrote;
+	}
+	return 0;
+}
+
+static int block_flush(stream *streamp)
+{
+	if ( streamp->buf_len > 0 ) {
+		if ( block_rawwrite(streamp, streamp->buf, streamp->buf_len) < 0 ) {
+			return -1;
+		}
+		streamp->buf_len = 0;
+	}
+	return 0;
+}
+
+static int block_write(stream *streamp, const void *buf, int len)
+{
+	if ( (streamp->buf_len + len) > streamp->buf_size ) {
+		if ( block_flush(streamp) < 0 ) {
+			return -1;
+		}
+	}
+	if ( (size_t)len >= streamp->buf_size ) {
+		/* Large writes go straight to the file */
+		return (block_rawwrite(streamp, buf, len) < 0) ? -1 : len;
+	}
+	if ( !streamp->buf && !block_alloc(streamp) ) {
+		return -1;
+	}
+	memcpy(streamp->buf + streamp->buf_len, buf, len);
+	streamp->buf_len += len;
+	return len;
+}
+
+/* Compression formats recognized by file_open() from their magic bytes.
+   Once opened, the decoder owns the file descriptor. */
+struct stream_codec {
+	const char *name;
+	const char *magic;
+	size_t magic_len;
+	/* Set up the decoder, returns 0 on failure. NULL if support was not compiled in */
+	int (*open)(stream *streamp, int fd);
+	int (*read)(stream *streamp, void *buf, int len);
+	/* The uncompressed size of the data between 'start' and 'end', if it can be
+	   found without decompressing it, 0 otherwise. It may only be an estimate,
+	   the copy corrects the total of the install with the actual size */
+	size_t (*size)(int fd, off_t start, off_t end);
+	void (*close)(stream *streamp);
+};
+
+static int gzip_open(stream *streamp, int fd)
+{
+#ifdef GZIP_PARALLEL
+	/* Members are decoded by several threads, or at least ahead of the reads */
+	if ( (streamp->size > GZ_PARALLEL_MIN) && (preader_threads() > 1) ) {
+		streamp->cfp = preader_open(&gzip_preader, fd, lseek(fd, 0, SEEK_CUR), preader_threads());
+		if ( streamp->cfp ) {
+			return 1;
+		}
+	}
+#endif
+	streamp->zfp = gzdopen(fd, "rb");
+	return (streamp->zfp != NULL);
+}
+
+static int gzip_read(stream *streamp, void *buf, int len)
+{
+#ifdef GZIP_PARALLEL
+	if ( streamp->cfp ) {
+		return preader_read((preader *)streamp->cfp, buf, len);
+	}
+#endif
+	return gzread(streamp->zfp, buf, len);
+}
+
+/* Compressed data decoded by the size hooks that have nothing better, to
+   measure the ratio. It must hold a whole bzip2 block. The decoders are given
+   it a step at a time, so that they don't read far past the data they output */
+#define SIZE_SAMPLE	(1024*1024)
+#define SIZE_STEP	(4*1024)
+
+/* Read the start of the data between 'start' and 'end' for a size hook,
+   NULL on failure */
+static unsigned char *size_sample(int fd, off_t start, off_t end, size_t *len)
+{
+	unsigned char *buf;
+	size_t done = 0;
+	ssize_t nread;
+
+	*len = ((end - start) > SIZE_SAMPLE) ? SIZE_SAMPLE : (size_t)(end - start);
+	buf = (unsigned char *)malloc(*len);
+	if ( buf == NULL ) {
+		return NULL;
+	}
+	while ( done < *len ) {
+		nread = pread(fd, buf + done, *len - done, start + done);
+		if ( nread <= 0 ) {
+			if ( (nread < 0) && (errno == EINTR) ) {
+				continue;
+			}
+			free(buf);
+			return NULL;
+		}
+		done += nread;
+	}
+	return buf;
+}
+
+/* The uncompressed size of the 'total' bytes of compressed data, from the
+   'out' bytes that the first 'in' of them decoded to */
+static unsigned long long size_extrapolate(unsigned long long out, size_t in, off_t total)
+{
+	if ( in == 0 ) {
+		return 0;
+	}
+	return (unsigned long long)((double)out * (double)total / (double)in);
+}
+
+/* Decode a sample of gzip data. Returns the uncompressed size, which is exact
+   if '*complete' is set and extrapolated otherwise, 0 if the data could not be
+   decoded. '*members' is the number of members that ended in the sample */
+static unsigned long long gzip_sample(int fd, off_t start, off_t end, int *members, int *complete)
+{
+	unsigned char *in, out[64*1024];
+	unsigned long long total = 0, at_out = 0;
+	size_t len, fed = 0, at_in = 0;
+	z_stream strm;
+	int ret;
+
+	*members = *complete = 0;
+	in = size_sample(fd, start, end, &len);
+	if ( in == NULL ) {
+		return 0;
+	}
+	memset(&strm, 0, sizeof(strm));
+	if ( inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK ) {
+		free(in);
+		return 0;
+	}
+	strm.next_in = in;
+	for ( ;; ) {
+		if ( (strm.avail_in == 0) && (fed < len) ) {
+			strm.avail_in = ((len - fed) > SIZE_STEP) ? SIZE_STEP : (len - fed);
+			fed += strm.avail_in;
+		}
+		strm.next_out = out;
+		strm.avail_out = sizeof(out);
+		ret = inflate(&strm, Z_NO_FLUSH);
+		if ( strm.avail_out < sizeof(out) ) {
+			total += sizeof(out) - strm.avail_out;
+			at_out = total;
+			at_in = fed - strm.avail_in;
+		}
+		if ( ret == Z_STREAM_END ) {
+			++ *members;
+			/* Anything but another member is ignored, like gzip does */
+			if ( (len - (fed - strm.avail_in) < 2) || memcmp(strm.next_in, "\037\213", 2) ) {
+				*complete = (len == (size_t)(end - start));
+				break;
+			}
+			inflateReset(&strm);
+		} else if ( ((ret != Z_OK) && (ret != Z_BUF_ERROR)) ||
+					((strm.avail_in == 0) && (fed == len) && (strm.avail_out > 0)) ) {
+			break; /* Corrupt data, or the end of the sample */
+		}
+	}
+	inflateEnd(&strm);
+	free(in);
+	if ( *complete ) {
+		return total;
+	}
+	return size_extrapolate(at_out, at_in, end - start);
+}
+
+static size_t gzip_size(int fd, off_t start, off_t end)
+{
+	unsigned char isize[4];
+	unsigned long long size, estimate;
+	int members, complete;
+
+	/* Exact for BGZF files, whose members all record their size */
+	size = gz_bgzf_size(fd, start, end);
+	if ( size > 0 ) {
+		return size;
+	}
+	/* Exact if the whole file fits in the sample. A file made of several
+	   members would have to be decoded to the end, the copy corrects it */
+	estimate = gzip_sample(fd, start, end, &members, &complete);
+	if ( complete || (members > 0) ) {
+		return estimate;
+	}
+	/* A single member records its size modulo 4 GB, the estimate tells how
+	   many times 4 GB have to be added to it */
+	if ( pread(fd, isize, 4, end - 4) != 4 ) {
+		return estimate;
+	}
+	/* Read little-endian value platform independently */
+	size = isize[0] | (isize[1] << 8) | (isize[2] << 16) | ((unsigned long long)isize[3] << 24);
+	if ( estimate > size + 0x80000000ULL ) {
+		size += (estimate - size + 0x80000000ULL) & ~0xFFFFFFFFULL;
+	}
+	return size;
+}
+
+static void gzip_close(stream *streamp)
+{
+#ifdef GZIP_PARALLEL
+	if ( streamp->cfp ) {
+		preader_close((preader *)streamp->cfp);
+		streamp->cfp = NULL;
+		return;
+	}
+#endif
+	gzclose(streamp->zfp);
+	streamp->zfp = NULL;
+}
+
+#ifdef HAVE_BZIP2_SUPPORT
+static int bzip2_open(stream *streamp, int fd)
+{
+#ifdef BZIP2_PARALLEL
+	/* Blocks are decoded by several threads. This also reads all of the
+	   concatenated streams, where bzread() stops after the first one */
+	streamp->cfp = preader_open(&bzip2_preader, fd, lseek(fd, 0, SEEK_CUR), preader_threads());
+	if ( streamp->cfp ) {
+		return 1;
+	}
+#endif
+	streamp->bzfp = BZDOPEN(fd, "rb");
+	return (streamp->bzfp != NULL);
+}
+
+static int bzip2_read(stream *streamp, void *buf, int len)
+{
+#ifdef BZIP2_PARALLEL
+	if ( streamp->cfp ) {
+		return preader_read((preader *)streamp->cfp, buf, len);
+	}
+#endif
+	return BZREAD(streamp->bzfp, buf, len);
+}
+
+/* There is no record of the uncompressed size, it is extrapolated from
+   a sample like for gzip, and exact if the whole file fits in it */
+static size_t bzip2_size(int fd, off_t start, off_t end)
+{
+	unsigned char *in;
+	char out[64*1024], *next;
+	unsigned long long total = 0, at_out = 0;
+	size_t len, fed = 0, at_in = 0;
+	unsigned int left;
+	bz_stream strm;
+	int ret, complete = 0;
+
+	in = size_sample(fd, start, end, &len);
+	if ( in == NULL ) {
+		return 0;
+	}
+	memset(&strm, 0, sizeof(strm));
+	if ( BZDECOMPRESSINIT(&strm, 0, 0) != BZ_OK ) {
+		free(in);
+		return 0;
+	}
+	strm.next_in = (char *)in;
+	for ( ;; ) {
+		if ( (strm.avail_in == 0) && (fed < len) ) {
+			strm.avail_in = ((len - fed) > SIZE_STEP) ? SIZE_STEP : (len - fed);
+			fed += strm.avail_in;
+		}
+		strm.next_out = out;
+		strm.avail_out = sizeof(out);
+		ret = BZDECOMPRESS(&strm);
+		if ( strm.avail_out < sizeof(out) ) {
+			total += sizeof(out) - strm.avail_out;
+			at_out = total;
+			at_in = fed - strm.avail_in;
+		}
+		if ( ret == BZ_STREAM_END ) {
+			/* Streams may be concatenated, anything else is ignored */
+			BZDECOMPRESSEND(&strm);
+			if ( (len - (fed - strm.avail_in) < 4) || memcmp(strm.next_in, "BZh", 3) ) {
+				complete = (len == (size_t)(end - start));
+				break;
+			}
+			next = strm.next_in;
+			left = strm.avail_in;
+			memset(&strm, 0, sizeof(strm));
+			if ( BZDECOMPRESSINIT(&strm, 0, 0) != BZ_OK ) {
+				free(in);
+				return 0;
+			}
+			strm.next_in = next;
+			strm.avail_in = left;
+		} else if ( (ret != BZ_OK) || ((strm.avail_in == 0) && (fed == len) && (strm.avail_out > 0)) ) {
+			/* Corrupt data, or the end of the sample */
+			BZDECOMPRESSEND(&strm);
+			break;
+		}
+	}
+	free(in);
+	if ( complete ) {
+		return total;
+	}
+	return size_extrapolate(at_out, at_in, end - start);
+}
+
+static void bzip2_close(stream *streamp)
+{
+#ifdef BZIP2_PARALLEL
+	if ( streamp->cfp ) {
+		preader_close((preader *)streamp->cfp);
+		streamp->cfp = NULL;
+		return;
+	}
+#endif
+	BZCLOSE(streamp->bzfp);
+	streamp->bzfp = NULL;
+}
+#endif
+
+#if defined(HAVE_XZ_SUPPORT) || defined(HAVE_ZSTD_SUPPORT) || defined(HAVE_LZ4_SUPPORT)
+/* Size of the compressed input buffer of the codecs below */
+#define CODEC_INPUT	(128*1024)
+
+/* State of the decoders that read the compressed data themselves */
+typedef struct {
+	int fd;
+	unsigned char in[CODEC_INPUT];
+	size_t in_pos, in_len;
+	int in_eof;
+	/* The decoder reached the end of the data (xz) or of a frame (zstd, lz4) */
+	int done;
+	void *ctx;
+} codec_state;
+
+static codec_state *codec_state_new(stream *streamp, int fd)
+{
+	codec_state *state = (codec_state *)malloc(sizeof *state);
+
+	if ( state ) {
+		memset(state, 0, sizeof *state);
+		state->fd = fd;
+	}
+	streamp->cfp = state;
+	return state;
+}
+
+/* Release the state, and the descriptor once the decoder was opened */
+static void codec_state_free(stream *streamp, int opened)
+{
+	codec_state *state = (codec_state *)streamp->cfp;
+
+	if ( opened ) {
+		close(state->fd);
+	}
+	free(state);
+	streamp->cfp = NULL;
+}
+
+/* Refill the input buffer once it has been consumed, returns -1 on error */
+static int codec_fill(codec_state *state)
+{
+	ssize_t nread;
+
+	if ( (state->in_pos < state->in_len) || state->in_eof ) {
+		return 0;
+	}
+	do {
+		nread = read(state->fd, state->in, sizeof(state->in));
+	} while ( (nread < 0) && (errno == EINTR) );
+	if ( nread < 0 ) {
+		return -1;
+	}
+	state->in_pos = 0;
+	state->in_len = nread;
+	state->in_eof = (nread == 0);
+	return 0;
+}
+
+/* Return what was decoded before an error, or the error */
+static int codec_error(stream *streamp, size_t decoded, const char *reason)
+{
+	log_warning(_("Unable to decompress %s: %s"), streamp->path, reason);
+	return decoded ? (int)decoded : -1;
+}
+#endif
+
+#ifdef HAVE_XZ_SUPPORT
+/* The legacy .lzma format has no magic, it is only used when the caller names it */
+static int xz_decoder_open(stream *streamp, int fd, int legacy)
+{
+	static const lzma_stream init = LZMA_STREAM_INIT;
+	codec_state *state = codec_state_new(streamp, fd);
+	lzma_stream *strm;
+	lzma_ret ret;
+
+	if ( state == NULL ) {
+		return 0;
+	}
+	strm = (lzma_stream *)malloc(sizeof *strm);
+	if ( strm ) {
+		*strm = init;
+		if ( legacy ) {
+			ret = lzma_alone_decoder(strm, UINT64_MAX);
+		} else {
+			ret = lzma_stream_decoder(strm, UINT64_MAX, LZMA_CONCATENATED);
+		}
+		if ( ret == LZMA_OK ) {
+			state->ctx = strm;
+			return 1;
+		}
+		free(strm);
+	}
+	codec_state_free(streamp, 0);
+	return 0;
+}
+
+static int xz_open(stream *streamp, int fd)
+{
+	return xz_decoder_open(streamp, fd, 0);
+}
+
+static int lzma_open(stream *streamp, int fd)
+{
+	return xz_decoder_open(streamp, fd, 1);
+}
+
+static int xz_read(stream *streamp, void *buf, int len)
+{
+	codec_state *state = (codec_state *)streamp->cfp;
+	lzma_stream *strm = (lzma_stream *)state->ctx;
+	lzma_ret ret;
+
+	if ( state->done ) {
+		return 0;
+	}
+	strm->next_out = buf;
+	strm->avail_out = len;
+	while ( strm->avail_out > 0 ) {
+		if ( codec_fill(state) < 0 ) {
+			return codec_error(streamp, len - strm->avail_out, strerror(errno));
+		}
+		strm->next_in = state->in + state->in_pos;
+		strm->avail_in = state->in_len - state->in_pos;
+		ret = lzma_code(strm, state->in_eof ? LZMA_FINISH : LZMA_RUN);
+		state->in_pos = state->in_len - strm->avail_in;
+		if ( ret == LZMA_STREAM_END ) {
+			state->done = 1;
+			break;
+		} else if ( ret != LZMA_OK ) {
+			return codec_error(streamp, len - strm->avail_out, "xz");
+		}
+	}
+	return len - strm->avail_out;
+}
+
+/* The index at the end of each xz stream records its uncompressed size.
+   Concatenated streams are walked from the last one back to the first */
+static size_t xz_size(int fd, off_t start, off_t end)
+{
+	unsigned char footer[LZMA_STREAM_HEADER_SIZE], *index_buf;
+	lzma_stream_flags flags;
+	lzma_index *index;
+	uint64_t memlimit, stream_size;
+	size_t pos, size = 0;
+
+	while ( end > start ) {
+		if ( ((end - start) < 2*LZMA_STREAM_HEADER_SIZE) ||
+			 (pread(fd, footer, sizeof(footer), end - sizeof(footer)) != sizeof(footer)) ) {
+			return 0;
+		}
+		/* Stream padding between the streams, four null bytes at a time */
+		if ( !footer[8] && !footer[9] && !footer[10] && !footer[11] ) {
+			end -= 4;
+			continue;
+		}
+		if ( (lzma_stream_footer_decode(&flags, footer) != LZMA_OK) ||
+			 (flags.backward_size > (end - start - 2*LZMA_STREAM_HEADER_SIZE)) ) {
+			return 0;
+		}
+		index_buf = (unsigned char *)malloc(flags.backward_size);
+		index = NULL;
+		memlimit = UINT64_MAX;
+		pos = 0;
+		stream_size = 0;
+		if ( index_buf &&
+			 (pread(fd, index_buf, flags.backward_size, end - sizeof(footer) - flags.backward_size) == flags.backward_size) &&
+			 (lzma_index_buffer_decode(&index, &memlimit, NULL, index_buf, &pos, flags.backward_size) == LZMA_OK) ) {
+			size += lzma_index_uncompressed_size(index);
+			stream_size = lzma_index_stream_size(index);
+			lzma_index_end(index, NULL);
+		}
+		free(index_buf);
+		if ( (stream_size == 0) || (stream_size > (uint64_t)(end - start)) ) {
+			return 0;
+		}
+		end -= stream_size;
+	}
+	return size;
+}
+
+static void xz_close(stream *streamp)
+{
+	codec_state *state = (codec_state *)streamp->cfp;
+
+	lzma_end((lzma_stream *)state->ctx);
+	free(state->ctx);
+	codec_state_free(streamp, 1);
+}
+#endif
+
+#ifdef HAVE_ZSTD_SUPPORT
+/* Largest zstd frame header */
+#define ZSTD_HEADER_MAX	18
+
+static int zstd_open(stream *streamp, int fd)
+{
+	codec_state *state = codec_state_new(streamp, fd);
+
+	if ( state == NULL ) {
+		return 0;
+	}
+	state->ctx = ZSTD_createDStream();
+	if ( state->ctx && !ZSTD_isError(ZSTD_initDStream(state->ctx)) ) {
+		return 1;
+	}
+	ZSTD_freeDStream(state->ctx);
+	codec_state_free(streamp, 0);
+	return 0;
+}
+
+static int zstd_read(stream *streamp, void *buf, int len)
+{
+	codec_state *state = (codec_state *)streamp->cfp;
+	ZSTD_outBuffer out;
+	ZSTD_inBuffer in;
+	size_t ret, before;
+
+	out.dst = buf;
+	out.size = len;
+	out.pos = 0;
+	while ( out.pos < out.size ) {
+		if ( codec_fill(state) < 0 ) {
+			return codec_error(streamp, out.pos, strerror(errno));
+		}
+		in.src = state->in;
+		in.size = state->in_len;
+		in.pos = state->in_pos;
+		before = out.pos;
+		ret = ZSTD_decompressStream(state->ctx, &out, &in);
+		state->in_pos = in.pos;
+		if ( ZSTD_isError(ret) ) {
+			return codec_error(streamp, out.pos, ZSTD_getErrorName(ret));
+		}
+		if ( state->in_eof && (out.pos == before) ) {
+			if ( ! state->done ) {
+				return codec_error(streamp, out.pos, "truncated zstd frame");
+			}
+			break;
+		}
+		state->done = (ret == 0);
+	}
+	return out.pos;
+}
+
+/* The size of a frame is in its header, if the compressor knew it. To find
+   the next frame, the blocks of the frame are skipped from header to header */
+static size_t zstd_size(int fd, off_t start, off_t end)
+{
+	static const int dict_id_size[4] = { 0, 1, 2, 4 };
+	static const int content_size_size[4] = { 0, 2, 4, 8 };
+	unsigned char header[ZSTD_HEADER_MAX];
+	unsigned long long frame, size = 0;
+	unsigned int magic, block;
+	off_t pos = start;
+	ssize_t len;
+	int desc;
+
+	while ( pos < end ) {
+		len = pread(fd, header, sizeof(header), pos);
+		if ( len < 8 ) {
+			return 0;
+		}
+		magic = header[0] | (header[1] << 8) | (header[2] << 16) | ((unsigned int)header[3] << 24);
+		if ( (magic & 0xFFFFFFF0) == 0x184D2A50 ) { /* Skippable frame */
+			pos += 8 + (header[4] | (header[5] << 8) | (header[6] << 16) | ((off_t)header[7] << 24));
+			continue;
+		}
+		frame = ZSTD_getFrameContentSize(header, len);
+		if ( (frame == ZSTD_CONTENTSIZE_UNKNOWN) || (frame == ZSTD_CONTENTSIZE_ERROR) ) {
+			return 0;
+		}
+		size += frame;
+
+		/* Magic number, frame header descriptor, window descriptor unless the
+		   frame is a single segment, dictionary ID and content size */
+		desc = header[4];
+		pos += 5 + dict_id_size[desc & 3];
+		if ( desc & 0x20 ) {
+			pos += content_size_size[desc >> 6] ? content_size_size[desc >> 6] : 1;
+		} else {
+			pos += 1 + content_size_size[desc >> 6];
+		}
+		do {
+			if ( pread(fd, header, 3, pos) != 3 ) {
+				return 0;
+			}
+			block = header[0] | (header[1] << 8) | (header[2] << 16);
+			switch ( (block >> 1) & 3 ) {
+				case 0: /* Raw */
+				case 2: /* Compressed */
+					pos += 3 + (block >> 3);
+					break;
+				case 1: /* RLE, a single byte repeated */
+					pos += 3 + 1;
+					break;
+				default:
+					return 0;
+			}
+		} while ( ! (block & 1) );
+		if ( desc & 0x04 ) { /* Content checksum */
+			pos += 4;
+		}
+	}
+	return (pos == end) ? size : 0;
+}
+
+static void zstd_close(stream *streamp)
+{
+	codec_state *state = (codec_state *)streamp->cfp;
+
+	ZSTD_freeDStream(state->ctx);
+	codec_state_free(streamp, 1);
+}
+#endif
+
+#ifdef HAVE_LZ4_SUPPORT
+static int lz4_open(stream *streamp, int fd)
+{
+	codec_state *state = codec_state_new(streamp, fd);
+	LZ4F_dctx *dctx;
+
+	if ( state == NULL ) {
+		return 0;
+	}
+	if ( LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)) ) {
+		codec_state_free(streamp, 0);
+		return 0;
+	}
+	state->ctx = dctx;
+	return 1;
+}
+
+static int lz4_read(stream *streamp, void *buf, int len)
+{
+	codec_state *state = (codec_state *)streamp->cfp;
+	size_t pos = 0, in_size, out_size, ret;
+
+	while ( pos < (size_t)len ) {
+		if ( codec_fill(state) < 0 ) {
+			return codec_error(streamp, pos, strerror(errno));
+		}
+		in_size = state->in_len - state->in_pos;
+		out_size = len - pos;
+		ret = LZ4F_decompress(state->ctx, (char *)buf + pos, &out_size,
+							  state->in + state->in_pos, &in_size, NULL);
+		if ( LZ4F_isError(ret) ) {
+			return codec_error(streamp, pos, LZ4F_getErrorName(ret));
+		}
+		state->in_pos += in_size;
+		pos += out_size;
+		if ( state->in_eof && (out_size == 0) ) {
+			if ( ! state->done ) {
+				return codec_error(streamp, pos, "truncated lz4 frame");
+			}
+			break;
+		}
+		state->done = (ret == 0);
+	}
+	return pos;
+}
+
+/* Same as zstd: each frame may record its size, and its blocks are skipped
+   to find the next one */
+static size_t lz4_size(int fd, off_t start, off_t end)
+{
+	unsigned char header[LZ4F_HEADER_SIZE_MAX];
+	LZ4F_dctx *dctx;
+	LZ4F_frameInfo_t frame;
+	unsigned int magic, block;
+	off_t pos = start;
+	ssize_t nread;
+	size_t len, size = 0;
+	int ok;
+
+	while ( pos < end ) {
+		nread = pread(fd, header, sizeof(header), pos);
+		if ( nread < 8 ) {
+			return 0;
+		}
+		magic = header[0] | (header[1] << 8) | (header[2] << 16) | ((unsigned int)header[3] << 24);
+		if ( (magic & 0xFFFFFFF0) == 0x184D2A50 ) { /* Skippable frame */
+			pos += 8 + (header[4] | (header[5] << 8) | (header[6] << 16) | ((off_t)header[7] << 24));
+			continue;
+		}
+		if ( LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)) ) {
+			return 0;
+		}
+		len = nread;
+		ok = !LZ4F_isError(LZ4F_getFrameInfo(dctx, &frame, header, &len)) && (frame.contentSize > 0);
+		LZ4F_freeDecompressionContext(dctx);
+		if ( ! ok ) {
+			return 0;
+		}
+		size += frame.contentSize;
+
+		/* 'len' is the size of the frame header. The high bit of the size of a
+		   block tells that it is stored uncompressed, 0 ends the frame */
+		pos += len;
+		do {
+			if ( pread(fd, header, 4, pos) != 4 ) {
+				return 0;
+			}
+			block = (header[0] | (header[1] << 8) | (header[2] << 16) | ((unsigned int)header[3] << 24)) & 0x7FFFFFFF;
+			pos += 4;
+			if ( block ) {
+				pos += block;
+				if ( frame.blockChecksumFlag ) {
+					pos += 4;
+				}
+			}
+		} while ( block );
+		if ( frame.contentChecksumFlag ) {
+			pos += 4;
+		}
+	}
+	return (pos == end) ? size : 0;
+}
+
+static void lz4_close(stream *streamp)
+{
+	codec_state *state = (codec_state *)streamp->cfp;
+
+	LZ4F_freeDecompressionContext(state->ctx);
+	codec_state_free(streamp, 1);
+}
+#endif
+
+/* Known compression formats, the first two are used by file_fdopen() */
+#define CODEC_GZIP	(&codecs[0])
+#define CODEC_BZIP2	(&codecs[1])
+
+static const stream_codec codecs[] = {
+	{ "gzip", "\037\213", 2, gzip_open, gzip_read, gzip_size, gzip_close },
+#ifdef HAVE_BZIP2_SUPPORT
+	{ "bzip2", "BZ", 2, bzip2_open, bzip2_read, bzip2_size, bzip2_close },
+#else
+	{ "bzip2", "BZ", 2, NULL, NULL, NULL, NULL },
+#endif
+#ifdef HAVE_XZ_SUPPORT
+	{ "xz", "\375" "7zXZ\0", 6, xz_open, xz_read, xz_size, xz_close },
+	{ "lzma", "", 0, lzma_open, xz_read, NULL, xz_close },
+#else
+	{ "xz", "\375" "7zXZ\0", 6, NULL, NULL, NULL, NULL },
+	{ "lzma", "", 0, NULL, NULL, NULL, NULL },
+#endif
+#ifdef HAVE_ZSTD_SUPPORT
+	{ "zstd", "\050\265\057\375", 4, zstd_open, zstd_read, zstd_size, zstd_close },
+#else
+	{ "zstd", "\050\265\057\375", 4, NULL, NULL, NULL, NULL },
+#endif
+#ifdef HAVE_LZ4_SUPPORT
+	{ "lz4", "\004\042\115\030", 4, lz4_open, lz4_read, lz4_size, lz4_close },
+#else
+	{ "lz4", "\004\042\115\030", 4, NULL, NULL, NULL, NULL },
+#endif
+	{ NULL }
+};
+
+/* Find the compression format of the data at 'offset' in a file, NULL if it's not compressed */
+static const stream_codec *codec_detect(int fd, off_t offset)
+{
+	unsigned char magic[8];
+	ssize_t len;
+	const stream_codec *codec;
+
+	len = pread(fd, magic, sizeof(magic), offset);
+	for ( codec = codecs; codec->name; ++codec ) {
+		if ( codec->magic_len && (len >= (ssize_t)codec->magic_len) &&
+			 (memcmp(magic, codec->magic, codec->magic_len) == 0) ) {
+			return codec;
+		}
+	}
+	return NULL;
+}
+
+/* Find a compression format by name, NULL if it is unknown */
+static const stream_codec *codec_find(const char *name)
+{
+	const stream_codec *codec;
+
+	for ( codec = codecs; codec->name; ++codec ) {
+		if ( strcmp(codec->name, name) == 0 ) {
+			return codec;
+		}
+	}
+	return NULL;
+}
+
+#ifdef HAVE_PTHREAD_H
+/* Number of blocks in flight between the stages of a stream pipeline */
+#define PIPE_SLOTS	4
+
+/* Compressed input streams are decompressed ahead by a background thread,
+   and large output streams are checksummed and written behind the caller
+   by two more threads. The stages share a ring of blocks: the caller only
+   takes the lock when it moves on to another block. */
+struct stream_pipe {
+	pthread_t threads[2];
+	int nthreads;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned char *data[PIPE_SLOTS];
+	size_t len[PIPE_SLOTS];
+	size_t slot_size;
+	/* Blocks produced, checksummed and consumed so far */
+	unsigned long head, summed, tail;
+	/* The reader owns the block at 'tail' when 'have' is set */
+	int have;
+	size_t pos;	/* Position in the caller's current block */
+	int eof, error, quit;
+};
+
+static void pipe_free(stream_pipe *pipe)
+{
+	int i;
+
+	pthread_cond_destroy(&pipe->cond);
+	pthread_mutex_destroy(&pipe->lock);
+	for ( i = 0; i < PIPE_SLOTS; ++i ) {
+		free(pipe->data[i]);
+	}
+	free(pipe);
+}
+
+static stream_pipe *pipe_alloc(size_t slot_size)
+{
+	stream_pipe *pipe;
+	int i;
+
+	pipe = (stream_pipe *)malloc(sizeof *pipe);
+	if ( pipe == NULL ) {
+		return NULL;
+	}
+	memset(pipe, 0, sizeof *pipe);
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_cond_init(&pipe->cond, NULL);
+	pipe->slot_size = slot_size;
+	for ( i = 0; i < PIPE_SLOTS; ++i ) {
+		pipe->data[i] = block_malloc(slot_size);
+		if ( pipe->data[i] == NULL ) {
+			pipe_free(pipe);
+			return NULL;
+		}
+	}
+	return pipe;
+}
+
+/* Start the threads of a pipeline, returns the number actually started.
+   When a worker pool copies several streams at once, the workers already keep
+   the processors busy: a pipeline only gets threads if its share allows it */
+static int pipe_start(stream_pipe *pipe, void *(*stages[])(void *), int count, stream *streamp)
+{
+	if ( (preader_streams() > 1) && (preader_threads() <= count) ) {
+		return 0;
+	}
+	while ( pipe->nthreads < count ) {
+		if ( pthread_create(&pipe->threads[pipe->nthreads], NULL, stages[pipe->nthreads], streamp) != 0 ) {
+			break;
+		}
+		++ pipe->nthreads;
+	}
+	return pipe->nthreads;
+}
+
+/* Stop the threads of a pipeline and release it */
+static void pipe_stop(stream *streamp)
+{
+	stream_pipe *pipe = streamp->pipe;
+	int i;
+
+	pthread_mutex_lock(&pipe->lock);
+	pipe->quit = 1;
+	pthread_cond_broadcast(&pipe->cond);
+	pthread_mutex_unlock(&pipe->lock);
+	for ( i = 0; i < pipe->nthreads; ++i ) {
+		pthread_join(pipe->threads[i], NULL);
+	}
+	streamp->pipe = NULL;
+	pipe_free(pipe);
+}
+
+/* Decompression stage of an input stream */
+static void *pipe_inflate(void *data)
+{
+	stream *streamp = (stream *)data;
+	stream_pipe *pipe = streamp->pipe;
+	unsigned char *block;
+	int nread;
+
+	pthread_mutex_lock(&pipe->lock);
+	while ( ! pipe->quit ) {
+		if ( (pipe->head - pipe->tail) == PIPE_SLOTS ) {
+			pthread_cond_wait(&pipe->cond, &pipe->lock);
+			continue;
+		}
+		block = pipe->data[pipe->head % PIPE_SLOTS];
+		pthread_mutex_unlock(&pipe->lock);
+
+		nread = streamp->codec->read(streamp, block, pipe->slot_size);
+
+		pthread_mutex_lock(&pipe->lock);
+		if ( nread <= 0 ) {
+			pipe->error = (nread < 0);
+			pipe->eof = 1;
+			pthread_cond_broadcast(&pipe->cond);
+			break;
+		}
+		pipe->len[pipe->head % PIPE_SLOTS] = nread;
+		++ pipe->head;
+		pthread_cond_broadcast(&pipe->cond);
+	}
+	pthread_mutex_unlock(&pipe->lock);
+	return NULL;
+}
+
+/* Start decompressing a compressed input stream in the background */
+static void pipe_start_reader(stream *streamp)
+{
+	static void *(*stages[])(void *) = { pipe_inflate };
+
+	streamp->pipe = pipe_alloc(block_size);
+	if ( streamp->pipe ) {
+		if ( pipe_start(streamp->pipe, stages, 1, streamp) == 0 ) {
+			pipe_free(streamp->pipe);
+			streamp->pipe = NULL;
+		}
+	}
+}
+
+/* Make sure the caller has a block with some data left in it.
+   The previous block is only given back to the decompressor now,
+   so that file_skip_zeroes() can always step back one byte. */
+static int pipe_next(stream_pipe *pipe)
+{
+	if ( pipe->have && (pipe->pos < pipe->len[pipe->tail % PIPE_SLOTS]) ) {
+		return 1;
+	}
+	pthread_mutex_lock(&pipe->lock);
+	if ( pipe->have ) {
+		++ pipe->tail;
+		pthread_cond_broadcast(&pipe->cond);
+	}
+	while ( (pipe->tail == pipe->head) && !pipe->eof ) {
+		pthread_cond_wait(&pipe->cond, &pipe->lock);
+	}
+	pipe->have = (pipe->tail != pipe->head);
+	pipe->pos = 0;
+	pthread_mutex_unlock(&pipe->lock);
+	return pipe->have;
+}
+
+static int pipe_read(stream *streamp, void *buf, int len)
+{
+	stream_pipe *pipe = streamp->pipe;
+	unsigned char *ptr = (unsigned char *) buf;
+	size_t count;
+	int total = 0;
+
+	while ( (len > 0) && pipe_next(pipe) ) {
+		count = pipe->len[pipe->tail % PIPE_SLOTS] - pipe->pos;
+		if ( count > (size_t)len ) {
+			count = len;
+		}
+		memcpy(ptr, pipe->data[pipe->tail % PIPE_SLOTS] + pipe->pos, count);
+		pipe->pos += count;
+		ptr += count;
+		total += count;
+		len -= count;
+	}
+	if ( (total == 0) && pipe->error ) {
+		return -1;
+	}
+	return total;
+}
+
+/* Hand out the data of the current block in place */
+static int pipe_read_buffer(stream *streamp, const void **data, int len)
+{
+	stream_pipe *pipe = streamp->pipe;
+	size_t count;
+
+	if ( !pipe_next(pipe) ) {
+		return pipe->error ? -1 : 0;
+	}
+	count = pipe->len[pipe->tail % PIPE_SLOTS] - pipe->pos;
+	if ( count > (size_t)len ) {
+		count = len;
+	}
+	*data = pipe->data[pipe->tail % PIPE_SLOTS] + pipe->pos;
+	pipe->pos += count;
+	return count;
+}
+
+/* Go back one byte in the current block of an input stream */
+static void pipe_unget(stream_pipe *pipe)
+{
+	if ( pipe->have && (pipe->pos > 0) ) {
+		-- pipe->pos;
+	}
+}
+
+static int pipe_eof(stream_pipe *pipe)
+{
+	unsigned long left;
+	int eof;
 
-#include <dlfcn.h>
+	pthread_mutex_lock(&pipe->lock);
+	left = pipe->head - pipe->tail;
+	if ( pipe->have && (pipe->pos == pipe->len[pipe->tail % PIPE_SLOTS]) ) {
+		-- left;
+	}
+	eof = pipe->eof && (left == 0);
+	pthread_mutex_unlock(&pipe->lock);
+	return eof;
+}
 
-static BZFILE* dummy_bzopen(const char* path, const char* mode);
-static BZFILE* dummy_bzdopen(int fd, const char* mode);
-static int dummy_bzread(BZFILE* b, void* buf, int len);
-static int dummy_bzwrite(BZFILE* b, void* buf, int len);
-static const char* dummy_bzerror(BZFILE *b, int *errnum);
-static void dummy_bzclose(BZFILE* b);
+/* Checksum stage of an output stream */
+static void *pipe_checksum(void *data)
+{
+	stream *streamp = (stream *)data;
+	stream_pipe *pipe = streamp->pipe;
+	int slot;
+
+	pthread_mutex_lock(&pipe->lock);
+	for ( ;; ) {
+		if ( pipe->summed == pipe->head ) {
+			if ( pipe->quit ) {
+				break;
+			}
+			pthread_cond_wait(&pipe->cond, &pipe->lock);
+			continue;
+		}
+		slot = pipe->summed % PIPE_SLOTS;
+		pthread_mutex_unlock(&pipe->lock);
+		md5_write(&streamp->md5, pipe->data[slot], pipe->len[slot]);
+		pthread_mutex_lock(&pipe->lock);
+		++ pipe->summed;
+		pthread_cond_broadcast(&pipe->cond);
+	}
+	pthread_mutex_unlock(&pipe->lock);
+	return NULL;
+}
 
-static BZFILE* (*BZOPEN)(const char* path, const char* mode) = dummy_bzopen;
-static BZFILE* (*BZDOPEN)(int fd, const char* mode)          = dummy_bzdopen;
-static int (*BZREAD)(BZFILE* b, void* buf, int len)          = dummy_bzread;
-static int (*BZWRITE)(BZFILE* b, void* buf, int len)         = dummy_bzwrite;
-static const char* (*BZERROR)(BZFILE *b, int *errnum)        = dummy_bzerror;
-static void (*BZCLOSE)(BZFILE* b)                            = dummy_bzclose;
+/* Write-behind stage of an output stream */
+static void *pipe_writer(void *data)
+{
+	stream *streamp = (stream *)data;
+	stream_pipe *pipe = streamp->pipe;
+	int slot, error;
+
+	pthread_mutex_lock(&pipe->lock);
+	for ( ;; ) {
+		if ( pipe->tail == pipe->head ) {
+			if ( pipe->quit ) {
+				break;
+			}
+			pthread_cond_wait(&pipe->cond, &pipe->lock);
+			continue;
+		}
+		slot = pipe->tail % PIPE_SLOTS;
+		/* Once a write failed, the rest of the data is just dropped */
+		error = pipe->error;
+		pthread_mutex_unlock(&pipe->lock);
+		if ( ! error ) {
+			error = (block_rawwrite(streamp, pipe->data[slot], pipe->len[slot]) < 0);
+		}
+		pthread_mutex_lock(&pipe->lock);
+		pipe->error = error;
+		++ pipe->tail;
+		pthread_cond_broadcast(&pipe->cond);
+	}
+	pthread_mutex_unlock(&pipe->lock);
+	return NULL;
+}
 
-static void dobz2init(void); // dlopen libbz2
+/* Hand the rest of a large output stream over to the checksum and writer threads */
+static void pipe_start_writer(stream *streamp)
+{
+	static void *(*stages[])(void *) = { pipe_checksum, pipe_writer };
 
-#endif
+	if ( block_flush(streamp) < 0 ) {
+		return;
+	}
+	streamp->pipe = pipe_alloc(streamp->buf_size);
+	if ( streamp->pipe ) {
+		if ( pipe_start(streamp->pipe, stages, 2, streamp) < 2 ) {
+			pipe_stop(streamp);
+		}
+	}
+}
 
-#endif
+/* Pass the caller's current block down the pipeline */
+static int pipe_submit(stream_pipe *pipe)
+{
+	int slot;
 
-/* Magic to detect a gzip compressed file */
-static const char gzip_magic[2] = { 0037, 0213 }, bzip_magic[2] = "BZ" ;
+	if ( pipe->pos == 0 ) {
+		return 0;
+	}
+	pthread_mutex_lock(&pipe->lock);
+	pipe->len[pipe->head % PIPE_SLOTS] = pipe->pos;
+	++ pipe->head;
+	pipe->pos = 0;
+	pthread_cond_broadcast(&pipe->cond);
+	/* Wait until the next block has been both checksummed and written */
+	while ( !pipe->error && (((pipe->head - pipe->tail) == PIPE_SLOTS) ||
+							 ((pipe->head - pipe->summed) == PIPE_SLOTS)) ) {
+		pthread_cond_wait(&pipe->cond, &pipe->lock);
+	}
+	slot = pipe->error ? -1 : 0;
+	pthread_mutex_unlock(&pipe->lock);
+	return slot;
+}
 
-extern struct option_elem *current_option;
+static int pipe_write(stream *streamp, const void *buf, int len)
+{
+	stream_pipe *pipe = streamp->pipe;
+	const unsigned char *ptr = (const unsigned char *) buf;
+	size_t count;
+	int total = 0;
+
+	while ( len > 0 ) {
+		count = pipe->slot_size - pipe->pos;
+		if ( count > (size_t)len ) {
+			count = len;
+		}
+		memcpy(pipe->data[pipe->head % PIPE_SLOTS] + pipe->pos, ptr, count);
+		pipe->pos += count;
+		ptr += count;
+		total += count;
+		len -= count;
+		if ( (pipe->pos == pipe->slot_size) && (pipe_submit(pipe) < 0) ) {
+			return -1;
+		}
+	}
+	return total;
+}
 
-void file_init(void)
+/* Write out everything still in the pipeline and stop it, returns -1 on error */
+static int pipe_close(stream *streamp)
 {
-#ifdef BZIP2_DLOPEN
-	dobz2init();
-#endif
+	int error;
+
+	if ( streamp->mode == 'w' ) {
+		pipe_submit(streamp->pipe);
+	}
+	error = streamp->pipe->error;
+	pipe_stop(streamp);
+	return error ? -1 : 0;
 }
+#else
+/* Without threads, streams are always processed by the caller */
+static void pipe_start_reader(stream *streamp) { }
+static void pipe_start_writer(stream *streamp) { }
+static int pipe_read(stream *streamp, void *buf, int len) { return -1; }
+static int pipe_read_buffer(stream *streamp, const void **data, int len) { return -1; }
+static int pipe_write(stream *streamp, const void *buf, int len) { return -1; }
+static void pipe_unget(stream_pipe *pipe) { }
+static int pipe_eof(stream_pipe *pipe) { return 1; }
+static int pipe_close(stream *streamp) { return 0; }
+#endif
 
 void file_create_hierarchy(install_info *info, const char *path)
 {
@@ -120,10 +1504,18 @@ stream *file_fdopen(install_info *info, const char *path, FILE *fd, gzFile zfd,
         return(NULL);
     }
     memset(streamp, 0, (sizeof *streamp));
+	streamp->fd = -1;
 	streamp->fp = fd;
 	streamp->zfp = zfd;
 	streamp->bzfp = bzfd;
 	streamp->mode = *mode;
+	if ( streamp->mode == 'r' ) {
+		if ( zfd ) {
+			streamp->codec = CODEC_GZIP;
+		} else if ( bzfd && CODEC_BZIP2->read ) {
+			streamp->codec = CODEC_BZIP2;
+		}
+	}
 	if(!stat(path, &st)){
 	  streamp->size = st.st_size;
 	}
@@ -155,17 +1547,18 @@ stream *file_open_install(install_info *info, const char *path, const char *mode
 	return file_open(info, path, mode);
 }
 
-stream *file_open(install_info *info, const char *path, const char *mode)
+/* Allocate a new stream object */
+static stream *stream_new(install_info *info, const char *path, const char *mode)
 {
     stream *streamp;
 
-    /* Allocate a file stream */
     streamp = (stream *)malloc(sizeof *streamp);
     if ( streamp == NULL ) {
         log_warning(_("Out of memory"));
         return(NULL);
     }
     memset(streamp, 0, (sizeof *streamp));
+    streamp->fd = -1;
     streamp->path = strdup(path);
     if ( streamp->path == NULL ) {
         file_close(info, streamp);
@@ -173,53 +1566,96 @@ stream *file_open(install_info *info, const char *path, const char *mode)
         return(NULL);
     }
     streamp->mode = *mode;
+    return(streamp);
+}
+
+/* Set up a read stream on a descriptor, from its current position.
+   The compression format is detected, unless 'format' names it.
+   The descriptor is closed if this fails. */
+static int stream_open_read(stream *streamp, int fd, const char *mode, const char *format)
+{
+	const stream_codec *codec, *named;
+	struct stat st;
+	off_t start;
+
+	fstat(fd, &st);
+	start = lseek(fd, 0, SEEK_CUR);
+	if ( start < 0 ) {
+		start = 0;
+	}
+	streamp->size = st.st_size - start;
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise(fd, start, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	codec = codec_detect(fd, start);
+	if ( format && strcmp(format, "none") ) {
+		named = codec_find(format);
+		if ( named == NULL ) {
+			log_warning(_("File '%s' is in an unknown %s format"), streamp->path, format);
+		} else if ( (named->magic_len == 0) || (named == codec) ) {
+			codec = named;
+		} else {
+			log_warning(_("File '%s' should be in %s format, but it doesn't look like it"), streamp->path, format);
+		}
+	} else if ( format ) {
+		codec = NULL;
+	}
+	if ( codec && !codec->open ) {
+		log_warning(_("File '%s' may be in %s format, but support was not compiled in!"), streamp->path, codec->name);
+		codec = NULL;
+	}
+	if ( codec ) {
+		if ( codec->size ) {
+			size_t size = codec->size(fd, start, st.st_size);
+			if ( size > 0 ) {
+				streamp->size = size;
+			}
+		}
+		if ( ! codec->open(streamp, fd) ) {
+			close(fd);
+			return 0;
+		}
+		streamp->codec = codec;
+	} else if ( mode[1] == 's' ) {
+		streamp->fp = fdopen(fd, "rb");
+		if ( streamp->fp == NULL ) {
+			close(fd);
+			return 0;
+		}
+	} else {
+		streamp->fd = fd;
+		streamp->offset = streamp->dropped = start;
+		streamp->buf_size = block_size;
+		/* No need for a large buffer on small files */
+		if ( streamp->buf_size > streamp->size ) {
+			long pagesize = sysconf(_SC_PAGESIZE);
+			streamp->buf_size = (streamp->size + pagesize) & ~(pagesize - 1);
+		}
+	}
+	return 1;
+}
+
+stream *file_open(install_info *info, const char *path, const char *mode)
+{
+    stream *streamp;
+
+    /* Allocate a file stream */
+    streamp = stream_new(info, path, mode);
+    if ( streamp == NULL ) {
+        return(NULL);
+    }
 
     if ( streamp->mode == 'r' ) {
-        char magic[2];
+        int fd;
 
-        streamp->fp = fopen(path, "rb");
-		if ( ! streamp->fp ) {
+        fd = open(path, O_RDONLY);
+		if ( fd < 0 ) {
 			file_close(info, streamp);
 			log_warning(_("Failed to open file %s"), path);
 			return(NULL);
 		}
-        if ( fread(magic, 1, 2, streamp->fp) == 2 ) {
-            if ( memcmp(magic, gzip_magic, 2) == 0 ) {
-			    fseek(streamp->fp, (off_t)(-4), SEEK_END);
-                /* Read little-endian value platform independently */
-                streamp->size = (((unsigned int)fgetc(streamp->fp))<<24);
-                streamp->size >>= 8;
-                streamp->size |= (((unsigned int)fgetc(streamp->fp))<<24);
-                streamp->size >>= 8;
-                streamp->size |= (((unsigned int)fgetc(streamp->fp))<<24);
-                streamp->size >>= 8;
-                streamp->size |= (((unsigned int)fgetc(streamp->fp))<<24);
-
-                fclose(streamp->fp);
-                streamp->fp = NULL;
-                streamp->zfp = gzopen(path, "rb");
-            } else if ( memcmp(magic, bzip_magic, 2) == 0 ) {
-#ifdef HAVE_BZIP2_SUPPORT
-				/* TODO: Get the uncompressed size ! */
-
-                fclose(streamp->fp);
-                streamp->fp = NULL;
-                streamp->bzfp = BZOPEN(path, "rb");
-#else
-			    struct stat st;
-                rewind(streamp->fp);
-				fstat(fileno(streamp->fp), &st);
-				streamp->size = st.st_size;
-				log_warning(_("File '%s' may be in BZIP2 format, but support was not compiled in!"), path);
-#endif
-            } else {
-			    struct stat st;
-                rewind(streamp->fp);
-				fstat(fileno(streamp->fp), &st);
-				streamp->size = st.st_size;
-            }
-        }
-        if ( (streamp->fp == NULL) && (streamp->zfp == NULL) && (streamp->bzfp == NULL) ) {
+        if ( ! stream_open_read(streamp, fd, mode, NULL) ) {
             file_close(info, streamp);
             log_warning(_("Couldn't read from file: %s"), path);
             return(NULL);
@@ -230,19 +1666,37 @@ stream *file_open(install_info *info, const char *path, const char *mode)
 
         /* Open the file for writing */
         log_quiet(_("Installing file %s"), path);
-        streamp->fp = fopen(path, "wb");
-        if ( streamp->fp == NULL ) {
+        streamp->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+        if ( streamp->fd < 0 ) {
 		    streamp->size = 0;
             file_close(info, streamp);
             log_warning(_("Couldn't write to file: %s"), path);
             return(NULL);
         }
+		streamp->buf_size = block_size;
         streamp->elem = add_file_entry(info, current_option, path, NULL, mode[1] == 'm' );
 		md5_init(&streamp->md5);
     }
     return(streamp);
 }
 
+stream *file_open_fd(install_info *info, const char *path, int fd, const char *format)
+{
+    stream *streamp;
+
+    streamp = stream_new(info, path, "r");
+    if ( streamp == NULL ) {
+        close(fd);
+        return(NULL);
+    }
+    if ( ! stream_open_read(streamp, fd, "r", format) ) {
+        file_close(info, streamp);
+        log_warning(_("Couldn't read from file: %s"), path);
+        return(NULL);
+    }
+    return(streamp);
+}
+
 static int file_read_internal(install_info *info, void *buf, int len, stream *streamp)
 {
     int nread = 0;
@@ -252,12 +1706,23 @@ static int file_read_internal(install_info *info, void *buf, int len, stream *st
             /* fread doesn't differentiate between EOF and error... */
             if ( (nread == 0) && (ferror(streamp->fp)) )
                 nread = -1;
-        } else if ( streamp->zfp ) {
-            nread = gzread(streamp->zfp, buf, len);
-        #ifdef HAVE_BZIP2_SUPPORT
-        } else if ( streamp->bzfp ) {
-			nread = BZREAD(streamp->bzfp, buf, len);
-		#endif
+        } else if ( streamp->fd >= 0 ) {
+            nread = block_read(streamp, buf, len);
+        } else if ( streamp->codec ) {
+			/* Large compressed files are decompressed ahead in the background */
+			if ( !streamp->pipe && ((streamp->offset >= block_size) || (streamp->size > block_size)) ) {
+				pipe_start_reader(streamp);
+			}
+			if ( streamp->pipe ) {
+				nread = pipe_read(streamp, buf, len);
+			} else {
+				nread = streamp->codec->read(streamp, buf, len);
+			}
+			if ( nread > 0 ) {
+				streamp->offset += nread;
+			} else if ( nread == 0 ) {
+				streamp->eof = 1;
+			}
 		}
     } else {
         log_warning(_("Read on write stream"));
@@ -266,7 +1731,7 @@ static int file_read_internal(install_info *info, void *buf, int len, stream *st
 }
 
 
-int file_read(install_info *info, void *buf, int len, stream *streamp)
+int file_try_read(install_info *info, void *buf, int len, stream *streamp)
 {
     int retval = 0;
     char *ptr = (char *) buf;
@@ -299,12 +1764,72 @@ int file_read(install_info *info, void *buf, int len, stream *streamp)
         /* only flag as an error if no data was read...      */
         /*  ...we'll catch it on the next read in that case. */
         if (retval == 0)
-            log_fatal(_("Read failure on %s"), streamp->path);
+            retval = -1;
     }
 
     return(retval);
 }
 
+int file_read(install_info *info, void *buf, int len, stream *streamp)
+{
+    int retval = file_try_read(info, buf, len, streamp);
+
+    if (retval < 0)
+        log_fatal(_("Read failure on %s"), streamp->path);
+
+    return(retval);
+}
+
+int file_read_buffer(install_info *info, const void **data, int len, stream *streamp)
+{
+	ssize_t nread = -1;
+
+	if ( (streamp->mode != 'r') || streamp->fp ) {
+		return -1;
+	}
+	if ( streamp->fd >= 0 ) {
+		if ( streamp->buf_pos == streamp->buf_len ) {
+			if ( streamp->eof ) {
+				return 0;
+			}
+			block_release(streamp, streamp->offset);
+			streamp->buf_pos = streamp->buf_len = 0;
+			if ( !streamp->buf && !block_alloc(streamp) ) {
+				return -1;
+			}
+			nread = block_rawread(streamp, streamp->buf, streamp->buf_size);
+			if ( nread <= 0 ) {
+				goto done;
+			}
+			streamp->buf_len = nread;
+		}
+		nread = streamp->buf_len - streamp->buf_pos;
+		if ( nread > len ) {
+			nread = len;
+		}
+		*data = streamp->buf + streamp->buf_pos;
+		streamp->buf_pos += nread;
+	} else if ( streamp->codec ) {
+		/* Only large streams are decompressed in the background, see file_read() */
+		if ( !streamp->pipe && ((streamp->offset >= block_size) || (streamp->size > block_size)) ) {
+			pipe_start_reader(streamp);
+		}
+		if ( !streamp->pipe ) {
+			return -1;
+		}
+		nread = pipe_read_buffer(streamp, data, len);
+		if ( nread > 0 ) {
+			streamp->offset += nread;
+		} else if ( nread == 0 ) {
+			streamp->eof = 1;
+		}
+	}
+ done:
+	if ( nread < 0 ) {
+		log_fatal(_("Read failure on %s"), streamp->path);
+	}
+	return nread;
+}
 
 void file_skip(install_info *info, int len, stream *streamp)
 {
@@ -312,7 +1837,24 @@ void file_skip(install_info *info, int len, stream *streamp)
 	int nread;
 
 	/* uncompressed files can seek instead of read */
-	if (( streamp->fp ) && ( streamp->mode == 'r' )) {
+	if (( streamp->fd >= 0 ) && ( streamp->mode == 'r' )) {
+		size_t avail = streamp->buf_len - streamp->buf_pos;
+		off_t pos;
+
+		if ( len <= avail ) {
+			streamp->buf_pos += len;
+			return;
+		}
+		len -= avail;
+		streamp->buf_pos = streamp->buf_len = 0;
+		/* Seeking past the end is fine, the next read will hit EOF */
+		pos = streamp->offset + len;
+		if ( lseek(streamp->fd, pos, SEEK_SET) == pos ) {
+			streamp->offset = pos;
+			return;  /* successful seek */
+		}
+		/* fall back to reading if this fails for any reason... */
+	} else if (( streamp->fp ) && ( streamp->mode == 'r' )) {
 		long pos = ftell(streamp->fp);
 		if (pos != -1) {
 			int rc = 0;
@@ -343,13 +1885,17 @@ void file_skip_zeroes(install_info *info, stream *streamp)
 	for(;;){
 	  if ( streamp->fp ) {
 		  c = fgetc(streamp->fp);
+	  }else if ( streamp->fd >= 0 ) {
+		  unsigned char ch;
+		  c = (block_read(streamp, &ch, 1) == 1) ? ch : EOF;
+	  }else if ( streamp->pipe ) {
+		  unsigned char ch;
+		  c = (pipe_read(streamp, &ch, 1) == 1) ? ch : EOF;
 	  }else if ( streamp->zfp ) {
 		  c = gzgetc(streamp->zfp);
-      #ifdef HAVE_BZIP2_SUPPORT
-	  }else if ( streamp->bzfp ) {
-		  c = EOF;
-		  BZREAD(streamp->bzfp, &c, 1);
-      #endif
+	  }else if ( streamp->codec ) {
+		  unsigned char ch;
+		  c = (streamp->codec->read(streamp, &ch, 1) == 1) ? ch : EOF;
 	  } else {
 		  c = EOF;
       }
@@ -359,12 +1905,14 @@ void file_skip_zeroes(install_info *info, stream *streamp)
 		/* Go back one byte */
 		if ( streamp->fp ) {
 			fseek(streamp->fp, -1L, SEEK_CUR);
+		} else if ( streamp->fd >= 0 ) {
+			streamp->buf_pos--;
+		} else if ( streamp->pipe ) {
+			pipe_unget(streamp->pipe);
 		} else if ( streamp->zfp ) { /* Probably slow */
 			gzseek(streamp->zfp, -1L, SEEK_CUR);
-        #ifdef HAVE_BZIP2_SUPPORT
-		} else if ( streamp->bzfp ) {
+		} else if ( streamp->codec ) {
 			/* Doh! But it's OK, this function is not used any more */
-        #endif
 		}
 		break;
 	  }
@@ -379,7 +1927,17 @@ static int file_write_internal(install_info *info, void *buf, int len, stream *s
     int nwrote;
     nwrote = 0;
     if ( streamp->mode == 'w' ) {
-        if ( streamp->fp ) {
+        if ( streamp->fd >= 0 ) {
+			/* Large files are checksummed and written out in the background */
+			if ( !streamp->pipe && (streamp->size >= streamp->buf_size) ) {
+				pipe_start_writer(streamp);
+			}
+			if ( streamp->pipe ) {
+				nwrote = pipe_write(streamp, buf, len);
+			} else {
+				nwrote = block_write(streamp, buf, len);
+			}
+        } else if ( streamp->fp ) {
             nwrote = fwrite(buf, 1, len, streamp->fp);
         } else if ( streamp->zfp ) {
             nwrote = gzwrite(streamp->zfp, buf, len);
@@ -393,7 +1951,9 @@ static int file_write_internal(install_info *info, void *buf, int len, stream *s
             log_warning(_("Short write on %s"), streamp->path);
         } else {
 			streamp->size += nwrote; /* Warning: we assume that we always append data */
-			md5_write(&streamp->md5, buf, nwrote);
+			if ( ! streamp->pipe ) {
+				md5_write(&streamp->md5, buf, nwrote);
+			}
 		}
     } else {
         log_warning(_("Write on read stream"));
@@ -402,7 +1962,7 @@ static int file_write_internal(install_info *info, void *buf, int len, stream *s
 }
 
 
-int file_write(install_info *info, void *buf, int len, stream *streamp)
+int file_try_write(install_info *info, void *buf, int len, stream *streamp)
 {
     int retval = 0;
     char *ptr = (char *) buf;
@@ -425,27 +1985,177 @@ int file_write(install_info *info, void *buf, int len, stream *streamp)
         }
     }
 
-    if (len > 0)
+    return(retval);
+}
+
+int file_write(install_info *info, void *buf, int len, stream *streamp)
+{
+    int retval = file_try_write(info, buf, len, streamp);
+
+    if (retval < len)
         log_fatal(_("Write failure on %s"), streamp->path);
 
     return(retval);
 }
 
+/* Kernel copy methods for file_copy_range(), tried in this order */
+enum {
+	KCOPY_PROBE = 0,
+	KCOPY_CLONE,
+	KCOPY_RANGE,
+	KCOPY_SENDFILE,
+	KCOPY_NONE
+};
+
+/* Checksum a range of the input file that was copied by the kernel.
+   The source is read back rather than mapped: it is usually on the install
+   media, where a read error on a mapping would be a SIGBUS instead of EIO. */
+static int kcopy_md5(int fd, stream *output, off_t offset, size_t len)
+{
+	unsigned char buf[64*1024];
+	ssize_t nread;
+
+	while ( len > 0 ) {
+		nread = pread(fd, buf, (len > sizeof(buf)) ? sizeof(buf) : len, offset);
+		if ( nread <= 0 ) {
+			return -1;
+		}
+		md5_write(&output->md5, buf, nread);
+		offset += nread;
+		len -= nread;
+	}
+	return 0;
+}
+
+ssize_t file_copy_range(install_info *info, stream *input, stream *output, size_t len)
+{
+	ssize_t copied = -1;
+	off_t offset = output->size;
+	int in_fd, out_fd;
+
+	in_fd = stream_fd(input);
+	out_fd = stream_fd(output);
+	if ( (input->mode != 'r') || (in_fd < 0) || (output->mode != 'w') || (out_fd < 0) ||
+		 output->pipe || (output->kcopy == KCOPY_NONE) ) {
+		return -1;
+	}
+
+	if ( output->kcopy == KCOPY_PROBE ) {
+		/* Only start on a fresh pair of streams, nothing may have been buffered */
+		if ( (offset != 0) || (input->fp && (ftell(input->fp) != 0)) || (input->buf_len != 0) ||
+			 (lseek(in_fd, 0, SEEK_SET) != 0) ) {
+			output->kcopy = KCOPY_NONE;
+			return -1;
+		}
+		output->kcopy = KCOPY_RANGE;
+#ifdef FICLONE
+		/* Copy-on-write filesystems can share the extents of the whole file */
+		if ( ioctl(out_fd, FICLONE, in_fd) == 0 ) {
+			log_debug("Cloned %s", input->path);
+			output->kcopy = KCOPY_CLONE;
+		}
+#endif
+	}
+
+	switch ( output->kcopy ) {
+		case KCOPY_CLONE:
+			/* The data is already there, we only have to checksum it */
+			if ( offset >= input->size ) {
+				return 0;
+			}
+			copied = (len < (input->size - offset)) ? len : (input->size - offset);
+			break;
+		case KCOPY_RANGE:
+#ifdef HAVE_COPY_FILE_RANGE
+			copied = copy_file_range(in_fd, NULL, out_fd, NULL, len, 0);
+			if ( (copied >= 0) || ((errno != ENOSYS) && (errno != EXDEV) &&
+								   (errno != EINVAL) && (errno != EOPNOTSUPP)) ) {
+				break;
+			}
+#endif
+			output->kcopy = KCOPY_SENDFILE;
+			/* Fall through */
+		case KCOPY_SENDFILE:
+#if defined(__linux) && defined(HAVE_SENDFILE)
+			copied = sendfile(out_fd, in_fd, NULL, len);
+			if ( (copied >= 0) || ((errno != ENOSYS) && (errno != EINVAL)) ) {
+				break;
+			}
+#endif
+			output->kcopy = KCOPY_NONE;
+			/* Resynchronize with the file positions for file_read()/file_write() */
+			if ( (lseek(in_fd, offset, SEEK_SET) < 0) || (lseek(out_fd, offset, SEEK_SET) < 0) ||
+				 (input->fp && (fseek(input->fp, offset, SEEK_SET) < 0)) ||
+				 (output->fp && (fseek(output->fp, offset, SEEK_SET) < 0)) ) {
+				return -2;
+			}
+			input->offset = output->offset = offset;
+			return -1;
+	}
+
+	if ( copied < 0 ) {
+		return -2;
+	} else if ( copied > 0 ) {
+		if ( kcopy_md5(in_fd, output, offset, copied) < 0 ) {
+			return -3;
+		}
+		block_release(input, offset + copied);
+		output->size += copied;
+	}
+	return copied;
+}
+
+ssize_t file_copy_fd_range(install_info *info, int fd, off_t offset, size_t len, stream *output)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	loff_t from = offset;
+	ssize_t copied;
+	size_t total = 0;
+
+	if ( (output->mode != 'w') || (output->fd < 0) || output->pipe || (output->kcopy == KCOPY_NONE) ) {
+		return -1;
+	}
+	if ( block_flush(output) < 0 ) {
+		return -2;
+	}
+	while ( total < len ) {
+		copied = copy_file_range(fd, &from, output->fd, NULL, len - total, 0);
+		if ( copied < 0 ) {
+			if ( (total == 0) && ((errno == ENOSYS) || (errno == EXDEV) ||
+								  (errno == EINVAL) || (errno == EOPNOTSUPP)) ) {
+				output->kcopy = KCOPY_NONE;
+				return -1;
+			}
+			return -2;
+		} else if ( copied == 0 ) {
+			break;
+		}
+		total += copied;
+	}
+	if ( kcopy_md5(fd, output, offset, total) < 0 ) {
+		return -3;
+	}
+	output->offset += total;
+	output->size += total;
+	return total;
+#else
+	return -1;
+#endif
+}
+
 int file_eof(install_info *info, stream *streamp)
 {
     int eof;
 
     eof = 1;
-    if ( streamp->fp ) {
+    if ( streamp->fd >= 0 ) {
+        eof = streamp->eof && (streamp->buf_pos == streamp->buf_len);
+    } else if ( streamp->pipe ) {
+        eof = pipe_eof(streamp->pipe);
+    } else if ( streamp->fp ) {
         eof = feof(streamp->fp);
-    } else if ( streamp->zfp ) {
-        eof = gzeof(streamp->fp);
-    #ifdef HAVE_BZIP2_SUPPORT
-    } else if ( streamp->bzfp ) {
-		int err;
-		BZERROR(streamp->bzfp, &err);
-		eof = ( err == BZ_STREAM_END );
-    #endif
+    } else if ( streamp->codec ) {
+        eof = streamp->eof;
     }
     return(eof);
 }
@@ -453,13 +2163,31 @@ int file_eof(install_info *info, stream *streamp)
 int file_close(install_info *info, stream *streamp)
 {
     if ( streamp ) {
-        if ( streamp->fp ) {
+        if ( streamp->pipe && (pipe_close(streamp) < 0) ) {
+            log_warning(_("Short write on %s"), streamp->path);
+        }
+        if ( streamp->fd >= 0 ) {
+            if ( streamp->mode == 'w' ) {
+                if ( (block_flush(streamp) < 0) || (close(streamp->fd) != 0) ) {
+                    log_warning(_("Short write on %s"), streamp->path);
+                }
+            } else {
+                block_release(streamp, streamp->offset);
+                close(streamp->fd);
+            }
+            streamp->fd = -1;
+            free(streamp->buf);
+            streamp->buf = NULL;
+        } else if ( streamp->fp ) {
             if ( fclose(streamp->fp) != 0 ) {
                 if ( streamp->mode == 'w' ) {
                     log_warning(_("Short write on %s"), streamp->path);
                 }
             }
 	    streamp->fp = NULL;
+        } else if ( streamp->codec ) {
+            streamp->codec->close(streamp);
+            streamp->codec = NULL;
         } else if ( streamp->zfp ) {
             if ( gzclose(streamp->zfp) != 0 ) {
                 if ( streamp->mode == 'w' ) {
@@ -514,6 +2242,31 @@ int file_symlink(install_info *info, const char *oldpath, const char *newpath)
     return(retval);
 }
 
+int file_link(install_info *info, const char *oldpath, const char *newpath, const unsigned char *md5sum)
+{
+	int retval;
+	struct file_elem *elem;
+
+	/* Log the action */
+	log_quiet(_("Creating hard link: %s --> %s\n"), newpath, oldpath);
+
+	/* Do the action */
+	file_create_hierarchy(info, newpath);
+	if ( file_exists(newpath) ) {
+		unlink(newpath);
+	}
+	retval = link(oldpath, newpath);
+	if ( retval < 0 ) {
+		log_debug("Can't link %s to %s: %s", newpath, oldpath, strerror(errno));
+	} else {
+		elem = add_file_entry(info, current_option, newpath, NULL, 0);
+		if ( elem && md5sum ) {
+			memcpy(elem->md5sum, md5sum, 16);
+		}
+	}
+	return retval;
+}
+
 int file_issymlink(install_info *info, const char *path)
 {
 	struct stat st;
@@ -596,12 +2349,10 @@ int file_chmod(install_info *info, const char *path, int mode)
 }
 
 /* The uncompressed file size */
-size_t file_size(install_info *info, const char *path)
+off_t file_size(install_info *info, const char *path)
 {
     struct stat st;
-    FILE *fp;
-    char magic[2];
-    size_t size, count;
+    off_t size, count;
 
     size = -1;
     if ( lstat(path, &st) == 0 ) {
@@ -629,24 +2380,18 @@ size_t file_size(install_info *info, const char *path)
 		} else if ( S_ISLNK(st.st_mode) ) {
 			size = st.st_size;
         } else {
-            fp = fopen(path, "rb");
-            if ( fp ) {
-                /* If it's a gzip file, read uncompressed size from end */
-                if ( (fread(magic, 1, 2, fp) == 2) &&
-                    (memcmp(magic, gzip_magic, 2) == 0) ) {
-                    fseek(fp, (off_t)(-4), SEEK_END);
-                    /* Read little-endian value platform independently */
-                    size = (((unsigned int)fgetc(fp))<<24);
-                    size >>= 8;
-                    size |= (((unsigned int)fgetc(fp))<<24);
-                    size >>= 8;
-                    size |= (((unsigned int)fgetc(fp))<<24);
-                    size >>= 8;
-                    size |= (((unsigned int)fgetc(fp))<<24);
-                } else {
+            int fd = open(path, O_RDONLY);
+            if ( fd >= 0 ) {
+                /* Compressed files may know their uncompressed size */
+                const stream_codec *codec = codec_detect(fd, 0);
+                size = 0;
+                if ( codec && codec->size ) {
+                    size = codec->size(fd, 0, st.st_size);
+                }
+                if ( size == 0 ) {
                     size = st.st_size;
                 }
-                fclose(fp);
+                close(fd);
             } else {
                 log_quiet(_("Unable to read %s"), path);
             }
@@ -734,6 +2479,21 @@ static void dummy_bzclose(BZFILE* b)
 	return;
 }
 
+static int dummy_bzDecompressInit(bz_stream *strm, int verbosity, int small)
+{
+	return BZ_PARAM_ERROR;
+}
+
+static int dummy_bzDecompress(bz_stream *strm)
+{
+	return BZ_PARAM_ERROR;
+}
+
+static int dummy_bzDecompressEnd(bz_stream *strm)
+{
+	return BZ_PARAM_ERROR;
+}
+
 static void bz2dummies()
 {
 	BZOPEN  = dummy_bzopen;
@@ -742,6 +2502,9 @@ static void bz2dummies()
 	BZWRITE = dummy_bzwrite;
 	BZERROR = dummy_bzerror;
 	BZCLOSE = dummy_bzclose;
+	BZDECOMPRESSINIT = dummy_bzDecompressInit;
+	BZDECOMPRESS = dummy_bzDecompress;
+	BZDECOMPRESSEND = dummy_bzDecompressEnd;
 }
 
 #define GET_SYM(func, sym) \
@@ -782,6 +2545,9 @@ static void dobz2init()
 	GET_SYM(BZWRITE,"BZ2_bzwrite")
 	GET_SYM(BZERROR,"BZ2_bzerror")
 	GET_SYM(BZCLOSE,"BZ2_bzclose")
+	GET_SYM(BZDECOMPRESSINIT,"BZ2_bzDecompressInit")
+	GET_SYM(BZDECOMPRESS,"BZ2_bzDecompress")
+	GET_SYM(BZDECOMPRESSEND,"BZ2_bzDecompressEnd")
 }
 
 #endif
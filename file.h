@@ -24,32 +24,99 @@
 typedef struct {
     char *path;
     char mode;
-    size_t size;
+    off_t size;
     FILE *fp;
     gzFile zfp;
 	BZFILE *bzfp;
+	/* Decoder of compressed input streams, see the codec list in file.c */
+	const struct stream_codec *codec;
+	void *cfp;
+	/* Block I/O backend for plain files: raw descriptor and aligned buffer */
+	int fd;
+	unsigned char *buf;
+	size_t buf_size, buf_pos, buf_len;
+	off_t offset, dropped;
+	int eof;
+	/* Background decompression or checksum and write-behind threads */
+	struct stream_pipe *pipe;
 	MD5_CONTEXT md5;
 	struct file_elem *elem;
+	int kcopy; /* Kernel copy method in use, see file_copy_range() */
 } stream;
 
+/* Limits and default for the size of the block I/O buffers */
+#define FILE_BLOCK_MIN		(1024*1024)
+#define FILE_BLOCK_MAX		(4*1024*1024)
+#define FILE_BLOCK_DEFAULT	FILE_BLOCK_MIN
+
 extern void file_init(void);
+/** Set the size of the buffers used for plain file I/O, from a string like "4M" or "2048k".
+ * The value is clamped between FILE_BLOCK_MIN and FILE_BLOCK_MAX.
+ * @return 0 if the string could not be parsed
+ */
+extern int file_set_blocksize(const char *size);
 /** wrapper for file_open to prompt user whether to overwrite. Also unlinks file first */
 extern stream *file_open_install(install_info *info, const char *path, const char *mode);
+/** Plain files are read and written with large unbuffered blocks. A mode of "rs"
+ * keeps a stdio FILE in streamp->fp instead, for callers that need to seek in it. */
 extern stream *file_open(install_info *info,const char *path,const char *mode);
+/** Open a read stream on a descriptor, from its current position. The data may
+ * be in any of the supported compression formats. The stream owns the descriptor.
+ * @param format name of the compression format if it is known ("gzip", "bzip2",
+ * "xz", "lzma", "zstd", "lz4" or "none"), NULL to tell from the data. The legacy
+ * lzma format can't be recognized from the data, it must be named.
+ */
+extern stream *file_open_fd(install_info *info, const char *path, int fd, const char *format);
 extern stream *file_fdopen(install_info *info, const char *path, FILE *fd, gzFile zfd, BZFILE *bzfd, const char *mode);
 extern int file_read(install_info *info, void *buf, int len, stream *streamp);
+/** Same as file_read(), but a failure is not fatal: it returns -1 and the
+ * caller reports it. Worker threads use it.
+ */
+extern int file_try_read(install_info *info, void *buf, int len, stream *streamp);
+/** Read up to 'len' bytes from an input stream without copying them: '*data' is
+ * pointed to the buffer of the stream, which stays valid until the next call on it.
+ * @return the number of bytes available, 0 at end of file, or -1 if the stream
+ * can't do it and file_read() must be used.
+ */
+extern int file_read_buffer(install_info *info, const void **data, int len, stream *streamp);
 extern void file_skip_zeroes(install_info *info, stream *streamp);
 extern void file_skip(install_info *info, int len, stream *streamp);
 extern int file_write(install_info *info, void *buf, int len, stream *streamp);
+/** Same as file_write(), but a failure is not fatal: it returns the number of
+ * bytes written and the caller reports a short count. Worker threads use it.
+ */
+extern int file_try_write(install_info *info, void *buf, int len, stream *streamp);
+/** Copy up to 'len' bytes from an uncompressed input stream to an output stream
+ * without going through user space, using a reflink clone, copy_file_range()
+ * or sendfile(), in that order. The MD5 sum of the output is computed by
+ * reading the copied range back from the source. Errors are returned rather
+ * than reported, so that worker threads can use it.
+ * @return the number of bytes copied, 0 at end of file, -1 if the fast path
+ * is not available for these streams and file_read()/file_write() must be used,
+ * -2 on a write error or -3 on a read error.
+ */
+extern ssize_t file_copy_range(install_info *info, stream *input, stream *output, size_t len);
+/** Append 'len' bytes found at 'offset' in a file to an output stream with
+ * copy_file_range(). It does not use the file position of 'fd', so several
+ * threads may copy from the same descriptor. Errors are returned rather than
+ * reported, so that worker threads can use it.
+ * @return the number of bytes copied, -1 if it is not available and the
+ * data has to go through file_write(), -2 on a write error or -3 on a read
+ * error.
+ */
+extern ssize_t file_copy_fd_range(install_info *info, int fd, off_t offset, size_t len, stream *output);
 extern int file_eof(install_info *info, stream *streamp);
 extern int file_close(install_info *info, stream *streamp);
 extern int file_symlink(install_info *info, const char *oldpath, const char *newpath);
+/** Create a hard link to a file that was installed, registered with the given MD5 sum.
+ * It fails quietly, the caller is expected to make a copy instead. */
+extern int file_link(install_info *info, const char *oldpath, const char *newpath, const unsigned char *md5sum);
 extern int file_issymlink(install_info *info, const char *path);
 extern int file_mkdir(install_info *info, const char *path, int mode);
 extern int file_mkfifo(install_info *info, const char *path, int mode);
 extern int file_mknod(install_info *info, const char *path, int mode, dev_t dev);
 extern int file_chmod(install_info *info, const char *path, int mode);
-extern size_t file_size(install_info *info, const char *path);
+extern off_t file_size(install_info *info, const char *path);
 extern int file_exists(const char *path);
 extern int dir_exists(const char *path);
 extern void file_create_hierarchy(install_info *info, const char *path);
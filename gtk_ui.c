@@ -91,6 +91,7 @@
 #include <sys/stat.h>
 #include <ctype.h>
 #include <gtk/gtk.h>
+#include <gdk/gdkx.h>
 #include <glade/glade.h>
 
 #include "install.h"
@@ -99,6 +100,7 @@
 #include "detect.h"
 #include "file.h"
 #include "copy.h"
+#include "progress.h"
 #include "bools.h"
 #include "loki_launchurl.h"
 
@@ -899,7 +901,7 @@ void setup_checkbox_option_slot( GtkWidget* widget, gpointer func_data)
 		}
 
 		/* Mark this option for installation */
-		mark_option(cur_info, data_node, "true", 0);
+		mark_option_size(cur_info, data_node, "true", 0);
 		
 		/* Recurse down any other options to re-enable grayed out options */
 		node = XML_CHILDREN(data_node);
@@ -909,7 +911,7 @@ void setup_checkbox_option_slot( GtkWidget* widget, gpointer func_data)
 		}
 	} else {
 		/* Unmark this option for installation */
-		mark_option(cur_info, data_node, "false", 1);
+		mark_option_size(cur_info, data_node, "false", 1);
 		
 		/* Recurse down any other options */
 		node = XML_CHILDREN(data_node);
@@ -939,7 +941,6 @@ void setup_checkbox_option_slot( GtkWidget* widget, gpointer func_data)
 			node = node->next;
 		}
 	}
-    cur_info->install_size = size_tree(cur_info, XML_CHILDREN(XML_ROOT(cur_info->config)));
 	update_size();
 }
 
@@ -1915,6 +1916,14 @@ static install_state gtkui_pick_class(install_info *info)
 	return iterate_for_state();
 }
 
+#ifndef ENABLE_GTK2
+/* The connection to the X server */
+static int gtkui_event_fd(install_info *info)
+{
+	return ConnectionNumber(GDK_DISPLAY());
+}
+#endif
+
 static void gtkui_idle(install_info *info)
 {
 #ifdef ENABLE_GTK2
@@ -2023,76 +2032,61 @@ static install_state gtkui_setup(install_info *info)
 
 static int gtkui_update(install_info *info, const char *path, size_t progress, size_t size, const char *current)
 {
-    static gfloat last_update = -1.0;
-    static gdouble last_installed_bytes = -1.0;
-    GtkWidget *widget;
+    static GtkWidget *option_label = NULL, *file_label, *file_progress, *total_progress;
+    char option[1024];
     int textlen;
-    const char *text;
+    const char *text, *rate;
     char *install_path;
     gfloat new_update;
-    static GTimeVal ltv = { 0, 0 };
-    GTimeVal tv;
 
     if ( cur_state == SETUP_ABORT ) {
 		return FALSE;
     }
 
+    /* The calls are already spaced out by progress_update() */
+    if ( ! option_label ) {
+        option_label = glade_xml_get_widget(setup_glade, "current_option_label");
+        file_label = glade_xml_get_widget(setup_glade, "current_file_label");
+        file_progress = glade_xml_get_widget(setup_glade, "current_file_progress");
+        total_progress = glade_xml_get_widget(setup_glade, "total_file_progress");
+    }
+
     if ( progress && size ) {
         new_update = (gfloat)progress / (gfloat)size;
     } else { /* "Running script" */
         new_update = 1.0;
     }
 
-    g_get_current_time(&tv);
-
-    if( (int)(new_update*100) != 100) {
-		if(tv.tv_sec == ltv.tv_sec
-				&& tv.tv_usec - ltv.tv_usec < 50000) { /* 50ms */
-			return TRUE;
-		}
-		else if(tv.tv_sec == ltv.tv_sec+1
-				&& tv.tv_usec + (1000000-ltv.tv_usec) < 50000) { /* 50ms */
-			return TRUE;
-		}
-    }
-	ltv = tv;
-
-    if ( ( (int)(new_update*100) != (int)(last_update*100) ) || ( last_installed_bytes !=  (gdouble)info->installed_bytes ) ) {
-        if ( new_update == 1.0 ) {
-            last_update = 0.0;
+    if ( option_label ) {
+        rate = progress_rate(info);
+        if ( *rate ) {
+            snprintf(option, sizeof(option), "%s (%s)", current, rate);
+            gtk_label_set_text( GTK_LABEL(option_label), option);
         } else {
-            last_update = new_update;
+            gtk_label_set_text( GTK_LABEL(option_label), current);
         }
-        widget = glade_xml_get_widget(setup_glade, "current_option_label");
-        if ( widget ) {
-            gtk_label_set_text( GTK_LABEL(widget), current);
+    }
+    if ( file_label ) {
+        text = path;
+        /* Remove the install path from the string */
+        install_path = cur_info->install_path;
+        if ( strncmp(text, install_path, strlen(install_path)) == 0 ) {
+            text+=strlen(install_path)+1;
         }
-        widget = glade_xml_get_widget(setup_glade, "current_file_label");
-        if ( widget ) {
-            text = path;
-            /* Remove the install path from the string */
-            install_path = cur_info->install_path;
-            if ( strncmp(text, install_path, strlen(install_path)) == 0 ) {
-                text+=strlen(install_path)+1;
-            }
-            textlen = strlen(text);
-            if ( textlen > MAX_TEXTLEN ) {
-                text+=textlen-MAX_TEXTLEN;
-            }
-            gtk_label_set_text( GTK_LABEL(widget), text);
+        textlen = strlen(text);
+        if ( textlen > MAX_TEXTLEN ) {
+            text+=textlen-MAX_TEXTLEN;
         }
-        widget = glade_xml_get_widget(setup_glade, "current_file_progress");
-        gtk_progress_bar_update(GTK_PROGRESS_BAR(widget), new_update);
-        new_update = (gdouble)info->installed_bytes / (gdouble)info->install_size;
-		last_installed_bytes=(gdouble)info->installed_bytes;
-		if (new_update > 1.0) {
-			new_update = 1.0;
-		} else if (new_update < 0.0) {
-			new_update = 0.0;
-		}
-        widget = glade_xml_get_widget(setup_glade, "total_file_progress");
-        gtk_progress_bar_update(GTK_PROGRESS_BAR(widget), new_update);
-    }
+        gtk_label_set_text( GTK_LABEL(file_label), text);
+    }
+    gtk_progress_bar_update(GTK_PROGRESS_BAR(file_progress), new_update);
+    new_update = (gdouble)info->installed_bytes / (gdouble)info->install_size;
+	if (new_update > 1.0) {
+		new_update = 1.0;
+	} else if (new_update < 0.0) {
+		new_update = 0.0;
+	}
+    gtk_progress_bar_update(GTK_PROGRESS_BAR(total_progress), new_update);
 	gtkui_idle(info);
 	return TRUE;
 }
@@ -2246,7 +2240,14 @@ int gtkui_okay(Install_UI *UI, int *argc, char ***argv)
             UI->website = gtkui_website;
             UI->complete = gtkui_complete;
 			UI->pick_class = gtkui_pick_class;
+#ifdef ENABLE_GTK2
+			/* Its events are not processed while commands run */
+			UI->idle = NULL;
+			UI->event_fd = NULL;
+#else
 			UI->idle = gtkui_idle;
+			UI->event_fd = gtkui_event_fd;
+#endif
 			UI->exit = NULL;
 			UI->shutdown = gtkui_shutdown;
 			UI->is_gui = 1;
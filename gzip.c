@@ -0,0 +1,319 @@
+/* Parallel decoder for gzip data made of several members
+
+   A gzip file may hold several members one after the other, which can be
+   decoded on their own. That is the case of concatenated files, and of the
+   BGZF format of bgzip, where every member records its length in an extra
+   header field. The scanner hands every member to the parallel reader.
+
+   There is no length in plain members, so the scanner looks for something
+   that looks like the header of the next one. If it was fooled by the data,
+   the member fails to decode and the reader goes on sequentially from its
+   start. Members too large to be held in memory as one job, including the
+   single member of most files, are also left to the sequential decoder.
+*/
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "gzip.h"
+
+/* Length of the BGZF member whose header is at 'p' (18 bytes), 0 if it isn't one */
+static size_t bgzf_member(const unsigned char *p)
+{
+	if ( (p[0] == 0x1f) && (p[1] == 0x8b) && (p[2] == 8) && (p[3] & 4) &&
+		 (p[10] == 6) && (p[11] == 0) && (p[12] == 'B') && (p[13] == 'C') && (p[14] == 2) && (p[15] == 0) ) {
+		return (p[16] | (p[17] << 8)) + 1;
+	}
+	return 0;
+}
+
+size_t gz_bgzf_size(int fd, off_t start, off_t end)
+{
+	unsigned char header[18], isize[4];
+	size_t len, size = 0;
+
+	while ( start < end ) {
+		if ( pread(fd, header, sizeof(header), start) != sizeof(header) ) {
+			return 0;
+		}
+		len = bgzf_member(header);
+		if ( (len == 0) || (start + (off_t)len > end) || (pread(fd, isize, 4, start + len - 4) != 4) ) {
+			return 0;
+		}
+		size += isize[0] | (isize[1] << 8) | (isize[2] << 16) | ((size_t)isize[3] << 24);
+		start += len;
+	}
+	return size;
+}
+
+#ifdef GZIP_PARALLEL
+
+/* Largest member decoded as one job, and largest output of a job */
+#define GZ_MEMBER_MAX	(4*1024*1024)
+#define GZ_OUTPUT_MAX	(64*1024*1024)
+/* Size of the reads of the sequential decoder */
+#define GZ_INPUT		(256*1024)
+
+/* State of the sequential decoder */
+enum {
+	SEQ_ERROR = -1,
+	SEQ_DATA,
+	SEQ_START,	/* At the beginning of a member */
+	SEQ_END,	/* At the end of a member, another one may follow */
+	SEQ_DONE
+};
+
+typedef struct {
+	int fd;
+	z_stream strm;
+	unsigned char *in;
+	off_t offset;
+	int eof, state, members;
+} gz_seq;
+
+/* Whether the 10 bytes at 'p' look like the header of a gzip member */
+static int member_header(const unsigned char *p)
+{
+	return (p[0] == 0x1f) && (p[1] == 0x8b) && (p[2] == 8) && !(p[3] & 0xE0) &&
+		   ((p[8] == 0) || (p[8] == 2) || (p[8] == 4)) && ((p[9] <= 13) || (p[9] == 255));
+}
+
+/* Position of the next member header at or after byte 'from', -1 if there is
+   none before byte 'limit' or the end of the file, -2 on a read error */
+static long find_member(preader_input *in, size_t from, size_t limit)
+{
+	unsigned char *p;
+	int ret;
+
+	for ( ;; ) {
+		while ( from + 10 <= in->len ) {
+			p = (unsigned char *)memchr(in->buf + from, 0x1f, in->len - 9 - from);
+			if ( p == NULL ) {
+				from = in->len - 9;
+				break;
+			}
+			from = p - in->buf;
+			if ( member_header(p) ) {
+				return (long)from;
+			}
+			++from;
+		}
+		if ( in->len >= limit ) {
+			return -1;
+		}
+		ret = preader_fill(in);
+		if ( ret <= 0 ) {
+			return (ret < 0) ? -2 : -1;
+		}
+	}
+}
+
+static int gz_scan(preader *reader, int fd, off_t start, off_t *resume)
+{
+	preader_input in;
+	preader_job *job;
+	size_t len;
+	long next;
+	int members = 0, done = 0;
+
+	memset(&in, 0, sizeof(in));
+	in.fd = fd;
+	in.offset = in.next = start;
+	for ( ;; ) {
+		*resume = in.offset;
+		if ( preader_need(&in, 18) < 0 ) {
+			break;
+		}
+		if ( (in.len < 10) || !member_header(in.buf) ) {
+			/* Anything after the last member is ignored, like gzip does */
+			done = (members > 0);
+			break;
+		}
+		len = (in.len >= 18) ? bgzf_member(in.buf) : 0;
+		if ( len > 0 ) {
+			if ( preader_need(&in, len) <= 0 ) {
+				break;
+			}
+		} else {
+			next = find_member(&in, 18, GZ_MEMBER_MAX);
+			if ( next == -2 ) {
+				break;
+			}
+			if ( next < 0 ) {
+				if ( ! in.eof ) {
+					/* Too large for a job */
+					break;
+				}
+				len = in.len;
+			} else {
+				len = next;
+			}
+		}
+		job = preader_job_new(len, in.offset);
+		if ( job == NULL ) {
+			break;
+		}
+		memcpy(job->in, in.buf, len);
+		if ( ! preader_submit(reader, job) ) {
+			done = 1;
+			break;
+		}
+		++members;
+		preader_drop(&in, len);
+	}
+	free(in.buf);
+	return done;
+}
+
+static int gz_decode(preader_job *job)
+{
+	z_stream strm;
+	size_t size;
+	unsigned char *out;
+	int ret;
+
+	memset(&strm, 0, sizeof(strm));
+	if ( inflateInit2(&strm, 15 + 16) != Z_OK ) {
+		return 0;
+	}
+	size = job->in_len * 4;
+	if ( size < 65536 ) {
+		size = 65536;
+	}
+	job->out = (unsigned char *)malloc(size);
+	strm.next_in = job->in;
+	strm.avail_in = job->in_len;
+	for ( ret = Z_OK; job->out; ) {
+		strm.next_out = job->out + job->out_len;
+		strm.avail_out = size - job->out_len;
+		ret = inflate(&strm, Z_NO_FLUSH);
+		job->out_len = size - strm.avail_out;
+		if ( ret == Z_STREAM_END ) {
+			if ( strm.avail_in == 0 ) {
+				break;
+			}
+			/* The scanner may have missed the start of a member */
+			if ( inflateReset(&strm) != Z_OK ) {
+				ret = Z_MEM_ERROR;
+				break;
+			}
+			continue;
+		}
+		if ( ret != Z_OK ) {
+			break;
+		}
+		if ( strm.avail_out > 0 ) {
+			/* Ran out of input before the end of the member */
+			ret = Z_BUF_ERROR;
+			break;
+		}
+		if ( size >= GZ_OUTPUT_MAX ) {
+			/* Leave it to the sequential decoder */
+			break;
+		}
+		size *= 2;
+		out = (unsigned char *)realloc(job->out, size);
+		if ( out == NULL ) {
+			break;
+		}
+		job->out = out;
+	}
+	inflateEnd(&strm);
+	return (ret == Z_STREAM_END) && job->out;
+}
+
+static void *gz_seq_open(int fd, off_t offset)
+{
+	gz_seq *seq;
+
+	seq = (gz_seq *)calloc(1, sizeof *seq);
+	if ( seq == NULL ) {
+		return NULL;
+	}
+	seq->fd = fd;
+	seq->offset = offset;
+	seq->in = (unsigned char *)malloc(GZ_INPUT);
+	if ( !seq->in || (inflateInit2(&seq->strm, 15 + 16) != Z_OK) ) {
+		free(seq->in);
+		free(seq);
+		return NULL;
+	}
+	seq->state = SEQ_START;
+	return seq;
+}
+
+static int gz_seq_read(void *data, void *buf, int len)
+{
+	gz_seq *seq = (gz_seq *)data;
+	z_stream *strm = &seq->strm;
+	unsigned int avail_in, avail_out;
+	ssize_t n;
+	int ret;
+
+	strm->next_out = (Bytef *)buf;
+	strm->avail_out = len;
+	while ( (strm->avail_out > 0) && (seq->state != SEQ_DONE) && (seq->state != SEQ_ERROR) ) {
+		if ( (strm->avail_in == 0) && !seq->eof ) {
+			n = pread(seq->fd, seq->in, GZ_INPUT, seq->offset);
+			if ( n < 0 ) {
+				seq->state = SEQ_ERROR;
+				break;
+			}
+			seq->eof = (n == 0);
+			seq->offset += n;
+			strm->next_in = seq->in;
+			strm->avail_in = n;
+		}
+		if ( seq->state == SEQ_END ) {
+			if ( strm->avail_in == 0 ) {
+				seq->state = SEQ_DONE;
+				break;
+			}
+			/* Members may follow each other */
+			inflateReset(strm);
+			seq->state = SEQ_START;
+		}
+		avail_in = strm->avail_in;
+		avail_out = strm->avail_out;
+		ret = inflate(strm, Z_NO_FLUSH);
+		if ( ret == Z_STREAM_END ) {
+			seq->state = SEQ_END;
+			++seq->members;
+		} else if ( (ret == Z_DATA_ERROR) && (seq->state == SEQ_START) && seq->members ) {
+			/* Not another member, ignore the rest of the file */
+			seq->state = SEQ_DONE;
+		} else if ( ((ret != Z_OK) && (ret != Z_BUF_ERROR)) ||
+					(seq->eof && (strm->avail_in == avail_in) && (strm->avail_out == avail_out)) ) {
+			seq->state = SEQ_ERROR;
+		} else {
+			seq->state = SEQ_DATA;
+		}
+	}
+	if ( (seq->state == SEQ_ERROR) && (strm->avail_out == (unsigned int)len) ) {
+		return -1;
+	}
+	return len - strm->avail_out;
+}
+
+static void gz_seq_close(void *data)
+{
+	gz_seq *seq = (gz_seq *)data;
+
+	inflateEnd(&seq->strm);
+	free(seq->in);
+	free(seq);
+}
+
+const preader_ops gzip_preader = {
+	gz_scan,
+	gz_decode,
+	gz_seq_open,
+	gz_seq_read,
+	gz_seq_close
+};
+
+#endif /* GZIP_PARALLEL */
@@ -0,0 +1,24 @@
+/* Parallel decoder for gzip data made of several members */
+
+#ifndef __GZIP_H__
+#define __GZIP_H__
+
+#include <sys/types.h>
+
+#include "config.h"
+#include "preader.h"
+
+#ifdef HAVE_PTHREAD_H
+#define GZIP_PARALLEL
+
+/* Below this compressed size the data is decoded on the reading thread */
+#define GZ_PARALLEL_MIN		(1024*1024)
+
+extern const preader_ops gzip_preader;
+#endif
+
+/* The uncompressed size of BGZF data, from the headers and trailers of its
+   members, 0 if the data is not in that format */
+extern size_t gz_bgzf_size(int fd, off_t start, off_t end);
+
+#endif
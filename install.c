@@ -54,7 +54,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#ifdef __linux
+# include <sys/syscall.h>
+#endif
 #include <fcntl.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #ifdef HAVE_STRINGS_H
@@ -79,6 +83,10 @@
 #include "file.h"
 #include "network.h"
 #include "bools.h"
+#include "plan.h"
+#include "plugins.h"
+#include "shell.h"
+#include "progress.h"
 #include "loki_launchurl.h"
 
 #if HARDCODE_TRANSLATION
@@ -346,6 +354,11 @@ const char *GetProductCDKey(install_info *info)
     return (char *)xmlGetProp(XML_ROOT(info->config), BAD_CAST "cdkey");
 }
 
+const char *GetProductIOBlockSize(install_info *info)
+{
+    return (char *)xmlGetProp(XML_ROOT(info->config), BAD_CAST "iobuffer");
+}
+
 int GetProductPromptOverwrite(install_info *info)
 {
 	int ret = 1; /* yes */
@@ -1089,6 +1102,7 @@ struct cdrom_elem *add_cdrom_entry(install_info *info, const char *id, const cha
         elem->id = strdup(id);
         elem->file = strdup(file);
         elem->mounted = NULL;
+        elem->dev = 0;
         elem->next = info->cdroms_list;
         info->cdroms_list = elem;
     }
@@ -1097,9 +1111,12 @@ struct cdrom_elem *add_cdrom_entry(install_info *info, const char *id, const cha
 
 void set_cdrom_mounted(struct cdrom_elem *cd, const char *path)
 {
+    struct stat st;
+
     if ( cd ) {
         free(cd->mounted);
         cd->mounted = path ? strdup(path) : NULL;
+        cd->dev = (path && (stat(path, &st) == 0)) ? st.st_dev : 0;
     }
 }
 
@@ -1433,6 +1450,16 @@ void mark_option(install_info *info, xmlNodePtr node,
     }
 }
 
+void mark_option_size(install_info *info, xmlNodePtr node,
+                      const char *value, int recurse)
+{
+    unsigned long long before = size_option(info, node);
+
+    mark_option(info, node, value, recurse);
+    /* Only the subtree of the option is walked, its sizes are cached */
+    info->install_size += size_option(info, node) - before;
+}
+
 /* Enable an option, given its name */
 int enable_option_recurse(install_info *info, xmlNodePtr node, const char *option)
 {
@@ -1827,6 +1854,7 @@ void delete_install(install_info *info)
         free(comp);
     }
 	delete_cdrom_install(info);
+	plan_free();
     if ( info->lookup ) {
         close_lookup(info->lookup);
     }
@@ -1872,11 +1900,20 @@ install_state install(install_info *info, UIUpdateFunc update)
         }
     }
 
-    /* Walk the install tree */
+    /* Walk the install tree, scripted bools are run again from here on.
+       The pre-install script may have added files to the source directories */
+    setup_invalidate_bools();
+    plan_invalidate_files();
     node = XML_CHILDREN(XML_ROOT(info->config));
     info->install_size = size_tree(info, node);
 
+	/* The UI is updated at a steady rate from here on */
+	if ( update ) {
+		progress_start(info, update);
+		update = progress_update;
+	}
     copy_tree(info, node, info->install_path, update);
+	copy_flush(info, update);
 
 	/* Install the optional README and EULA files
 	   Warning: those are always installed in the root of the installation directory!
@@ -1910,6 +1947,10 @@ install_state install(install_info *info, UIUpdateFunc update)
 			f += strlen(info->setup_path)+1;
 		copy_path(info, f, info->install_path, NULL, !keepdirs, NULL, NULL, update);
 	}
+	/* Show where the copy ended */
+	if ( update ) {
+		progress_flush(info);
+	}
     if(info->options.install_menuitems){
 		int i;
 		for(i = 0; i<MAX_DESKTOPS; i++) {
@@ -2130,9 +2171,9 @@ static const char *get_optiontags_string(install_info *info)
 	return tags;
 }
 
-static void output_script_header(FILE *f, install_info *info, product_component_t *comp)
+static void output_script_header(shell_text *text, install_info *info, product_component_t *comp)
 {
-    fprintf(f,
+    shell_printf(text,
             "SETUP_PRODUCTNAME=\"%s\"\n"
             "SETUP_PRODUCTVER=\"%s\"\n"
             "SETUP_COMPONENTNAME=\"%s\"\n"
@@ -2156,40 +2197,34 @@ static void output_script_header(FILE *f, install_info *info, product_component_
 			);
 #ifdef RPM_SUPPORT
     if(strcmp(rpm_root,"/")) /* Emulate RPM environment for scripts */
-        fprintf(f,"RPM_INSTALL_PREFIX=%s\n", rpm_root);
+        shell_printf(text, "RPM_INSTALL_PREFIX=%s\n", rpm_root);
 #endif
-    fseek(f, 0L, SEEK_CUR);
 }
 
 static void generate_uninst_script(install_info *info, product_component_t *component, 
 								   const char *file, const char *name, script_type_t t)
 {
-	FILE *pre;
+	shell_text script = { NULL, 0, 0 };
 	int count;
-	char tmp_name[] = "/tmp/setupXXXXXX", buf[1024];
-	int tmp = mkstemp(tmp_name);
-	if ( tmp < 0 ) {
-		log_fatal(_("Could not create temporary script"));
-	}
-	
-	pre = fdopen(tmp, "w");
-	if ( pre ) {
-		int script_file = open(file, O_RDONLY);
-		output_script_header(pre, info, component);
-		if (script_file > 0) {
-			for(;;) {
-				count = read(script_file, buf, sizeof(buf));
-				if(count>0)
-					fwrite(buf, 1, count, pre);
-				else
-					break;
-			}
-			close(script_file);
+	char buf[1024];
+	int script_file = open(file, O_RDONLY);
+
+	output_script_header(&script, info, component);
+	if (script_file > 0) {
+		for(;;) {
+			count = read(script_file, buf, sizeof(buf));
+			if(count>0)
+				shell_printf(&script, "%.*s", count, buf);
+			else
+				break;
 		}
-		fchmod(fileno(pre), 0755);
-		fclose(pre);
-		loki_registerscript_fromfile_component(component, t, name, tmp_name);
-		unlink(tmp_name);
+		close(script_file);
+	}
+	if ( script.buf ) {
+		loki_registerscript_component(component, t, name, script.buf);
+		free(script.buf);
+	} else {
+		log_fatal(_("Out of memory"));
 	}
 }
 
@@ -2314,56 +2349,37 @@ void generate_uninstall(install_info *info)
                 /* Generate optional pre and post uninstall scripts in the 'scripts' subdirectory */
 
                 if(opt->pre_script_list){
-                    FILE *pre;
-					char tmp_name[] = "/tmp/setupXXXXXX";
-                    int tmp = mkstemp(tmp_name);
-					if ( tmp < 0 ) {
-                        log_fatal(_("Could not create temporary script"));
-					}
-
-                    pre = fdopen(tmp, "w");
-                    if ( pre ) {
-                        output_script_header(pre, info, component);
+                    shell_text pre = { NULL, 0, 0 };
 
-                        fprintf(pre, "pre()\n{\n");
-                        for ( selem = opt->pre_script_list; selem; selem = selem->next ) {
-                            fprintf(pre, "%s\n", selem->script);
-                        }
-                        fprintf(pre,"}\npre 0\n");
-                    
-                        fchmod(fileno(pre), 0755);
-                        fclose(pre);
+                    output_script_header(&pre, info, component);
+                    shell_printf(&pre, "pre()\n{\n");
+                    for ( selem = opt->pre_script_list; selem; selem = selem->next ) {
+                        shell_printf(&pre, "%s\n", selem->script);
+                    }
+                    if ( shell_printf(&pre, "}\npre 0\n") ) {
                         snprintf(buf, sizeof(buf), "%s-preun", opt->name);
-                        loki_registerscript_fromfile(option, LOKI_SCRIPT_PREUNINSTALL, buf, tmp_name);
-                        unlink(tmp_name);
+                        loki_registerscript(option, LOKI_SCRIPT_PREUNINSTALL, buf, pre.buf);
                     } else {
-                        log_fatal(_("Could not write temporary pre-uninstall script in %s"), buf);
+                        log_fatal(_("Out of memory"));
                     }
+                    free(pre.buf);
                 }
 
                 if(opt->post_script_list){
-                    FILE *post;
-					char tmp_name[] = "/tmp/setupXXXXXX";
-                    int tmp = mkstemp(tmp_name);
-					if ( tmp < 0 ) {
-                        log_fatal(_("Could not create temporary script"));
-					}
-					
-                    post = fdopen(tmp, "w");
-                    if ( post ) {
-                        output_script_header(post, info, component);
-                        fprintf(post, "post()\n{\n");
-                        for ( selem = opt->post_script_list; selem; selem = selem->next ) {
-                            fprintf(post, "%s\n", selem->script);
-                        }
-                        fprintf(post,"}\npost 0\n");
-                        fclose(post);
+                    shell_text post = { NULL, 0, 0 };
+
+                    output_script_header(&post, info, component);
+                    shell_printf(&post, "post()\n{\n");
+                    for ( selem = opt->post_script_list; selem; selem = selem->next ) {
+                        shell_printf(&post, "%s\n", selem->script);
+                    }
+                    if ( shell_printf(&post, "}\npost 0\n") ) {
                         snprintf(buf, sizeof(buf), "%s-postun", opt->name);
-                        loki_registerscript_fromfile(option, LOKI_SCRIPT_POSTUNINSTALL, buf, tmp_name);
-                        unlink(tmp_name);
+                        loki_registerscript(option, LOKI_SCRIPT_POSTUNINSTALL, buf, post.buf);
                     } else {
-                        log_fatal(_("Could not write post-uninstall script in %s"), buf);
+                        log_fatal(_("Out of memory"));
                     }
+                    free(post.buf);
                 }
             }
             pop_curdir();
@@ -2972,6 +2988,9 @@ int run_script(install_info *info, const char *script, int arg, int include_tags
     int fd;
     int exitval;
     char working_dir[PATH_MAX];
+    char cmd[PATH_MAX];
+    shell_text env, local;
+    setup_bool *b;
     
     /* We need to append the working directory onto the script name so
        it can always be found. Do this only if the script file exists
@@ -2985,6 +3004,58 @@ int run_script(install_info *info, const char *script, int arg, int include_tags
         strncat(working_dir, "/", sizeof(working_dir)-strlen(working_dir));
     }
 
+    /* Environment variables for the script */
+    memset(&env, 0, sizeof(env));
+    memset(&local, 0, sizeof(local));
+    shell_printf(&env,
+				 "SETUP_PRODUCTNAME=\"%s\"\n"
+				 "SETUP_PRODUCTVER=\"%s\"\n"
+				 "SETUP_INSTALLPATH=\"%s\"\n"
+				 "SETUP_SYMLINKSPATH=\"%s\"\n"
+				 "SETUP_CDROMPATH=\"%s\"\n"
+				 "SETUP_DISTRO=\"%s\"\n"
+				 "SETUP_REINSTALL=\"%s\"\n"
+				 "SETUP_ARCH=\"%s\"\n"
+				 "export SETUP_PRODUCTNAME SETUP_PRODUCTVER SETUP_INSTALLPATH SETUP_SYMLINKSPATH SETUP_CDROMPATH SETUP_DISTRO SETUP_REINSTALL SETUP_ARCH\n",
+				 info->name, info->version,
+				 info->install_path,
+				 info->symlinks_path,
+				 info->cdroms_list ? info->cdroms_list->mounted : "",
+				 info->distro ? distribution_symbol[info->distro] : "",
+				 info->options.reinstalling ? "1" : "0",
+				 info->arch);
+    /* Set boolean environment variables */
+    for ( b = setup_booleans; b; b = b->next ) {
+        if (b->envvar && b->inited) { /* We are NOT running scripts at this point */
+            shell_printf(&env, "%s=%d; export %s\n", b->envvar, b->value, b->envvar);
+        }
+    }
+    if ( include_tags ) {
+        shell_printf(&local,
+					 "SETUP_OPTIONTAGS=\"%s\"\n"
+					 "export SETUP_OPTIONTAGS\n", 
+					 get_optiontags_string(info));
+    }
+    if ( arg >= 0 ) {
+        snprintf(cmd, sizeof(cmd), "%d", arg);
+    } else {
+        strncpy(cmd, info->install_path, sizeof(cmd));
+    }
+    exitval = -1;
+    if ( !env.buf || (include_tags && !local.buf) ) {
+        log_warning(_("Out of memory"));
+        goto done;
+    }
+
+    if ( shell_coprocess ) {
+        snprintf(script_file, PATH_MAX, "%s%s", working_dir, script);
+        exitval = shell_run(info, env.buf, local.buf ? local.buf : "", script_file, cmd);
+        if ( exitval != -2 ) {
+            goto done;
+        }
+        exitval = -1;
+    }
+
     snprintf(script_file, PATH_MAX, "%s/tmp_script_XXXXXX", info->install_path);
     fd = mkstemp(script_file);
     if ( fd < 0 ) { /* Maybe the install directory didn't exist? */
@@ -2992,62 +3063,28 @@ int run_script(install_info *info, const char *script, int arg, int include_tags
         snprintf(script_file, PATH_MAX, "/tmp/tmp_script_XXXXXX");
         fd = mkstemp(script_file);
     }
-    exitval = -1;
     if ( fd >= 0 ) {
         FILE *fp;
-        char cmd[PATH_MAX];
 
         fp = fdopen(fd, "w");
         if ( fp ) {
-			setup_bool *b;
-
-            fprintf(fp, /* Create script file, setting environment variables */
-					"#!/bin/sh\n"
-					"SETUP_PRODUCTNAME=\"%s\"\n"
-					"SETUP_PRODUCTVER=\"%s\"\n"
-					"SETUP_INSTALLPATH=\"%s\"\n"
-					"SETUP_SYMLINKSPATH=\"%s\"\n"
-					"SETUP_CDROMPATH=\"%s\"\n"
-					"SETUP_DISTRO=\"%s\"\n"
-					"SETUP_REINSTALL=\"%s\"\n"
-					"SETUP_ARCH=\"%s\"\n"
-					"export SETUP_PRODUCTNAME SETUP_PRODUCTVER SETUP_INSTALLPATH SETUP_SYMLINKSPATH SETUP_CDROMPATH SETUP_DISTRO SETUP_REINSTALL SETUP_ARCH\n",
-					info->name, info->version,
-					info->install_path,
-					info->symlinks_path,
-					info->cdroms_list ? info->cdroms_list->mounted : "",
-					info->distro ? distribution_symbol[info->distro] : "",
-					info->options.reinstalling ? "1" : "0",
-					info->arch);
-
-			if ( include_tags )
-				fprintf(fp, 
-						"SETUP_OPTIONTAGS=\"%s\"\n"
-						"export SETUP_OPTIONTAGS\n", 
-						get_optiontags_string(info));
-			/* Set boolean environment variables */
-			for ( b = setup_booleans; b; b = b->next ) {
-				if (b->envvar && b->inited) { /* We are NOT running scripts at this point */
-					fprintf(fp,"%s=%d; export %s\n", b->envvar, b->value, b->envvar);
-				}
-			}
+            /* Create script file, setting environment variables */
+            fprintf(fp, "#!/bin/sh\n%s%s", env.buf, local.buf ? local.buf : "");
 
 			/* Append script itself */
 			fprintf(fp, "%s%s\n", 
 					working_dir, script);
             fchmod(fileno(fp),0755); /* Turn on executable bit */
             fclose(fp);
-			if ( arg >= 0 ) {
-				snprintf(cmd, sizeof(cmd), "%d", arg);
-			} else {
-				strncpy(cmd, info->install_path, sizeof(cmd));
-			}
            
             exitval = run_command(info, script_file, cmd, NULL, 1);
         }
         close(fd);
     }
 	unlink(script_file);
+ done:
+    free(env.buf);
+    free(local.buf);
     return(exitval);
 }
 
@@ -3088,22 +3125,127 @@ int run_command3(install_info *info, const char *cmd, const char *arg1, const ch
         perror("fork");
         break;
     default: /* Parent */
-        while ( waitpid(child, &exitval, WNOHANG) == 0 ) {
-            if ( UI.idle ) {
-                UI.idle(info); /* Run an idle loop while the command is running */
-            }
-			usleep(10000);
-        }
-        if ( WIFEXITED(exitval) ) {
-            exitval = WEXITSTATUS(exitval);
-        } else {
-            exitval = 1;
-        }
+        exitval = wait_command(info, child, -1, NULL, NULL);
         break;
     }
     return exitval;
 }
 
+/* How often the idle function of the UI is called when it has no descriptor
+   to wait for, in milliseconds */
+#define IDLE_INTERVAL	10
+
+/* Written to by the SIGCHLD handler */
+static int child_pipe[2] = { -1, -1 };
+
+static void child_signal(int sig)
+{
+	int saved_errno = errno;
+
+	if ( write(child_pipe[1], "", 1) < 0 ) {
+		/* Full, there is a wake up pending already */
+	}
+	errno = saved_errno;
+}
+
+/* A descriptor that becomes readable when a child exits: a pidfd for it on
+   recent Linux kernels, or a pipe written to on SIGCHLD */
+static int child_fd(pid_t child, int *pidfd)
+{
+	struct sigaction sa;
+
+	*pidfd = -1;
+#if defined(__linux) && defined(SYS_pidfd_open)
+	*pidfd = syscall(SYS_pidfd_open, child, 0);
+	if ( *pidfd >= 0 ) {
+		return *pidfd;
+	}
+#endif
+	if ( child_pipe[0] < 0 ) {
+		if ( pipe(child_pipe) < 0 ) {
+			return -1;
+		}
+		fcntl(child_pipe[0], F_SETFL, O_NONBLOCK);
+		fcntl(child_pipe[1], F_SETFL, O_NONBLOCK);
+		fcntl(child_pipe[0], F_SETFD, FD_CLOEXEC);
+		fcntl(child_pipe[1], F_SETFD, FD_CLOEXEC);
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = child_signal;
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+		sigaction(SIGCHLD, &sa, NULL);
+	}
+	return child_pipe[0];
+}
+
+int wait_command(install_info *info, pid_t child, int fd, int (*output)(int fd, void *data), void *data)
+{
+	struct pollfd fds[3];
+	int exitval = 0, pidfd, ui_fd, nfds, out_index = -1, ui_index = -1, timeout, ret;
+	char buf[64];
+
+	fds[0].fd = child_fd(child, &pidfd);
+	fds[0].events = POLLIN;
+	for ( ;; ) {
+		ret = waitpid(child, &exitval, WNOHANG);
+		if ( (ret == child) || ((ret < 0) && (errno != EINTR)) ) {
+			break;
+		}
+		nfds = 1;
+		if ( fd >= 0 ) {
+			out_index = nfds++;
+			fds[out_index].fd = fd;
+			fds[out_index].events = POLLIN;
+		}
+		ui_fd = (UI.idle && UI.event_fd) ? UI.event_fd(info) : -1;
+		if ( ui_fd >= 0 ) {
+			ui_index = nfds++;
+			fds[ui_index].fd = ui_fd;
+			fds[ui_index].events = POLLIN;
+		}
+		if ( (fds[0].fd < 0) || (UI.idle && (ui_fd < 0)) ) {
+			timeout = IDLE_INTERVAL;
+		} else if ( pidfd < 0 ) {
+			/* Another thread waiting for a child may have had the wake up */
+			timeout = 1000;
+		} else {
+			timeout = -1;
+		}
+		/* Sleep until the child exits, it has output, or the UI has events */
+		ret = poll(fds, nfds, timeout);
+		if ( ret < 0 ) {
+			if ( errno != EINTR ) {
+				usleep(IDLE_INTERVAL * 1000);
+			}
+			continue;
+		}
+		if ( (pidfd < 0) && (fds[0].fd >= 0) && (fds[0].revents & POLLIN) ) {
+			while ( read(child_pipe[0], buf, sizeof(buf)) > 0 )
+				;
+		}
+		if ( (fd >= 0) && (fds[out_index].revents & (POLLIN|POLLHUP|POLLERR)) ) {
+			if ( ! output(fd, data) ) {
+				fd = -1;
+			}
+		}
+		if ( UI.idle && ((ui_fd < 0) || fds[ui_index].revents) ) {
+			UI.idle(info); /* Run an idle loop while the command is running */
+		}
+	}
+	if ( pidfd >= 0 ) {
+		close(pidfd);
+	}
+	/* Whatever the child wrote last */
+	while ( (fd >= 0) && output(fd, data) )
+		;
+	if ( WIFEXITED(exitval) ) {
+		exitval = WEXITSTATUS(exitval);
+	} else {
+		exitval = 1;
+	}
+	return exitval;
+}
+
 /* Convenience functions to quickly change back and forth between current directories */
 
 #define MAX_CURDIRS 10
@@ -9,6 +9,7 @@
 #include "setup-locale.h"
 
 #include <limits.h>
+#include <sys/types.h>
 
 #include "setup-xml.h"
 
@@ -120,6 +121,7 @@ typedef struct _install_info {
         char *name;
         char *file;
         char *mounted;
+        dev_t dev;          /* Device of the mount point */
         struct cdrom_elem *next;
     } *cdroms_list;
 
@@ -270,6 +272,8 @@ extern int         GetProductHasManPages(install_info *info);
 extern int         GetProductUseFork(install_info *info);
 extern const char *GetProductCDKey(install_info *info);
 extern const char *GetProductPostInstallMsg(install_info *info);
+/** size of the file I/O buffers, as a string (e.g. "4M") */
+extern const char *GetProductIOBlockSize(install_info *info);
 /** whether the user should be prompted when files already exist */
 extern int GetProductPromptOverwrite(install_info *info);
 
@@ -356,6 +360,10 @@ extern void set_manpath(install_info *info, const char *path);
 extern void mark_option(install_info *info, xmlNodePtr node,
                         const char *value, int recurse);
 
+/* The same, adding or taking what the change makes to the install size */
+extern void mark_option_size(install_info *info, xmlNodePtr node,
+                             const char *value, int recurse);
+
 /* Enable an option recursively, given its name */
 extern int enable_option(install_info *info, const char *option);
 
@@ -426,12 +434,18 @@ extern void pop_curdir(void);
 /* Run a program in the background */
 int run_command(install_info *info, const char *cmd, const char *arg1, const char *arg2, int warn);
 int run_command3(install_info *info, const char *cmd, const char *arg1, const char *arg2, const char *arg3, int warn);
+/* Wait for a child process, running the idle function of the UI in the meantime.
+   'output' is called when there is data to read from 'fd', if it isn't -1, and
+   returns 0 once it is done with it. Returns the exit status of the child */
+int wait_command(install_info *info, pid_t child, int fd, int (*output)(int fd, void *data), void *data);
 
 /* Manage the list of corrupt files if we're restoring */
 extern void add_corrupt_file(const product_t *prod, const char *path, const char *option);
 extern void free_corrupt_files(void);
 extern int file_is_corrupt(const product_t *prod, const char *path);
 extern int restoring_corrupt(void);
+/* The number of files still to be restored, archives can stop once it is 0 */
+extern int corrupt_files_left(void);
 extern void select_corrupt_options(install_info *info);
 
 int xmlNodePropIsTrue(xmlNodePtr node, const char* prop);
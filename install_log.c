@@ -28,42 +28,42 @@ void log_exit(void)
 void log_debug(const char *fmt, ...)
 {
     va_list ap;
-    char buf[BUFSIZ];
 
-    va_start(ap, fmt);
-    vsnprintf(buf, BUFSIZ, fmt, ap);
-    va_end(ap);
-    print_log(log, LOG_DEBUG, "%s\n", buf);
+    if ( log_wanted(log, LOG_DEBUG) ) {
+        va_start(ap, fmt);
+        vprint_log_line(log, LOG_DEBUG, fmt, ap);
+        va_end(ap);
+    }
 }
 void log_quiet(const char *fmt, ...)
 {
     va_list ap;
-    char buf[BUFSIZ];
 
-    va_start(ap, fmt);
-    vsnprintf(buf, BUFSIZ, fmt, ap);
-    va_end(ap);
-    print_log(log, LOG_QUIET, "%s\n", buf);
+    if ( log_wanted(log, LOG_QUIET) ) {
+        va_start(ap, fmt);
+        vprint_log_line(log, LOG_QUIET, fmt, ap);
+        va_end(ap);
+    }
 }
 void log_normal(const char *fmt, ...)
 {
     va_list ap;
-    char buf[BUFSIZ];
 
-    va_start(ap, fmt);
-    vsnprintf(buf, BUFSIZ, fmt, ap);
-    va_end(ap);
-    print_log(log, LOG_NORMAL, "%s\n", buf);
+    if ( log_wanted(log, LOG_NORMAL) ) {
+        va_start(ap, fmt);
+        vprint_log_line(log, LOG_NORMAL, fmt, ap);
+        va_end(ap);
+    }
 }
 void log_warning(const char *fmt, ...)
 {
     va_list ap;
-    char buf[BUFSIZ];
 
-    va_start(ap, fmt);
-    vsnprintf(buf, BUFSIZ, fmt, ap);
-    va_end(ap);
-    print_log(log, LOG_WARNING, "%s\n", buf);
+    if ( log_wanted(log, LOG_WARNING) ) {
+        va_start(ap, fmt);
+        vprint_log_line(log, LOG_WARNING, fmt, ap);
+        va_end(ap);
+    }
 }
 
 void log_fatal(const char *fmt, ...)
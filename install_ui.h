@@ -25,6 +25,7 @@ typedef struct {
     UIUpdateFunc update;
     void (*abort)(install_info *info);
 	void (*idle)(install_info *info);
+	int (*event_fd)(install_info *info); /* Readable when idle() has events to process, or NULL */
 	yesno_answer (*prompt)(const char *txt, yesno_answer suggest);
     install_state (*website)(install_info *info);
     install_state (*complete)(install_info *info);
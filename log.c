@@ -1,22 +1,38 @@
 
-/* Functions to perform install logging */
+/* Functions to perform install logging
+
+   Only the messages that are printed out are formatted at all. They are also
+   kept in a ring of fixed size for write_log(), so that a long install does
+   not keep every line it ever logged in memory. Threads reserve their place
+   in the ring with an atomic add and copy their message there on their own.
+*/
+
+#include "config.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#if !defined(HAVE_SYNC_BUILTINS) && defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#endif
 
 #include "install_log.h"
 #include "log.h"
 
+/* Memory kept for the last entries of the log, a power of two */
+#define LOG_RING_SIZE	(256*1024)
+
 struct _install_log {
     log_level verbosity;
-    struct log_entry {
-        char *text;
-        struct log_entry *next;
-    } *entry, *tail;
+    char *ring;
+    size_t head;		/* Total bytes written to the ring */
 };
 
+#if !defined(HAVE_SYNC_BUILTINS) && defined(HAVE_PTHREAD_H)
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 install_log *create_log(log_level verbosity)
 {
     install_log *log;
@@ -24,68 +40,129 @@ install_log *create_log(log_level verbosity)
     log = (install_log *)malloc(sizeof(*log));
     if ( log ) {
         log->verbosity = verbosity;
-        log->entry = NULL;
-        log->tail = NULL;
+        log->head = 0;
+        log->ring = (char *)malloc(LOG_RING_SIZE);
+        if ( log->ring == NULL ) {
+            free(log);
+            log = NULL;
+        }
     }
     return log;
 }
 
+int log_wanted(install_log *log, log_level level)
+{
+    return log && (level >= log->verbosity);
+}
+
+/* Reserve 'len' bytes of the ring, returns where they start */
+static size_t reserve_ring(install_log *log, size_t len)
+{
+#ifdef HAVE_SYNC_BUILTINS
+    return __sync_fetch_and_add(&log->head, len);
+#else
+    size_t pos;
+
+# ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&ring_lock);
+# endif
+    pos = log->head;
+    log->head += len;
+# ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&ring_lock);
+# endif
+    return pos;
+#endif
+}
+
+static void append_log(install_log *log, const char *text, size_t len)
+{
+    size_t pos, part;
+
+    pos = reserve_ring(log, len) & (LOG_RING_SIZE - 1);
+    part = LOG_RING_SIZE - pos;
+    if ( part > len ) {
+        part = len;
+    }
+    memcpy(log->ring + pos, text, part);
+    memcpy(log->ring, text + part, len - part);
+}
+
+int vprint_log_line(install_log *log, log_level level, const char *fmt, va_list ap)
+{
+    char text[BUFSIZ];
+    size_t prefix, len;
+
+    if ( ! log_wanted(log, level) ) {
+        return 0;
+    }
+
+    /* Get the message text, after the prefix printed out */
+    prefix = snprintf(text, sizeof(text), "%s", _("loki_setup: "));
+    vsnprintf(text + prefix, sizeof(text) - prefix - 1, fmt, ap);
+    len = strlen(text);
+    text[len++] = '\n';
+    text[len] = '\0';
+
+    /* Print it out in a single call, so that lines from different threads do not mix */
+    fputs(text, stdout);
+    fflush(stdout);
+
+    append_log(log, text + prefix, len - prefix);
+    return 0;
+}
+
 int print_log(install_log *log, log_level level, const char *fmt, ...)
 {
-    struct log_entry *entry;
     va_list ap;
     char text[BUFSIZ];
 
+    if ( ! log_wanted(log, level) ) {
+        return 0;
+    }
+
     /* Get the message text */
     va_start(ap, fmt);
     vsnprintf(text, BUFSIZ, fmt, ap);
     va_end(ap);
 
-    if ( log ) {
-        /* Print it out if appropriate */
-        if ( level >= log->verbosity ) {
-            fputs(_("loki_setup: "), stdout);
-            fputs(text, stdout);
-            fflush(stdout);
-        }
+    fputs(_("loki_setup: "), stdout);
+    fputs(text, stdout);
+    fflush(stdout);
 
-        /* Create a new log entry */
-        entry = (struct log_entry *)malloc(sizeof(*entry));
-        if ( entry == NULL ) {
-            return -1;
-        }
-        entry->text = (char *)malloc(strlen(text)+1);
-        if ( entry->text == NULL ) {
-            free(entry);
-            return -1;
-        }
-        strcpy(entry->text, text);
-        entry->next = NULL;
-
-        /* Add it to the log list */
-        if ( log->entry == NULL ) {
-            log->entry = entry;
-            log->tail = entry;
-        } else {
-            log->tail->next = entry;
-            log->tail = entry;
-        }
-    }
+    append_log(log, text, strlen(text));
     return 0;
 }
 
 int write_log(install_log *log, const char *file)
 {
-    struct log_entry *entry;
     FILE *out;
+    size_t head, pos;
+    const char *line;
 
     if ( log ) {
         out = fopen(file, "w");
         if ( out == NULL ) {
             return -1;
         }
-        for ( entry=log->entry; entry; entry=entry->next ) {
-            fputs(entry->text, out);
+        head = log->head;
+        if ( head <= LOG_RING_SIZE ) {
+            fwrite(log->ring, 1, head, out);
+        } else {
+            /* The oldest entries were dropped, start at the first whole line */
+            pos = head & (LOG_RING_SIZE - 1);
+            line = memchr(log->ring + pos, '\n', LOG_RING_SIZE - pos);
+            if ( line ) {
+                ++line;
+                fwrite(line, 1, log->ring + LOG_RING_SIZE - line, out);
+                fwrite(log->ring, 1, pos, out);
+            } else {
+                line = memchr(log->ring, '\n', pos);
+                if ( line ) {
+                    ++line;
+                    fwrite(line, 1, log->ring + pos - line, out);
+                }
+            }
         }
         fclose(out);
     }
@@ -94,15 +171,8 @@ int write_log(install_log *log, const char *file)
 
 void destroy_log(install_log *log)
 {
-    struct log_entry *entry;
-
     if ( log ) {
-        while ( log->entry ) {
-            entry = log->entry;
-            log->entry = entry->next;
-            free(entry->text);
-            free(entry);
-        }
+        free(log->ring);
         free(log);
     }
 }
@@ -4,6 +4,8 @@
 
 /* Functions to perform install logging */
 
+#include <stdarg.h>
+
 #include "install.h"
 
 typedef enum {
@@ -15,7 +17,11 @@ typedef enum {
 } log_level;
 
 extern install_log *create_log(log_level verbosity);
+/* Whether messages at that level are logged at all, check it before formatting one */
+extern int log_wanted(install_log *log, log_level level);
 extern int print_log(install_log *log, log_level level, const char *fmt, ...);
+/* The same from a va_list, and a newline is added to the message */
+extern int vprint_log_line(install_log *log, log_level level, const char *fmt, va_list ap);
 extern int write_log(install_log *log, const char *file);
 extern void destroy_log(install_log *log);
 
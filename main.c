@@ -42,6 +42,7 @@ Modifications by Borland/Inprise Corp.:
 #include "detect.h"
 #include "plugins.h"
 #include "bools.h"
+#include "shell.h"
 
 #ifdef HAVE_GETOPT_H
 #include <getopt.h>
@@ -57,6 +58,7 @@ int force_console = 0;
 extern int disable_install_path;
 extern int disable_binary_path;
 int express_setup = 0;
+extern int copy_workers;
 #ifdef RPM_SUPPORT
 extern char *rpm_root;
 extern int force_manual;
@@ -81,6 +83,7 @@ void exit_setup(int ret)
     /* Cleanup afterwards */
     if ( info )
         delete_install(info);
+	shell_stop();
 	setup_exit_bools();
     FreePlugins();
 	free_corrupt_files();
@@ -130,16 +133,19 @@ static void print_usage(const char *argv0)
 _("Usage: %s [options]\n\n"
 "Options can be one or more of the following:\n"
 "   -b path  Set the binary path to <path>\n"
+"   -B size  Set the size of the file I/O buffers, from 1M to 4M (default 1M)\n"
 "   -h       Display this help message\n"
 "   -i path  Set the install path to <path>\n"
 "   -c cwd   Use an alternate current directory for the install\n"
 "   -f file  Use an alternative XML file (default %s)\n"
+"   -j n     Copy up to n files at the same time (default 4, 1 to disable)\n"
 "   -m       Force manual extraction of RPM packages, do not update RPM database\n"
 "   -n       Force the text-only user interface\n"
 "   -o opt   Enable the option named \"opt\" from the XML file. Also enables non\n"
 "            interactive operation. Can be used multiple times.\n"
 "   -p pref  Specify a path prefix in the installation media.\n"
 "   -r root  Set the root directory for extracting RPM files (default is /)\n"
+"   -s       Run the scripts of the install from a single shell process\n"
 "   -v n     Set verbosity level to n. Available values :\n"
 "            0: Debug  1: Quiet  2: Normal 3: Warnings 4: Fatal\n"
 "   -V       Print the version of the setup program and exit\n"),
@@ -147,14 +153,17 @@ _("Usage: %s [options]\n\n"
 _("Usage: %s [options]\n\n"
 "Options can be one or more of the following:\n"
 "   -b path  Set the binary path to <path>\n"
+"   -B size  Set the size of the file I/O buffers, from 1M to 4M (default 1M)\n"
 "   -h       Display this help message\n"
 "   -i path  Set the install path to <path>\n"
 "   -c cwd   Use an alternate current directory for the install\n"
 "   -f file  Use an alternative XML file (default %s)\n"
+"   -j n     Copy up to n files at the same time (default 4, 1 to disable)\n"
 "   -n       Force the text-only user interface\n"
 "   -o opt   Enable the option named \"opt\" from the XML file. Also enables non\n"
 "            interactive operation. Can be used multiple times.\n"
 "   -p pref  Specify a path prefix in the installation media.\n"
+"   -s       Run the scripts of the install from a single shell process\n"
 "   -v n     Set verbosity level to n. Available values :\n"
 "            0: Debug  1: Quiet  2: Normal 3: Warnings 4: Fatal\n"
 "   -V       Print the version of the setup program and exit\n"),
@@ -190,6 +199,7 @@ int main(int argc, char **argv)
     char install_path[PATH_MAX];
     char binary_path[PATH_MAX];
 	const char *product_prefix = NULL, *str;
+	const char *io_blocksize = NULL;
     struct enabled_option *enabled_opt;
 #if defined(darwin)
     // If we're on Mac OS, we need to make sure the current working directoy
@@ -213,9 +223,9 @@ int main(int argc, char **argv)
     /* Parse the command-line options */
     while ( (c=getopt(argc, argv,
 #ifdef RPM_SUPPORT
-					  "hnc:f:r:v:Vi:b:mo:p:"
+					  "hnc:f:r:sv:Vi:b:B:j:mo:p:"
 #else
-					  "hnc:f:v:Vi:b:o:p:"
+					  "hnc:f:sv:Vi:b:B:j:o:p:"
 #endif
 					  )) != EOF ) {
         switch (c) {
@@ -259,9 +269,21 @@ int main(int argc, char **argv)
 	        strncpy(binary_path, optarg, sizeof(binary_path));
 			disable_binary_path = 1;
 			break;
+		case 'B':
+			io_blocksize = optarg;
+			break;
+		case 'j':
+			copy_workers = atoi(optarg);
+			if ( copy_workers < 1 ) {
+				copy_workers = 1;
+			}
+			break;
 		case 'p':
 			product_prefix = optarg;
 			break;
+		case 's':
+			shell_coprocess = 1;
+			break;
         case 'o': /* Store the enabled options for later processing */
             enabled_opt = (struct enabled_option *)malloc(sizeof(struct enabled_option));
             enabled_opt->option = strdup(optarg);
@@ -306,6 +328,14 @@ int main(int argc, char **argv)
         exit(3);
     }
 
+	/* The command line overrides the I/O buffer size from the XML file */
+	if ( ! io_blocksize ) {
+		io_blocksize = GetProductIOBlockSize(info);
+	}
+	if ( io_blocksize && ! file_set_blocksize(io_blocksize) ) {
+		log_warning(_("Invalid I/O buffer size: %s"), io_blocksize);
+	}
+
     /* Get the appropriate setup UI */
     for ( i=0; GUI_okay[i]; ++i ) {
         if ( GUI_okay[i](&UI, &argc, &argv) ) {
@@ -0,0 +1,167 @@
+/* The install plan
+
+   Working out the size of the install means evaluating the conditions of
+   every element of the XML file, expanding the file patterns and looking at
+   every matching file, which can take a while for large products. The UIs do
+   it again every time an option is toggled, and the copy expands the very
+   same patterns once more.
+
+   The results are kept with the nodes of the XML tree instead: the sizes of
+   the options until a setup boolean changes, as they depend on conditions,
+   and the files matched by the patterns for as long as their source
+   directory stays the same and no install script ran.
+*/
+
+#include "config.h"
+
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glob.h>
+
+#include "plan.h"
+#include "copy.h"
+#include "file.h"
+#include "install_log.h"
+
+static plan_node *plans = NULL;
+static unsigned plan_generation = 0;
+static unsigned files_generation = 0;
+
+plan_node *plan_get(xmlNodePtr node)
+{
+	plan_node *plan = (plan_node *)node->_private;
+
+	if ( plan == NULL ) {
+		plan = (plan_node *)calloc(1, sizeof *plan);
+		if ( plan == NULL ) {
+			log_fatal(_("Out of memory"));
+			return NULL;
+		}
+		plan->node = node;
+		plan->generation = plan_generation;
+		plan->next = plans;
+		plans = plan;
+		node->_private = plan;
+	}
+	return plan;
+}
+
+int plan_sized(plan_node *plan)
+{
+	return plan->sized && (plan->generation == plan_generation);
+}
+
+void plan_set_size(plan_node *plan, unsigned long long size)
+{
+	plan->size = size;
+	plan->sized = 1;
+	plan->generation = plan_generation;
+}
+
+static void free_files(plan_node *plan)
+{
+	int i, j;
+
+	for ( i = 0; i < plan->num_patterns; ++i ) {
+		for ( j = 0; j < plan->patterns[i].count; ++j ) {
+			free(plan->patterns[i].files[j].path);
+		}
+		free(plan->patterns[i].files);
+		free(plan->patterns[i].pattern);
+	}
+	free(plan->patterns);
+	free(plan->base);
+	plan->patterns = NULL;
+	plan->num_patterns = 0;
+	plan->base = NULL;
+}
+
+plan_node *plan_files(install_info *info, xmlNodePtr node, const char *base,
+					  const char *filedesc, const char *suffix)
+{
+	plan_node *plan;
+	plan_pattern *pat;
+	plan_file *file;
+	char fpat[PATH_MAX], cwd[PATH_MAX], dir[PATH_MAX];
+	struct stat st;
+	glob_t globbed;
+	int i, indir;
+
+	/* The current directory may not be the same for the copy */
+	if ( (*base != '/') && getcwd(cwd, sizeof(cwd)) ) {
+		snprintf(dir, sizeof(dir), "%s/%s", cwd, base);
+		base = dir;
+	}
+	plan = plan_get(node);
+	if ( plan->base && (strcmp(plan->base, base) == 0) && (plan->files_generation == files_generation) ) {
+		return plan;
+	}
+	free_files(plan);
+	plan->base = strdup(base);
+	plan->files_generation = files_generation;
+
+	/* The patterns are expanded the way the copy does, from the source directory */
+	indir = (stat(base, &st) == 0) && S_ISDIR(st.st_mode);
+	if ( indir ) {
+		push_curdir(base);
+	}
+	while ( filedesc && parse_line(&filedesc, fpat, (sizeof fpat)) ) {
+		pat = (plan_pattern *)realloc(plan->patterns, (plan->num_patterns + 1) * sizeof *pat);
+		if ( pat == NULL ) {
+			log_fatal(_("Out of memory"));
+			break;
+		}
+		plan->patterns = pat;
+		pat += plan->num_patterns++;
+		memset(pat, 0, sizeof *pat);
+		pat->pattern = strdup(fpat);
+		if ( indir && (glob(fpat, GLOB_ERR, NULL, &globbed) == 0) ) {
+			pat->found = 1;
+			pat->files = (plan_file *)calloc(globbed.gl_pathc, sizeof *pat->files);
+			for ( i = 0; pat->files && (i < globbed.gl_pathc); ++i ) {
+				file = &pat->files[pat->count++];
+				file->path = strdup(globbed.gl_pathv[i]);
+				file->plugin = FindPluginForFile(file->path, suffix);
+				if ( file->plugin ) {
+					file->size = file->plugin->Size(info, file->path);
+				} else {
+					file->size = file_size(info, file->path);
+				}
+			}
+			globfree(&globbed);
+		}
+	}
+	if ( indir ) {
+		pop_curdir();
+	}
+	return plan;
+}
+
+void plan_invalidate(void)
+{
+	++plan_generation;
+}
+
+void plan_invalidate_files(void)
+{
+	++files_generation;
+	/* The sizes were computed from the files */
+	plan_invalidate();
+}
+
+void plan_free(void)
+{
+	plan_node *plan;
+
+	while ( plans ) {
+		plan = plans;
+		plans = plan->next;
+		free_files(plan);
+		plan->node->_private = NULL;
+		free(plan);
+	}
+}
@@ -0,0 +1,64 @@
+/* The install plan: what the elements of the XML file resolve to on this
+   system, worked out once and shared by the size and copy passes */
+
+#ifndef __PLAN_H__
+#define __PLAN_H__
+
+#include <sys/types.h>
+
+#include "install.h"
+#include "plugins.h"
+
+/* A file matched by one of the patterns of a <files> element */
+typedef struct {
+	char *path;					/* As returned by glob() in the source directory */
+	const SetupPlugin *plugin;
+	off_t size;
+} plan_file;
+
+typedef struct {
+	char *pattern;
+	int found;					/* Whether glob() succeeded */
+	int count;
+	plan_file *files;
+} plan_pattern;
+
+/* Attached to the node of an element of the XML file */
+typedef struct plan_node {
+	xmlNodePtr node;
+	unsigned generation;		/* The plan is stale once plan_invalidate() was called */
+	/* Install size of an option or readme element */
+	int sized;
+	unsigned long long size;
+	/* Source files of a <files> element */
+	char *base;
+	unsigned files_generation;	/* Stale once plan_invalidate_files() was called */
+	int num_patterns;
+	plan_pattern *patterns;
+	struct plan_node *next;
+} plan_node;
+
+/* The plan of a node, created empty if needed */
+extern plan_node *plan_get(xmlNodePtr node);
+
+/* Whether the install size of a node was already computed */
+extern int plan_sized(plan_node *plan);
+extern void plan_set_size(plan_node *plan, unsigned long long size);
+
+/* Resolve the patterns of a <files> element in the source directory 'base',
+   unless that was already done */
+extern plan_node *plan_files(install_info *info, xmlNodePtr node, const char *base,
+							 const char *filedesc, const char *suffix);
+
+/* Forget everything that depends on the conditions of the XML file, when a
+   setup boolean changed */
+extern void plan_invalidate(void);
+
+/* Forget the files matched by the patterns as well, after an install script
+   ran: it may have added or removed files in the source directories */
+extern void plan_invalidate_files(void);
+
+/* Release the plans of all the nodes */
+extern void plan_free(void);
+
+#endif
@@ -87,6 +87,26 @@ int FreePlugins(void)
 	return ret;
 }
 
+/* Let the plugins finish the work they deferred */
+ssize_t FlushPlugins(install_info *info, UIUpdateFunc update)
+{
+	struct plugin_list *plg;
+	ssize_t size = 0, flushed;
+	int failed = 0;
+
+	for ( plg = plugins; plg; plg = plg->next ) {
+		if ( plg->plugin->Flush ) {
+			flushed = plg->plugin->Flush(info, update);
+			if ( flushed < 0 ) {
+				failed = 1;
+			} else {
+				size += flushed;
+			}
+		}
+	}
+	return failed ? -1 : size;
+}
+
 /* Dumps info on a file about all registered plugins */
 void DumpPlugins(FILE *f)
 {
@@ -23,14 +23,18 @@ typedef struct {
 	/* Free the plugin */
 	int (*FreePlugin)(void);
 
-	/* Get the size of the file */
-	size_t (*Size)(install_info *info, const char *path);
+	/* Get the size of the file once extracted, or -1 if it can't be read */
+	off_t (*Size)(install_info *info, const char *path);
 
 	/* Extract the file */
 	size_t (*Copy)(install_info *info, const char *path, const char *dest, const char *current_option,
 				   xmlNodePtr node,
 				   UIUpdateFunc update);
 
+	/* Finish what Copy() left for later, like a batch of packages to install.
+	   May be NULL. Returns the number of bytes installed, or -1 if it failed */
+	ssize_t (*Flush)(install_info *info, UIUpdateFunc update);
+
 } SetupPlugin;
 
 /* Dynamic plugins must export a C function with the following signature :
@@ -57,6 +61,11 @@ int InitPlugins(void);
 /* Free all registered plugins */
 int FreePlugins(void);
 
+/* Let the plugins finish the work they deferred, before anything that may need
+   the files they install (scripts, binaries from a package) and at the end of
+   the install. Returns the number of bytes installed, or -1 if one of them failed */
+ssize_t FlushPlugins(install_info *info, UIUpdateFunc update);
+
 /* Dumps info on a file about all registered plugins */
 void DumpPlugins(FILE *f);
 
@@ -47,7 +47,7 @@ static int CPIOFreePlugin(void)
 }
 
 /* Get the size of the file */
-static size_t CPIOSize(install_info *info, const char *path)
+static off_t CPIOSize(install_info *info, const char *path)
 {
 	return file_size(info, path) - 118;
 }
@@ -79,6 +79,9 @@ size_t copy_cpio_stream(install_info *info, stream *input, const char *dest, con
 
     memset(&file_hdr, 0, sizeof(file_hdr));
     while ( ! file_eof(info, input) ) {
+		if ( restoring_corrupt() && !corrupt_files_left() ) {
+			break; /* The rest of the archive is not needed */
+		}
 		has_crc = 0;
 		file_read(info, magic, 6, input);
 		count += 6;
@@ -146,6 +149,7 @@ size_t copy_cpio_stream(install_info *info, stream *input, const char *dest, con
 		}else{
 			if ( restoring_corrupt() && !file_is_corrupt(info->product, file_hdr.c_name) ) {
 				file_skip(info, file_hdr.c_filesize, input);
+				count += file_hdr.c_filesize;
 			} else {
 				unsigned long chk = 0;
 				/* Open the file for output */
@@ -78,9 +78,9 @@ static int rar_list_callback(UINT msg,LONG UserData,LONG P1,LONG P2)
 
 
 /* Get the size of the file */
-static size_t RARSize(install_info *info, const char *path)
+static off_t RARSize(install_info *info, const char *path)
 {
-    size_t retval = 0;
+    off_t retval = 0;
     int rc = 0;
     HANDLE h;
     struct RAROpenArchiveData raroad;
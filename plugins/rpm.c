@@ -1,30 +1,36 @@
 /* RPM plugin for setup */
 /* $Id: rpm.c,v 1.11 2004-11-02 03:48:57 megastep Exp $ */
 
+#include "config.h"
 #include "plugins.h"
 #include "file.h"
 #include "cpio.h"
 #include "install_log.h"
 #include "md5.h"
+#include "progress.h"
 
 #include <string.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include <zlib.h>
 
-#ifdef LIBBZ2_PREFIX
-#define BZDOPEN BZ2_bzdopen
-#else
-#define BZDOPEN bzdopen
-#endif
-
 #define HAVE_ZLIB_H
 #include <rpm/rpmio.h>
 #include <rpm/rpmlib.h>
 #include <rpm/header.h>
+#ifdef HAVE_RPMTS
+#include <rpm/rpmts.h>
+#include <rpm/rpmps.h>
+#endif
+
+/* Not in the headers of older versions of rpmlib */
+#define RPM_TAG_LONGSIZE	5009
+#define RPM_TYPE_INT64		5
 
 char *rpm_root = "/";
 int force_manual = 0;
@@ -57,14 +63,39 @@ static int RPMFreePlugin(void)
 	return 1;
 }
 
+/* The installed size of a package. Packages over 4 GB have a 64-bit tag for it */
+static off_t rpm_size(Header hd)
+{
+    int_32 type, c;
+    void *p;
+
+	if ( headerGetEntry(hd, RPM_TAG_LONGSIZE, &type, &p, &c) && (type == RPM_TYPE_INT64) ) {
+		return (off_t) *(unsigned long long *) p;
+	}
+	if ( headerGetEntry(hd, RPMTAG_SIZE, &type, &p, &c) && (type == RPM_INT32_TYPE) ) {
+		return (off_t) *(unsigned int *) p;
+	}
+	return 0;
+}
+
+/* The compression of the payload, which is gzip if the header doesn't say */
+static const char *rpm_payload_format(Header hd)
+{
+    int_32 type, c;
+    void *p;
+
+	if ( headerGetEntry(hd, RPMTAG_PAYLOADCOMPRESSOR, &type, &p, &c) && (type == RPM_STRING_TYPE) ) {
+		return (const char *) p;
+	}
+	return "gzip";
+}
+
 /* Get the size of the file */
-static size_t RPMSize(install_info *info, const char *path)
+static off_t RPMSize(install_info *info, const char *path)
 {
     FD_t fdi;
     Header hd;
-	size_t size = 0;
-    int_32 type, c;
-    void *p;
+	off_t size = 0;
 	int rc;
 
     fdi = fdOpen(path, O_RDONLY, 0644);
@@ -75,14 +106,349 @@ static size_t RPMSize(install_info *info, const char *path)
         return 0;
     }
 
-	headerGetEntry(hd, RPMTAG_SIZE, &type, &p, &c);
-	if(type==RPM_INT32_TYPE){
-		size = *(int_32*) p;
-	}
+	size = rpm_size(hd);
  	fdClose(fdi);
 	return size;
 }
 
+/* Progress of "rpm --percent", read from its output */
+typedef struct {
+	install_info *info;
+	const char *path;
+	const char *option;
+	UIUpdateFunc update;
+	size_t size;
+	float percent;
+	double previous_bytes;
+	int error, aborted;
+	size_t len;
+	char buf[256];
+} rpm_progress;
+
+static int rpm_output(int fd, void *data)
+{
+	rpm_progress *prog = (rpm_progress *)data;
+	char *line, *end;
+	double bytes_copied;
+	ssize_t n;
+
+	n = read(fd, prog->buf + prog->len, sizeof(prog->buf) - 1 - prog->len);
+	if ( n <= 0 ) {
+		return (n < 0) && (errno == EINTR);
+	}
+	if ( prog->error || prog->aborted ) { /* Let rpm finish */
+		return 1;
+	}
+	prog->len += n;
+	prog->buf[prog->len] = '\0';
+	for ( line = prog->buf; (end = strchr(line, '\n')) != NULL; line = end + 1 ) {
+		*end = '\0';
+		if ( *line == '\0' ) {
+			continue;
+		}
+		if ( sscanf(line, "%%%% %f", &prog->percent) != 1 ) {
+			prog->error = 1;
+			return 1;
+		}
+		/* calculate the bytes installed in this pass of the loop */
+		bytes_copied = (prog->percent/100.0)*prog->size - prog->previous_bytes;
+		prog->previous_bytes += bytes_copied;
+		prog->info->installed_bytes += bytes_copied;
+		if ( ! prog->update(prog->info, prog->path, (prog->percent/100.0)*prog->size, prog->size, prog->option) ) {
+			prog->aborted = 1;
+			return 1;
+		}
+	}
+	/* Keep the start of the next line */
+	prog->len = strlen(line);
+	if ( prog->len == sizeof(prog->buf) - 1 ) {
+		prog->len = 0;
+	}
+	memmove(prog->buf, line, prog->len);
+	return 1;
+}
+
+#ifdef HAVE_RPMTS
+/* With rpmlib 4.4 and later the packages are installed in-process, in
+   transactions run by RPMFlush(). The database is opened once for all of
+   them, and the progress is reported as the files of the packages are written.
+   The packages with nodeps="true" have their own transaction, whose dependencies
+   are not checked, like rpm -U --nodeps did for each of them */
+typedef struct rpm_package {
+	char *path;
+	char *name, *version, *release;
+	char *option_name;
+	struct option_elem *option;
+	int autoremove;
+	int nodeps;
+	off_t size;
+	double installed_bytes;
+	int installed;
+	FD_t fd;
+	struct rpm_package *next;
+} rpm_package;
+
+static struct {
+	rpmts ts;			/* Packages whose dependencies are checked */
+	rpmts ts_nodeps;	/* Packages added with nodeps */
+	rpm_package *packages, *last;
+	int relocate;		/* Whether some packages are relocated */
+	install_info *info;
+	UIUpdateFunc update;
+	int aborted;
+	int failed;			/* Whether a package could not be added */
+} rpm_batch;
+
+static void rpm_free_package(rpm_package *pkg)
+{
+	free(pkg->path);
+	free(pkg->name);
+	free(pkg->version);
+	free(pkg->release);
+	free(pkg->option_name);
+	free(pkg);
+}
+
+static char *rpm_header_string(Header hd, int_32 tag)
+{
+	int_32 type, c;
+	void *p;
+
+	if ( headerGetEntry(hd, tag, &type, &p, &c) && (type == RPM_STRING_TYPE) ) {
+		return strdup((char *) p);
+	}
+	return strdup("");
+}
+
+/* Add a package to the transaction, returns 0 if it can't be read */
+static int rpm_queue(install_info *info, const char *path, const char *dest, const char *option_name,
+					 int relocate, int autoremove, int nodeps)
+{
+	static int configured = 0;
+	struct rpmRelocation_s relocs[2];
+	rpm_package *pkg;
+	rpmts *ts = nodeps ? &rpm_batch.ts_nodeps : &rpm_batch.ts;
+	Header hd;
+	FD_t fd;
+	rpmRC rc;
+
+	if ( ! configured ) {
+		if ( rpmReadConfigFiles(NULL, NULL) != 0 ) {
+			log_warning(_("RPM error: %s"), rpmErrorString());
+			return 0;
+		}
+		configured = 1;
+	}
+	if ( *ts == NULL ) {
+		*ts = rpmtsCreate();
+		rpmtsSetRootDir(*ts, rpm_root);
+	}
+
+	fd = Fopen(path, "r.ufdio");
+	if ( (fd == NULL) || Ferror(fd) ) {
+		log_warning(_("Unable to open RPM file: '%s'"), path);
+		if ( fd ) {
+			Fclose(fd);
+		}
+		return 0;
+	}
+	rc = rpmReadPackageFile(*ts, fd, path, &hd);
+	Fclose(fd);
+	/* Like rpm -U, packages signed with unknown keys are installed */
+	if ( (rc != RPMRC_OK) && (rc != RPMRC_NOTTRUSTED) && (rc != RPMRC_NOKEY) ) {
+		log_warning(_("RPM error: %s"), rpmErrorString());
+		return 0;
+	}
+
+	pkg = (rpm_package *) calloc(1, sizeof(rpm_package));
+	if ( pkg == NULL ) {
+		log_fatal(_("Out of memory"));
+		headerFree(hd);
+		return 0;
+	}
+	pkg->path = strdup(path);
+	pkg->name = rpm_header_string(hd, RPMTAG_NAME);
+	pkg->version = rpm_header_string(hd, RPMTAG_VERSION);
+	pkg->release = rpm_header_string(hd, RPMTAG_RELEASE);
+	pkg->option_name = strdup(option_name ? option_name : "");
+	pkg->option = current_option;
+	pkg->autoremove = autoremove;
+	pkg->nodeps = nodeps;
+	pkg->size = rpm_size(hd);
+
+	/* Same as --relocate /=dest */
+	relocs[0].oldPath = "/";
+	relocs[0].newPath = dest;
+	relocs[1].oldPath = NULL;
+	relocs[1].newPath = NULL;
+	if ( rpmtsAddInstallElement(*ts, hd, (fnpyKey) pkg, 1, relocate ? relocs : NULL) != 0 ) {
+		log_warning(_("Unable to install RPM file: '%s'"), path);
+		headerFree(hd);
+		rpm_free_package(pkg);
+		return 0;
+	}
+	headerFree(hd);
+
+	if ( rpm_batch.last ) {
+		rpm_batch.last->next = pkg;
+	} else {
+		rpm_batch.packages = pkg;
+	}
+	rpm_batch.last = pkg;
+	if ( relocate ) {
+		rpm_batch.relocate = 1;
+	}
+	return 1;
+}
+
+/* Called by rpmlib as the transaction goes. The amounts are unsigned long long
+   with rpmlib 4.4, rpm_loff_t later which is the same size */
+static void *rpm_notify(const void *h, const rpmCallbackType what,
+						const unsigned long long amount, const unsigned long long total,
+						fnpyKey key, rpmCallbackData data)
+{
+	rpm_package *pkg = (rpm_package *) key;
+	double bytes;
+
+	switch ( what ) {
+		case RPMCALLBACK_INST_OPEN_FILE:
+			if ( (pkg == NULL) || rpm_batch.aborted ) {
+				return NULL;
+			}
+			pkg->fd = Fopen(pkg->path, "r.ufdio");
+			if ( (pkg->fd == NULL) || Ferror(pkg->fd) ) {
+				log_warning(_("Unable to open RPM file: '%s'"), pkg->path);
+				if ( pkg->fd ) {
+					Fclose(pkg->fd);
+				}
+				pkg->fd = NULL;
+			}
+			return pkg->fd;
+		case RPMCALLBACK_INST_CLOSE_FILE:
+			if ( pkg && pkg->fd ) {
+				Fclose(pkg->fd);
+				pkg->fd = NULL;
+			}
+			break;
+		case RPMCALLBACK_INST_PROGRESS:
+			if ( (pkg == NULL) || (total == 0) ) {
+				break;
+			}
+			/* The amounts are of the payload, the install size was computed from the header */
+			bytes = ((double) amount / (double) total) * pkg->size;
+			rpm_batch.info->installed_bytes += bytes - pkg->installed_bytes;
+			pkg->installed_bytes = bytes;
+			if ( amount >= total ) {
+				pkg->installed = 1;
+			}
+			if ( rpm_batch.update && !rpm_batch.aborted &&
+				 !rpm_batch.update(rpm_batch.info, pkg->path, (size_t) bytes, pkg->size, pkg->option_name) ) {
+				/* The packages not started yet are skipped */
+				rpm_batch.aborted = 1;
+			}
+			break;
+		default:
+			break;
+	}
+	return NULL;
+}
+
+/* Run one of the transactions, the packages it installed are marked as such */
+static void rpm_run(rpmts ts, int nodeps)
+{
+	rpm_package *pkg;
+	rpmps ps;
+	rpmprobFilterFlags filter = 0;
+	int rc;
+
+	if ( ! nodeps ) {
+		rpmtsCheck(ts);
+		ps = rpmtsProblems(ts);
+		if ( ps && (rpmpsNumProblems(ps) > 0) ) {
+			log_warning(_("The RPM packages have unresolved dependencies:"));
+			rpmpsPrint(stderr, ps);
+			rpmpsFree(ps);
+			return;
+		}
+		rpmpsFree(ps);
+	}
+
+	rpmtsOrder(ts);
+	rpmtsSetNotifyCallback(ts, rpm_notify, NULL);
+	if ( rpm_batch.relocate ) { /* --badreloc */
+		filter |= RPMPROB_FILTER_FORCERELOCATE;
+	}
+	rc = rpmtsRun(ts, NULL, filter);
+	if ( rc > 0 ) {
+		ps = rpmtsProblems(ts);
+		if ( ps && (rpmpsNumProblems(ps) > 0) ) {
+			rpmpsPrint(stderr, ps);
+		}
+		rpmpsFree(ps);
+	}
+	for ( pkg = rpm_batch.packages; pkg; pkg = pkg->next ) {
+		if ( pkg->nodeps == nodeps ) {
+			if ( rc == 0 ) {
+				pkg->installed = 1;
+			} else if ( rc < 0 ) {
+				pkg->installed = 0;
+			}
+		}
+	}
+}
+
+/* Install the packages added by RPMCopy() since the last time.
+   Returns -1 if one of them could not be installed, unless the user aborted */
+static ssize_t RPMFlush(install_info *info, UIUpdateFunc update)
+{
+	rpm_package *pkg, *next;
+	ssize_t size = 0;
+	int failed = rpm_batch.failed;
+
+	if ( (rpm_batch.ts == NULL) && (rpm_batch.ts_nodeps == NULL) ) {
+		rpm_batch.failed = 0;
+		return failed ? -1 : 0;
+	}
+	rpm_batch.info = info;
+	rpm_batch.update = update;
+	rpm_batch.aborted = progress_aborted();
+
+	if ( ! rpm_batch.aborted ) {
+		progress_flush(info);
+		/* First, they may provide what the other packages depend on */
+		if ( rpm_batch.ts_nodeps ) {
+			rpm_run(rpm_batch.ts_nodeps, 1);
+		}
+		if ( rpm_batch.ts && ! rpm_batch.aborted ) {
+			rpm_run(rpm_batch.ts, 0);
+		}
+	}
+
+	for ( pkg = rpm_batch.packages; pkg; pkg = next ) {
+		next = pkg->next;
+		if ( pkg->installed ) {
+			/* Log the RPM installation */
+			add_rpm_entry(info, pkg->option, pkg->name, pkg->version, atoi(pkg->release), pkg->autoremove);
+			info->installed_bytes += pkg->size - pkg->installed_bytes;
+			size += pkg->size;
+		} else if ( ! rpm_batch.aborted ) {
+			log_warning(_("Unable to install RPM file: '%s'"), pkg->path);
+			failed = 1;
+		}
+		rpm_free_package(pkg);
+	}
+
+	if ( rpm_batch.ts ) {
+		rpmtsFree(rpm_batch.ts);
+	}
+	if ( rpm_batch.ts_nodeps ) {
+		rpmtsFree(rpm_batch.ts_nodeps);
+	}
+	memset(&rpm_batch, 0, sizeof(rpm_batch));
+	return failed ? -1 : size;
+}
+#endif /* HAVE_RPMTS */
+
 /* Extract the file */
 static size_t RPMCopy(install_info *info, const char *path, const char *dest, const char *current_option_name, 
 		      xmlNodePtr node,
@@ -101,6 +467,15 @@ static size_t RPMCopy(install_info *info, const char *path, const char *dest, co
 	int autoremove = (autorm && !strcasecmp(autorm, "true"));
 	int nodeps = (depsoff && !strcasecmp(depsoff, "true"));
 
+#ifdef HAVE_RPMTS
+    if ( rpm_access && ! force_manual ) { /* Installed with the others by RPMFlush(), which counts it */
+        if ( ! rpm_queue(info, path, dest, current_option_name, relocate, autoremove, nodeps) ) {
+            rpm_batch.failed = 1;
+        }
+        return 0;
+    }
+#endif
+
     fdi = fdOpen(path, O_RDONLY, 0644);
     rc = rpmReadPackageHeader(fdi, &hd, &isSource, NULL, NULL);
     if ( rc ) {
@@ -111,18 +486,14 @@ static size_t RPMCopy(install_info *info, const char *path, const char *dest, co
     size = 0;
     if ( rpm_access && ! force_manual ) { /* We can call RPM directly */
         char cmd[300];
-        FILE *fp;
-        float percent = 0.0;
-		double bytes_copied = 0.0;
-		double previous_bytes = 0.0;
+        int out[2];
+        pid_t child;
+        rpm_progress prog;
         char *name = "", *version = "", *release = "";
 		char *options = (char *) malloc(PATH_MAX);
 		options[0] = '\0';
 
-        headerGetEntry(hd, RPMTAG_SIZE, &type, &p, &c);
-        if(type==RPM_INT32_TYPE){
-			size = *(int_32*) p;
-        }
+        size = rpm_size(hd);
         headerGetEntry(hd, RPMTAG_RELEASE, &type, &p, &c);
         if(type==RPM_STRING_TYPE){
 			release = (char *) p;
@@ -148,38 +519,37 @@ static size_t RPMCopy(install_info *info, const char *path, const char *dest, co
 		snprintf(cmd,sizeof(cmd),"rpm -U --percent --root %s %s %s", rpm_root,
 				 options, path);
 
-		fp = popen(cmd, "r");
-		while ( percent < 100.0 ) {
-			if(!fp || feof(fp)){
-				pclose(fp);
-				free(options);
-				log_warning(_("Unable to install RPM file: '%s'"), path);
-				return 0;
+		/* Like popen(), but the progress is read as it comes while the UI is kept alive */
+		memset(&prog, 0, sizeof(prog));
+		prog.info = info;
+		prog.path = path;
+		prog.option = current_option_name;
+		prog.update = update;
+		prog.size = size;
+		child = -1;
+		if ( pipe(out) == 0 ) {
+			child = fork();
+			if ( child == 0 ) {
+				close(out[0]);
+				dup2(out[1], 1);
+				close(out[1]);
+				execl("/bin/sh", "sh", "-c", cmd, NULL);
+				_exit(127);
 			}
-			fscanf(fp,"%s", cmd);
-			if(strcmp(cmd,"%%")){
-				pclose(fp);
-				free(options);
-				log_warning(_("Unable to install RPM file: '%s'"), path);
-				return 0;
+			close(out[1]);
+			if ( child > 0 ) {
+				wait_command(info, child, out[0], rpm_output, &prog);
 			}
-			fscanf(fp,"%f", &percent);
-			/* calculate the bytes installed in this pass of the loop */
-			bytes_copied = (percent/100.0)*size - previous_bytes;
-			previous_bytes += bytes_copied;
-			info->installed_bytes += bytes_copied;
-			if ( ! update(info, path, (percent/100.0)*size, size, current_option_name) )
-				break;
+			close(out[0]);
 		}
-		pclose(fp);
 		free (options);
+		if ( (child <= 0) || prog.error || (!prog.aborted && (prog.percent < 100.0)) ) {
+			log_warning(_("Unable to install RPM file: '%s'"), path);
+			return 0;
+		}
 		/* Log the RPM installation */
 		add_rpm_entry(info, current_option, name, version, atoi(release), autoremove);
     } else { /* Manually install the RPM file */
-        gzFile gzdi = NULL;
-		BZFILE *bzdi = NULL;
-		FILE *fd = NULL;
-		unsigned char magic[2];
         stream *cpio;
     
         if(headerIsEntry(hd, RPMTAG_PREIN)){      
@@ -188,20 +558,14 @@ static size_t RPMCopy(install_info *info, const char *path, const char *dest, co
 				run_script(info, (char*)p, 1, 1);
         }
 
-		/* Identify the type of compression for the archive */
-		if ( fdRead(fdi, magic, 2) < 2 ) {
+		/* The payload follows the header, it is decompressed by the stream layer
+		   ahead of the extraction. The stream gets its own descriptor, since it
+		   is closed before fdi */
+        cpio = file_open_fd(info, path, dup(fdFileno(fdi)), rpm_payload_format(hd));
+		if ( ! cpio ) {
+			fdClose(fdi);
 			return 0;
 		}
-		lseek(fdFileno(fdi), -2L, SEEK_CUR); 
-		if ( magic[0]==037 && magic[1]==0213 ) {
-			gzdi = gzdopen(fdFileno(fdi), "r");    /* XXX gzdi == fdi */
-		} else if ( magic[0]=='B' && magic[1]=='Z' ) {
-			bzdi = BZDOPEN(fdFileno(fdi), "r");
-		} else { /* Assume not compressed */
-			fd = fdopen(fdFileno(fdi), "r");
-		}
-		
-        cpio = file_fdopen(info, path, fd, gzdi, bzdi, "r");
 
         /* if relocate="true", copy the files into dest instead of rpm_root */
 		if (relocate) {
@@ -242,7 +606,12 @@ SetupPlugin rpm_plugin = {
 	"Stphane Peter <megastep@megastep.org>",
 	3, {".rpm", ".rpm.gz", "rpm.bz2"},
 	RPMInitPlugin, RPMFreePlugin,
-	RPMSize, RPMCopy
+	RPMSize, RPMCopy,
+#ifdef HAVE_RPMTS
+	RPMFlush
+#else
+	NULL
+#endif
 };
 
 #ifdef DYNAMIC_PLUGINS
@@ -25,7 +25,7 @@ static int FreePlugin(void)
 }
 
 /* Get the size of the file */
-static size_t Size(install_info *info, const char *path)
+static off_t Size(install_info *info, const char *path)
 {
 	/* TODO: Return the size of the uncompressed file */
 	return 0;
@@ -14,9 +14,42 @@
 # include <strings.h>
 #endif
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#ifndef makedev
+#define makedev(ma, mi) (((ma) << 8) | (mi))
+#endif
+
+/* Member data is handed to the output file in chunks of this size */
+#define TAR_CHUNK	(256*1024)
+/* Largest GNU long name or pax header we accept */
+#define TAR_META_MAX	(1024*1024)
+/* Files extracted so far, hashed by path, for the hard links to them */
+#define TAR_FILE_BUCKETS	1024
+
+#define tar_padded(size)	(((size) + RECORDSIZE - 1) & ~(unsigned long long)(RECORDSIZE - 1))
+
+typedef struct _tar_file {
+	char *path;
+	unsigned char md5sum[16];
+	struct _tar_file *next;
+} tar_file;
+
+/* The state of an archive while it is extracted */
+typedef struct {
+	/* Overrides for the next member, from GNU or pax headers */
+	char *name, *linkname;
+	unsigned long long size;
+	int has_size;
+	unsigned char *chunk;	/* For the streams that can't be read in place */
+	tar_file *files[TAR_FILE_BUCKETS];
+} tar_archive;
+
 /* Initialize the plugin */
 static int TarInitPlugin(void)
 {
@@ -30,30 +63,304 @@ static int TarFreePlugin(void)
 }
 
 /* Get the size of the file */
-static size_t TarSize(install_info *info, const char *path)
+static off_t TarSize(install_info *info, const char *path)
 {
 	/* This is a rough estimate, the headers are quite small */
 	log_debug("TAR: Size(%s)", path);
 	return file_size(info, path) - sizeof(tar_record);
 }
 
+/* Numeric fields are in octal, or in base-256 when the high bit is set (GNU, star) */
+static unsigned long long tar_number(const char *field, int len)
+{
+	const unsigned char *p = (const unsigned char *) field;
+	unsigned long long value = 0;
+
+	if ( *p & 0x80 ) {
+		if ( *p & 0x40 ) { /* Negative, only ever used for times */
+			return 0;
+		}
+		value = *p++ & 0x3f;
+		while ( --len > 0 ) {
+			value = (value << 8) | *p++;
+		}
+		return value;
+	}
+	while ( (len > 0) && ((*p == ' ') || (*p == '\0')) ) {
+		++ p;
+		-- len;
+	}
+	while ( (len > 0) && (*p >= '0') && (*p <= '7') ) {
+		value = (value << 3) | (*p++ - '0');
+		-- len;
+	}
+	return value;
+}
+
+/* The checksum is the sum of the bytes of the header, with spaces in place of
+   the checksum field. Some old archivers summed signed chars. */
+static int tar_checksum_ok(const tar_record *record)
+{
+	const int start = record->hdr.chksum - record->data;
+	const int end = start + sizeof(record->hdr.chksum);
+	unsigned long long chksum;
+	unsigned long sum = 0;
+	long ssum = 0;
+	int i;
+
+	for ( i = 0; i < RECORDSIZE; ++i ) {
+		if ( (i >= start) && (i < end) ) {
+			sum += ' ';
+			ssum += ' ';
+		} else {
+			sum += (unsigned char) record->data[i];
+			ssum += (signed char) record->data[i];
+		}
+	}
+	chksum = tar_number(record->hdr.chksum, sizeof(record->hdr.chksum));
+	return (chksum == sum) || ((long long) chksum == ssum);
+}
+
+/* Skip member data, this seeks when the archive is not compressed */
+static void tar_skip(install_info *info, stream *input, unsigned long long len)
+{
+	int count;
+
+	while ( len > 0 ) {
+		count = (len > (1 << 30)) ? (1 << 30) : (int) len;
+		file_skip(info, count, input);
+		len -= count;
+	}
+}
+
+/* Read the data of a GNU long name or a pax header, NULL if it is truncated */
+static char *tar_read_meta(install_info *info, stream *input, unsigned long long size)
+{
+	char *data;
+
+	if ( size > TAR_META_MAX ) {
+		log_fatal(_("Unexpected data in installation file!"));
+	}
+	data = (char *) malloc(size + 1);
+	if ( data == NULL ) {
+		log_fatal(_("Out of memory"));
+	}
+	if ( file_read(info, data, (int) size, input) != (int) size ) {
+		free(data);
+		return NULL;
+	}
+	data[size] = '\0';
+	tar_skip(info, input, tar_padded(size) - size);
+	return data;
+}
+
+/* Keep the attributes of a pax header that matter to us.
+   The records are "<length> <keyword>=<value>\n" */
+static void tar_pax(tar_archive *tar, char *data, unsigned long long size)
+{
+	char *rec, *key, *value, *next, *end = data + size;
+	unsigned long len;
+
+	for ( rec = data; rec < end; rec = next ) {
+		len = strtoul(rec, &key, 10);
+		/* The length counts itself, the space and at least the newline */
+		if ( (*key != ' ') || (len <= (unsigned long)(key - rec) + 1) ||
+			 (len > (unsigned long)(end - rec)) ) {
+			break;
+		}
+		next = rec + len;
+		++ key;
+		value = memchr(key, '=', next - key);
+		if ( !value || (next[-1] != '\n') ) {
+			continue;
+		}
+		*value++ = '\0';
+		next[-1] = '\0';
+		if ( !strcmp(key, "path") ) {
+			free(tar->name);
+			tar->name = strdup(value);
+		} else if ( !strcmp(key, "linkpath") ) {
+			free(tar->linkname);
+			tar->linkname = strdup(value);
+		} else if ( !strcmp(key, "size") ) {
+			tar->size = strtoull(value, NULL, 10);
+			tar->has_size = 1;
+		}
+	}
+}
+
+/* The paths of a member, from the long names read before it if there were any */
+static void tar_member_names(tar_archive *tar, const tar_record *record, const char *dest,
+							 char *final, char *linkname)
+{
+	if ( tar->name ) {
+		snprintf(final, PATH_MAX, "%s/%s", dest, tar->name);
+	} else if ( !memcmp(record->hdr.magic, TMAGIC, sizeof(TMAGIC)) && record->hdr.prefix[0] ) {
+		snprintf(final, PATH_MAX, "%s/%.*s/%.*s", dest, (int) sizeof(record->hdr.prefix),
+				 record->hdr.prefix, NAMSIZ, record->hdr.name);
+	} else {
+		snprintf(final, PATH_MAX, "%s/%.*s", dest, NAMSIZ, record->hdr.name);
+	}
+	if ( tar->linkname ) {
+		snprintf(linkname, PATH_MAX, "%s", tar->linkname);
+	} else {
+		snprintf(linkname, PATH_MAX, "%.*s", NAMSIZ, record->hdr.linkname);
+	}
+	free(tar->name);
+	free(tar->linkname);
+	tar->name = tar->linkname = NULL;
+	tar->has_size = 0;
+}
+
+static unsigned int tar_hash(const char *path)
+{
+	unsigned int hash = 5381;
+
+	while ( *path ) {
+		hash = hash * 33 + (unsigned char)*path++;
+	}
+	return hash % TAR_FILE_BUCKETS;
+}
+
+static void tar_add_file(tar_archive *tar, const char *path, const unsigned char *md5sum)
+{
+	tar_file *file;
+	unsigned int hash;
+
+	file = (tar_file *) malloc(sizeof(tar_file));
+	if ( file == NULL ) {
+		log_fatal(_("Out of memory"));
+	}
+	file->path = strdup(path);
+	memcpy(file->md5sum, md5sum, 16);
+	hash = tar_hash(path);
+	file->next = tar->files[hash];
+	tar->files[hash] = file;
+}
+
+static tar_file *tar_find_file(tar_archive *tar, const char *path)
+{
+	tar_file *file;
+
+	for ( file = tar->files[tar_hash(path)]; file; file = file->next ) {
+		if ( !strcmp(path, file->path) ) {
+			return file;
+		}
+	}
+	return NULL;
+}
+
+static void tar_free(tar_archive *tar)
+{
+	tar_file *next;
+	int i;
+
+	for ( i = 0; i < TAR_FILE_BUCKETS; ++i ) {
+		while ( tar->files[i] ) {
+			next = tar->files[i]->next;
+			free(tar->files[i]->path);
+			free(tar->files[i]);
+			tar->files[i] = next;
+		}
+	}
+	free(tar->name);
+	free(tar->linkname);
+	free(tar->chunk);
+}
+
+static unsigned char *tar_chunk(tar_archive *tar)
+{
+	if ( !tar->chunk ) {
+		tar->chunk = (unsigned char *) malloc(TAR_CHUNK);
+		if ( tar->chunk == NULL ) {
+			log_fatal(_("Out of memory"));
+		}
+	}
+	return tar->chunk;
+}
+
+/* Write the data of a member to its output file. When the input allows it, the
+   data goes straight from the buffer of the input stream to the output.
+   Returns 0 if the install was aborted, '*done' is how much of the data was read. */
+static int tar_write(install_info *info, tar_archive *tar, stream *input, stream *output,
+					 unsigned long long len, unsigned long long *done,
+					 const char *final, const char *current_option, UIUpdateFunc update)
+{
+	const void *data;
+	int want, count;
+
+	*done = 0;
+	while ( *done < len ) {
+		want = ((len - *done) > TAR_CHUNK) ? TAR_CHUNK : (int)(len - *done);
+		count = file_read_buffer(info, &data, want, input);
+		if ( count < 0 ) {
+			data = tar_chunk(tar);
+			count = file_read(info, tar->chunk, want, input);
+		}
+		if ( count <= 0 ) {
+			break;
+		}
+		info->installed_bytes += file_write(info, (void *) data, count, output);
+		*done += count;
+
+		if ( update ) {
+			if ( ! update(info, final, *done, len, current_option) )
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/* Copy a file that was installed already, for hard links that can't be made */
+static void tar_copy_file(install_info *info, tar_archive *tar, const char *target, const char *final,
+						  const char *open_mode, unsigned int mode)
+{
+	stream *output;
+	struct file_elem *elem;
+	ssize_t count;
+	int fd;
+
+	/* Not with file_open(), the file would be decompressed if it looks compressed */
+	fd = open(target, O_RDONLY);
+	if ( fd < 0 ) {
+		log_warning(_("Tar: can't link '%s' to '%s': %s"), final, target, strerror(errno));
+		return;
+	}
+	output = file_open_install(info, final, open_mode);
+	if ( output ) {
+		while ( (count = read(fd, tar_chunk(tar), TAR_CHUNK)) > 0 ) {
+			file_write(info, tar->chunk, count, output);
+		}
+		elem = output->elem;
+		file_close(info, output);
+		tar_add_file(tar, final, elem->md5sum);
+		file_chmod(info, final, mode);
+	}
+	close(fd);
+}
+
 /* Extract the file */
-static size_t TarCopy(install_info *info, const char *path, const char *dest, const char *current_option, 
+static size_t TarCopy(install_info *info, const char *path, const char *dest, const char *current_option,
 		      xmlNodePtr node,
 		      UIUpdateFunc update)
 {
     static tar_record zeroes;
     tar_record record;
-    char final[PATH_MAX];
+    tar_archive tar;
+    tar_file *file;
+    char final[PATH_MAX], linkname[PATH_MAX], target[PATH_MAX];
+    char *meta;
     stream *input, *output;
-    size_t size, copied;
-    size_t this_size;
+    struct file_elem *elem;
+    size_t size;
+    unsigned long long left, done;
     unsigned int mode, user_mode = 0;
-    int blocks, left, length;
+    int aborted = 0;
     /* Optional MD5 sum can be specified in the XML file */
     const char *md5 = (char *)xmlGetProp(node, BAD_CAST "md5sum");
     const char *mut = (char *)xmlGetProp(node, BAD_CAST "mutable");
     const char *mode_str = (char *)xmlGetProp(node, BAD_CAST "mode");
+    const char *open_mode = (mut && *mut=='y') ? "wm" : "wb";
 
 	if ( mode_str ) {
 		user_mode = (unsigned int) strtol(mode_str, NULL, 8);
@@ -66,8 +373,11 @@ static size_t TarCopy(install_info *info, const char *path, const char *dest, co
     if ( input == NULL ) {
         return(-1);
     }
-    while ( ! file_eof(info, input) ) {
-        int cur_size;
+    memset(&tar, 0, sizeof(tar));
+    while ( !aborted && ! file_eof(info, input) ) {
+		if ( restoring_corrupt() && !corrupt_files_left() ) {
+			break; /* The rest of the archive is not needed */
+		}
         if ( file_read(info, &record, (sizeof record), input)
                                             != (sizeof record) ) {
             break;
@@ -75,58 +385,94 @@ static size_t TarCopy(install_info *info, const char *path, const char *dest, co
         if ( memcmp(&record, &zeroes, (sizeof record)) == 0 ) {
             continue;
         }
-        snprintf(final, sizeof(final), "%s/%s", dest, record.hdr.name);
+		if ( ! tar_checksum_ok(&record) ) {
+			log_warning(_("Tar: bad header checksum in '%s'"), path);
+			log_fatal(_("Unexpected data in installation file!"));
+		}
+		left = tar_number(record.hdr.size, sizeof(record.hdr.size));
+
+		/* Headers that only describe the next member */
+		if ( (record.hdr.typeflag == TF_GNU_LONGNAME) || (record.hdr.typeflag == TF_GNU_LONGLINK) ||
+			 (record.hdr.typeflag == TF_PAX_HEADER) || (record.hdr.typeflag == TF_PAX_GLOBAL) ) {
+			meta = tar_read_meta(info, input, left);
+			if ( meta == NULL ) {
+				break;
+			}
+			switch (record.hdr.typeflag) {
+				case TF_GNU_LONGNAME:
+					free(tar.name);
+					tar.name = meta;
+					break;
+				case TF_GNU_LONGLINK:
+					free(tar.linkname);
+					tar.linkname = meta;
+					break;
+				case TF_PAX_HEADER:
+					tar_pax(&tar, meta, left);
+					free(meta);
+					break;
+				default:
+					/* The global attributes are only defaults we don't use */
+					free(meta);
+					break;
+			}
+			continue;
+		}
 
-        sscanf(record.hdr.mode, "%o", &mode);
-        sscanf(record.hdr.size, "%o", &left);
-        cur_size = left;
-        blocks = (left+RECORDSIZE-1)/RECORDSIZE;
+		if ( tar.has_size ) {
+			left = tar.size;
+		}
+		tar_member_names(&tar, &record, dest, final, linkname);
+		mode = (unsigned int) tar_number(record.hdr.mode, sizeof(record.hdr.mode)) & 07777;
+		done = 0;
         switch (record.hdr.typeflag) {
             case TF_OLDNORMAL:
             case TF_NORMAL:
+            case TF_CONTIG:
+				if ( final[strlen(final)-1] == '/' ) {
+					/* Old archivers marked the directories this way */
+					if ( !restoring_corrupt() ) {
+						dir_create_hierarchy(info, final, mode);
+					}
+					break;
+				}
 				if ( restoring_corrupt() && !file_is_corrupt(info->product, final) ) {
-					file_skip(info, left, input);
-				} else {
-					this_size = 0;
-					output = file_open_install(info, final, (mut && *mut=='y') ? "wm" : "wb");
-					if ( output ) {
-						while ( blocks-- > 0 ) {
-							if ( file_read(info, &record, (sizeof record), input)
-								 != (sizeof record) ) {
-								break;
-							}
-							if ( left < (sizeof record) ) {
-								length = left;
-							} else {
-								length = (sizeof record);
-							}
-							copied = file_write(info, &record, length, output);
-							info->installed_bytes += copied;
-							size += copied;
-							left -= copied;
-							this_size += copied;
-
-							if ( update ) {
-								if ( ! update(info, final, this_size, cur_size, current_option) )
-									break;
-							}
-						}
-						file_close(info, output);
-						if ( md5 ) { /* Verify the output file */
-							char sum[CHECKSUM_SIZE+1];
-							
-							strcpy(sum, get_md5(output->md5.buf));
-							if ( strcasecmp(md5, sum) ) {
-								log_fatal(_("File '%s' has an invalid checksum! Aborting."), final);
-							}
+					break;
+				}
+				output = file_open_install(info, final, open_mode);
+				if ( output ) {
+					aborted = !tar_write(info, &tar, input, output, left, &done,
+										 final, current_option, update);
+					elem = output->elem;
+					file_close(info, output);
+					tar_add_file(&tar, final, elem->md5sum);
+					if ( md5 ) { /* Verify the output file */
+						char sum[CHECKSUM_SIZE+1];
+
+						strcpy(sum, get_md5(elem->md5sum));
+						if ( strcasecmp(md5, sum) ) {
+							log_fatal(_("File '%s' has an invalid checksum! Aborting."), final);
 						}
-						file_chmod(info, final, user_mode ? user_mode : mode);
 					}
+					file_chmod(info, final, user_mode ? user_mode : mode);
+				}
+                break;
+            case TF_LINK:
+				if ( restoring_corrupt() && !file_is_corrupt(info->product, final) ) {
+					break;
+				}
+				snprintf(target, sizeof(target), "%s/%s", dest, linkname);
+				/* Mutable files are copied, a change to one would show in the other */
+				file = tar_find_file(&tar, target);
+				if ( file && !(mut && *mut=='y') && (file_link(info, target, final, file->md5sum) == 0) ) {
+					tar_add_file(&tar, final, file->md5sum);
+				} else {
+					tar_copy_file(info, &tar, target, final, open_mode, user_mode ? user_mode : mode);
 				}
                 break;
             case TF_SYMLINK:
 				if ( !restoring_corrupt() ) {
-					file_symlink(info, record.hdr.linkname, final);
+					file_symlink(info, linkname, final);
 				}
                 break;
             case TF_DIR:
@@ -134,18 +480,30 @@ static size_t TarCopy(install_info *info, const char *path, const char *dest, co
 					dir_create_hierarchy(info, final, mode);
 				}
                 break;
+            case TF_FIFO:
+				if ( !restoring_corrupt() ) {
+					file_mkfifo(info, final, mode);
+				}
+                break;
+            case TF_CHR:
+            case TF_BLK:
+				if ( !restoring_corrupt() ) {
+					file_mknod(info, final, ((record.hdr.typeflag == TF_CHR) ? S_IFCHR : S_IFBLK) | mode,
+							   makedev(tar_number(record.hdr.devmajor, sizeof(record.hdr.devmajor)),
+									   tar_number(record.hdr.devminor, sizeof(record.hdr.devminor))));
+				}
+                break;
             default:
                 log_warning(_("Tar: '%s' is unknown file type: %c"),
-                            record.hdr.name, record.hdr.typeflag);
-                log_fatal(_("Unexpected data in installation file!"));
+                            final, record.hdr.typeflag);
                 break;
         }
-        while ( blocks-- > 0 ) {
-            file_read(info, &record, (sizeof record), input);
-        }
+		/* Whatever was not extracted is skipped, with the padding */
+		tar_skip(info, input, tar_padded(left) - done);
         size += left;
     }
     file_close(info, input);
+    tar_free(&tar);
 
     return size;
 }
@@ -159,7 +517,7 @@ SetupPlugin tar_plugin = {
 	"Unix TAR Archives Plugin",
 	"1.0",
 	"Stphane Peter <megastep@megastep.org>",
-	4, {".tar", ".tar.gz", ".tar.Z", ".tar.bz2"},
+	7, {".tar", ".tar.gz", ".tar.Z", ".tar.bz2", ".tar.xz", ".tar.zst", ".tar.lz4"},
 	TarInitPlugin, TarFreePlugin,
 	TarSize, TarCopy
 };
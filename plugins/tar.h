@@ -44,6 +44,13 @@ typedef union {
 #define  TF_DIR       '5'        /* Directory */
 #define  TF_FIFO      '6'        /* FIFO special file */
 #define  TF_CONTIG    '7'        /* Contiguous file */
+#define  TF_PAX_GLOBAL 'g'       /* POSIX: attributes for all the members that follow */
+#define  TF_PAX_HEADER 'x'       /* POSIX: attributes for the next member */
+#define  TF_GNU_LONGLINK 'K'     /* GNU: link name of the next member */
+#define  TF_GNU_LONGNAME 'L'     /* GNU: name of the next member */
+
+/* The magic of POSIX archives, where the name may be split with the prefix field */
+#define  TMAGIC      "ustar"
 
 extern size_t unpack_tarball(FILE *tarfile);
 
@@ -1,6 +1,8 @@
 /* UnrealEngine2-compressed files (.uz2) plugin for setup */
 /* $Id: uz2.c,v 1.8 2005-08-23 00:48:00 megastep Exp $ */
 
+#include "config.h"
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -8,12 +10,18 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
 #include "plugins.h"
 #include "file.h"
 #include "install_log.h"
+#include "copy.h"
 
 typedef unsigned char uint8;
 typedef unsigned int uint32;
@@ -21,6 +29,53 @@ typedef unsigned int uint32;
 #define MAXUNCOMPSIZE	32768
 #define MAXCOMPSIZE		33096		// 32768 + 1%
 
+/* Chunks inflated ahead of the one being written, per worker thread */
+#define UZ2_WINDOW		4
+
+/*
+ * A .uz2 file is a sequence of chunks, each one a 32-bit compressed size,
+ *  a 32-bit uncompressed size and an independent zlib stream. The whole
+ *  table is read before anything is extracted, so that the chunks can be
+ *  inflated by several threads at once, and written in order. The file is
+ *  read with pread() rather than mapped: it is usually on the install media,
+ *  where a read error would be a SIGBUS instead of EIO.
+ */
+typedef struct {
+    off_t offset;          /* of the compressed data */
+    uint32 csize;
+    uint32 usize;
+} uz2_chunk;
+
+typedef struct {
+    int fd;
+    off_t size;
+    uint32 count;
+    uz2_chunk *chunks;
+    off_t total;           /* uncompressed size */
+} uz2_file;
+
+/* A chunk being inflated or waiting to be written */
+typedef struct {
+    uint8 cbuf[MAXCOMPSIZE];
+    uint8 ubuf[MAXUNCOMPSIZE];
+    int ready, ok;
+} uz2_slot;
+
+typedef struct {
+    uz2_file *file;
+    uz2_slot *slots;
+    uint32 nslots;
+    uint32 next;           /* next chunk to inflate */
+    uint32 written;        /* chunks written so far */
+    int nthreads;
+#ifdef HAVE_PTHREAD_H
+    int quit;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    pthread_t threads[COPY_WORKERS_MAX];
+#endif
+} uz2_pool;
+
 /* Initialize the plugin */
 static int UZ2InitPlugin(void)
 {
@@ -37,58 +92,290 @@ static int UZ2FreePlugin(void)
 
 
 /*
- * Read an unsigned 32-bit int and swap to native byte order.
+ * Little-endian 32-bit int, to native byte order.
  */
-static int readui32(install_info *info, stream *in, uint32 *val)
+static uint32 uz2_ui32(const uint8 *p)
 {
-    uint32 v;
-    if (file_read(info, &v, sizeof (v), in) != sizeof (v))
+    return(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32) p[3] << 24));
+} /* uz2_ui32 */
+
+
+/*
+ * Read 'len' bytes at 'ofs' into 'buf'. This may run in any thread.
+ */
+static const uint8 *uz2_data(uz2_file *file, off_t ofs, size_t len, uint8 *buf)
+{
+    size_t done = 0;
+    ssize_t br;
+
+    while (done < len)
     {
-        log_debug("UZ2: read failure!");
+        br = pread(file->fd, buf + done, len - done, ofs + done);
+        if ((br < 0) && (errno == EINTR))
+            continue;
+        if (br <= 0)
+            return NULL;
+        done += br;
+    }
+    return buf;
+}
+
+
+static void uz2_close(uz2_file *file)
+{
+    if (file->fd >= 0)
+        close(file->fd);
+    free(file->chunks);
+    file->fd = -1;
+    file->chunks = NULL;
+}
+
+
+/*
+ * Open a .uz2 file and read its table of chunks.
+ */
+static int uz2_open(const char *path, uz2_file *file)
+{
+    struct stat st;
+    uint8 hdr[8];
+    const uint8 *p;
+    uz2_chunk *chunk;
+    uint32 max = 0;
+    off_t pos = 0;
+
+    memset(file, '\0', sizeof (uz2_file));
+    file->fd = open(path, O_RDONLY);
+    if (file->fd < 0)
+    {
+        log_debug("UZ2: can't open %s: %s", path, strerror(errno));
+        return 0;
+    }
+    if (fstat(file->fd, &st) < 0)
+    {
+        log_debug("UZ2: can't stat %s: %s", path, strerror(errno));
+        uz2_close(file);
         return 0;
     }
+    file->size = st.st_size;
 
-#if BYTE_ORDER == BIG_ENDIAN
-	*val = ((v<<24)|((v<<8)&0x00FF0000)|((v>>8)&0x0000FF00)|(v>>24));
-#else
-    *val = v;
+    while (pos < file->size)
+    {
+        if ( (file->size - pos < 8) || ((p = uz2_data(file, pos, 8, hdr)) == NULL) )
+        {
+            log_debug("UZ2: read failure in %s!", path);
+            uz2_close(file);
+            return 0;
+        }
+
+        if (file->count == max)
+        {
+            max = max ? max * 2 : 256;
+            chunk = (uz2_chunk *) realloc(file->chunks, max * sizeof (uz2_chunk));
+            if (chunk == NULL)
+            {
+                log_fatal(_("Out of memory"));
+                uz2_close(file);
+                return 0;
+            }
+            file->chunks = chunk;
+        }
+
+        chunk = &file->chunks[file->count];
+        chunk->csize = uz2_ui32(p);
+        chunk->usize = uz2_ui32(p + 4);
+        chunk->offset = pos + 8;
+        if ( (chunk->csize > MAXCOMPSIZE) || (chunk->usize > MAXUNCOMPSIZE) ||
+             (chunk->csize > file->size - chunk->offset) )
+        {
+            log_debug("UZ2: %s is bogus!", path);
+            uz2_close(file);
+            return 0;
+        }
+
+        file->total += chunk->usize;
+        file->count++;
+        pos = chunk->offset + chunk->csize;
+    }
+
+    return 1;
+}
+
+
+/* This may run in any thread */
+static int uz2_inflate(uz2_file *file, uz2_chunk *chunk, uz2_slot *slot)
+{
+    const uint8 *data;
+    uLongf x = chunk->usize;
+
+    data = uz2_data(file, chunk->offset, chunk->csize, slot->cbuf);
+    if (data == NULL)
+        return 0;
+
+    return (uncompress(slot->ubuf, &x, data, chunk->csize) == Z_OK) && (x == chunk->usize);
+}
+
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * Inflate the chunks in order, staying at most a window of slots ahead of
+ *  the one being written.
+ */
+static void *uz2_worker(void *data)
+{
+    uz2_pool *pool = (uz2_pool *) data;
+    uz2_slot *slot;
+    uint32 i;
+    int ok;
+
+    pthread_mutex_lock(&pool->lock);
+    for ( ;; )
+    {
+        while ( !pool->quit && (pool->next < pool->file->count) &&
+                (pool->next - pool->written >= pool->nslots) )
+            pthread_cond_wait(&pool->work, &pool->lock);
+
+        if (pool->quit || (pool->next >= pool->file->count))
+            break;
+
+        i = pool->next++;
+        slot = &pool->slots[i % pool->nslots];
+        pthread_mutex_unlock(&pool->lock);
+        ok = uz2_inflate(pool->file, &pool->file->chunks[i], slot);
+        pthread_mutex_lock(&pool->lock);
+        slot->ok = ok;
+        slot->ready = 1;
+        pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
 #endif
-    return(1);
-} /* readui32 */
 
 
-/* Get the size of the file */
-static size_t UZ2Size(install_info *info, const char *path)
+static int uz2_pool_start(uz2_pool *pool, uz2_file *file)
 {
-    uint32 csize;  /* compressed size */
-    uint32 usize;  /* uncompressed size */
-    size_t retval = 0;
-    size_t insize = 0;
-    stream *in;
+    uint32 i;
+    int n = 1;
 
-    if ((in = file_open(info, path, "rb")) == NULL)
-        return -1;
+    memset(pool, '\0', sizeof (uz2_pool));
+    pool->file = file;
 
-    while (insize < in->size)
+#ifdef HAVE_PTHREAD_H
+    if ((copy_workers > 1) && (file->count > 1))
+        n = (copy_workers < COPY_WORKERS_MAX) ? copy_workers : COPY_WORKERS_MAX;
+#endif
+    pool->nslots = n * UZ2_WINDOW;
+    pool->slots = (uz2_slot *) calloc(pool->nslots, sizeof (uz2_slot));
+    if (pool->slots == NULL)
     {
-        if (
-             (!readui32(info, in, &csize)) ||
-             (!readui32(info, in, &usize)) ||
-             (csize > MAXCOMPSIZE) ||
-             (usize > MAXUNCOMPSIZE)
-           )
+        log_fatal(_("Out of memory"));
+        return 0;
+    }
+
+#ifdef HAVE_PTHREAD_H
+    if (n > 1)
+    {
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->work, NULL);
+        pthread_cond_init(&pool->done, NULL);
+        for (i = 0; i < (uint32) n; i++)
         {
-            retval = -1;
-            break;
+            if (pthread_create(&pool->threads[i], NULL, uz2_worker, pool) != 0)
+                break;
+        }
+        pool->nthreads = i;
+        if (pool->nthreads == 0)
+        {
+            log_debug("UZ2: Unable to start the threads, inflating one chunk at a time");
+            pthread_cond_destroy(&pool->done);
+            pthread_cond_destroy(&pool->work);
+            pthread_mutex_destroy(&pool->lock);
         }
+    }
+#endif
+
+    return 1;
+}
 
-        file_skip(info, csize, in);
 
-        retval += usize;
-        insize += 8 + csize;
+static void uz2_pool_stop(uz2_pool *pool)
+{
+#ifdef HAVE_PTHREAD_H
+    int i;
+
+    if (pool->nthreads > 0)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->quit = 1;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+        for (i = 0; i < pool->nthreads; i++)
+            pthread_join(pool->threads[i], NULL);
+        pthread_cond_destroy(&pool->done);
+        pthread_cond_destroy(&pool->work);
+        pthread_mutex_destroy(&pool->lock);
+        pool->nthreads = 0;
     }
+#endif
 
-    file_close(info, in);
+    free(pool->slots);
+    pool->slots = NULL;
+}
+
+
+/*
+ * Get the next chunk to write, inflated by the workers if there are any.
+ *  Returns NULL if it is corrupt.
+ */
+static uz2_slot *uz2_pool_next(uz2_pool *pool)
+{
+    uint32 i = pool->written;
+    uz2_slot *slot = &pool->slots[i % pool->nslots];
+
+#ifdef HAVE_PTHREAD_H
+    if (pool->nthreads > 0)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (!slot->ready)
+            pthread_cond_wait(&pool->done, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+        return slot->ok ? slot : NULL;
+    }
+#endif
+
+    return uz2_inflate(pool->file, &pool->file->chunks[i], slot) ? slot : NULL;
+}
+
+
+/* The chunk returned by uz2_pool_next() was written, its slot can be reused */
+static void uz2_pool_release(uz2_pool *pool)
+{
+#ifdef HAVE_PTHREAD_H
+    if (pool->nthreads > 0)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->slots[pool->written % pool->nslots].ready = 0;
+        pool->written++;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+#endif
+    pool->written++;
+}
+
+
+/* Get the size of the file */
+static off_t UZ2Size(install_info *info, const char *path)
+{
+    uz2_file file;
+    off_t retval;
+
+    if (!uz2_open(path, &file))
+        return -1;
+
+    retval = file.total;
+    uz2_close(&file);
     return(retval);
 }
 
@@ -97,15 +384,14 @@ static size_t UZ2Copy(install_info *info, const char *path, const char *dest, co
 		      xmlNodePtr node,
 		      UIUpdateFunc update)
 {
-    static uint8 cbuf[MAXCOMPSIZE];
-    static uint8 ubuf[MAXUNCOMPSIZE];
-
-    uint32 csize;  /* compressed size */
-    uint32 usize;  /* uncompressed size */
+    uz2_file file;
+    uz2_pool pool;
+    uz2_slot *slot;
+    uz2_chunk *chunk;
     size_t insize = 0;
     char final[PATH_MAX];
-    stream *in;
     stream *out;
+    struct file_elem *elem;
 	unsigned int user_mode = 0;
 
     /* Optional MD5 sum can be specified in the XML file */
@@ -134,78 +420,76 @@ static size_t UZ2Copy(install_info *info, const char *path, const char *dest, co
         final[strlen(final) - 4] = '\0'; /* chop off ".uz2" */
     }
 
-    if ((in = file_open(info, path, "rb")) == NULL)
+    if (!uz2_open(path, &file))
         return 0;
 
     if ((out = file_open_install(info, final, (mut && *mut=='y') ? "wm" : "wb"))==NULL)
     {
-        file_close(info, in);
+        uz2_close(&file);
         return 0;
     }
 
-    while (insize < in->size)
+    if (!uz2_pool_start(&pool, &file))
     {
-        uLongf x;
-        update(info, final, insize, in->size, current_option);
-
-        if ( (!readui32(info, in, &csize)) || (!readui32(info, in, &usize)) )
-            break;
-
-        if ( (csize > MAXCOMPSIZE) || (usize > MAXUNCOMPSIZE) )
-        {
-            log_debug("UZ2: %s is bogus!", path);
-            break;
-        }
+        uz2_pool_stop(&pool);
+        file_close(info, out);
+        uz2_close(&file);
+        unlink(final);
+        return 0;
+    }
 
-        if (file_read(info, cbuf, csize, in) != csize)
-        {
-            log_debug("UZ2: read failure in %s!", path);
-            break;
-        }
+    while (pool.written < file.count)
+    {
+        update(info, final, insize, file.size, current_option);
 
-        x = usize;
-        if ((uncompress(ubuf, &x, cbuf, csize) != Z_OK) || (x != usize))
+        chunk = &file.chunks[pool.written];
+        slot = uz2_pool_next(&pool);
+        if (slot == NULL)
         {
             log_debug("UZ2: %s is corrupt!", path);
             break;
         }
 
-        if (file_write(info, ubuf, usize, out) != usize)
+        if (file_write(info, slot->ubuf, chunk->usize, out) != chunk->usize)
         {
             log_debug("UZ2: write failure in %s!", final);
             break;
         }
 
-        info->installed_bytes += usize;
-        insize += 8 + csize;
+        info->installed_bytes += chunk->usize;
+        insize += 8 + chunk->csize;
+        uz2_pool_release(&pool);
     }
 
-    update(info, final, insize, in->size, current_option);
+    update(info, final, insize, file.size, current_option);
+
+    uz2_pool_stop(&pool);
 
-    if (insize != in->size)
+    if (insize != file.size)
     {
         log_fatal("UZ2: Failed to fully write [%s]!", final);
         file_close(info, out);
-        file_close(info, in);
+        uz2_close(&file);
         unlink(final);
         return 0;
     }
 
-    file_close(info, in);
+    uz2_close(&file);
+
+    elem = out->elem;
+    file_close(info, out);
 
     if ( user_mode )
         file_chmod(info, final, user_mode);
 
     if ( md5 ) { /* Verify the output file */
         char sum[CHECKSUM_SIZE+1];
-        strcpy(sum, get_md5(out->md5.buf));
+        strcpy(sum, get_md5(elem->md5sum));
         if ( strcasecmp(md5, sum) ) {
             log_fatal(_("File '%s' has an invalid checksum! Aborting."), final);
         }
     }
 
-    file_close(info, out);
-
     return insize;
 }
 
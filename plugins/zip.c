@@ -1,23 +1,32 @@
 /* ZIP plugin for setup */
 /* $Id: zip.c,v 1.13 2005-08-23 00:48:00 megastep Exp $ */
 
+#include "config.h"
 #include "plugins.h"
 #include "file.h"
 #include "install_log.h"
 #include "arch.h"
 #include "md5.h"
+#include "copy.h"
+#include "progress.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <time.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
 /*
  * A lot of this code was cut-and-pasted from my work on PhysicsFS:
  *    http://icculus.org/physfs/
@@ -25,10 +34,9 @@
  */
 
 /*
- * A buffer of ZIP_READBUFSIZE is malloc() at init time, and is free()'d at
- *  deinit time; compressed data is read into this buffer, and then is
- *  decompressed into an alloc'd buffer of ZIP_WRITEBUFSIZE bytes (which is
- *  malloc()'d and free()'d the same way.
+ * Every thread extracting members has its own buffers: compressed data is
+ *  read into one of ZIP_READBUFSIZE bytes, and then is decompressed into one
+ *  of ZIP_WRITEBUFSIZE bytes.
  *
  * Depending on your speed and memory requirements, you should tweak this
  *  value.
@@ -36,6 +44,9 @@
 #define ZIP_READBUFSIZE   (64 * 1024)
 #define ZIP_WRITEBUFSIZE  (512 * 1024)
 
+/* The end-of-central-dir record is at most this far from the end of the file */
+#define ZIP_EOCD_SEARCH   (65535 + 22)
+
 
 
 /* legacy defines from PhysicsFS... */
@@ -56,23 +67,19 @@ typedef long long sint64;
 typedef unsigned long long uint64;
 
 
-static uint8 *zip_buf_in = NULL;
-static uint8 *zip_buf_out = NULL;
-
-
 /*
  * One ZIPentry is kept for each file in an open ZIP archive.
  */
 typedef struct _ZIPentry
 {
     char *name;                         /* Name of file in archive        */
-    uint32 offset;               /* offset of data in archive      */
+    uint64 offset;               /* offset of data in archive      */
     uint16 version;              /* version made by                */
     uint16 version_needed;       /* version needed to extract      */
     uint16 compression_method;   /* compression method             */
     uint32 crc;                  /* crc-32                         */
-    uint32 compressed_size;      /* compressed size                */
-    uint32 uncompressed_size;    /* uncompressed size              */
+    uint64 compressed_size;      /* compressed size                */
+    uint64 uncompressed_size;    /* uncompressed size              */
     sint64 last_mod_time;        /* last file mod time             */
     uint32 external_attr;        /* external attributes            */
 } ZIPentry;
@@ -82,15 +89,42 @@ typedef struct _ZIPentry
  */
 typedef struct
 {
-    uint16 entryCount; /* Number of files in ZIP.                     */
+    uint32 entryCount; /* Number of files in ZIP.                     */
     ZIPentry *entries;        /* info on all files in ZIP.                   */
 } ZIPinfo;
 
+/*
+ * The archive is read with pread(), which several threads can do at the
+ *  same time. It is not mapped in memory: it is usually on the install
+ *  media, where a read error would be a SIGBUS instead of EIO.
+ */
+typedef struct
+{
+    install_info *info;
+    const char *path;
+    int fd;
+    sint64 size;
+} ZIParchive;
+
 
 /* Magic numbers... */
 #define ZIP_LOCAL_FILE_SIG          0x04034b50
 #define ZIP_CENTRAL_DIR_SIG         0x02014b50
 #define ZIP_END_OF_CENTRAL_DIR_SIG  0x06054b50
+#define ZIP64_END_OF_CENTRAL_DIR_SIG 0x06064b50
+#define ZIP64_LOCATOR_SIG           0x07064b50
+#define ZIP64_EXTENDED_INFO_ID      0x0001
+
+/* Sizes of the fixed part of the records */
+#define ZIP_LOCAL_FILE_LEN          30
+#define ZIP_CENTRAL_DIR_LEN         46
+#define ZIP_END_OF_CENTRAL_DIR_LEN  22
+#define ZIP64_END_OF_CENTRAL_DIR_LEN 56
+#define ZIP64_LOCATOR_LEN           20
+
+/* Fields that are too small for Zip64 archives hold this, the real value is elsewhere */
+#define ZIP64_MARK_16               0xFFFF
+#define ZIP64_MARK_32               0xFFFFFFFF
 
 /* compression methods... */
 #define COMPMETH_NONE 0
@@ -131,35 +165,77 @@ static int zlib_err(int rc)
 
 
 /*
- * Read an unsigned 32-bit int and swap to native byte order.
+ * Little-endian integers of the archive, to native byte order.
  */
-static int readui32(FILE *in, uint32 *val)
-{
-    uint32 v;
-    BAIL_IF_MACRO(fread(&v, sizeof (v), 1, in) != 1, NULL, 0);
-#if BYTE_ORDER == BIG_ENDIAN
-	*val = ((v<<24)|((v<<8)&0x00FF0000)|((v>>8)&0x0000FF00)|(v>>24));
-#else
-    *val = v;
-#endif
+static uint16 zip_ui16(const uint8 *p)
+{
+    return((uint16) (p[0] | (p[1] << 8)));
+} /* zip_ui16 */
+
+
+static uint32 zip_ui32(const uint8 *p)
+{
+    return(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32) p[3] << 24));
+} /* zip_ui32 */
+
+
+static uint64 zip_ui64(const uint8 *p)
+{
+    return(zip_ui32(p) | ((uint64) zip_ui32(p + 4) << 32));
+} /* zip_ui64 */
+
+
+static int zip_open_archive(install_info *info, const char *path, ZIParchive *archive)
+{
+    struct stat st;
+
+    memset(archive, '\0', sizeof (ZIParchive));
+    archive->info = info;
+    archive->path = path;
+    archive->fd = open(path, O_RDONLY);
+    BAIL_IF_MACRO(archive->fd < 0, strerror(errno), 0);
+    if (fstat(archive->fd, &st) < 0)
+    {
+        close(archive->fd);
+        BAIL_MACRO(strerror(errno), 0);
+    } /* if */
+    archive->size = st.st_size;
+
     return(1);
-} /* readui32 */
+} /* zip_open_archive */
+
+
+static void zip_close_archive(ZIParchive *archive)
+{
+    if (archive->fd >= 0)
+        close(archive->fd);
+    archive->fd = -1;
+} /* zip_close_archive */
 
 
 /*
- * Read an unsigned 16-bit int and swap to native byte order.
+ * Read 'len' bytes at 'ofs' in the archive into 'buf'.
+ *  Returns NULL if they are not all there.
  */
-static int readui16(FILE *in, uint16 *val)
-{
-    uint16 v;
-    BAIL_IF_MACRO(fread(&v, sizeof (v), 1, in) != 1, NULL, 0);
-#if BYTE_ORDER == BIG_ENDIAN
-    *val = ((v << 8) | (v >> 8));
-#else
-    *val = v;
-#endif
-    return(1);
-} /* readui16 */
+static const uint8 *zip_data(ZIParchive *archive, uint64 ofs, size_t len, uint8 *buf)
+{
+    size_t done = 0;
+    ssize_t br;
+
+    BAIL_IF_MACRO((ofs > (uint64) archive->size) || (len > (uint64) archive->size - ofs),
+                  ERR_CORRUPTED, NULL);
+
+    while (done < len)
+    {
+        br = pread(archive->fd, buf + done, len - done, ofs + done);
+        if ((br < 0) && (errno == EINTR))
+            continue;
+        BAIL_IF_MACRO(br <= 0, NULL, NULL);
+        done += br;
+    } /* while */
+
+    return(buf);
+} /* zip_data */
 
 
 static void zip_free_entries(ZIPentry *entries, uint32 max)
@@ -196,35 +272,49 @@ static void zip_convert_dos_path(ZIPentry *entry, char *path)
 } /* zip_convert_dos_path */
 
 
+/*
+ * Check a size of the local file header against the central directory.
+ *  The Zip64 mark means the size is in an extra field, which we don't read
+ *  again: the central directory has it too.
+ */
+static int zip_local_size_ok(uint32 local, uint64 central)
+{
+    return((local == central) || (local == ZIP64_MARK_32));
+} /* zip_local_size_ok */
+
+
 /*
  * Parse the local file header of an entry, and update entry->offset.
  */
-static int zip_parse_local(FILE *in, ZIPentry *entry)
-{
-    uint32 ui32;
-    uint16 ui16;
-    uint16 fnamelen;
-    uint16 extralen;
-
-    BAIL_IF_MACRO(fseek(in, entry->offset, SEEK_SET) == -1, NULL, 0);
-    BAIL_IF_MACRO(!readui32(in, &ui32), NULL, 0);
-    BAIL_IF_MACRO(ui32 != ZIP_LOCAL_FILE_SIG, ERR_CORRUPTED, 0);
-    BAIL_IF_MACRO(!readui16(in, &ui16), NULL, 0);
-    BAIL_IF_MACRO(ui16 != entry->version_needed, ERR_CORRUPTED, 0);
-    BAIL_IF_MACRO(!readui16(in, &ui16), NULL, 0);  /* general bits. */
-    BAIL_IF_MACRO(!readui16(in, &ui16), NULL, 0);
-    BAIL_IF_MACRO(ui16 != entry->compression_method, ERR_CORRUPTED, 0);
-    BAIL_IF_MACRO(!readui32(in, &ui32), NULL, 0);  /* date/time */
-    BAIL_IF_MACRO(!readui32(in, &ui32), NULL, 0);
-    BAIL_IF_MACRO(ui32 != entry->crc, ERR_CORRUPTED, 0);
-    BAIL_IF_MACRO(!readui32(in, &ui32), NULL, 0);
-    BAIL_IF_MACRO(ui32 != entry->compressed_size, ERR_CORRUPTED, 0);
-    BAIL_IF_MACRO(!readui32(in, &ui32), NULL, 0);
-    BAIL_IF_MACRO(ui32 != entry->uncompressed_size, ERR_CORRUPTED, 0);
-    BAIL_IF_MACRO(!readui16(in, &fnamelen), NULL, 0);
-    BAIL_IF_MACRO(!readui16(in, &extralen), NULL, 0);
-
-    entry->offset += fnamelen + extralen + 30;
+static int zip_parse_local(ZIParchive *archive, ZIPentry *entry)
+{
+    uint8 buf[ZIP_LOCAL_FILE_LEN];
+    const uint8 *hdr;
+    uint16 flags;
+
+    hdr = zip_data(archive, entry->offset, ZIP_LOCAL_FILE_LEN, buf);
+    BAIL_IF_MACRO(hdr == NULL, NULL, 0);
+    BAIL_IF_MACRO(zip_ui32(hdr) != ZIP_LOCAL_FILE_SIG, ERR_CORRUPTED, 0);
+    /*
+     * version needed at 4: it isn't checked, since it is often raised to
+     *  4.5 in the central directory only, once the writer knows the offset
+     *  of the entry takes Zip64.
+     */
+    flags = zip_ui16(hdr + 6);
+    BAIL_IF_MACRO(zip_ui16(hdr + 8) != entry->compression_method, ERR_CORRUPTED, 0);
+    /* date/time at 10. */
+
+    /* With bit 3, crc and sizes are zero here and follow the data instead. */
+    if ((flags & 0x0008) == 0)
+    {
+        BAIL_IF_MACRO(zip_ui32(hdr + 14) != entry->crc, ERR_CORRUPTED, 0);
+        BAIL_IF_MACRO(!zip_local_size_ok(zip_ui32(hdr + 18), entry->compressed_size),
+                      ERR_CORRUPTED, 0);
+        BAIL_IF_MACRO(!zip_local_size_ok(zip_ui32(hdr + 22), entry->uncompressed_size),
+                      ERR_CORRUPTED, 0);
+    } /* if */
+
+    entry->offset += zip_ui16(hdr + 26) + zip_ui16(hdr + 28) + ZIP_LOCAL_FILE_LEN;
     return(1);
 } /* zip_parse_local */
 
@@ -299,207 +389,290 @@ sint64 zip_dos_time_to_unix_time(uint32 dostime)
 } /* zip_dos_time_to_unix_time */
 
 
-static int zip_load_entry(FILE *in, ZIPentry *entry, uint32 ofs_fixup)
+/*
+ * Get the values of the Zip64 extended information extra field. It only
+ *  holds the fields that are marked in the record, in this order.
+ */
+static int zip_load_zip64_extra(const uint8 *extra, uint16 extralen, ZIPentry *entry,
+                                uint64 *offset)
+{
+    const uint8 *end = extra + extralen;
+    const uint8 *p;
+    uint16 id, len;
+
+    while (end - extra >= 4)
+    {
+        id = zip_ui16(extra);
+        len = zip_ui16(extra + 2);
+        extra += 4;
+        BAIL_IF_MACRO(end - extra < len, ERR_CORRUPTED, 0);
+
+        if (id == ZIP64_EXTENDED_INFO_ID)
+        {
+            p = extra;
+            if (entry->uncompressed_size == ZIP64_MARK_32)
+            {
+                BAIL_IF_MACRO(extra + len - p < 8, ERR_CORRUPTED, 0);
+                entry->uncompressed_size = zip_ui64(p);
+                p += 8;
+            } /* if */
+            if (entry->compressed_size == ZIP64_MARK_32)
+            {
+                BAIL_IF_MACRO(extra + len - p < 8, ERR_CORRUPTED, 0);
+                entry->compressed_size = zip_ui64(p);
+                p += 8;
+            } /* if */
+            if (*offset == ZIP64_MARK_32)
+            {
+                BAIL_IF_MACRO(extra + len - p < 8, ERR_CORRUPTED, 0);
+                *offset = zip_ui64(p);
+            } /* if */
+            /* the disk number start is of no use to us. */
+            return(1);
+        } /* if */
+
+        extra += len;
+    } /* while */
+
+    return(1);
+} /* zip_load_zip64_extra */
+
+
+/*
+ * Load a central directory record at 'p', returns where the next one starts.
+ */
+static const uint8 *zip_load_entry(const uint8 *p, const uint8 *end,
+                                   ZIPentry *entry, uint64 ofs_fixup)
 {
     uint16 fnamelen, extralen, commentlen;
-    uint16 ui16;
-    uint32 ui32;
+    uint64 offset;
 
     /* sanity check with central directory signature... */
-    BAIL_IF_MACRO(!readui32(in, &ui32), NULL, 0);
-    BAIL_IF_MACRO(ui32 != ZIP_CENTRAL_DIR_SIG, ERR_CORRUPTED, 0);
+    BAIL_IF_MACRO(end - p < ZIP_CENTRAL_DIR_LEN, ERR_CORRUPTED, NULL);
+    BAIL_IF_MACRO(zip_ui32(p) != ZIP_CENTRAL_DIR_SIG, ERR_CORRUPTED, NULL);
 
     /* Get the pertinent parts of the record... */
-    BAIL_IF_MACRO(!readui16(in, &entry->version), NULL, 0);
-    BAIL_IF_MACRO(!readui16(in, &entry->version_needed), NULL, 0);
-    BAIL_IF_MACRO(!readui16(in, &ui16), NULL, 0);  /* general bits */
-    BAIL_IF_MACRO(!readui16(in, &entry->compression_method), NULL, 0);
-    BAIL_IF_MACRO(!readui32(in, &ui32), NULL, 0);
-    entry->last_mod_time = zip_dos_time_to_unix_time(ui32);
-    BAIL_IF_MACRO(!readui32(in, &entry->crc), NULL, 0);
-    BAIL_IF_MACRO(!readui32(in, &entry->compressed_size), NULL, 0);
-    BAIL_IF_MACRO(!readui32(in, &entry->uncompressed_size), NULL, 0);
-    BAIL_IF_MACRO(!readui16(in, &fnamelen), NULL, 0);
-    BAIL_IF_MACRO(!readui16(in, &extralen), NULL, 0);
-    BAIL_IF_MACRO(!readui16(in, &commentlen), NULL, 0);
-    BAIL_IF_MACRO(!readui16(in, &ui16), NULL, 0);  /* disk number start */
-    BAIL_IF_MACRO(!readui16(in, &ui16), NULL, 0);  /* internal file attribs */
-    BAIL_IF_MACRO(!readui32(in, &entry->external_attr), NULL, 0);
-    BAIL_IF_MACRO(!readui32(in, &entry->offset), NULL, 0);
-    entry->offset += ofs_fixup;
-
+    entry->version = zip_ui16(p + 4);
+    entry->version_needed = zip_ui16(p + 6);
+    /* general bits at 8 */
+    entry->compression_method = zip_ui16(p + 10);
+    entry->last_mod_time = zip_dos_time_to_unix_time(zip_ui32(p + 12));
+    entry->crc = zip_ui32(p + 16);
+    entry->compressed_size = zip_ui32(p + 20);
+    entry->uncompressed_size = zip_ui32(p + 24);
+    fnamelen = zip_ui16(p + 28);
+    extralen = zip_ui16(p + 30);
+    commentlen = zip_ui16(p + 32);
+    /* disk number start at 34, internal file attribs at 36 */
+    entry->external_attr = zip_ui32(p + 38);
+    offset = zip_ui32(p + 42);
+
+    BAIL_IF_MACRO(end - p < ZIP_CENTRAL_DIR_LEN + fnamelen + extralen + commentlen,
+                  ERR_CORRUPTED, NULL);
+
+    /* sizes and offset over 4 gigs are in the extra field... */
+    if ((entry->compressed_size == ZIP64_MARK_32) ||
+        (entry->uncompressed_size == ZIP64_MARK_32) ||
+        (offset == ZIP64_MARK_32))
+    {
+        if (!zip_load_zip64_extra(p + ZIP_CENTRAL_DIR_LEN + fnamelen, extralen, entry, &offset))
+            return(NULL);
+    } /* if */
+    entry->offset = offset + ofs_fixup;
     entry->name = (char *) malloc(fnamelen + 1);
-    BAIL_IF_MACRO(entry->name == NULL, ERR_OUT_OF_MEMORY, 0);
-    if (fread(entry->name, fnamelen, 1, in) != 1)
-        goto zip_load_entry_puked;
-
+    BAIL_IF_MACRO(entry->name == NULL, ERR_OUT_OF_MEMORY, NULL);
+    memcpy(entry->name, p + ZIP_CENTRAL_DIR_LEN, fnamelen);
     entry->name[fnamelen] = '\0';  /* null-terminate the filename. */
     zip_convert_dos_path(entry, entry->name);
 
-        /* seek to the start of the next entry in the central directory... */
-    if (fseek(in, extralen + commentlen, SEEK_CUR) == -1)
-        goto zip_load_entry_puked;
-
-    return(1);  /* success. */
-
-zip_load_entry_puked:
-    free(entry->name);
-    return(0);  /* failure. */
+    /* the next entry in the central directory is after the extra field and comment... */
+    return(p + ZIP_CENTRAL_DIR_LEN + fnamelen + extralen + commentlen);
 } /* zip_load_entry */
 
 
-static int zip_load_entries(FILE *in, ZIPinfo *info,
-                            uint32 data_ofs, uint32 central_ofs)
+static int zip_load_entries(ZIParchive *archive, ZIPinfo *info, uint64 data_ofs,
+                            uint64 central_ofs, uint64 central_len)
 {
     uint32 max = info->entryCount;
     uint32 i;
+    uint8 *buf = NULL;
+    const uint8 *p, *end;
 
-    BAIL_IF_MACRO(fseek(in, central_ofs, SEEK_SET) == -1, NULL, 0);
+    BAIL_IF_MACRO((uint64) (size_t) central_len != central_len, ERR_UNSUPPORTED_ARCHIVE, 0);
+    buf = (uint8 *) malloc(central_len);
+    BAIL_IF_MACRO(buf == NULL, ERR_OUT_OF_MEMORY, 0);
 
-    info->entries = (ZIPentry *) malloc(sizeof (ZIPentry) * max);
-    BAIL_IF_MACRO(info->entries == NULL, ERR_OUT_OF_MEMORY, 0);
+    p = zip_data(archive, central_ofs, central_len, buf);
+    info->entries = (ZIPentry *) calloc(max, sizeof (ZIPentry));
+    if ((p == NULL) || (info->entries == NULL))
+    {
+        free(buf);
+        free(info->entries);
+        info->entries = NULL;
+        BAIL_MACRO(ERR_OUT_OF_MEMORY, 0);
+    } /* if */
+    end = p + central_len;
 
     for (i = 0; i < max; i++)
     {
-        if (!zip_load_entry(in, &info->entries[i], data_ofs))
+        p = zip_load_entry(p, end, &info->entries[i], data_ofs);
+        if (p == NULL)
         {
             zip_free_entries(info->entries, i);
+            info->entries = NULL;
+            free(buf);
             return(0);
         } /* if */
     } /* for */
 
+    free(buf);
     return(1);
 } /* zip_load_entries */
 
 
-static sint64 zip_find_end_of_central_dir(install_info *info,
-                                          const char *path,
-                                          FILE *in,
-                                          sint64 *len)
+static sint64 zip_find_end_of_central_dir(ZIParchive *archive)
 {
-    uint8 buf[256];
-    sint32 i = 0;
-    sint64 filelen;
+    uint8 buf[ZIP_EOCD_SEARCH];
+    const uint8 *data;
     sint64 filepos;
-    sint32 maxread;
-    sint32 totalread = 0;
-    int found = 0;
-    uint32 extra = 0;
-
-    filelen = file_size(info, path);
-    BAIL_IF_MACRO(filelen == -1, NULL, 0);
+    sint32 len, i;
 
     /*
-     * Jump to the end of the file and start reading backwards.
-     *  The last thing in the file is the zipfile comment, which is variable
+     * The last thing in the file is the zipfile comment, which is variable
      *  length, and the field that specifies its size is before it in the
      *  file (argh!)...this means that we need to scan backwards until we
      *  hit the end-of-central-dir signature. We can then sanity check that
      *  the comment was as big as it should be to make sure we're in the
-     *  right place. The comment length field is 16 bits, so we can stop
-     *  searching for that signature after a little more than 64k at most,
-     *  and call it a corrupted zipfile.
+     *  right place. The comment length field is 16 bits, so the signature
+     *  is in the last ZIP_EOCD_SEARCH bytes, which are all read at once.
      */
+    len = (archive->size < ZIP_EOCD_SEARCH) ? (sint32) archive->size : ZIP_EOCD_SEARCH;
+    BAIL_IF_MACRO(len < ZIP_END_OF_CENTRAL_DIR_LEN, ERR_NOT_AN_ARCHIVE, -1);
+    filepos = archive->size - len;
+    data = zip_data(archive, filepos, len, buf);
+    BAIL_IF_MACRO(data == NULL, NULL, -1);
 
-    if (sizeof (buf) < filelen)
-    {
-        filepos = filelen - sizeof (buf);
-        maxread = sizeof (buf);
-    } /* if */
-    else
+    for (i = len - ZIP_END_OF_CENTRAL_DIR_LEN; i >= 0; i--)
     {
-        filepos = 0;
-        maxread = filelen;
-    } /* else */
-
-    while ((totalread < filelen) && (totalread < 65557))
-    {
-        BAIL_IF_MACRO(fseek(in, filepos, SEEK_SET) == -1, NULL, -1);
-
-        /* make sure we catch a signature between buffers. */
-        if (totalread != 0)
+        if ((data[i + 0] == 0x50) &&
+            (data[i + 1] == 0x4B) &&
+            (data[i + 2] == 0x05) &&
+            (data[i + 3] == 0x06) )
         {
-            if (fread(buf, maxread - 4, 1, in) != 1)
-                return(-1);
-            *((uint32 *) (&buf[maxread - 4])) = extra;
-            totalread += maxread - 4;
+            return(filepos + i);  /* that's the signature! */
         } /* if */
-        else
-        {
-            if (fread(buf, maxread, 1, in) != 1)
-                return(-1);
-            totalread += maxread;
-        } /* else */
-
-        extra = *((uint32 *) (&buf[0]));
-
-        for (i = maxread - 4; i > 0; i--)
-        {
-            if ((buf[i + 0] == 0x50) &&
-                (buf[i + 1] == 0x4B) &&
-                (buf[i + 2] == 0x05) &&
-                (buf[i + 3] == 0x06) )
-            {
-                found = 1;  /* that's the signature! */
-                break;  
-            } /* if */
-        } /* for */
-
-        if (found)
-            break;
-
-        filepos -= (maxread - 4);
-    } /* while */
-
-    BAIL_IF_MACRO(!found, ERR_NOT_AN_ARCHIVE, -1);
-
-    if (len != NULL)
-        *len = filelen;
+    } /* for */
 
-    return(filepos + i);
+    BAIL_MACRO(ERR_NOT_AN_ARCHIVE, -1);
 } /* zip_find_end_of_central_dir */
 
 
-static int zip_parse_end_of_central_dir(install_info *info, const char *path,
-                                        FILE *in, ZIPinfo *zipinfo,
-                                        uint32 *data_start,
-                                        uint32 *central_dir_ofs)
+/*
+ * Find the Zip64 end-of-central-dir record, given the position of the
+ *  classic one. Returns -1 if the archive has none.
+ */
+static sint64 zip_find_zip64_end_of_central_dir(ZIParchive *archive, sint64 pos)
+{
+    uint8 buf[ZIP64_LOCATOR_LEN];
+    const uint8 *data;
+    sint64 guess;
+    uint64 ofs;
+
+    /* the locator is right before the end-of-central-dir record. */
+    if (pos < ZIP64_LOCATOR_LEN + ZIP64_END_OF_CENTRAL_DIR_LEN)
+        return(-1);
+    data = zip_data(archive, pos - ZIP64_LOCATOR_LEN, ZIP64_LOCATOR_LEN, buf);
+    if ((data == NULL) || (zip_ui32(data) != ZIP64_LOCATOR_SIG))
+        return(-1);
+
+    /* number of the disk with the Zip64 end-of-central-dir, and of disks */
+    BAIL_IF_MACRO(zip_ui32(data + 4) != 0, ERR_UNSUPPORTED_ARCHIVE, -2);
+    BAIL_IF_MACRO(zip_ui32(data + 16) > 1, ERR_UNSUPPORTED_ARCHIVE, -2);
+
+    /* where the locator says... */
+    ofs = zip_ui64(data + 8);
+    data = zip_data(archive, ofs, 4, buf);
+    if ((data != NULL) && (zip_ui32(data) == ZIP64_END_OF_CENTRAL_DIR_SIG))
+        return((sint64) ofs);
+
+    /* ...or right before it, if there is data prepended to the archive. */
+    guess = pos - ZIP64_LOCATOR_LEN - ZIP64_END_OF_CENTRAL_DIR_LEN;
+    data = zip_data(archive, guess, 4, buf);
+    if ((data != NULL) && (zip_ui32(data) == ZIP64_END_OF_CENTRAL_DIR_SIG))
+        return(guess);
+
+    BAIL_MACRO(ERR_CORRUPTED, -2);
+} /* zip_find_zip64_end_of_central_dir */
+
+
+static int zip_parse_end_of_central_dir(ZIParchive *archive, ZIPinfo *zipinfo,
+                                        uint64 *data_start,
+                                        uint64 *central_dir_ofs,
+                                        uint64 *central_dir_len)
 {
-    uint32 ui32;
-    uint16 ui16;
-    sint64 len;
-    sint64 pos;
+    uint8 buf[ZIP64_END_OF_CENTRAL_DIR_LEN];
+    const uint8 *eocd;
+    sint64 pos, pos64;
+    uint64 entries;
 
-    /* find the end-of-central-dir record, and seek to it. */
-    pos = zip_find_end_of_central_dir(info, path, in, &len);
+    /* find the end-of-central-dir record. */
+    pos = zip_find_end_of_central_dir(archive);
     BAIL_IF_MACRO(pos == -1, NULL, 0);
-	BAIL_IF_MACRO(fseek(in, pos, SEEK_SET) == -1, NULL, 0);
+    eocd = zip_data(archive, pos, ZIP_END_OF_CENTRAL_DIR_LEN, buf);
+    BAIL_IF_MACRO(eocd == NULL, NULL, 0);
 
     /* check signature again, just in case. */
-    BAIL_IF_MACRO(!readui32(in, &ui32), NULL, 0);
-    BAIL_IF_MACRO(ui32 != ZIP_END_OF_CENTRAL_DIR_SIG, ERR_NOT_AN_ARCHIVE, 0);
+    BAIL_IF_MACRO(zip_ui32(eocd) != ZIP_END_OF_CENTRAL_DIR_SIG, ERR_NOT_AN_ARCHIVE, 0);
 
-	/* number of this disk */
-    BAIL_IF_MACRO(!readui16(in, &ui16), NULL, 0);
-    BAIL_IF_MACRO(ui16 != 0, ERR_UNSUPPORTED_ARCHIVE, 0);
+    /*
+     * Make sure that the comment length matches to the end of file...
+     *  If it doesn't, we're either in the wrong part of the file, or the
+     *  file is corrupted, but we give up either way.
+     */
+    BAIL_IF_MACRO((pos + ZIP_END_OF_CENTRAL_DIR_LEN + zip_ui16(eocd + 20)) > archive->size,
+                  ERR_UNSUPPORTED_ARCHIVE, 0);
 
-	/* number of the disk with the start of the central directory */
-    BAIL_IF_MACRO(!readui16(in, &ui16), NULL, 0);
-    BAIL_IF_MACRO(ui16 != 0, ERR_UNSUPPORTED_ARCHIVE, 0);
+    pos64 = zip_find_zip64_end_of_central_dir(archive, pos);
+    BAIL_IF_MACRO(pos64 == -2, NULL, 0);
+    if (pos64 >= 0)
+    {
+        /* Zip64: the same fields, wider, in a record of its own. */
+        eocd = zip_data(archive, pos64, ZIP64_END_OF_CENTRAL_DIR_LEN, buf);
+        BAIL_IF_MACRO(eocd == NULL, NULL, 0);
+        /* size of this record at 4, versions at 12 and 14 */
+        BAIL_IF_MACRO(zip_ui32(eocd + 16) != 0, ERR_UNSUPPORTED_ARCHIVE, 0);
+        BAIL_IF_MACRO(zip_ui32(eocd + 20) != 0, ERR_UNSUPPORTED_ARCHIVE, 0);
+        entries = zip_ui64(eocd + 32);
+        BAIL_IF_MACRO(zip_ui64(eocd + 24) != entries, ERR_UNSUPPORTED_ARCHIVE, 0);
+        *central_dir_len = zip_ui64(eocd + 40);
+        *central_dir_ofs = zip_ui64(eocd + 48);
+        /* the central directory is followed by this record now. */
+        pos = pos64;
+    } /* if */
+    else
+    {
+        /* number of this disk */
+        BAIL_IF_MACRO(zip_ui16(eocd + 4) != 0, ERR_UNSUPPORTED_ARCHIVE, 0);
+
+        /* number of the disk with the start of the central directory */
+        BAIL_IF_MACRO(zip_ui16(eocd + 6) != 0, ERR_UNSUPPORTED_ARCHIVE, 0);
 
-	/* total number of entries in the central dir on this disk */
-    BAIL_IF_MACRO(!readui16(in, &ui16), NULL, 0);
+        /* total number of entries in the central dir, on this disk and in all */
+        entries = zip_ui16(eocd + 10);
+        BAIL_IF_MACRO(zip_ui16(eocd + 8) != entries, ERR_UNSUPPORTED_ARCHIVE, 0);
 
-	/* total number of entries in the central dir */
-    BAIL_IF_MACRO(!readui16(in, &zipinfo->entryCount), NULL, 0);
-    BAIL_IF_MACRO(ui16 != zipinfo->entryCount, ERR_UNSUPPORTED_ARCHIVE, 0);
+        /* size of the central directory */
+        *central_dir_len = zip_ui32(eocd + 12);
 
-	/* size of the central directory */
-    BAIL_IF_MACRO(!readui32(in, &ui32), NULL, 0);
+        /* offset of central directory */
+        *central_dir_ofs = zip_ui32(eocd + 16);
+    } /* else */
 
-	/* offset of central directory */
-    BAIL_IF_MACRO(!readui32(in, central_dir_ofs), NULL, 0);
-    BAIL_IF_MACRO(pos < *central_dir_ofs + ui32, ERR_UNSUPPORTED_ARCHIVE, 0);
+    /* every entry takes some room, which keeps calloc() sane. */
+    BAIL_IF_MACRO(entries > *central_dir_len / ZIP_CENTRAL_DIR_LEN, ERR_CORRUPTED, 0);
+    zipinfo->entryCount = (uint32) entries;
+    BAIL_IF_MACRO((*central_dir_ofs > (uint64) pos) || (*central_dir_len > (uint64) pos - *central_dir_ofs),
+                  ERR_UNSUPPORTED_ARCHIVE, 0);
 
     /*
      * For self-extracting archives, etc, there's crapola in the file
@@ -509,21 +682,11 @@ static int zip_parse_end_of_central_dir(install_info *info, const char *path,
      *  sizeof central dir)...the difference in bytes is how much arbitrary
      *  data is at the start of the physical file.
      */
-	*data_start = pos - (*central_dir_ofs + ui32);
+    *data_start = pos - (*central_dir_ofs + *central_dir_len);
 
     /* Now that we know the difference, fix up the central dir offset... */
     *central_dir_ofs += *data_start;
 
-	/* zipfile comment length */
-    BAIL_IF_MACRO(!readui16(in, &ui16), NULL, 0);
-
-    /*
-     * Make sure that the comment length matches to the end of file...
-     *  If it doesn't, we're either in the wrong part of the file, or the
-     *  file is corrupted, but we give up either way.
-     */
-    BAIL_IF_MACRO((pos + 22 + ui16) > len, ERR_UNSUPPORTED_ARCHIVE, 0);
-
     return(1);  /* made it. */
 } /* zip_parse_end_of_central_dir */
 
@@ -534,60 +697,525 @@ static int zip_parse_end_of_central_dir(install_info *info, const char *path,
  */
 static void zip_expand_symlink_path(char *path)
 {
-    char *ptr = path;
-    char *prevptr = path;
+    char *src = path;
+    char *dst = path;
+    char *next;
+    size_t len;
 
-    while (1)
+    while (*src)
     {
-        ptr = strchr(ptr, '/');
-        if (ptr == NULL)
-            break;
+        next = strchr(src, '/');
+        len = (next != NULL) ? (size_t) (next - src) : strlen(src);
 
-        if (*(ptr + 1) == '.')
+        if ((len == 0) || ((len == 1) && (src[0] == '.')))
         {
-            if (*(ptr + 2) == '/')
-            {
-                /* current dir in middle of string: ditch it. */
-                memmove(ptr, ptr + 2, strlen(ptr + 2) + 1);
-            } /* else if */
+            /* empty or current dir: ditch it. */
+        } /* if */
 
-            else if (*(ptr + 2) == '\0')
+        else if ((len == 2) && (src[0] == '.') && (src[1] == '.'))
+        {
+            /* parent dir: move back one, if possible. */
+            while ((dst > path) && (*--dst != '/'))
+                ;
+        } /* else if */
+
+        else
+        {
+            if (dst > path)
+                *dst++ = '/';
+            memmove(dst, src, len);
+            dst += len;
+        } /* else */
+
+        src += len;
+        if (*src == '/')
+            src++;
+    } /* while */
+
+    *dst = '\0';
+} /* zip_expand_symlink_path */
+
+
+/*
+ * Members are independent, so they are inflated by a pool of worker
+ *  threads, at most copy_workers of them. The output files are opened and
+ *  closed by the installer thread, so that they are registered in the order
+ *  of the central directory and the prompts stay in the UI thread; the
+ *  workers only move the data.
+ */
+#define ZIP_WRITE_ERROR 1
+#define ZIP_READ_ERROR  2
+
+typedef struct _zip_job
+{
+    install_info *info;
+    ZIPentry *entry;
+    stream *out;
+    char *final;
+    const char *current_option;
+    size_t written;           /* Shared with the worker, see progress_count() */
+    uint64 extracted;
+    int done;
+    int error;                /* ZIP_WRITE_ERROR or ZIP_READ_ERROR */
+    UIUpdateFunc update;      /* Only when the job runs in the installer thread */
+    struct _zip_job *next;
+} zip_job;
+
+static struct
+{
+    int nthreads;
+    int abort;
+    zip_job *jobs, *jobs_tail;  /* All unfinished jobs, in submission order */
+    zip_job *queue;             /* First job waiting for a worker */
+    zip_job *last;              /* Job that a worker started last */
+    int pending;
+    size_t total;
+    const char *path;           /* The archive, for error messages */
+    uint8 *buf_in, *buf_out;    /* For the installer thread */
+    const char *md5;
+    unsigned int user_mode;
+#ifdef HAVE_PTHREAD_H
+    int quit;
+    pthread_mutex_t lock;
+    pthread_cond_t work, progress;
+    pthread_t threads[COPY_WORKERS_MAX];
+#endif
+} zip_pool;
+
+
+static int zip_job_progress(zip_job *job, size_t len)
+{
+    if (job == NULL)  /* a symlink, nothing to report. */
+        return(1);
+
+    progress_count(&job->written, len);
+    progress_add(len);
+    if (job->update)
+    {
+        if (!job->update(job->info, job->final, job->written,
+                         job->entry->uncompressed_size, job->current_option))
+            zip_pool.abort = 1;
+        return(!zip_pool.abort);
+    } /* if */
+    return(!progress_aborted());
+} /* zip_job_progress */
+
+
+/*
+ * Extract an entry to 'out', or into 'buf_out' if it is NULL (symlinks,
+ *  which must fit in it). This may run in any thread, so failures to write
+ *  the output are left in job->error for zip_finish_job() to report.
+ *  Returns the number of bytes extracted.
+ */
+static uint64 zip_extract(ZIParchive *archive, ZIPentry *entry, stream *out,
+                          uint8 *buf_in, uint8 *buf_out, zip_job *job)
+{
+    z_stream zstr;
+    const uint8 *data;
+    uint64 bw = 0;
+    uint64 br;
+    uint64 compressed_position = 0;
+    ssize_t copied;
+    int rc;
+
+    if (entry->compression_method == COMPMETH_NONE)
+    {
+        /* Stored data is copied by the kernel if possible. */
+        if ((out != NULL) && ((uint64) (size_t) entry->uncompressed_size == entry->uncompressed_size))
+        {
+            copied = file_copy_fd_range(archive->info, archive->fd,
+                                        entry->offset, entry->uncompressed_size, out);
+            if (copied >= 0)
             {
-                /* current dir at end of string: ditch it. */
-                *ptr = '\0';
+                zip_job_progress(job, copied);
+                return((uint64) copied);
+            } /* if */
+            else if (copied < -1)
+            {
+                job->error = (copied == -2) ? ZIP_WRITE_ERROR : ZIP_READ_ERROR;
+                return(0);
             } /* else if */
+        } /* if */
+
+        while (bw < entry->uncompressed_size)
+        {
+            br = entry->uncompressed_size - bw;
+            if (br > ZIP_WRITEBUFSIZE)
+                br = ZIP_WRITEBUFSIZE;
+
+            data = zip_data(archive, entry->offset + bw, br, buf_out);
+            if (data == NULL)
+                break;
 
-            else if (*(ptr + 2) == '.')
+            if ((out != NULL) && (file_try_write(archive->info, (void *) data, br, out) != br))
             {
-                if (*(ptr + 3) == '/')
-                {
-                    /* parent dir in middle: move back one, if possible. */
-                    memmove(prevptr, ptr + 4, strlen(ptr + 4) + 1);
-                    ptr = prevptr;
-                    while (prevptr != path)
-                    {
-                        prevptr--;
-                        if (*prevptr == '/')
-                        {
-                            prevptr++;
-                            break;
-                        } /* if */
-                    } /* while */
-                } /* if */
-
-                if (*(ptr + 3) == '\0')
-                {
-                    /* parent dir at end: move back one, if possible. */
-                    *prevptr = '\0';
-                } /* if */
+                job->error = ZIP_WRITE_ERROR;
+                break;
             } /* if */
+
+            bw += br;
+            if (out != NULL && !zip_job_progress(job, br))
+                break;
+        } /* while */
+        return(bw);
+    } /* if */
+
+    memset(&zstr, '\0', sizeof (z_stream));
+    if ((rc = inflateInit2(&zstr, -MAX_WBITS)) != Z_OK)
+    {
+        zlib_err(rc);
+        return(0);
+    } /* if */
+
+    while (bw < entry->uncompressed_size)
+    {
+        /* input buffer is empty; read more from the archive. */
+        if (zstr.avail_in == 0)
+        {
+            br = entry->compressed_size - compressed_position;
+            if (br == 0)  /* no more compressed data? */
+                break;
+
+            if (br > ZIP_READBUFSIZE)
+                br = ZIP_READBUFSIZE;
+
+            data = zip_data(archive, entry->offset + compressed_position, br, buf_in);
+            if (data == NULL)
+                break;
+
+            compressed_position += br;
+            zstr.next_in = (Bytef *) data;
+            zstr.avail_in = (uInt) br;
+        } /* if */
+
+        if (out != NULL)
+        {
+            zstr.next_out = buf_out;
+            zstr.avail_out = ZIP_WRITEBUFSIZE;
         } /* if */
         else
         {
-            prevptr = ptr;
+            /* symlinks are inflated in one piece, with room for a null. */
+            zstr.next_out = buf_out + bw;
+            zstr.avail_out = ZIP_WRITEBUFSIZE - 1 - bw;
+            if (zstr.avail_out == 0)
+            {
+                log_debug("ZIP: out of buffer space reading symlink.");
+                break;
+            } /* if */
         } /* else */
+
+        rc = inflate(&zstr, Z_SYNC_FLUSH);
+        if ((rc != Z_OK) && (rc != Z_STREAM_END))
+        {
+            zlib_err(rc);
+            break;
+        } /* if */
+
+        br = zstr.next_out - (out ? buf_out : buf_out + bw);
+        if ((out != NULL) && (br > 0))
+        {
+            if (file_try_write(archive->info, buf_out, br, out) != br)
+            {
+                job->error = ZIP_WRITE_ERROR;
+                break;
+            } /* if */
+            if (!zip_job_progress(job, br))
+            {
+                bw += br;
+                break;
+            } /* if */
+        } /* if */
+        bw += br;
+
+        if (rc == Z_STREAM_END)
+            break;
     } /* while */
-} /* zip_expand_symlink_path */
+
+    inflateEnd(&zstr);
+    return(bw);
+} /* zip_extract */
+
+
+/*
+ * Close the output of a job and check it. Called in the installer thread,
+ *  in the order the jobs were submitted.
+ */
+static void zip_finish_job(zip_job *job)
+{
+    struct file_elem *elem = job->out->elem;
+
+    file_close(job->info, job->out);
+
+    if (job->error == ZIP_WRITE_ERROR)
+        log_fatal(_("Write failure on %s"), job->final);
+    else if (job->error == ZIP_READ_ERROR)
+        log_fatal(_("Read failure on %s"), zip_pool.path);
+
+    if (job->extracted < job->entry->uncompressed_size)
+    {
+        log_debug("ZIP: Failed to fully write [%s]!", job->final);
+        unlink(job->final);
+    } /* if */
+    else
+    {
+        zip_pool.total += job->entry->uncompressed_size;
+        if ( zip_pool.user_mode )
+            file_chmod(job->info, job->final, zip_pool.user_mode);
+
+        if ( zip_pool.md5 ) { /* Verify the output file */
+          char sum[CHECKSUM_SIZE+1];
+
+          strcpy(sum, get_md5(elem->md5sum));
+          if ( strcasecmp(zip_pool.md5, sum) ) {
+            log_fatal(_("File '%s' has an invalid checksum! Aborting."), job->final);
+          }
+        }
+    } /* else */
+
+    free(job->final);
+    free(job);
+} /* zip_finish_job */
+
+
+#ifdef HAVE_PTHREAD_H
+static void *zip_worker(void *data)
+{
+    ZIParchive *archive = (ZIParchive *) data;
+    uint8 *buf_in = NULL;
+    uint8 *buf_out;
+    zip_job *job;
+
+    buf_out = (uint8 *) malloc(ZIP_WRITEBUFSIZE);
+    buf_in = (uint8 *) malloc(ZIP_READBUFSIZE);
+
+    pthread_mutex_lock(&zip_pool.lock);
+    for ( ;; )
+    {
+        while (!zip_pool.queue && !zip_pool.quit)
+            pthread_cond_wait(&zip_pool.work, &zip_pool.lock);
+
+        job = zip_pool.queue;
+        if (job == NULL)
+            break;
+
+        zip_pool.queue = job->next;
+        zip_pool.last = job;
+        if (!zip_pool.abort && buf_out && buf_in)
+        {
+            pthread_mutex_unlock(&zip_pool.lock);
+            job->extracted = zip_extract(archive, job->entry, job->out, buf_in, buf_out, job);
+            pthread_mutex_lock(&zip_pool.lock);
+        } /* if */
+        job->done = 1;
+        pthread_cond_signal(&zip_pool.progress);
+    } /* for */
+    pthread_mutex_unlock(&zip_pool.lock);
+
+    free(buf_in);
+    free(buf_out);
+    return(NULL);
+} /* zip_worker */
+
+
+/*
+ * Report the progress of the workers to the UI and finish the jobs that
+ *  are done, until no more than 'limit' jobs are left pending.
+ */
+static void zip_pool_poll(install_info *info, UIUpdateFunc update, int limit)
+{
+    zip_job *job, *last;
+    size_t size = 0;
+    size_t total = 0;
+    const char *final = NULL;
+    const char *current_option = NULL;
+    struct timeval now;
+    struct timespec until;
+    int abort;
+
+    for ( ;; )
+    {
+        pthread_mutex_lock(&zip_pool.lock);
+        if ((zip_pool.pending > limit) && !(zip_pool.jobs && zip_pool.jobs->done))
+        {
+            /* Wake up in time for the next update of the UI */
+            gettimeofday(&now, NULL);
+            until.tv_sec = now.tv_sec;
+            until.tv_nsec = (now.tv_usec + PROGRESS_INTERVAL * 1000) * 1000;
+            if ( until.tv_nsec >= 1000000000 ) {
+                until.tv_sec += until.tv_nsec / 1000000000;
+                until.tv_nsec %= 1000000000;
+            }
+            pthread_cond_timedwait(&zip_pool.progress, &zip_pool.lock, &until);
+        } /* if */
+
+        last = zip_pool.last;
+        if (last)
+        {
+            final = last->final;
+            current_option = last->current_option;
+            size = progress_count(&last->written, 0);
+            total = last->entry->uncompressed_size;
+        } /* if */
+
+        job = NULL;
+        if (zip_pool.jobs && zip_pool.jobs->done)
+        {
+            job = zip_pool.jobs;
+            zip_pool.jobs = job->next;
+            if (!zip_pool.jobs)
+                zip_pool.jobs_tail = NULL;
+            if (zip_pool.last == job)
+                zip_pool.last = NULL;
+        } /* if */
+        abort = zip_pool.abort;
+        pthread_mutex_unlock(&zip_pool.lock);
+
+        progress_collect(info);
+        if (last && update && !abort)
+        {
+            if (!update(info, final, size, total, current_option))
+            {
+                pthread_mutex_lock(&zip_pool.lock);
+                zip_pool.abort = 1;
+                pthread_mutex_unlock(&zip_pool.lock);
+            } /* if */
+        } /* if */
+
+        if (job)
+        {
+            zip_finish_job(job);
+            -- zip_pool.pending;
+        } /* if */
+        else if (zip_pool.pending <= limit)
+        {
+            break;
+        } /* else if */
+    } /* for */
+} /* zip_pool_poll */
+#endif
+
+
+static int zip_pool_start(ZIParchive *archive, uint32 entries)
+{
+    int i;
+
+    memset(&zip_pool, '\0', sizeof (zip_pool));
+    zip_pool.path = archive->path;
+    zip_pool.buf_out = (uint8 *) malloc(ZIP_WRITEBUFSIZE);
+    zip_pool.buf_in = (uint8 *) malloc(ZIP_READBUFSIZE);
+    if ((zip_pool.buf_out == NULL) || (zip_pool.buf_in == NULL))
+    {
+        free(zip_pool.buf_out);
+        free(zip_pool.buf_in);
+        BAIL_MACRO(ERR_OUT_OF_MEMORY, 0);
+    } /* if */
+
+#ifdef HAVE_PTHREAD_H
+    if ((copy_workers > 1) && (entries > 1))
+    {
+        pthread_mutex_init(&zip_pool.lock, NULL);
+        pthread_cond_init(&zip_pool.work, NULL);
+        pthread_cond_init(&zip_pool.progress, NULL);
+        for (i = 0; (i < copy_workers) && (i < COPY_WORKERS_MAX); i++)
+        {
+            if (pthread_create(&zip_pool.threads[i], NULL, zip_worker, archive) != 0)
+                break;
+        } /* for */
+        zip_pool.nthreads = i;
+        if (zip_pool.nthreads == 0)
+        {
+            log_debug("ZIP: Unable to start the threads, extracting one file at a time");
+            pthread_cond_destroy(&zip_pool.progress);
+            pthread_cond_destroy(&zip_pool.work);
+            pthread_mutex_destroy(&zip_pool.lock);
+        } /* if */
+    } /* if */
+#endif
+
+    return(1);
+} /* zip_pool_start */
+
+
+/*
+ * Wait for all the queued members and stop the workers.
+ *  Returns the number of bytes extracted.
+ */
+static size_t zip_pool_stop(install_info *info, UIUpdateFunc update)
+{
+#ifdef HAVE_PTHREAD_H
+    int i;
+
+    if (zip_pool.nthreads > 0)
+    {
+        zip_pool_poll(info, update, 0);
+        pthread_mutex_lock(&zip_pool.lock);
+        zip_pool.quit = 1;
+        pthread_cond_broadcast(&zip_pool.work);
+        pthread_mutex_unlock(&zip_pool.lock);
+        for (i = 0; i < zip_pool.nthreads; i++)
+            pthread_join(zip_pool.threads[i], NULL);
+        pthread_cond_destroy(&zip_pool.progress);
+        pthread_cond_destroy(&zip_pool.work);
+        pthread_mutex_destroy(&zip_pool.lock);
+        zip_pool.nthreads = 0;
+    } /* if */
+#endif
+
+    free(zip_pool.buf_in);
+    free(zip_pool.buf_out);
+    zip_pool.buf_in = zip_pool.buf_out = NULL;
+    return(zip_pool.total);
+} /* zip_pool_stop */
+
+
+/*
+ * Extract a member to its open output file, in the background if there are
+ *  workers. At most two members per worker are kept open.
+ */
+static void zip_pool_submit(install_info *info, ZIParchive *archive, ZIPentry *entry,
+                            stream *out, const char *final, const char *current_option,
+                            UIUpdateFunc update)
+{
+    zip_job *job = (zip_job *) malloc(sizeof (zip_job));
+
+    if (job == NULL)
+        log_fatal(_("Out of memory"));
+    memset(job, '\0', sizeof (zip_job));
+    job->info = info;
+    job->entry = entry;
+    job->out = out;
+    job->final = strdup(final);
+    job->current_option = current_option;
+
+#ifdef HAVE_PTHREAD_H
+    if (zip_pool.nthreads > 0)
+    {
+        pthread_mutex_lock(&zip_pool.lock);
+        if (zip_pool.jobs_tail)
+            zip_pool.jobs_tail->next = job;
+        else
+            zip_pool.jobs = job;
+        zip_pool.jobs_tail = job;
+        if (!zip_pool.queue)
+            zip_pool.queue = job;
+        pthread_cond_signal(&zip_pool.work);
+        pthread_mutex_unlock(&zip_pool.lock);
+        ++ zip_pool.pending;
+
+        zip_pool_poll(info, update, 2 * zip_pool.nthreads);
+        return;
+    } /* if */
+#endif
+
+    job->update = update;
+    if (update && !update(info, final, 0, entry->uncompressed_size, current_option))
+        zip_pool.abort = 1;
+    else
+        job->extracted = zip_extract(archive, entry, out, zip_pool.buf_in, zip_pool.buf_out, job);
+    progress_collect(info);
+    zip_finish_job(job);
+} /* zip_pool_submit */
 
 
 
@@ -596,54 +1224,36 @@ static void zip_expand_symlink_path(char *path)
 /* Initialize the plugin */
 static int ZIPInitPlugin(void)
 {
-    zip_buf_in = (uint8 *) malloc(ZIP_READBUFSIZE);
-    if (zip_buf_in == NULL)
-        return(0);
-
-    zip_buf_out = (uint8 *) malloc(ZIP_WRITEBUFSIZE);
-    if (zip_buf_out == NULL)
-    {
-        free(zip_buf_in);
-        zip_buf_in = NULL;
-        return(0);
-    }
     return(1);
 }
 
 /* Free the plugin */
 static int ZIPFreePlugin(void)
 {
-    if (zip_buf_in != NULL)
-        free(zip_buf_in);
-
-    if (zip_buf_out != NULL)
-        free(zip_buf_out);
-
-    zip_buf_in = zip_buf_out = NULL;
-
 	return 1;
 }
 
 
 /* Get the size of the file */
-static size_t ZIPSize(install_info *info, const char *path)
+static off_t ZIPSize(install_info *info, const char *path)
 {
-    size_t retval = -1;
+    off_t retval = -1;
     ZIPinfo zipinfo;
-    stream *in = NULL;
-    uint32 data_start;
-    uint32 cent_dir_ofs;
+    ZIParchive archive;
+    uint64 data_start;
+    uint64 cent_dir_ofs;
+    uint64 cent_dir_len;
     uint32 i;
 
     memset(&zipinfo, '\0', sizeof (ZIPinfo));
 
-    if ((in = file_open(info, path, "rb")) == NULL)
-        goto zip_zipsize_end;
-    
-    if (!zip_parse_end_of_central_dir(info, path, in->fp, &zipinfo, &data_start, &cent_dir_ofs))
+    if (!zip_open_archive(info, path, &archive))
+        return(retval);
+
+    if (!zip_parse_end_of_central_dir(&archive, &zipinfo, &data_start, &cent_dir_ofs, &cent_dir_len))
         goto zip_zipsize_end;
 
-    if (!zip_load_entries(in->fp, &zipinfo, data_start, cent_dir_ofs))
+    if (!zip_load_entries(&archive, &zipinfo, data_start, cent_dir_ofs, cent_dir_len))
         goto zip_zipsize_end;
 
     retval = 0;
@@ -656,7 +1266,7 @@ static size_t ZIPSize(install_info *info, const char *path)
 
 zip_zipsize_end:
     zip_free_entries(zipinfo.entries, zipinfo.entryCount);
-    file_close(info, in);
+    zip_close_archive(&archive);
     return(retval);
 }
 
@@ -667,16 +1277,13 @@ static size_t ZIPCopy(install_info *info, const char *path, const char *dest, co
 					  UIUpdateFunc update)
 {
     char final[PATH_MAX];
-    z_stream zstr;
     size_t retval = 0;
     ZIPinfo zipinfo;
-    stream *in = NULL;
-    uint32 data_start;
-    uint32 cent_dir_ofs;
-    uint32 compressed_position = 0;
+    ZIParchive archive;
+    uint64 data_start;
+    uint64 cent_dir_ofs;
+    uint64 cent_dir_len;
     uint32 i;
-    int rc;
-	unsigned int user_mode = 0;
     int lcase_fnames = 0;
 
     /* Optional MD5 sum can be specified in the XML file */
@@ -685,9 +1292,6 @@ static size_t ZIPCopy(install_info *info, const char *path, const char *dest, co
     const char *mode_str = (char *)xmlGetProp(node, BAD_CAST "mode");
     const char *fname_conv = (char *)xmlGetProp(node, BAD_CAST "lcasefilenames");
 
-	if ( mode_str ) {
-		user_mode = (unsigned int) strtol(mode_str, NULL, 8);
-	}
     if ( fname_conv ) {
         lcase_fnames = (int) strtol(fname_conv, NULL, 10);
     }
@@ -697,202 +1301,95 @@ static size_t ZIPCopy(install_info *info, const char *path, const char *dest, co
 
 	log_debug("ZIP: Copy %s -> %s", path, dest);
 
-    if ((in = file_open(info, path, "rb")) == NULL)
+    if (!zip_open_archive(info, path, &archive))
+        return(retval);
+
+    if (!zip_parse_end_of_central_dir(&archive, &zipinfo, &data_start, &cent_dir_ofs, &cent_dir_len))
         goto zip_zipsize_end;
-    
-    if (!zip_parse_end_of_central_dir(info, path, in->fp, &zipinfo, &data_start, &cent_dir_ofs))
+
+    if (!zip_load_entries(&archive, &zipinfo, data_start, cent_dir_ofs, cent_dir_len))
         goto zip_zipsize_end;
 
-    if (!zip_load_entries(in->fp, &zipinfo, data_start, cent_dir_ofs))
+    if (!zip_pool_start(&archive, zipinfo.entryCount))
         goto zip_zipsize_end;
+    zip_pool.md5 = md5;
+	if ( mode_str ) {
+		zip_pool.user_mode = (unsigned int) strtol(mode_str, NULL, 8);
+	}
 
-    for (i = 0; i < zipinfo.entryCount; i++)
+    for (i = 0; (i < zipinfo.entryCount) && !zip_pool.abort; i++)
     {
         ZIPentry *entry = &zipinfo.entries[i];
-        uint32 bw = 0;
         stream *out = NULL;
         int symlnk = 0;
 
-        compressed_position = 0;
         snprintf(final, sizeof(final), "%s/%s", dest, entry->name);
 
-        if (entry->name[strlen(entry->name) - 1] == '/')
+        if ((*entry->name == '\0') || (entry->name[strlen(entry->name) - 1] == '/'))
         {
             final[strlen(final) - 1] = '\0';  /* lose '/' at end. */
             dir_create_hierarchy(info, final, 0755);
             continue;
         } /* if */
 
-        if (!zip_parse_local(in->fp, entry))
+        symlnk = zip_has_symlink_attr(entry);
+
+        if (!symlnk && lcase_fnames) {
+            int flen = strlen(final);
+            char *p = &final[flen - 1];
+            while ((*p != '/') && (flen > 0)) {
+                *p = tolower(*p);
+                if (--flen)
+                    p--;
+            } /* while */
+        } /* if */
+
+        /* The central directory tells where the damaged files are, the others are not read */
+        if (restoring_corrupt() && (symlnk || !file_is_corrupt(info->product, final)))
             continue;
 
-        if (fseek(in->fp, entry->offset, SEEK_SET) == -1)
+        if (!zip_parse_local(&archive, entry))
             continue;
 
         file_create_hierarchy(info, final);
 
-        symlnk = zip_has_symlink_attr(entry);
-
-        if (entry->compression_method != COMPMETH_NONE)
+        if (symlnk)
         {
-            memset(&zstr, '\0', sizeof (z_stream));
-            if ((rc = inflateInit2(&zstr, -MAX_WBITS)) != Z_OK)
-            {
-                zlib_err(rc);
-                continue;
-            }
-            zstr.next_out = zip_buf_out;
-            zstr.avail_out = ZIP_WRITEBUFSIZE;
-        } /* if */
+            /* symlinks are tiny, they are made right away. */
+            char lnkname[PATH_MAX];
+            uint64 len = 0;
 
-        if (!symlnk)
-        {
-            if (lcase_fnames) {
-               int flen = strlen(final);
-               char *p = &final[flen - 1];
-               while ((*p != '/') && (flen > 0)) {
-                  *p = tolower(*p);
-                  if (--flen)
-                      p--;
-               } /* while */
-            } /* if */
-            out = file_open_install(info, final, (mut && *mut=='y') ? "wm" : "wb");
-            if (!out)
+            if (entry->uncompressed_size < ZIP_WRITEBUFSIZE)
+                len = zip_extract(&archive, entry, NULL, zip_pool.buf_in, zip_pool.buf_out, NULL);
+            if ((len == 0) || (len < entry->uncompressed_size))
             {
-                log_debug("ZIP: failed to open [%s] for write.", final);
-                inflateEnd(&zstr);
+                log_debug("ZIP: Failed to fully write [%s]!", final);
                 continue;
             } /* if */
-        } /* if */
-
-        update(info, final, 0, entry->uncompressed_size, current_option);
-
-        while (bw < entry->uncompressed_size)
-        {
-            size_t w = 0;
-            size_t br = 0;
-            if (entry->compression_method == COMPMETH_NONE)
-            {
-                size_t maxread = entry->uncompressed_size - bw;
-                if (maxread > ZIP_WRITEBUFSIZE)
-                    maxread = ZIP_WRITEBUFSIZE;
-
-                w = br = file_read(info, zip_buf_out, maxread, in);
-                if (br != maxread)
-                    break;
-        
-                if (!symlnk)
-                {
-                    w = file_write(info, zip_buf_out, br, out);
-                    if (w != br)
-                        break;
-                    info->installed_bytes += br;
-                } /* if */
-
-                bw += w;
-                update(info, final, bw, entry->uncompressed_size, current_option);
-            } /* if */
-
-            else  /* compressed entry. */
-            {
-                /* input buffer is empty; read more from disk. */
-                if (zstr.avail_in == 0)
-                {
-                    size_t br, b;
-                    br = entry->compressed_size - compressed_position;
-                    if (br == 0)  /* no more compressed data? */
-                    {
-                        assert(zstr.avail_out == ZIP_WRITEBUFSIZE);
-                        break;
-                    } /* if */
-                    else
-                    {
-                        if (br > ZIP_READBUFSIZE)
-                            br = ZIP_READBUFSIZE;
-
-                        b = file_read(info, zip_buf_in, br, in);
-                        if (b != br)
-                            break;
-
-                        compressed_position += br;
-                        zstr.next_in = zip_buf_in;
-                        zstr.avail_in = br;
-                    } /* else */
-                } /* if */
-
-                rc = inflate(&zstr, Z_SYNC_FLUSH);
-                if ((rc != Z_OK) && (rc != Z_STREAM_END))
-                {
-                    zlib_err(rc);
-                    break;
-                }
-
-                /* if output buffer has data, dump it to disk. */
-                if (zstr.avail_out < ZIP_WRITEBUFSIZE)
-                {
-                    int bytes_to_write = ZIP_WRITEBUFSIZE - zstr.avail_out;
-                    if ((symlnk) && (zstr.avail_out == 0))
-                    {
-                        assert(0);
-	                    log_debug("ZIP: out of buffer space reading symlink.");
-                        break;  /* no buffer, can't write yet: screwed. */
-                    }
-
-                    w = file_write(info, zip_buf_out, bytes_to_write, out);
-                    if (w != bytes_to_write)
-                        break;
-                    info->installed_bytes += w;
-
-                    bw += bytes_to_write;
-                    update(info, final, bw, entry->uncompressed_size, current_option);
-                    zstr.next_out = zip_buf_out;
-                    zstr.avail_out = ZIP_WRITEBUFSIZE;
-                } /* if */
-            } /* else */
-        } /* while */
-
-        if (entry->compression_method != COMPMETH_NONE)
-            inflateEnd(&zstr);
 
-        if (!symlnk)
-            file_close(info, out);
-
-        if (bw < entry->uncompressed_size)
-        {
-            log_debug("ZIP: Failed to fully write [%s]!", final);
-            if (!symlnk)
-                unlink(final);
-        } /* if */
-
-        if (symlnk)
-        {
-            char lnkname[PATH_MAX];
             /* null-terminate string. */
-            zip_buf_out[entry->uncompressed_size] = '\0';
-            zip_expand_symlink_path((char *)zip_buf_out);
-            snprintf(lnkname, sizeof (lnkname), "%s/%s", dest, zip_buf_out);
+            zip_pool.buf_out[entry->uncompressed_size] = '\0';
+            zip_expand_symlink_path((char *)zip_pool.buf_out);
+            snprintf(lnkname, sizeof (lnkname), "%s/%s", dest, zip_pool.buf_out);
             file_symlink(info, lnkname, final);
+            continue;
         } /* if */
-        else
+
+        out = file_open_install(info, final, (mut && *mut=='y') ? "wm" : "wb");
+        if (!out)
         {
-            retval += entry->uncompressed_size;
-			if ( user_mode )
-				file_chmod(info, final, user_mode);
-
-			if ( md5 ) { /* Verify the output file */
-			  char sum[CHECKSUM_SIZE+1];
-			  
-			  strcpy(sum, get_md5(out->md5.buf));
-			  if ( strcasecmp(md5, sum) ) {
-				log_fatal(_("File '%s' has an invalid checksum! Aborting."), final);
-			  }
-			}
-        } /* else */
+            log_debug("ZIP: failed to open [%s] for write.", final);
+            continue;
+        } /* if */
+
+        zip_pool_submit(info, &archive, entry, out, final, current_option, update);
     } /* for */
 
+    retval = zip_pool_stop(info, update);
+
 zip_zipsize_end:
     zip_free_entries(zipinfo.entries, zipinfo.entryCount);
-    file_close(info, in);
+    zip_close_archive(&archive);
     return(retval);
 }
 
@@ -0,0 +1,395 @@
+/* Parallel decoding of compressed data made of independent blocks
+
+   A scanner thread, specific to the compression format, splits the data into
+   jobs that can be decoded on their own. A pool of threads decodes them, and
+   the reader gets the data back in order. This is how lbzip2 and pigz work.
+
+   When a job fails to decode, because the scanner was fooled by the data, or
+   when the scanner can't split the data any further, the rest of it is read
+   with a plain sequential decoder on the reader's thread. It starts from the
+   restart point of the job, skipping the data that was already returned.
+*/
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "preader.h"
+
+#ifdef HAVE_PTHREAD_H
+
+#include <pthread.h>
+
+#define PREADER_THREADS_MAX	16
+/* Size of the reads of the scanners */
+#define PREADER_INPUT		(1024*1024)
+
+enum {
+	JOB_QUEUED,
+	JOB_RUNNING,
+	JOB_DONE,
+	JOB_FAILED
+};
+
+struct preader {
+	const preader_ops *ops;
+	int fd;
+	off_t start;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t scanner;
+	pthread_t threads[PREADER_THREADS_MAX];
+	int nthreads;
+	preader_job *head, *tail;	/* Jobs in stream order, until they are read */
+	preader_job *todo;			/* First job no thread has taken yet */
+	int pending, max_pending;
+	int scanned;				/* 1 once the scanner is done, -1 if it gave up */
+	off_t resume;
+	int quit;
+
+	size_t head_pos;			/* Amount of data of the head job already read */
+	off_t restart;				/* Restart point of the last job read */
+	off_t emitted;				/* Data returned since that restart point */
+	void *seq;					/* Sequential decoder, once the threads are gone */
+	int sequential;
+};
+
+/* Number of streams decoded at the same time, which share the processors */
+static int streams = 1;
+
+void preader_set_streams(int count)
+{
+	streams = (count > 1) ? count : 1;
+}
+
+int preader_streams(void)
+{
+	return streams;
+}
+
+int preader_threads(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	n /= streams;
+	if ( n < 1 ) {
+		n = 1;
+	} else if ( n > PREADER_THREADS_MAX ) {
+		n = PREADER_THREADS_MAX;
+	}
+	return (int)n;
+}
+
+preader_job *preader_job_new(size_t in_len, off_t restart)
+{
+	preader_job *job;
+
+	job = (preader_job *)calloc(1, sizeof *job);
+	if ( job ) {
+		job->in_len = in_len;
+		job->restart = restart;
+		job->in = (unsigned char *)calloc(1, in_len);
+		if ( job->in == NULL ) {
+			free(job);
+			job = NULL;
+		}
+	}
+	return job;
+}
+
+static void job_free(preader_job *job)
+{
+	free(job->in);
+	free(job->out);
+	free(job);
+}
+
+int preader_submit(preader *reader, preader_job *job)
+{
+	pthread_mutex_lock(&reader->lock);
+	while ( (reader->pending >= reader->max_pending) && !reader->quit ) {
+		pthread_cond_wait(&reader->cond, &reader->lock);
+	}
+	if ( reader->quit ) {
+		pthread_mutex_unlock(&reader->lock);
+		job_free(job);
+		return 0;
+	}
+	if ( reader->tail ) {
+		reader->tail->next = job;
+	} else {
+		reader->head = job;
+	}
+	reader->tail = job;
+	if ( ! reader->todo ) {
+		reader->todo = job;
+	}
+	++reader->pending;
+	pthread_cond_broadcast(&reader->cond);
+	pthread_mutex_unlock(&reader->lock);
+	return 1;
+}
+
+static void *preader_scanner(void *data)
+{
+	preader *reader = (preader *)data;
+	off_t resume = reader->start;
+	int done;
+
+	done = reader->ops->scan(reader, reader->fd, reader->start, &resume);
+
+	pthread_mutex_lock(&reader->lock);
+	reader->scanned = done ? 1 : -1;
+	reader->resume = resume;
+	pthread_cond_broadcast(&reader->cond);
+	pthread_mutex_unlock(&reader->lock);
+	return NULL;
+}
+
+static void *preader_worker(void *data)
+{
+	preader *reader = (preader *)data;
+	preader_job *job;
+	int ok;
+
+	pthread_mutex_lock(&reader->lock);
+	for ( ;; ) {
+		while ( !reader->todo && !reader->scanned && !reader->quit ) {
+			pthread_cond_wait(&reader->cond, &reader->lock);
+		}
+		if ( reader->quit || !reader->todo ) {
+			break;
+		}
+		job = reader->todo;
+		reader->todo = job->next;
+		job->state = JOB_RUNNING;
+		pthread_mutex_unlock(&reader->lock);
+
+		ok = reader->ops->decode(job);
+		free(job->in);
+		job->in = NULL;
+
+		pthread_mutex_lock(&reader->lock);
+		job->state = ok ? JOB_DONE : JOB_FAILED;
+		pthread_cond_broadcast(&reader->cond);
+	}
+	pthread_mutex_unlock(&reader->lock);
+	return NULL;
+}
+
+/* Stop the threads and drop the jobs not read yet */
+static void preader_stop(preader *reader)
+{
+	preader_job *job;
+	int i;
+
+	pthread_mutex_lock(&reader->lock);
+	reader->quit = 1;
+	pthread_cond_broadcast(&reader->cond);
+	pthread_mutex_unlock(&reader->lock);
+
+	pthread_join(reader->scanner, NULL);
+	for ( i = 0; i < reader->nthreads; ++i ) {
+		pthread_join(reader->threads[i], NULL);
+	}
+	reader->nthreads = 0;
+	while ( reader->head ) {
+		job = reader->head;
+		reader->head = job->next;
+		job_free(job);
+	}
+	reader->tail = reader->todo = NULL;
+}
+
+preader *preader_open(const preader_ops *ops, int fd, off_t start, int threads)
+{
+	preader *reader;
+
+	reader = (preader *)calloc(1, sizeof *reader);
+	if ( reader == NULL ) {
+		return NULL;
+	}
+	if ( threads > PREADER_THREADS_MAX ) {
+		threads = PREADER_THREADS_MAX;
+	}
+	reader->ops = ops;
+	reader->fd = fd;
+	reader->start = reader->restart = start;
+	reader->max_pending = 2 * threads + 2;
+	pthread_mutex_init(&reader->lock, NULL);
+	pthread_cond_init(&reader->cond, NULL);
+	if ( pthread_create(&reader->scanner, NULL, preader_scanner, reader) != 0 ) {
+		pthread_cond_destroy(&reader->cond);
+		pthread_mutex_destroy(&reader->lock);
+		free(reader);
+		return NULL;
+	}
+	while ( reader->nthreads < threads ) {
+		if ( pthread_create(&reader->threads[reader->nthreads], NULL, preader_worker, reader) != 0 ) {
+			break;
+		}
+		++reader->nthreads;
+	}
+	if ( reader->nthreads == 0 ) {
+		preader_stop(reader);
+		pthread_cond_destroy(&reader->cond);
+		pthread_mutex_destroy(&reader->lock);
+		free(reader);
+		return NULL;
+	}
+	return reader;
+}
+
+/* Go on with the sequential decoder from 'offset' */
+static int preader_sequential(preader *reader, off_t offset)
+{
+	char skip[16384];
+	off_t left;
+	int n;
+
+	preader_stop(reader);
+	reader->sequential = 1;
+	reader->seq = reader->ops->seq_open(reader->fd, offset);
+	if ( reader->seq == NULL ) {
+		return 0;
+	}
+	/* Skip the data already returned from that point */
+	left = (offset == reader->restart) ? reader->emitted : 0;
+	for ( ; left > 0; left -= n ) {
+		n = reader->ops->seq_read(reader->seq, skip, (left < (off_t)sizeof(skip)) ? (int)left : (int)sizeof(skip));
+		if ( n <= 0 ) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int preader_read(preader *reader, void *buf, int len)
+{
+	preader_job *job;
+	off_t resume;
+	int scanned, total = 0, n;
+
+	while ( (total < len) && !reader->sequential ) {
+		pthread_mutex_lock(&reader->lock);
+		while ( ((job = reader->head) == NULL) ? !reader->scanned : (job->state < JOB_DONE) ) {
+			pthread_cond_wait(&reader->cond, &reader->lock);
+		}
+		scanned = reader->scanned;
+		resume = reader->resume;
+		pthread_mutex_unlock(&reader->lock);
+
+		if ( job == NULL ) {
+			if ( scanned > 0 ) {
+				return total;
+			}
+			/* The scanner could not split the rest of the data */
+			if ( ! preader_sequential(reader, resume) ) {
+				return total ? total : -1;
+			}
+		} else if ( job->state == JOB_FAILED ) {
+			if ( ! preader_sequential(reader, job->restart) ) {
+				return total ? total : -1;
+			}
+		} else {
+			if ( (reader->head_pos == 0) && (job->restart != reader->restart) ) {
+				reader->restart = job->restart;
+				reader->emitted = 0;
+			}
+			n = job->out_len - reader->head_pos;
+			if ( n > len - total ) {
+				n = len - total;
+			}
+			memcpy((char *)buf + total, job->out + reader->head_pos, n);
+			reader->head_pos += n;
+			reader->emitted += n;
+			total += n;
+			if ( reader->head_pos == job->out_len ) {
+				pthread_mutex_lock(&reader->lock);
+				reader->head = job->next;
+				if ( reader->head == NULL ) {
+					reader->tail = NULL;
+				}
+				--reader->pending;
+				pthread_cond_broadcast(&reader->cond);
+				pthread_mutex_unlock(&reader->lock);
+				job_free(job);
+				reader->head_pos = 0;
+			}
+		}
+	}
+	if ( (total < len) && reader->seq ) {
+		n = reader->ops->seq_read(reader->seq, (char *)buf + total, len - total);
+		if ( n < 0 ) {
+			return total ? total : -1;
+		}
+		total += n;
+	}
+	return total;
+}
+
+void preader_close(preader *reader)
+{
+	if ( reader->sequential ) {
+		if ( reader->seq ) {
+			reader->ops->seq_close(reader->seq);
+		}
+	} else {
+		preader_stop(reader);
+	}
+	pthread_cond_destroy(&reader->cond);
+	pthread_mutex_destroy(&reader->lock);
+	close(reader->fd);
+	free(reader);
+}
+
+int preader_fill(preader_input *in)
+{
+	ssize_t n;
+
+	if ( in->eof ) {
+		return 0;
+	}
+	if ( in->size - in->len < PREADER_INPUT ) {
+		unsigned char *buf = (unsigned char *)realloc(in->buf, in->len + PREADER_INPUT + 8);
+		if ( buf == NULL ) {
+			return -1;
+		}
+		in->buf = buf;
+		in->size = in->len + PREADER_INPUT;
+	}
+	n = pread(in->fd, in->buf + in->len, PREADER_INPUT, in->next);
+	if ( n < 0 ) {
+		return -1;
+	}
+	if ( n == 0 ) {
+		in->eof = 1;
+	}
+	in->len += n;
+	in->next += n;
+	return (n > 0);
+}
+
+int preader_need(preader_input *in, size_t bytes)
+{
+	int ret;
+
+	while ( in->len < bytes ) {
+		ret = preader_fill(in);
+		if ( ret <= 0 ) {
+			return ret;
+		}
+	}
+	return 1;
+}
+
+void preader_drop(preader_input *in, size_t bytes)
+{
+	memmove(in->buf, in->buf + bytes, in->len - bytes);
+	in->len -= bytes;
+	in->offset += bytes;
+}
+
+#endif /* HAVE_PTHREAD_H */
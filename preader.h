@@ -0,0 +1,84 @@
+/* Parallel decoding of compressed data made of independent blocks */
+
+#ifndef __PREADER_H__
+#define __PREADER_H__
+
+#include <sys/types.h>
+
+#include "config.h"
+
+#ifdef HAVE_PTHREAD_H
+
+/* A piece of compressed data that can be decoded on its own */
+typedef struct preader_job {
+	unsigned char *in;
+	size_t in_len;
+	unsigned char *out;
+	size_t out_len;
+	/* Where a sequential decoder can start to produce the data of this job */
+	off_t restart;
+	int param;			/* For the use of the decoder */
+	int state;
+	struct preader_job *next;
+} preader_job;
+
+typedef struct preader preader;
+
+typedef struct {
+	/* Runs on its own thread, splits the data at 'start' into jobs given to
+	   preader_submit(). Returns 1 once all of the data was submitted, or 0 to
+	   have the data from '*resume' on decoded sequentially */
+	int (*scan)(preader *reader, int fd, off_t start, off_t *resume);
+	/* Runs on the worker threads: decode 'in' to 'out', returns 0 on failure */
+	int (*decode)(preader_job *job);
+	/* Sequential decoder, used once a job failed to decode or the scanner gave up */
+	void *(*seq_open)(int fd, off_t offset);
+	/* Returns 0 at the end of the data, -1 on error */
+	int (*seq_read)(void *seq, void *buf, int len);
+	void (*seq_close)(void *seq);
+} preader_ops;
+
+/* The worker pools tell how many streams they decode at the same time, so that
+   the threads of all the readers add up to about the number of processors.
+   It is set back to 1 when the pool is stopped */
+extern void preader_set_streams(int count);
+extern int preader_streams(void);
+
+/* The number of decoding threads to use for one stream, 1 on single processor
+   systems and when there are as many streams as processors */
+extern int preader_threads(void);
+
+/* Start decoding the data at 'start' in a file with 'threads' threads.
+   The reader owns the descriptor, it is closed by preader_close().
+   Returns NULL if the threads could not be started, the descriptor is left open then */
+extern preader *preader_open(const preader_ops *ops, int fd, off_t start, int threads);
+/* Read decoded data, in order. Returns 0 at the end of the data, -1 on error */
+extern int preader_read(preader *reader, void *buf, int len);
+extern void preader_close(preader *reader);
+
+/* For the scanner: a new job with room for 'in_len' bytes of input, and the
+   call to queue it, which waits until there is room for it. Returns 0 if the
+   reader is being closed, the scanner should return then */
+extern preader_job *preader_job_new(size_t in_len, off_t restart);
+extern int preader_submit(preader *reader, preader_job *job);
+
+/* Compressed data being scanned, read from 'next' and kept from 'offset' on */
+typedef struct {
+	int fd;
+	unsigned char *buf;
+	size_t len, size;
+	off_t offset;
+	off_t next;
+	int eof;
+} preader_input;
+
+/* Read more data, returns 0 at the end of the file and -1 on error */
+extern int preader_fill(preader_input *in);
+/* Make sure 'bytes' bytes are available, returns 0 if the file is too short */
+extern int preader_need(preader_input *in, size_t bytes);
+/* Drop the data before byte 'bytes' */
+extern void preader_drop(preader_input *in, size_t bytes);
+
+#endif /* HAVE_PTHREAD_H */
+
+#endif
@@ -0,0 +1,190 @@
+/* Rate limited progress reports to the UI
+
+   The copy functions report their progress for every buffer they write, and
+   the worker threads do so at the same time. All of the reports go through
+   here: the workers only add to a counter, and the UI is called by the
+   installer thread at most every PROGRESS_INTERVAL milliseconds. The UI no
+   longer has to throttle itself, and can show the throughput and the time
+   left computed from the same counters.
+*/
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "install.h"
+#include "progress.h"
+
+/* Time between two measures of the throughput, in milliseconds */
+#define RATE_INTERVAL	1000
+
+static struct {
+	UIUpdateFunc update;
+	unsigned long long last;		/* Time of the last UI update */
+	int held;						/* Whether the last report was held back */
+	char path[PATH_MAX];			/* The report held back */
+	size_t progress, size;
+	char current[PATH_MAX];
+	unsigned long long sample_time;	/* Last measure of the throughput */
+	unsigned long long sample_bytes;
+	double rate;					/* Bytes per second */
+	char rate_text[128];
+} hub;
+
+/* Shared with the worker threads */
+static size_t pending;
+static size_t aborted;
+
+#if !defined(HAVE_SYNC_BUILTINS) && defined(HAVE_PTHREAD_H)
+static pthread_mutex_t count_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+size_t progress_count(size_t *counter, size_t n)
+{
+#ifdef HAVE_SYNC_BUILTINS
+	return __sync_add_and_fetch(counter, n);
+#else
+	size_t value;
+
+# ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&count_lock);
+# endif
+	value = (*counter += n);
+# ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&count_lock);
+# endif
+	return value;
+#endif
+}
+
+/* The time in milliseconds */
+static unsigned long long progress_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+void progress_start(install_info *info, UIUpdateFunc update)
+{
+	memset(&hub, 0, sizeof(hub));
+	hub.update = update;
+	hub.sample_time = progress_now();
+	hub.sample_bytes = info->installed_bytes;
+	pending = 0;
+	aborted = 0;
+}
+
+void progress_add(size_t bytes)
+{
+	progress_count(&pending, bytes);
+}
+
+void progress_collect(install_info *info)
+{
+	size_t bytes = progress_count(&pending, 0);
+
+	if ( bytes ) {
+		progress_count(&pending, -bytes);
+		info->installed_bytes += bytes;
+	}
+}
+
+int progress_aborted(void)
+{
+	return progress_count(&aborted, 0) != 0;
+}
+
+/* Measure the throughput once in a while, smoothed so that a slow file or a
+   script does not make the estimate jump around */
+static void progress_sample(install_info *info, unsigned long long now)
+{
+	double rate;
+
+	if ( (now - hub.sample_time < RATE_INTERVAL) || (info->installed_bytes < hub.sample_bytes) ) {
+		return;
+	}
+	rate = (double)(info->installed_bytes - hub.sample_bytes) * 1000.0 / (double)(now - hub.sample_time);
+	if ( hub.rate > 0.0 ) {
+		hub.rate = (hub.rate * 3.0 + rate) / 4.0;
+	} else {
+		hub.rate = rate;
+	}
+	hub.sample_time = now;
+	hub.sample_bytes = info->installed_bytes;
+	*hub.rate_text = '\0';
+}
+
+const char *progress_rate(install_info *info)
+{
+	unsigned long long left;
+
+	if ( (hub.rate < 1.0) || (info->installed_bytes >= info->install_size) ) {
+		return "";
+	}
+	if ( ! *hub.rate_text ) {
+		left = (unsigned long long)((double)(info->install_size - info->installed_bytes) / hub.rate) + 1;
+		if ( left >= 3600 ) {
+			snprintf(hub.rate_text, sizeof(hub.rate_text), _("%.1f MB/s, %d:%02d:%02d left"),
+					 hub.rate / (1024.0*1024.0), (int)(left / 3600), (int)(left / 60 % 60), (int)(left % 60));
+		} else {
+			snprintf(hub.rate_text, sizeof(hub.rate_text), _("%.1f MB/s, %d:%02d left"),
+					 hub.rate / (1024.0*1024.0), (int)(left / 60), (int)(left % 60));
+		}
+	}
+	return hub.rate_text;
+}
+
+static int progress_dispatch(install_info *info, const char *path, size_t progress, size_t size,
+							 const char *current, unsigned long long now)
+{
+	hub.last = now;
+	hub.held = 0;
+	progress_sample(info, now);
+	if ( ! hub.update(info, path, progress, size, current) ) {
+		progress_count(&aborted, 1);
+		return 0;
+	}
+	return 1;
+}
+
+int progress_update(install_info *info, const char *path, size_t progress, size_t size, const char *current)
+{
+	unsigned long long now;
+
+	progress_collect(info);
+	if ( progress_aborted() ) {
+		return 0;
+	}
+	if ( ! hub.update ) {
+		return 1;
+	}
+	now = progress_now();
+	if ( now - hub.last < PROGRESS_INTERVAL ) {
+		/* Keep it for later */
+		strncpy(hub.path, path ? path : "", sizeof(hub.path) - 1);
+		strncpy(hub.current, current ? current : "", sizeof(hub.current) - 1);
+		hub.progress = progress;
+		hub.size = size;
+		hub.held = 1;
+		return 1;
+	}
+	return progress_dispatch(info, path, progress, size, current, now);
+}
+
+void progress_flush(install_info *info)
+{
+	progress_collect(info);
+	if ( hub.held && hub.update && !progress_aborted() ) {
+		progress_dispatch(info, hub.path, hub.progress, hub.size, hub.current, progress_now());
+	}
+}
@@ -0,0 +1,39 @@
+/* Rate limited progress reports to the UI */
+
+#ifndef __PROGRESS_H__
+#define __PROGRESS_H__
+
+#include <sys/types.h>
+
+#include "install.h"
+
+/* Time between two updates of the UI, in milliseconds */
+#define PROGRESS_INTERVAL	50
+
+/* Start reporting the progress of the install to 'update', the function of the UI */
+extern void progress_start(install_info *info, UIUpdateFunc update);
+
+/* The function to hand to the copy functions instead of the one of the UI.
+   It is called at most every PROGRESS_INTERVAL milliseconds, the reports in
+   between are remembered for progress_flush(). Returns 0 if the install was aborted */
+extern int progress_update(install_info *info, const char *path, size_t progress, size_t size, const char *current);
+
+/* Show the last report now if it was held back, before something that may take a while */
+extern void progress_flush(install_info *info);
+
+/* Add to a counter shared between threads and return its new value */
+extern size_t progress_count(size_t *counter, size_t n);
+
+/* Thread safe: bytes copied by the worker threads, added to
+   info->installed_bytes by progress_collect() and the next update */
+extern void progress_add(size_t bytes);
+extern void progress_collect(install_info *info);
+
+/* Whether the UI aborted the install, for the worker threads */
+extern int progress_aborted(void);
+
+/* The throughput and the estimated time left, for the UI to display.
+   It is empty until there is enough data to tell */
+extern const char *progress_rate(install_info *info);
+
+#endif
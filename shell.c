@@ -0,0 +1,301 @@
+/* A shell process kept around to run the scripts of the install
+
+   Every script used to be written to a temporary file along with the setup
+   variables, and run by a new shell. Instead, a single /bin/sh reads commands
+   from a pipe: the variables are exported once, and again only when they
+   change, and every script runs in a subshell of its own, from the current
+   directory of the installer and with the same argument as before. The exit
+   status comes back through another pipe, on file descriptor 4 of the shell.
+   The standard input of the installer is kept as descriptor 5 for the
+   scripts.
+
+   The shell is started again whenever the environment of the installer
+   changed, since it would not see that.
+*/
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "install.h"
+#include "install_ui.h"
+#include "install_log.h"
+#include "shell.h"
+
+extern char **environ;
+
+int shell_coprocess = 0;
+
+static pid_t shell_pid = -1;
+static int shell_cmd = -1, shell_status = -1;
+/* What was last run with shell_run() as 'env' */
+static char *shell_env = NULL;
+static unsigned long shell_environ;
+
+int shell_printf(shell_text *text, const char *fmt, ...)
+{
+	va_list ap;
+	char *buf;
+	int len;
+
+	for ( ;; ) {
+		if ( text->size > text->len ) {
+			va_start(ap, fmt);
+			len = vsnprintf(text->buf + text->len, text->size - text->len, fmt, ap);
+			va_end(ap);
+			if ( len < 0 ) {
+				return 0;
+			}
+			if ( (size_t)len < text->size - text->len ) {
+				text->len += len;
+				return 1;
+			}
+		} else {
+			len = 256;
+		}
+		buf = (char *)realloc(text->buf, text->size + len + 256);
+		if ( buf == NULL ) {
+			return 0;
+		}
+		text->buf = buf;
+		text->size += len + 256;
+	}
+}
+
+int shell_quote(shell_text *text, const char *str)
+{
+	const char *quote;
+	int ok = shell_printf(text, "'");
+
+	while ( ok && (quote = strchr(str, '\'')) != NULL ) {
+		ok = shell_printf(text, "%.*s'\\''", (int)(quote - str), str);
+		str = quote + 1;
+	}
+	return ok && shell_printf(text, "%s'", str);
+}
+
+/* Changes with the environment of the installer */
+static unsigned long hash_environ(void)
+{
+	unsigned long hash = 5381;
+	const char *p;
+	int i;
+
+	for ( i = 0; environ[i]; ++i ) {
+		for ( p = environ[i]; *p; ++p ) {
+			hash = hash * 33 + (unsigned char)*p;
+		}
+		hash = hash * 33;
+	}
+	return hash;
+}
+
+static int shell_start(void)
+{
+	int cmd[2], status[2], c, s;
+
+	if ( pipe(cmd) < 0 ) {
+		return 0;
+	}
+	if ( pipe(status) < 0 ) {
+		close(cmd[0]);
+		close(cmd[1]);
+		return 0;
+	}
+	switch( shell_pid = fork() ) {
+	case 0: /* Inside the child */
+		/* Out of the way of the descriptors set up for the shell */
+		c = fcntl(cmd[0], F_DUPFD, 10);
+		s = fcntl(status[1], F_DUPFD, 10);
+		close(cmd[0]);
+		close(cmd[1]);
+		close(status[0]);
+		close(status[1]);
+		if ( dup2(0, 5) < 0 ) {
+			/* No standard input, the scripts still need one */
+			int null = open("/dev/null", O_RDONLY);
+			dup2(null, 5);
+			close(null);
+		}
+		dup2(c, 0);
+		dup2(s, 4);
+		close(c);
+		close(s);
+		execl("/bin/sh", "sh", "-s", NULL);
+		_exit(127);
+	case -1: /* Error */
+		log_warning(_("Unable to start a shell: %s"), strerror(errno));
+		close(cmd[0]);
+		close(cmd[1]);
+		close(status[0]);
+		close(status[1]);
+		return 0;
+	default: /* Parent */
+		break;
+	}
+	close(cmd[0]);
+	close(status[1]);
+	shell_cmd = cmd[1];
+	shell_status = status[0];
+	fcntl(shell_cmd, F_SETFD, FD_CLOEXEC);
+	fcntl(shell_status, F_SETFD, FD_CLOEXEC);
+	shell_environ = hash_environ();
+	free(shell_env);
+	shell_env = NULL;
+	log_debug("Started the shell process %d\n", (int)shell_pid);
+	return 1;
+}
+
+static int shell_write(const char *buf, size_t len)
+{
+	void (*handler)(int);
+	ssize_t n;
+
+	/* Don't die if the shell did */
+	handler = signal(SIGPIPE, SIG_IGN);
+	while ( len > 0 ) {
+		n = write(shell_cmd, buf, len);
+		if ( n < 0 ) {
+			if ( errno == EINTR ) {
+				continue;
+			}
+			break;
+		}
+		buf += n;
+		len -= n;
+	}
+	signal(SIGPIPE, handler);
+	return len == 0;
+}
+
+/* Wait for the exit status of the script, -1 if the shell went away */
+static int shell_wait(install_info *info)
+{
+	char line[32];
+	size_t len = 0;
+	struct pollfd fds[2];
+	int nfds, timeout;
+	ssize_t n;
+
+	fds[0].fd = shell_status;
+	fds[0].events = POLLIN;
+	while ( len < sizeof(line) - 1 ) {
+		/* Like wait_command(), sleep until the UI has something to do */
+		nfds = 1;
+		timeout = -1;
+		if ( UI.idle ) {
+			fds[1].fd = UI.event_fd ? UI.event_fd(info) : -1;
+			fds[1].events = POLLIN;
+			fds[1].revents = 0;
+			if ( fds[1].fd >= 0 ) {
+				nfds = 2;
+			} else {
+				timeout = 10;
+			}
+		}
+		n = poll(fds, nfds, timeout);
+		if ( n < 0 ) {
+			if ( errno == EINTR ) {
+				continue;
+			}
+			return -1;
+		}
+		if ( UI.idle && ((timeout > 0) || fds[1].revents) ) {
+			UI.idle(info); /* Run an idle loop while the script is running */
+		}
+		if ( fds[0].revents == 0 ) {
+			continue;
+		}
+		n = read(shell_status, line + len, 1);
+		if ( n <= 0 ) {
+			if ( (n < 0) && (errno == EINTR) ) {
+				continue;
+			}
+			return -1;
+		}
+		if ( line[len] == '\n' ) {
+			line[len] = '\0';
+			return atoi(line);
+		}
+		++len;
+	}
+	return -1;
+}
+
+int shell_run(install_info *info, const char *env, const char *local,
+			  const char *script, const char *arg)
+{
+	shell_text cmd;
+	char cwd[PATH_MAX];
+	int ok, exitval;
+
+	if ( getcwd(cwd, sizeof(cwd)) == NULL ) {
+		return -2;
+	}
+	/* The shell would not see the changes of the environment */
+	if ( (shell_pid > 0) && (hash_environ() != shell_environ) ) {
+		shell_stop();
+	}
+	if ( (shell_pid < 0) && !shell_start() ) {
+		return -2;
+	}
+
+	memset(&cmd, 0, sizeof(cmd));
+	ok = 1;
+	if ( !shell_env || strcmp(shell_env, env) ) {
+		ok = shell_printf(&cmd, "%s", env);
+	}
+	ok = ok && shell_printf(&cmd, "(exec 0<&5 5<&- 4>&-\ncd ") && shell_quote(&cmd, cwd) &&
+		 shell_printf(&cmd, " || exit 1\n%sset -- ", local) && shell_quote(&cmd, arg) &&
+		 shell_printf(&cmd, "\neval ") && shell_quote(&cmd, script) &&
+		 shell_printf(&cmd, "\n); echo $? >&4\n");
+	if ( ! ok ) {
+		free(cmd.buf);
+		return -2;
+	}
+
+	log_debug("Running script in the shell: '%s' '%s'\n", script, arg);
+	if ( shell_write(cmd.buf, cmd.len) ) {
+		if ( !shell_env || strcmp(shell_env, env) ) {
+			free(shell_env);
+			shell_env = strdup(env);
+		}
+		exitval = shell_wait(info);
+	} else {
+		exitval = -1;
+	}
+	free(cmd.buf);
+	if ( exitval < 0 ) {
+		log_warning(_("The shell process running the scripts exited"));
+		shell_stop();
+	}
+	return exitval;
+}
+
+void shell_stop(void)
+{
+	int status;
+
+	if ( shell_pid > 0 ) {
+		/* The shell exits at the end of its input */
+		close(shell_cmd);
+		close(shell_status);
+		while ( (waitpid(shell_pid, &status, 0) < 0) && (errno == EINTR) )
+			;
+		shell_pid = -1;
+		shell_cmd = shell_status = -1;
+	}
+	free(shell_env);
+	shell_env = NULL;
+}
@@ -0,0 +1,35 @@
+/* A shell process kept around to run the scripts of the install */
+
+#ifndef __SHELL_H__
+#define __SHELL_H__
+
+#include <sys/types.h>
+
+#include "install.h"
+
+/* Use it instead of a new shell per script, set with the -s command line option */
+extern int shell_coprocess;
+
+/* Commands being put together for the shell */
+typedef struct {
+	char *buf;
+	size_t len, size;
+} shell_text;
+
+/* Append to the text, returns 0 if out of memory */
+extern int shell_printf(shell_text *text, const char *fmt, ...);
+/* Append a string quoted for the shell */
+extern int shell_quote(shell_text *text, const char *str);
+
+/* Run a script in a subshell of the shell process, from the current directory
+   and with 'arg' as its argument. The commands of 'env' are run by the shell
+   itself when they changed since the last script, those of 'local' by the
+   subshell only. Returns the exit status of the script, -1 if the shell died,
+   or -2 if the shell could not be used and the script was not run */
+extern int shell_run(install_info *info, const char *env, const char *local,
+					 const char *script, const char *arg);
+
+/* Have the shell process exit */
+extern void shell_stop(void);
+
+#endif
@@ -12,6 +12,7 @@
 #include <errno.h>
 #include <signal.h>
 #include <locale.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 
 #include "arch.h"
@@ -28,6 +29,9 @@
 #ifdef HAVE_GETOPT_H
 #include <getopt.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #ifdef PACKAGE
 #undef PACKAGE
@@ -61,12 +65,17 @@ static void log_file(const char *name, const char *reason)
     fprintf(stderr, "%s : %s\n", name, reason);
 }
 
+/* Directories to remove, in lists by depth so that the deepest go first */
 struct dir_entry {
     product_file_t *dir;
-    int depth;
     struct dir_entry *next;
 };
 
+typedef struct {
+    struct dir_entry **depth;
+    int max;
+} dir_set;
+
 static int get_depth(const char *path)
 {
     int depth = 1;
@@ -78,44 +87,203 @@ static int get_depth(const char *path)
     return depth;
 }
 
-static struct dir_entry *add_directory_entry(product_file_t *dir, struct dir_entry *list)
+static void add_directory_entry(product_file_t *dir, dir_set *set)
 {
     int depth = get_depth(loki_getpath_file(dir));
-    struct dir_entry *node;
+    struct dir_entry *node, **lists;
 
+    if ( depth >= set->max ) {
+        lists = (struct dir_entry **)realloc(set->depth, (depth + 16) * sizeof(*lists));
+        if ( ! lists ) {
+            log_file(loki_getpath_file(dir), "Warning: Out of memory!");
+            return;
+        }
+        memset(lists + set->max, 0, (depth + 16 - set->max) * sizeof(*lists));
+        set->depth = lists;
+        set->max = depth + 16;
+    }
     node = (struct dir_entry *) malloc(sizeof(struct dir_entry));
     if ( ! node ) {
         log_file(loki_getpath_file(dir), "Warning: Out of memory!");
-        return list;
+        return;
     }
     node->dir = dir;
-    node->depth = depth;
-
-    if ( list ) { /* Look for insert point */
-        struct dir_entry *ptr, *prev = NULL;
-
-        for ( ptr = list; ptr; ptr = ptr->next ) {
-            if ( depth > ptr->depth ) {
-                if ( prev ) {
-                    prev->next = node;
-                    node->next = ptr;
-                } else {
-                    node->next = list;
-                    list = node;
-                }
-                break;
+    node->next = set->depth[depth];
+    set->depth[depth] = node;
+}
+
+/* The files to remove, grouped by the directory they are in, so that they are
+   removed relative to it and the groups can be handed to several threads */
+#define FILE_BUCKETS        4096
+#define UNINSTALL_THREADS   4
+
+struct file_group {
+    char *dir;
+    char **files;
+    int count, size;
+    struct file_group *hash_next;
+};
+
+typedef struct {
+    struct file_group *buckets[FILE_BUCKETS];
+    struct file_group **groups;
+    int count, size;
+    int next;                   /* Next group to be removed by a thread */
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+#endif
+} file_set;
+
+static void add_removed_file(const char *path, file_set *set)
+{
+    const char *slash = strrchr(path, '/');
+    size_t len = slash ? (size_t)(slash - path) : 0;
+    unsigned int hash = 5381;
+    struct file_group *group, **groups;
+    char **files, *copy;
+    size_t i;
+
+    for ( i = 0; i < len; ++i ) {
+        hash = hash * 33 + (unsigned char)path[i];
+    }
+    for ( group = set->buckets[hash % FILE_BUCKETS]; group; group = group->hash_next ) {
+        if ( (strlen(group->dir) == len) && !strncmp(group->dir, path, len) ) {
+            break;
+        }
+    }
+    if ( ! group ) {
+        if ( set->count == set->size ) {
+            groups = (struct file_group **)realloc(set->groups, (set->size * 2 + 64) * sizeof(*groups));
+            if ( ! groups ) {
+                goto nomem;
             }
-            prev = ptr;
+            set->groups = groups;
+            set->size = set->size * 2 + 64;
         }
-        if ( !ptr ) { /* Insert at the end */
-            node->next = NULL;
-            prev->next = node;
+        group = (struct file_group *)calloc(1, sizeof(*group));
+        if ( ! group ) {
+            goto nomem;
         }
-    } else {
-        node->next = NULL;
-        list = node;
+        group->dir = (char *)malloc(len + 1);
+        if ( ! group->dir ) {
+            free(group);
+            goto nomem;
+        }
+        memcpy(group->dir, path, len);
+        group->dir[len] = '\0';
+        group->hash_next = set->buckets[hash % FILE_BUCKETS];
+        set->buckets[hash % FILE_BUCKETS] = group;
+        set->groups[set->count++] = group;
+    }
+    if ( group->count == group->size ) {
+        files = (char **)realloc(group->files, (group->size * 2 + 16) * sizeof(*files));
+        if ( ! files ) {
+            goto nomem;
+        }
+        group->files = files;
+        group->size = group->size * 2 + 16;
+    }
+    /* The path may be in a buffer that setupdb reuses */
+    copy = strdup(path);
+    if ( ! copy ) {
+        goto nomem;
+    }
+    group->files[group->count++] = copy;
+    return;
+
+nomem:
+    /* Remove it right away then */
+    if ( unlink(path) < 0 ) {
+        log_file(path, strerror(errno));
+    }
+}
+
+static void remove_group(struct file_group *group)
+{
+    int i, dirfd = -1;
+
+#ifdef HAVE_UNLINKAT
+# ifndef O_DIRECTORY
+#  define O_DIRECTORY 0
+# endif
+    dirfd = open(*group->dir ? group->dir : "/", O_RDONLY|O_DIRECTORY);
+#endif
+    for ( i = 0; i < group->count; ++i ) {
+        const char *fname = group->files[i];
+
+        // printf("Removing file: %s\n", fname);
+#ifdef HAVE_UNLINKAT
+        /* A relative path with no directory is removed from the current one */
+        if ( (dirfd >= 0) && strchr(fname, '/') ) {
+            if ( unlinkat(dirfd, strrchr(fname, '/') + 1, 0) < 0 ) {
+                log_file(fname, strerror(errno));
+            }
+            continue;
+        }
+#endif
+        if ( unlink(fname) < 0 ) {
+            log_file(fname, strerror(errno));
+        }
+    }
+    if ( dirfd >= 0 ) {
+        close(dirfd);
     }
-    return list;
+}
+
+static void *remove_groups(void *data)
+{
+    file_set *set = (file_set *)data;
+    int i;
+
+    for ( ;; ) {
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_lock(&set->lock);
+#endif
+        i = set->next++;
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_unlock(&set->lock);
+#endif
+        if ( i >= set->count ) {
+            break;
+        }
+        remove_group(set->groups[i]);
+    }
+    return NULL;
+}
+
+/* Remove all the files of the set, and free it */
+static void remove_files(file_set *set)
+{
+    int i, j, nthreads = 0;
+#ifdef HAVE_PTHREAD_H
+    pthread_t threads[UNINSTALL_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    pthread_mutex_init(&set->lock, NULL);
+    /* The directories are independent from each other */
+    while ( (nthreads < UNINSTALL_THREADS) && (nthreads < cpus) && (nthreads < set->count - 1) ) {
+        if ( pthread_create(&threads[nthreads], NULL, remove_groups, set) != 0 ) {
+            break;
+        }
+        ++nthreads;
+    }
+#endif
+    remove_groups(set);
+#ifdef HAVE_PTHREAD_H
+    for ( i = 0; i < nthreads; ++i ) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&set->lock);
+#endif
+    for ( i = 0; i < set->count; ++i ) {
+        for ( j = 0; j < set->groups[i]->count; ++j ) {
+            free(set->groups[i]->files[j]);
+        }
+        free(set->groups[i]->dir);
+        free(set->groups[i]->files);
+        free(set->groups[i]);
+    }
+    free(set->groups);
 }
 
 /* Signal handler for interrupted uninstalls */
@@ -132,7 +300,11 @@ static void emergency_exit(int sig)
 int uninstall_component(product_component_t *comp, product_info_t *info)
 {
     product_option_t *opt;
-    struct dir_entry *list = NULL, *freeable;
+    product_file_t *file, *nextfile;
+    struct dir_entry *freeable;
+    dir_set dirs;
+    file_set *files;
+    int depth;
 
     /* Go to the install directory, so the log appears in the right place */
     if ( chdir(info->root) < 0) {
@@ -146,51 +318,63 @@ int uninstall_component(product_component_t *comp, product_info_t *info)
     if ( loki_runscripts(comp, LOKI_SCRIPT_PREUNINSTALL) < 0 )
 		return 0;
 
+    files = (file_set *)calloc(1, sizeof(*files));
+    if ( ! files ) {
+        fprintf(stderr, _("Out of memory\n"));
+        return 0;
+    }
+    memset(&dirs, 0, sizeof(dirs));
     for ( opt = loki_getfirst_option(comp); opt; opt = loki_getnext_option(opt)){
-        product_file_t *file = loki_getfirst_file(opt), *nextfile;
-
-        while ( file ) {
+        for ( file = loki_getfirst_file(opt); file; file = loki_getnext_file(file) ) {
             const char *fname = loki_getpath_file(file);
             file_type_t t = loki_gettype_file(file);
 
-            if ( t == LOKI_FILE_DIRECTORY /* && strncmp(fname, info->root, strlen(fname))!=0 */ ) {
-                list = add_directory_entry(file, list);
-                file = loki_getnext_file(file);
-            } else {
-                switch( t ) {
-                case LOKI_FILE_SCRIPT: /* Ignore scripts */
-                    break;
-                case LOKI_FILE_RPM:
-                    printf(_("Notice: the %s RPM was installed for this product.\n"),
-                           fname);
-                    break;
-                default:
-                    // printf("Removing file: %s\n", loki_getpath_file(file));
-                    if ( unlink(fname) < 0 ) {
-                        log_file(fname, strerror(errno));
-                    }
-                    break;
-                }
-                    
-                nextfile = loki_getnext_file(file);
+            switch( t ) {
+            case LOKI_FILE_DIRECTORY:
+                add_directory_entry(file, &dirs);
+                break;
+            case LOKI_FILE_SCRIPT: /* Ignore scripts */
+                break;
+            case LOKI_FILE_RPM:
+                printf(_("Notice: the %s RPM was installed for this product.\n"),
+                       fname);
+                break;
+            default:
+                add_removed_file(fname, files);
+                break;
+            }
+        }
+    }
+    remove_files(files);
+    free(files);
+
+    /* Only then drop them from the product, the paths were still in use */
+    for ( opt = loki_getfirst_option(comp); opt; opt = loki_getnext_option(opt)){
+        file = loki_getfirst_file(opt);
+        while ( file ) {
+            nextfile = loki_getnext_file(file);
+            if ( loki_gettype_file(file) != LOKI_FILE_DIRECTORY ) {
                 loki_unregister_file(file);
-                file = nextfile;
             }
+            file = nextfile;
         }
     }
 
     /* Remove directories after all files from all options */
-    while ( list ) {
-        freeable = list;
-        list = list->next;
-        
-        // printf("Removing directory: %s\n", loki_getpath_file(freeable->dir));
-        if ( rmdir(loki_getpath_file(freeable->dir)) < 0 ) {
-            log_file(loki_getpath_file(freeable->dir), strerror(errno));  
+    for ( depth = dirs.max - 1; depth >= 0; --depth ) {
+        while ( dirs.depth[depth] ) {
+            freeable = dirs.depth[depth];
+            dirs.depth[depth] = freeable->next;
+
+            // printf("Removing directory: %s\n", loki_getpath_file(freeable->dir));
+            if ( rmdir(loki_getpath_file(freeable->dir)) < 0 ) {
+                log_file(loki_getpath_file(freeable->dir), strerror(errno));
+            }
+            loki_unregister_file(freeable->dir);
+            free(freeable);
         }
-        loki_unregister_file(freeable->dir);
-        free(freeable);
     }
+    free(dirs.depth);
 
     /* Run post-uninstall scripts */
     if ( loki_runscripts(comp, LOKI_SCRIPT_POSTUNINSTALL) < 0 ) {